@@ -0,0 +1,85 @@
+/*
+ * Atomic loads, stores and fences for the variables that are shared between
+ * threads (or, for the SWO ring buffer, between processes). GCC and clang use
+ * their built-ins; MSVC relies on its volatile semantics plus explicit memory
+ * barriers.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _ATOMICS_H
+#define _ATOMICS_H
+
+#include <stdint.h>
+
+/* ATOMIC_LOAD() has acquire semantics and ATOMIC_STORE() has release
+   semantics; ATOMIC_FENCE() is a full barrier. The shared variables must be
+   declared volatile: with MSVC, volatile accesses have acquire/release
+   semantics already. ATOMIC_CAS() returns true if the value at p was o and
+   has been replaced by n; with MSVC, it only works on a "long". */
+#if defined _MSC_VER
+  #include <windows.h>
+  #include <intrin.h>
+  #define ATOMIC_LOAD(p)        (*(p))
+  #define ATOMIC_STORE(p, v)    (*(p) = (v))
+  #define ATOMIC_CAS(p, o, n)   (_InterlockedCompareExchange((p), (n), (o)) == (o))
+  #define ATOMIC_FENCE()        MemoryBarrier()
+#else
+  #define ATOMIC_LOAD(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define ATOMIC_CAS(p, o, n)   __sync_bool_compare_and_swap((p), (o), (n))
+  #define ATOMIC_FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/* fixed-size variants, for memory that is shared between processes; the loads
+   must not write to memory, because readers may map it read-only (so no
+   compare-and-swap tricks to get an atomic 64-bit load on 32-bit targets) */
+#if defined _MSC_VER
+  #if defined _M_IX86
+    #include <emmintrin.h>
+  #endif
+  static __inline uint32_t atomic_load32(const volatile uint32_t *p)
+  {
+    uint32_t v = *p;
+    MemoryBarrier();
+    return v;
+  }
+  static __inline uint64_t atomic_load64(const volatile uint64_t *p)
+  {
+    uint64_t v;
+    #if defined _M_IX86
+      /* an aligned 64-bit SSE2 load is a single access */
+      _mm_storel_epi64((__m128i*)&v, _mm_loadl_epi64((const __m128i*)(const void*)p));
+    #else
+      v = *p;
+    #endif
+    MemoryBarrier();
+    return v;
+  }
+  #define ATOMIC_LOAD32(p)      atomic_load32(p)
+  #define ATOMIC_LOAD64(p)      atomic_load64(p)
+  #define ATOMIC_STORE32(p, v)  InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+  #define ATOMIC_STORE64(p, v)  InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+  #define FENCE_ACQUIRE()       MemoryBarrier()
+  #define FENCE_RELEASE()       MemoryBarrier()
+#else
+  #define ATOMIC_LOAD32(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_LOAD64(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE32(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define ATOMIC_STORE64(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define FENCE_ACQUIRE()       __atomic_thread_fence(__ATOMIC_ACQUIRE)
+  #define FENCE_RELEASE()       __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#endif /* _ATOMICS_H */
@@ -58,6 +58,7 @@
 #include <time.h>
 
 #include "bmscan.h"
+#include "capture.h"
 #include "bmp-script.h"
 #include "guidriver.h"
 #include "noc_file_dialog.h"
@@ -66,7 +67,12 @@
 
 #include "parsetsdl.h"
 #include "decodectf.h"
+#include "decodeitm.h"
+#include "livewatch.h"
+#include "profiler.h"
+#include "swousb.h"
 #include "swotrace.h"
+#include "tracetime.h"
 
 #include "res/btn_folder.h"
 #if defined __linux__ || defined __unix__
@@ -1943,6 +1949,10 @@ enum {
   STATE_SWODEVICE,
   STATE_SWOGENERIC,
   STATE_SWOCHANNELS,
+  STATE_SWOPROFILE,
+  STATE_LIVE_ADDRESS,
+  STATE_LIVE_SIZE,
+  STATE_LIVE_SETUP,
   STATE_HOVER_SYMBOL,
   STATE_QUIT,
 };
@@ -2178,7 +2188,48 @@ static void trace_info_mode(unsigned mode, unsigned clock, unsigned bitrate)
   console_add(msg, STRFLG_STATUS);
 }
 
-static int handle_trace_cmd(const char *command, unsigned *mode, unsigned *clock, unsigned *bitrate)
+/** trace_hwpacket() handles the packets from the DWT, for the profiler and
+ *  the live watches. It is called from the decoder thread, so the GUI locks
+ *  the decoder while it reads or changes the profile or the live watches.
+ */
+static void trace_hwpacket(const ITMPACKET *packet, double timestamp)
+{
+  (void)timestamp;
+  if (packet->type == ITMPKT_PCSAMPLE)
+    profile_sample((packet->size == 1) ? PROFILE_SLEEP : (unsigned long)packet->value);
+  else
+    live_packet(packet);
+}
+
+static void trace_info_profile(unsigned interval)
+{
+  const PROFILE_ENTRY *list;
+  unsigned long total;
+  int count, idx;
+  char msg[200];
+
+  if (interval == 0) {
+    console_add("Profiling: disabled\n", STRFLG_STATUS);
+    return;
+  }
+  trace_lock();
+  total = profile_total();
+  sprintf(msg, "Profiling: interval = %u cycles, %lu samples\n", interval, total);
+  console_add(msg, STRFLG_STATUS);
+  count = profile_results(&list);
+  if (count > 20)
+    count = 20;   /* only the top of the list */
+  for (idx = 0; idx < count; idx++) {
+    sprintf(msg, "%8lu %5.1f%%  ", list[idx].count, (total > 0) ? 100.0 * list[idx].count / total : 0.0);
+    strlcat(msg, list[idx].name, sizearray(msg));
+    strlcat(msg, "\n", sizearray(msg));
+    console_add(msg, STRFLG_STATUS);
+  }
+  trace_unlock();
+}
+
+static int handle_trace_cmd(const char *command, unsigned *mode, unsigned *clock, unsigned *bitrate,
+                            unsigned *profile_interval, int *timestamps, int *formatter)
 {
   const char *ptr;
 
@@ -2225,6 +2276,121 @@ static int handle_trace_cmd(const char *command, unsigned *mode, unsigned *clock
     return 2; /* only channel set changed */
   }
 
+  if (strncmp(ptr, "live", 4) == 0 && TERM_END(ptr, 4)) {
+    int slot;
+    ptr = skipwhite(ptr + 4);
+    if (*ptr == '\0') {
+      int idx;
+      const LIVEVAR *var;
+      trace_lock();
+      for (idx = 0; idx < LIVE_MAXVARS; idx++) {
+        char msg[200];
+        if ((var = live_get(idx)) == NULL)
+          continue;
+        sprintf(msg, "Live %d: %s = %llu (%lu updates)\n", idx, var->expr, var->value, var->updates);
+        console_add(msg, STRFLG_STATUS);
+      }
+      trace_unlock();
+      return 5; /* nothing changed */
+    }
+    if (strncmp(ptr, "clear", 5) == 0 && TERM_END(ptr, 5)) {
+      trace_lock();
+      live_clear();
+      trace_unlock();
+      return 7; /* comparators must be reprogrammed */
+    }
+    trace_lock();
+    slot = live_add(ptr);
+    trace_unlock();
+    if (slot < 0) {
+      console_add("No free DWT comparator\n", STRFLG_ERROR);
+      return 5;
+    }
+    return 6; /* look up the address of the new live watch */
+  }
+
+  if (strncmp(ptr, "capture", 7) == 0 && TERM_END(ptr, 7)) {
+    char msg[200];
+    ptr = skipwhite(ptr + 7);
+    if (strncmp(ptr, "off", 3) == 0 && TERM_END(ptr, 3)) {
+      trace_lock();
+      capture_cleanup();
+      trace_unlock();
+      console_add("Capture disabled\n", STRFLG_STATUS);
+    } else if (strncmp(ptr, "save", 4) == 0 && TERM_END(ptr, 4)) {
+      ptr = skipwhite(ptr + 4);
+      if (*ptr == '\0')
+        console_add("Missing filename\n", STRFLG_ERROR);
+      else if (trace_savesnapshot(ptr))
+        console_add("Snapshot saved\n", STRFLG_STATUS);
+      else
+        console_add("Failed to save the snapshot\n", STRFLG_ERROR);
+    } else {
+      /* the trigger is a halt of the target (or a manual trigger) */
+      unsigned long pre = 256, post = 64;
+      int result;
+      if (isdigit(*ptr)) {
+        pre = strtoul(ptr, (char**)&ptr, 10);
+        ptr = skipwhite(ptr);
+        if (isdigit(*ptr))
+          post = strtoul(ptr, NULL, 10);
+      }
+      trace_lock();
+      result = capture_setup(pre * 1024, post * 1024);
+      if (result) {
+        tracestring_clear();
+        capture_arm();
+      }
+      trace_unlock();
+      if (result) {
+        sprintf(msg, "Capture armed: %lu KiB before and %lu KiB after the target halts\n", pre, post);
+        console_add(msg, STRFLG_STATUS);
+      } else {
+        console_add("Insufficient memory for the capture\n", STRFLG_ERROR);
+      }
+    }
+    return 5; /* nothing changed in the target */
+  }
+
+  if (strncmp(ptr, "timestamps", 10) == 0 && TERM_END(ptr, 10)) {
+    assert(timestamps != NULL);
+    ptr = skipwhite(ptr + 10);
+    *timestamps = !(strncmp(ptr, "off", 3) == 0 && TERM_END(ptr, 3));
+    console_add(*timestamps ? "ITM timestamps enabled\n" : "ITM timestamps disabled\n", STRFLG_STATUS);
+    return 1; /* ITM configuration changed */
+  }
+
+  if (strncmp(ptr, "formatter", 9) == 0 && TERM_END(ptr, 9)) {
+    assert(formatter != NULL);
+    ptr = skipwhite(ptr + 9);
+    *formatter = !(strncmp(ptr, "off", 3) == 0 && TERM_END(ptr, 3));
+    console_add(*formatter ? "TPIU formatter enabled\n" : "TPIU formatter bypassed\n", STRFLG_STATUS);
+    return 1; /* TPIU configuration changed */
+  }
+
+  if (strncmp(ptr, "profile", 7) == 0 && TERM_END(ptr, 7)) {
+    unsigned long actual;
+    assert(profile_interval != NULL);
+    ptr = skipwhite(ptr + 7);
+    if (*ptr == '\0') {
+      trace_info_profile(*profile_interval);
+      return 5; /* nothing changed */
+    }
+    if (strncmp(ptr, "reset", 5) == 0 && TERM_END(ptr, 5)) {
+      trace_lock();
+      profile_reset();
+      trace_unlock();
+      return 5;
+    }
+    if (strncmp(ptr, "off", 3) == 0 && TERM_END(ptr, 3))
+      *profile_interval = 0;
+    else
+      *profile_interval = (unsigned)strtoul(ptr, NULL, 10);
+    profile_dwtctrl(*profile_interval, &actual);
+    *profile_interval = (unsigned)actual;
+    return 4; /* PC sampling configuration changed */
+  }
+
   /* mode */
   assert(mode != NULL);
   if (strncmp(ptr, "disable", 7) == 0 && TERM_END(ptr, 7)) {
@@ -2273,7 +2439,7 @@ static int handle_trace_cmd(const char *command, unsigned *mode, unsigned *clock
 
 int main(int argc, char *argv[])
 {
-  enum { TAB_CONFIGURATION, TAB_BREAKPOINTS, TAB_WATCHES, TAB_SEMIHOSTING, TAB_SWO, /* --- */ TAB_COUNT };
+  enum { TAB_CONFIGURATION, TAB_BREAKPOINTS, TAB_WATCHES, TAB_SEMIHOSTING, TAB_SWO, TAB_LIVE, /* --- */ TAB_COUNT };
   enum { SPLITTER_NONE, SPLITTER_VERTICAL, SPLITTER_HORIZONTAL, SIZER_SEMIHOSTING, SIZER_SWO };
 
   struct nk_context *ctx;
@@ -2288,8 +2454,11 @@ int main(int argc, char *argv[])
   int opt_allmsg = nk_false;
   int opt_autodownload = nk_true;
   unsigned opt_swomode = SWOMODE_NONE, opt_swobaud = 100000, opt_swoclock = 48000000;
+  unsigned opt_profile = 0, profile_active = 0;
+  int opt_swotstamp = nk_false;
+  int opt_swoformat = nk_false;
   float splitter_hor = 0.75, splitter_ver = 0.75;
-  char console_edit[128] = "", watch_edit[128] = "";
+  char console_edit[128] = "", watch_edit[128] = "", live_edit[LIVE_EXPRLEN] = "";
   STRINGLIST consoleedit_root = { NULL, NULL, 0 }, *consoleedit_next;
   TASK task;
   char cmd[300], statesymbol[64], ttipvalue[256];
@@ -2299,7 +2468,9 @@ int main(int argc, char *argv[])
   int idx, result;
   int prev_clicked_line;
   unsigned watchseq;
-  unsigned long scriptparams[3];
+  unsigned long scriptparams[16];
+  unsigned long live_address = 0;
+  int live_index = -1;
 
   /* locate the configuration file */
   if (folder_AppConfig(txtConfigFile, sizearray(txtConfigFile))) {
@@ -2329,7 +2500,7 @@ int main(int argc, char *argv[])
   for (idx = 0; idx < TAB_COUNT; idx++) {
     char key[40];
     int opened, size;
-    tab_states[idx] = (idx == TAB_SEMIHOSTING || idx == TAB_SWO) ? NK_MINIMIZED : NK_MAXIMIZED;
+    tab_states[idx] = (idx == TAB_SEMIHOSTING || idx == TAB_SWO || idx == TAB_LIVE) ? NK_MINIMIZED : NK_MAXIMIZED;
     tab_heights[idx] = 5 * ROW_HEIGHT;
     sprintf(key, "view%d", idx);
     ini_gets("Settings", key, "", cmd, sizearray(cmd), txtConfigFile);
@@ -2346,6 +2517,9 @@ int main(int argc, char *argv[])
   opt_swomode = (unsigned)ini_getl("SWO trace", "mode", SWOMODE_NONE, txtConfigFile);
   opt_swobaud = (unsigned)ini_getl("SWO trace", "bitrate", 100000, txtConfigFile);
   opt_swoclock = (unsigned)ini_getl("SWO trace", "clock", 48000000, txtConfigFile);
+  opt_profile = (unsigned)ini_getl("SWO trace", "profile", 0, txtConfigFile);
+  opt_swotstamp = (int)ini_getl("SWO trace", "timestamps", 0, txtConfigFile);
+  opt_swoformat = (int)ini_getl("SWO trace", "formatter", 0, txtConfigFile);
   for (idx = 0; idx < NUM_CHANNELS; idx++) {
     char key[40];
     unsigned clr;
@@ -2754,6 +2928,9 @@ int main(int argc, char *argv[])
       case STATE_RUNNING:
         prevstate = curstate;
         if (check_stopped(&source_execfile, &source_execline)) {
+          trace_lock();
+          capture_trigger("target halted");
+          trace_unlock();
           source_cursorfile = source_execfile;
           source_cursorline = source_execline;
           curstate = STATE_STOPPED;
@@ -2885,10 +3062,13 @@ int main(int argc, char *argv[])
             trace_status = trace_init();
             if (trace_status != TRACESTAT_OK)
               console_add("Failed to initialize SWO tracing\n", STRFLG_ERROR);
+            trace_sethwhandler(trace_hwpacket);
           }
+          trace_lock();   /* pause the decoder while the TSDL file is reloaded */
           ctf_parse_cleanup();
           ctf_decode_cleanup();
           tracestring_clear();
+          trace_setformatter(opt_swoformat);
           tracelog_statusmsg(TRACESTATMSG_CTF, NULL, 0);
           ctf_error_notify(CTFERR_NONE, 0, NULL);
           if (ctf_findmetadata(txtFilename, txtTSDLfile, sizearray(txtTSDLfile))
@@ -2903,6 +3083,7 @@ int main(int argc, char *argv[])
           } else {
             ctf_parse_cleanup();
           }
+          trace_unlock();
           if (opt_swomode == SWOMODE_ASYNC)
             sprintf(cmd, "monitor traceswo %u\n", opt_swobaud); /* automatically select async mode in the BMP */
           else
@@ -2957,6 +3138,11 @@ int main(int argc, char *argv[])
           assert(opt_swobaud > 0);
           scriptparams[0] = (opt_swomode == SWOMODE_MANCHESTER) ? 1 : 2;
           scriptparams[1] = opt_swoclock / opt_swobaud - 1;
+          scriptparams[2] = opt_swotstamp ? 0x10003 : 0x10011;  /* ITM_TCR: trace bus ID 1; with TSENA, SWOENA is cleared so that timestamps count CPU cycles */
+          scriptparams[3] = opt_swoformat ? 0x102 : 0;        /* TPIU_FFCR */
+          trace_lock();
+          tracetime_setclock(opt_swoclock);
+          trace_unlock();
           if (bmscript_line_fmt("swo-generic", mcu_family, cmd, scriptparams)) {
             /* run first line from the script */
             task_stdin(&task, cmd);
@@ -3000,11 +3186,129 @@ int main(int argc, char *argv[])
             if (!opt_allmsg)
               console_hiddenflags |= STRFLG_LOG;
           } else {
-            curstate = STATE_STOPPED;
+            curstate = STATE_SWOPROFILE;
           }
         } else if (gdbmi_isresult() != NULL) {
           /* run next line from the script (on the end of the script, move to
              the next state) */
+          if (bmscript_line_fmt(NULL, mcu_family, cmd, scriptparams)) {
+            task_stdin(&task, cmd);
+            atprompt = 0;
+          } else {
+            console_hiddenflags &= ~STRFLG_LOG;
+            curstate = STATE_SWOPROFILE;
+          }
+          gdbmi_sethandled(0);
+        }
+        break;
+      case STATE_SWOPROFILE:
+        /* PC sampling is only configured if it is requested, or if it must
+           be turned off */
+        if (opt_swomode == SWOMODE_NONE || (opt_profile == 0 && profile_active == 0)) {
+          curstate = STATE_STOPPED;
+          break;
+        }
+        if (!atprompt)
+          break;
+        if (prevstate != curstate) {
+          if (opt_profile > 0 && opt_profile != profile_active) {
+            trace_lock();
+            result = profile_init(txtFilename);
+            trace_unlock();
+            if (result == 0)
+              console_add("No function symbols found for profiling\n", STRFLG_ERROR);
+          }
+          profile_active = opt_profile;
+          scriptparams[0] = profile_dwtctrl(opt_profile, NULL);
+          if (bmscript_line_fmt("swo-profile", mcu_family, cmd, scriptparams)) {
+            /* run first line from the script */
+            task_stdin(&task, cmd);
+            atprompt = 0;
+            prevstate = curstate;
+            if (!opt_allmsg)
+              console_hiddenflags |= STRFLG_LOG;
+          } else {
+            curstate = STATE_STOPPED;
+          }
+        } else if (gdbmi_isresult() != NULL) {
+          if (bmscript_line_fmt(NULL, mcu_family, cmd, scriptparams)) {
+            task_stdin(&task, cmd);
+            atprompt = 0;
+          } else {
+            console_hiddenflags &= ~STRFLG_LOG;
+            curstate = STATE_STOPPED;
+          }
+          gdbmi_sethandled(0);
+        }
+        break;
+      case STATE_LIVE_ADDRESS:
+      case STATE_LIVE_SIZE:
+        if (!atprompt)
+          break;
+        if (curstate == STATE_LIVE_ADDRESS && prevstate != curstate)
+          live_index = live_unresolved();
+        if (live_index < 0) {
+          curstate = STATE_STOPPED;
+          break;
+        }
+        if (prevstate != curstate) {
+          if (curstate == STATE_LIVE_ADDRESS)
+            sprintf(cmd, "-data-evaluate-expression &(%s)\n", live_get(live_index)->expr);
+          else
+            sprintf(cmd, "-data-evaluate-expression sizeof(%s)\n", live_get(live_index)->expr);
+          task_stdin(&task, cmd);
+          atprompt = 0;
+          prevstate = curstate;
+        } else if (gdbmi_isresult() != NULL) {
+          const char *head = gdbmi_isresult();
+          if (strncmp(head, "done", 4) == 0 && (head = strstr(head, "value=")) != NULL) {
+            head = skipwhite(head + 6);
+            if (*head == '"')
+              head++;
+            if (curstate == STATE_LIVE_ADDRESS) {
+              /* value is formatted like: (int *) 0x20000010 <counter> */
+              const char *ptr = strstr(head, "0x");
+              if (ptr != NULL) {
+                live_address = strtoul(ptr, NULL, 16);
+                curstate = STATE_LIVE_SIZE;
+              } else {
+                console_add("Expression has no address\n", STRFLG_ERROR);
+                trace_lock();
+                live_remove(live_index);
+                trace_unlock();
+                curstate = STATE_STOPPED;
+              }
+            } else {
+              trace_lock();
+              live_resolve(live_index, live_address, (unsigned)strtoul(head, NULL, 10));
+              trace_unlock();
+              curstate = STATE_LIVE_SETUP;
+            }
+          } else {
+            trace_lock();
+            live_remove(live_index);  /* error message is already printed by GDB */
+            trace_unlock();
+            curstate = STATE_STOPPED;
+          }
+          gdbmi_sethandled(0);
+        }
+        break;
+      case STATE_LIVE_SETUP:
+        if (!atprompt)
+          break;
+        if (prevstate != curstate) {
+          live_dwtparams(scriptparams);
+          if (bmscript_line_fmt("swo-datatrace", mcu_family, cmd, scriptparams)) {
+            /* run first line from the script */
+            task_stdin(&task, cmd);
+            atprompt = 0;
+            prevstate = curstate;
+            if (!opt_allmsg)
+              console_hiddenflags |= STRFLG_LOG;
+          } else {
+            curstate = STATE_STOPPED;
+          }
+        } else if (gdbmi_isresult() != NULL) {
           if (bmscript_line_fmt(NULL, mcu_family, cmd, scriptparams)) {
             task_stdin(&task, cmd);
             atprompt = 0;
@@ -3278,11 +3582,18 @@ int main(int argc, char *argv[])
               if (handle_display_cmd(console_edit, stateparam, statesymbol, sizearray(statesymbol))) {
                 curstate = STATE_WATCH_TOGGLE;
                 tab_states[TAB_WATCHES] = nk_true; /* make sure the watch view to open */
-              } else if ((result = handle_trace_cmd(console_edit, &opt_swomode, &opt_swoclock, &opt_swobaud)) != 0) {
+              } else if ((result = handle_trace_cmd(console_edit, &opt_swomode, &opt_swoclock, &opt_swobaud, &opt_profile, &opt_swotstamp, &opt_swoformat)) != 0) {
                 if (result == 1) {
                   curstate = STATE_SWOTRACE;
                 } else if (result == 2) {
                   curstate = STATE_SWOCHANNELS;
+                } else if (result == 4) {
+                  curstate = STATE_SWOPROFILE;
+                } else if (result == 6) {
+                  curstate = STATE_LIVE_ADDRESS;
+                  tab_states[TAB_LIVE] = nk_true;
+                } else if (result == 7) {
+                  curstate = STATE_LIVE_SETUP;
                 } else if (result == 3) {
                   trace_info_mode(opt_swomode, opt_swoclock, opt_swobaud);
                   if (opt_swomode != SWOMODE_NONE) {
@@ -3329,6 +3640,10 @@ int main(int argc, char *argv[])
       if (insplitter == SPLITTER_HORIZONTAL)
         splitter_hor = (splitter_columns[0] + ctx->input.mouse.delta.x) / (canvas_width - SEPARATOR_HOR - 2 * SPACING);
 
+      /* SWO data is processed even if the trace view is closed, because the
+         live watches also depend on it */
+      tracestring_process(trace_status == TRACESTAT_OK);
+
       /* right column */
       if (nk_group_begin(ctx, "right", NK_WINDOW_BORDER)) {
         if (nk_tree_state_push(ctx, NK_TREE_TAB, "Configuration", &tab_states[TAB_CONFIGURATION])) {
@@ -3559,7 +3874,6 @@ int main(int argc, char *argv[])
         } /* semihosting (Target output) */
 
         if (nk_tree_state_push(ctx, NK_TREE_TAB, "SWO tracing", &tab_states[TAB_SWO])) {
-          tracestring_process(trace_status == TRACESTAT_OK);
           nk_layout_row_dynamic(ctx, tab_heights[TAB_SWO], 1);
           tracelog_widget(ctx, "tracelog", FONT_HEIGHT, -1, 0);
           /* make view height resizeable */
@@ -3578,6 +3892,84 @@ int main(int argc, char *argv[])
           nk_tree_state_pop(ctx);
         } /* SWO tracing */
 
+        if (nk_tree_state_push(ctx, NK_TREE_TAB, "Live watches", &tab_states[TAB_LIVE])) {
+          int count = 0;
+          trace_lock();   /* the decoder thread updates the values */
+          for (idx = 0; idx < LIVE_MAXVARS; idx++) {
+            const LIVEVAR *var = live_get(idx);
+            char label[60];
+            if (var == NULL)
+              continue;
+            count++;
+            nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 5);
+            nk_layout_row_push(ctx, 30);
+            sprintf(label, "%d", idx);   /* comparator number */
+            nk_label(ctx, label, NK_TEXT_LEFT);
+            nk_layout_row_push(ctx, 100);
+            nk_label(ctx, var->expr, NK_TEXT_LEFT);
+            nk_layout_row_push(ctx, 140);
+            if (var->updates > 0) {
+              sprintf(label, "%llu [0x%llx]", var->value, var->value);
+              nk_label(ctx, label, NK_TEXT_LEFT);
+            } else {
+              nk_label(ctx, "?", NK_TEXT_LEFT);
+            }
+            nk_layout_row_push(ctx, 100);
+            if (var->hist_count > 1) {
+              /* short history, oldest value first */
+              int pos = (var->hist_head - var->hist_count + LIVE_HISTORY) % LIVE_HISTORY;
+              int i;
+              float vmin = (float)var->history[pos], vmax = vmin;
+              for (i = 1; i < var->hist_count; i++) {
+                float v = (float)var->history[(pos + i) % LIVE_HISTORY];
+                if (v < vmin)
+                  vmin = v;
+                if (v > vmax)
+                  vmax = v;
+              }
+              if (vmax <= vmin)
+                vmax = vmin + 1;
+              if (nk_chart_begin(ctx, NK_CHART_LINES, var->hist_count, vmin, vmax)) {
+                for (i = 0; i < var->hist_count; i++)
+                  nk_chart_push(ctx, (float)var->history[(pos + i) % LIVE_HISTORY]);
+                nk_chart_end(ctx);
+              }
+            } else {
+              nk_spacing(ctx, 1);
+            }
+            nk_layout_row_push(ctx, ROW_HEIGHT);
+            if (nk_button_symbol(ctx, NK_SYMBOL_X)) {
+              live_remove(idx);
+              curstate = STATE_LIVE_SETUP;
+            }
+          }
+          trace_unlock();
+          if (count == 0) {
+            nk_layout_row_dynamic(ctx, ROW_HEIGHT, 1);
+            nk_label(ctx, "No live watches", NK_TEXT_ALIGN_CENTERED | NK_TEXT_ALIGN_MIDDLE);
+          }
+          nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 3);
+          nk_layout_row_push(ctx, 30);
+          nk_spacing(ctx, 1);
+          nk_layout_row_push(ctx, 240);
+          result = nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD | NK_EDIT_SIG_ENTER, live_edit, sizearray(live_edit), nk_filter_ascii);
+          nk_layout_row_push(ctx, ROW_HEIGHT);
+          if ((nk_button_symbol(ctx, NK_SYMBOL_PLUS) || (result & NK_EDIT_COMMITED)) && curstate == STATE_STOPPED && strlen(live_edit) > 0) {
+            int slot;
+            trace_lock();
+            slot = live_add(live_edit);
+            trace_unlock();
+            if (slot >= 0)
+              curstate = STATE_LIVE_ADDRESS;
+            else
+              console_add("No free DWT comparator\n", STRFLG_ERROR);
+            live_edit[0] = '\0';
+          } else if (result & NK_EDIT_ACTIVATED) {
+            console_activate = 0;
+          }
+          nk_tree_state_pop(ctx);
+        } /* live watches */
+
         nk_group_end(ctx);
       } /* right column */
 
@@ -3639,6 +4031,9 @@ int main(int argc, char *argv[])
   ini_putl("SWO trace", "mode", opt_swomode, txtConfigFile);
   ini_putl("SWO trace", "bitrate", opt_swobaud, txtConfigFile);
   ini_putl("SWO trace", "clock", opt_swoclock, txtConfigFile);
+  ini_putl("SWO trace", "profile", opt_profile, txtConfigFile);
+  ini_putl("SWO trace", "timestamps", opt_swotstamp, txtConfigFile);
+  ini_putl("SWO trace", "formatter", opt_swoformat, txtConfigFile);
   for (idx = 0; idx < NUM_CHANNELS; idx++) {
     char key[32];
     struct nk_color color = channel_getcolor(idx);
@@ -3655,5 +4050,8 @@ int main(int argc, char *argv[])
   console_clear();
   sources_clear(1);
   source_clear();
+  trace_close();
+  profile_cleanup();
+  capture_cleanup();
   return exitcode;
 }
@@ -33,6 +33,7 @@
     #define stricmp(s1,s2)    _stricmp((s1),(s2))
   #endif
 #elif defined __linux__
+  #include <pthread.h>
   #include <unistd.h>
   #include <bsd/string.h>
   #include <sys/stat.h>
@@ -48,10 +49,9 @@
 #include "noc_file_dialog.h"
 #include "bmp-script.h"
 #include "bmp-support.h"
+#include "bmscan.h"
 #include "elf-postlink.h"
-#include "gdb-rsp.h"
 #include "minIni.h"
-#include "rs232.h"
 #include "specialfolder.h"
 
 #include "res/btn_folder.h"
@@ -129,6 +129,47 @@ static void set_style(struct nk_context *ctx)
   nk_style_from_table(ctx, table);
 }
 
+/* the log and the status of the probes (in gang mode) are shared between the
+   GUI thread and the worker threads; log_lock() and log_unlock() protect these
+   (calls may be nested) */
+#if defined _WIN32
+  static CRITICAL_SECTION loglock;
+#else
+  static pthread_mutex_t loglock;
+#endif
+static int loglock_init = 0;
+
+static void log_lock(void)
+{
+  if (!loglock_init) {
+    #if defined _WIN32
+      InitializeCriticalSection(&loglock);
+    #else
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutex_init(&loglock, &attr);
+      pthread_mutexattr_destroy(&attr);
+    #endif
+    loglock_init = 1;
+  }
+  #if defined _WIN32
+    EnterCriticalSection(&loglock);
+  #else
+    pthread_mutex_lock(&loglock);
+  #endif
+}
+
+static void log_unlock(void)
+{
+  assert(loglock_init);
+  #if defined _WIN32
+    LeaveCriticalSection(&loglock);
+  #else
+    pthread_mutex_unlock(&loglock);
+  #endif
+}
+
 /* log_addstring() adds a string to the log data; the parameter "text" may be NULL
    to return the current log string without adding new data to it */
 static char *logtext = NULL;
@@ -142,12 +183,15 @@ static char *log_addstring(const char *text)
   if (text == NULL || strlen(text) == 0)
     return logtext;
 
+  log_lock();
   if (logtext != NULL)
     len += strlen(logtext);
   len += strlen(text) + 1;  /* +1 for the \0 */
   buf = malloc(len * sizeof(char));
-  if (buf == NULL)
+  if (buf == NULL) {
+    log_unlock();
     return logtext;
+  }
 
   *buf = '\0';
   if (logtext != NULL)
@@ -157,6 +201,7 @@ static char *log_addstring(const char *text)
   if (logtext != NULL)
     free(logtext);
   logtext = buf;
+  log_unlock();
   return logtext;
 }
 
@@ -216,10 +261,11 @@ static int log_widget(struct nk_context *ctx, const char *id, const char *conten
   return lines;
 }
 
-static int bmp_callback(int code, const char *message)
+static int bmp_callback(int code, const char *message, void *param)
 {
   char fullmsg[200] = "";
 
+  (void)param;
   assert(strlen(message) < sizearray(fullmsg) - 4);  /* colour code and \n may be added */
   if (code < 0)
     strcpy(fullmsg, "^1");  /* errors in red */
@@ -263,6 +309,45 @@ static int copyfile(FILE *fdest, FILE *fsrc)
   return 1;
 }
 
+static int save_flash(BMP_CONNECTION *bmp, const char *filename)
+{
+  unsigned long low, high;
+  unsigned char *data;
+  size_t size;
+  FILE *fp;
+  int result;
+
+  assert(filename != NULL);
+  if (!bmp_flashtotal(bmp, &low, &high))
+    return 0;   /* error was already reported on attaching */
+  size = high - low;
+  data = malloc(size);
+  if (data == NULL) {
+    log_addstring("^1Memory allocation error\n");
+    return 0;
+  }
+
+  result = bmp_readmem(bmp, low, data, size);
+  if (result) {
+    fp = fopen(filename, "wb");
+    if (fp != NULL) {
+      result = (fwrite(data, 1, size, fp) == size);
+      fclose(fp);
+    } else {
+      result = 0;
+    }
+    if (result) {
+      char msg[100];
+      sprintf(msg, "^2Saved Flash memory 0x%lx-0x%lx (%u KiB)\n", low, high - 1, (unsigned)(size / 1024));
+      log_addstring(msg);
+    } else {
+      log_addstring("^1Failed to save the file\n");
+    }
+  }
+  free(data);
+  return result;
+}
+
 static int patch_vecttable(FILE *fp, const char *mcutype)
 {
   char msg[100];
@@ -476,6 +561,308 @@ static int serialize_match(FILE *fp, const char *match, unsigned long offset,
   return 1;
 }
 
+/* gang programming: every Black Magic Probe that is connected to the
+   workstation gets its own worker thread, which runs the complete download
+   sequence on its own connection */
+#define MAX_GANG  16
+
+enum { SER_NONE, SER_ADDRESS, SER_MATCH };
+enum { GANG_IDLE, GANG_BUSY, GANG_SUCCESS, GANG_FAILED };
+
+typedef struct tagGANGJOB {
+  char filename[256];         /* target file */
+  const char *architecture;   /* MCU family, NULL for "generic" */
+  int tpwr;
+  int fullerase;
+  int incremental;            /* only write Flash sectors that changed */
+  int serialize;              /* SER_NONE, SER_ADDRESS or SER_MATCH */
+  char section[32];           /* SER_ADDRESS: section & address */
+  unsigned long address;
+  char match[64];             /* SER_MATCH: pattern & offset */
+  unsigned long offset;
+  int serialsize;
+  int format;
+  int nextserial;             /* next serial number to assign (shared) */
+} GANGJOB;
+
+typedef struct tagGANGSLOT {
+  int probe;                  /* sequence number of the probe */
+  char port[64];
+  int state;                  /* GANG_xxx, protected by log_lock() */
+  int done;                   /* worker thread has finished (protected) */
+  char message[100];          /* most recent status message (protected) */
+  int serial;                 /* assigned serial number, -1 if none (protected) */
+  GANGJOB *job;
+  #if defined _WIN32
+    HANDLE hThread;
+  #else
+    pthread_t hThread;
+  #endif
+} GANGSLOT;
+
+static GANGJOB gang_job;
+static GANGSLOT gang_slot[MAX_GANG];
+static int gang_count = 0;
+
+static void gang_setstatus(GANGSLOT *slot, int state, const char *message)
+{
+  log_lock();
+  if (state != GANG_IDLE)
+    slot->state = state;
+  if (message != NULL) {
+    const char *tail;
+    size_t len;
+    if (message[0] == '^' && message[1] != '\0')
+      message += 2;         /* skip colour code */
+    len = ((tail = strchr(message, '\n')) != NULL) ? (size_t)(tail - message) : strlen(message);
+    if (len >= sizearray(slot->message))
+      len = sizearray(slot->message) - 1;
+    memcpy(slot->message, message, len);
+    slot->message[len] = '\0';
+  }
+  log_unlock();
+}
+
+/* gang_done() sets the final result of a worker; it must be the last action
+   of the worker thread (the message is kept) */
+static void gang_done(GANGSLOT *slot, int result)
+{
+  log_lock();
+  slot->state = result ? GANG_SUCCESS : GANG_FAILED;
+  slot->done = 1;
+  log_unlock();
+}
+
+/* gang_callback() is the status callback for a worker thread; it updates the
+   status message of the probe, and adds the message to the log (prefixed with
+   the port, to tell the probes apart); the state is not changed, because not
+   every error is fatal (the worker sets the result when it finishes) */
+static int gang_callback(int code, const char *message, void *param)
+{
+  GANGSLOT *slot = (GANGSLOT*)param;
+  char fullmsg[250];
+
+  assert(slot != NULL);
+  gang_setstatus(slot, GANG_IDLE, message);
+  sprintf(fullmsg, "%s[%s] ", (code < 0) ? "^1" : (code > 0) ? "^2" : "", slot->port);
+  strlcat(fullmsg, message, sizearray(fullmsg));
+  if (strchr(message, '\n') == NULL)
+    strlcat(fullmsg, "\n", sizearray(fullmsg));
+  log_addstring(fullmsg);
+  return code >= 0;
+}
+
+/* gang_program() runs the download sequence on a single probe; it is the body
+   of a worker thread */
+static int gang_program(GANGSLOT *slot)
+{
+  GANGJOB *job = slot->job;
+  BMP_CONNECTION *bmp;
+  FILE *fpTgt, *fpWork;
+  int result;
+
+  assert(job != NULL);
+  bmp = bmp_create(slot->probe);
+  if (bmp == NULL) {
+    gang_setstatus(slot, GANG_BUSY, "Memory allocation error");
+    gang_done(slot, 0);
+    return 0;
+  }
+  bmp_setcallback(bmp, gang_callback, slot);
+  gang_setstatus(slot, GANG_BUSY, "Connecting");
+  fpTgt = fpWork = NULL;
+
+  result = bmp_connect(bmp);
+  if (result)
+    result = bmp_attach(bmp, job->tpwr, NULL, 0, NULL, 0);
+  if (result) {
+    fpTgt = fopen(job->filename, "rb");
+    if (fpTgt == NULL) {
+      gang_setstatus(slot, GANG_FAILED, "Failed to load the target file");
+      result = 0;
+    }
+  }
+  if (result && (job->architecture != NULL || job->serialize != SER_NONE)) {
+    /* every thread patches its own copy of the ELF file */
+    fpWork = tmpfile();
+    result = (fpWork != NULL) && copyfile(fpWork, fpTgt);
+    if (result && job->architecture != NULL)
+      result = patch_vecttable(fpWork, job->architecture);
+    if (result && job->serialize != SER_NONE) {
+      unsigned char data[50];
+      int serial;
+      /* claim a serial number only once the target is attached, so that
+         probes without a target do not use up numbers */
+      log_lock();
+      serial = job->nextserial++;
+      slot->serial = serial;
+      log_unlock();
+      result = serialize_databuffer(data, job->serialsize, serial, job->format);
+      if (result && job->serialize == SER_ADDRESS)
+        result = serialize_address(fpWork, job->section, job->address, data, job->serialsize);
+      else if (result && job->serialize == SER_MATCH)
+        result = serialize_match(fpWork, job->match, job->offset, data, job->serialsize);
+    }
+    if (!result)
+      gang_setstatus(slot, GANG_FAILED, "Failed to process the target file");
+  }
+  if (result && job->fullerase)
+    result = bmp_fullerase(bmp);
+  if (result) {
+    gang_setstatus(slot, GANG_BUSY, "Downloading");
+    if (job->architecture != NULL)
+      bmp_runscript(bmp, "memremap", job->architecture, NULL);
+    result = bmp_download(bmp, (fpWork != NULL) ? fpWork : fpTgt, job->incremental && !job->fullerase);
+  }
+  if (result) {
+    gang_setstatus(slot, GANG_BUSY, "Verifying");
+    if (job->architecture != NULL)
+      bmp_runscript(bmp, "memremap", job->architecture, NULL);
+    result = bmp_verify(bmp, (fpWork != NULL) ? fpWork : fpTgt);
+  }
+
+  if (fpWork != NULL)
+    fclose(fpWork);
+  if (fpTgt != NULL)
+    fclose(fpTgt);
+  bmp_destroy(bmp);
+  gang_done(slot, result);
+  return result;
+}
+
+#if defined _WIN32
+static DWORD WINAPI gang_thread(LPVOID arg)
+{
+  return (DWORD)gang_program((GANGSLOT*)arg);
+}
+#else
+static void *gang_thread(void *arg)
+{
+  gang_program((GANGSLOT*)arg);
+  return NULL;
+}
+#endif
+
+/** gang_start() scans for all connected probes, and starts a worker thread
+ *  for each.
+ *
+ *  \return The number of probes found, or 0 if none are found.
+ *
+ *  \note The fields of "gang_job" must be set before calling this function.
+ */
+static int gang_start(void)
+{
+  char port[64];
+  int idx;
+
+  gang_count = 0;
+  while (gang_count < MAX_GANG && find_bmp(gang_count, BMP_IF_GDB, port, sizearray(port))) {
+    GANGSLOT *slot = &gang_slot[gang_count];
+    memset(slot, 0, sizeof(GANGSLOT));
+    slot->probe = gang_count;
+    strlcpy(slot->port, port, sizearray(slot->port));
+    slot->state = GANG_BUSY;
+    slot->serial = -1;
+    slot->job = &gang_job;
+    gang_count++;
+  }
+
+  log_lock();   /* initializes the lock, before the workers use it */
+  log_unlock();
+  for (idx = 0; idx < gang_count; idx++) {
+    GANGSLOT *slot = &gang_slot[idx];
+    int ok;
+    #if defined _WIN32
+      slot->hThread = CreateThread(NULL, 0, gang_thread, slot, 0, NULL);
+      ok = (slot->hThread != NULL);
+    #else
+      ok = (pthread_create(&slot->hThread, NULL, gang_thread, slot) == 0);
+    #endif
+    if (!ok) {
+      slot->hThread = 0;
+      gang_setstatus(slot, GANG_BUSY, "Failed to create worker thread");
+      gang_done(slot, 0);
+    }
+  }
+  return gang_count;
+}
+
+/** gang_finished() returns whether all worker threads have completed; if so,
+ *  it releases the threads. A thread is only joined after it has flagged that
+ *  it is done, so that the GUI thread does not block.
+ *
+ *  \param success  Is set to the number of successfully programmed boards.
+ */
+static int gang_finished(int *success)
+{
+  int idx, busy;
+
+  busy = 0;
+  log_lock();
+  for (idx = 0; idx < gang_count; idx++)
+    if (!gang_slot[idx].done)
+      busy++;
+  log_unlock();
+  if (busy > 0)
+    return 0;
+
+  assert(success != NULL);
+  *success = 0;
+  for (idx = 0; idx < gang_count; idx++) {
+    GANGSLOT *slot = &gang_slot[idx];
+    if (slot->hThread != 0) {
+      #if defined _WIN32
+        WaitForSingleObject(slot->hThread, INFINITE);
+        CloseHandle(slot->hThread);
+      #else
+        pthread_join(slot->hThread, NULL);
+      #endif
+      slot->hThread = 0;
+    }
+    if (slot->state == GANG_SUCCESS)
+      *success += 1;
+  }
+  return 1;
+}
+
+/* gang_widget() draws the status grid, with a line per probe */
+static void gang_widget(struct nk_context *ctx, float rowheight)
+{
+  static const char *statename[] = { "", "busy", "OK", "FAILED" };
+  int idx;
+
+  log_lock();
+  for (idx = 0; idx < gang_count; idx++) {
+    const GANGSLOT *slot = &gang_slot[idx];
+    struct nk_color clr;
+    char field[32];
+    switch (slot->state) {
+    case GANG_SUCCESS:
+      clr = nk_rgb(100, 255, 100);
+      break;
+    case GANG_FAILED:
+      clr = nk_rgb(255, 100, 128);
+      break;
+    default:
+      clr = nk_rgb(255, 255, 100);
+    }
+    nk_layout_row(ctx, NK_DYNAMIC, rowheight, 4, nk_ratio(4, 0.3, 0.15, 0.15, 0.4));
+    nk_label(ctx, slot->port, NK_TEXT_LEFT);
+    nk_label_colored(ctx, statename[slot->state], NK_TEXT_LEFT, clr);
+    if (slot->serial >= 0)
+      sprintf(field, "#%d", slot->serial);
+    else
+      field[0] = '\0';
+    nk_label(ctx, field, NK_TEXT_LEFT);
+    nk_label(ctx, slot->message, NK_TEXT_LEFT);
+  }
+  if (gang_count == 0) {
+    nk_layout_row_dynamic(ctx, rowheight, 1);
+    nk_label(ctx, "No probes", NK_TEXT_LEFT);
+  }
+  log_unlock();
+}
+
 enum {
   STATE_IDLE,
   STATE_SAVE,
@@ -486,6 +873,8 @@ enum {
   STATE_DOWNLOAD,
   STATE_VERIFY,
   STATE_FINISH,
+  STATE_READBACK,
+  STATE_GANG,
 };
 
 int main(int argc, char *argv[])
@@ -507,6 +896,16 @@ int main(int argc, char *argv[])
     "be set to \"generic\"\n\n"
     "The \"Power Target\" option can be set to drive the\n"
     "power-sense pin with 3.3V (to power the target).\n\n"
+    "With \"Incremental download\", the Flash sectors whose\n"
+    "contents already match the firmware are skipped; only\n"
+    "the changed sectors are erased and written. This option\n"
+    "has no effect if the Flash memory is fully erased first.\n\n"
+    "With \"Gang programming\", the firmware is downloaded\n"
+    "to the targets on all probes connected to the work-\n"
+    "station, in parallel. The \"Probes\" tab shows the status\n"
+    "of each probe. Each target gets its own serial number;\n"
+    "a serial number is used up when a target is attached,\n"
+    "even if the download fails later.\n\n"
     "^3Serialization\n"
     "The serialization method is either \"No serialization\",\n"
     "or \"Address\" to store the serial number at a specific\n"
@@ -531,14 +930,17 @@ int main(int argc, char *argv[])
     "after each successful download. The size of the serial\n"
     "number is in bytes. The format can be chosen as binary,\n"
     "ASCII or Unicode. In the latter two cases, the serial\n"
-    "number is stored as readable text.\n\n";
+    "number is stored as readable text.\n\n"
+    "^3Read back\n"
+    "The \"Read back\" button reads the complete Flash memory\n"
+    "of the target and saves it in a binary file.\n\n";
 
-  enum { SER_NONE, SER_ADDRESS, SER_MATCH };
   enum { FMT_BIN, FMT_ASCII, FMT_UNICODE };
-  enum { TAB_OPTIONS, TAB_SERIALIZATION, TAB_STATUS, /* --- */ TAB_COUNT };
+  enum { TAB_OPTIONS, TAB_SERIALIZATION, TAB_STATUS, TAB_PROBES, /* --- */ TAB_COUNT };
 
   struct nk_context *ctx;
   struct nk_image btn_folder;
+  BMP_CONNECTION *bmp;
   struct nk_rect rcwidget;
   enum nk_collapse_states tab_states[TAB_COUNT];
   int running = 1;
@@ -547,13 +949,17 @@ int main(int argc, char *argv[])
   char txtSection[32] = "", txtAddress[32] = "", txtMatch[64] = "", txtOffset[32] = "";
   char txtSerial[32] = "", txtSerialSize[32] = "";
   char txtConfigFile[256];
+  char txtReadback[256] = "";
   FILE *fpTgt, *fpWork;
   int opt_tpwr = nk_false;
   int opt_fullerase = nk_false;
+  int opt_incremental = nk_false;
   int opt_architecture = 0;
   int opt_serialize = SER_NONE;
   int opt_format = FMT_BIN;
+  int opt_gang = nk_false;
   int help_active = 0;
+  int readback = 0;
   int load_options = 0;
 
   /* locate the configuration file */
@@ -585,10 +991,12 @@ int main(int argc, char *argv[])
   strcpy(txtOffset, "0");
   strcpy(txtSerial, "1");
   strcpy(txtSerialSize, "4");
+  opt_gang = (int)ini_getl("Settings", "gang", 0, txtConfigFile);
 
   /* check presence of the debug probe */
-  bmp_setcallback(bmp_callback);
-  bmp_connect();
+  bmp = bmp_create(0);
+  bmp_setcallback(bmp, bmp_callback, NULL);
+  bmp_connect(bmp);
 
   ctx = guidriver_init("BlackMagic Flash Programmer", WINDOW_WIDTH, WINDOW_HEIGHT, 0, FONT_HEIGHT);
   set_style(ctx);
@@ -597,6 +1005,7 @@ int main(int argc, char *argv[])
   tab_states[TAB_OPTIONS] = NK_MINIMIZED;
   tab_states[TAB_SERIALIZATION] = NK_MINIMIZED;
   tab_states[TAB_STATUS]= NK_MAXIMIZED;
+  tab_states[TAB_PROBES]= NK_MINIMIZED;
   fpTgt = fpWork = NULL;
 
   while (running) {
@@ -605,6 +1014,7 @@ int main(int argc, char *argv[])
     int result;
     switch (curstate) {
     case STATE_IDLE:
+      readback = 0;
       if (fpTgt != NULL) {
         fclose(fpTgt);
         fpTgt = NULL;
@@ -630,6 +1040,7 @@ int main(int argc, char *argv[])
         ini_puts("Options", "architecture", field, txtCfgFile);
         ini_putl("Options", "tpwr", opt_tpwr, txtCfgFile);
         ini_putl("Options", "full-erase", opt_fullerase, txtCfgFile);
+        ini_putl("Options", "incremental", opt_incremental, txtCfgFile);
         ini_putl("Serialize", "option", opt_serialize, txtCfgFile);
         sprintf(field, "%s:%s", txtSection, txtAddress);
         ini_puts("Serialize", "address", field, txtCfgFile);
@@ -637,7 +1048,7 @@ int main(int argc, char *argv[])
         ini_puts("Serialize", "match", field, txtCfgFile);
         sprintf(field, "%s:%s:%d", txtSerial, txtSerialSize, opt_format);
         ini_puts("Serialize", "serial", field, txtCfgFile);
-        curstate = STATE_ATTACH;
+        curstate = opt_gang ? STATE_GANG : STATE_ATTACH;
       } else {
         log_addstring("^1Failed to open the ELF file\n");
         curstate = STATE_IDLE;
@@ -645,11 +1056,11 @@ int main(int argc, char *argv[])
       waitidle = 0;
       break;
     case STATE_ATTACH:
-      result = bmp_connect();
+      result = bmp_connect(bmp);
       if (result) {
         char mcufamily[32];
         int arch;
-        result = bmp_attach(opt_tpwr, mcufamily, sizearray(mcufamily), NULL, 0);
+        result = bmp_attach(bmp, opt_tpwr, mcufamily, sizearray(mcufamily), NULL, 0);
         for (arch = 0; arch < sizearray(architectures); arch++)
           if (stricmp(architectures[arch], mcufamily) == 0)
             break;
@@ -661,7 +1072,12 @@ int main(int argc, char *argv[])
           log_addstring(msg);
         }
       }
-      curstate = result ? STATE_PRE_DOWNLOAD : STATE_IDLE;
+      if (!result)
+        curstate = STATE_IDLE;
+      else if (readback)
+        curstate = STATE_READBACK;
+      else
+        curstate = STATE_PRE_DOWNLOAD;
       waitidle = 0;
       break;
     case STATE_PRE_DOWNLOAD:
@@ -713,7 +1129,7 @@ int main(int argc, char *argv[])
     case STATE_FULLERASE:
       /* optionally erase all Flash memory */
       if (opt_fullerase) {
-        result = bmp_fullerase();
+        result = bmp_fullerase(bmp);
         curstate = result ? STATE_DOWNLOAD : STATE_IDLE;
       } else {
         curstate = STATE_DOWNLOAD;
@@ -723,16 +1139,16 @@ int main(int argc, char *argv[])
     case STATE_DOWNLOAD:
       /* download to target */
       if (opt_architecture > 0)
-        bmp_runscript("memremap", architectures[opt_architecture], NULL);
-      result = bmp_download((fpWork != NULL) ? fpWork : fpTgt);
+        bmp_runscript(bmp, "memremap", architectures[opt_architecture], NULL);
+      result = bmp_download(bmp, (fpWork != NULL) ? fpWork : fpTgt, opt_incremental && !opt_fullerase);
       curstate = result ? STATE_VERIFY : STATE_IDLE;
       waitidle = 0;
       break;
     case STATE_VERIFY:
       /* compare the checksum of Flash memory to the file */
       if (opt_architecture > 0)
-        bmp_runscript("memremap", architectures[opt_architecture], NULL);
-      result = bmp_verify((fpWork != NULL)? fpWork : fpTgt);
+        bmp_runscript(bmp, "memremap", architectures[opt_architecture], NULL);
+      result = bmp_verify(bmp, (fpWork != NULL)? fpWork : fpTgt);
       curstate = result ? STATE_FINISH : STATE_IDLE;
       waitidle = 0;
       break;
@@ -745,6 +1161,63 @@ int main(int argc, char *argv[])
       curstate = STATE_IDLE;
       waitidle = 0;
       break;
+    case STATE_READBACK:
+      /* save the contents of Flash memory to a file */
+      if (opt_architecture > 0)
+        bmp_runscript(bmp, "memremap", architectures[opt_architecture], NULL);
+      save_flash(bmp, txtReadback);
+      curstate = STATE_IDLE;
+      waitidle = 0;
+      break;
+    case STATE_GANG:
+      if (gang_count == 0) {
+        /* start gang programming; the probe of the single-target mode is
+           released, because a worker thread must open it */
+        bmp_disconnect(bmp);
+        strlcpy(gang_job.filename, txtFilename, sizearray(gang_job.filename));
+        gang_job.architecture = (opt_architecture > 0) ? architectures[opt_architecture] : NULL;
+        gang_job.tpwr = opt_tpwr;
+        gang_job.fullerase = opt_fullerase;
+        gang_job.incremental = opt_incremental;
+        gang_job.serialize = opt_serialize;
+        strlcpy(gang_job.section, txtSection, sizearray(gang_job.section));
+        gang_job.address = strtoul(txtAddress, NULL, 16);
+        strlcpy(gang_job.match, txtMatch, sizearray(gang_job.match));
+        gang_job.offset = strtoul(txtOffset, NULL, 16);
+        gang_job.serialsize = (int)strtol(txtSerialSize, NULL, 10);
+        gang_job.format = opt_format;
+        gang_job.nextserial = (int)strtol(txtSerial, NULL, 10);
+        if (gang_start() == 0) {
+          log_addstring("^1No Black Magic Probe found\n");
+          curstate = STATE_IDLE;
+        } else {
+          tab_states[TAB_STATUS] = NK_MINIMIZED;
+          tab_states[TAB_PROBES] = NK_MAXIMIZED;
+        }
+        waitidle = 0;
+      } else {
+        int success;
+        if (gang_finished(&success)) {
+          char msg[100];
+          sprintf(msg, "%sGang programming: %d of %d targets successful\n",
+                  (success == gang_count) ? "^2" : "^1", success, gang_count);
+          log_addstring(msg);
+          if (opt_serialize != SER_NONE)
+            sprintf(txtSerial, "%d", gang_job.nextserial);
+          gang_count = 0;
+          curstate = STATE_IDLE;
+          waitidle = 0;
+        } else {
+          /* refresh the status grid regularly */
+          #if defined _WIN32
+            Sleep(50);
+          #else
+            usleep(50 * 1000);
+          #endif
+          waitidle = 0;
+        }
+      }
+      break;
     }
 
     /* handle user input */
@@ -787,6 +1260,8 @@ int main(int argc, char *argv[])
           nk_layout_row_dynamic(ctx, ROW_HEIGHT, 1);
           nk_checkbox_label(ctx, "Power Target (3.3V)", &opt_tpwr);
           nk_checkbox_label(ctx, "Full Flash erase before download", &opt_fullerase);
+          nk_checkbox_label(ctx, "Incremental download", &opt_incremental);
+          nk_checkbox_label(ctx, "Gang programming (all probes)", &opt_gang);
 
           nk_tree_state_pop(ctx);
         }
@@ -827,7 +1302,14 @@ int main(int argc, char *argv[])
 
         if (nk_tree_state_push(ctx, NK_TREE_TAB, "Status", &tab_states[TAB_STATUS])) {
           nk_layout_row_dynamic(ctx, 4*ROW_HEIGHT, 1);
+          log_lock();
           log_widget(ctx, "status", logtext, FONT_HEIGHT, &loglines);
+          log_unlock();
+          nk_tree_state_pop(ctx);
+        }
+
+        if (opt_gang && nk_tree_state_push(ctx, NK_TREE_TAB, "Probes", &tab_states[TAB_PROBES])) {
+          gang_widget(ctx, FONT_HEIGHT);
           nk_tree_state_pop(ctx);
         }
 
@@ -849,6 +1331,7 @@ int main(int argc, char *argv[])
             opt_architecture = 0;
           opt_tpwr = (int)ini_getl("Options", "tpwr", 0, txtCfgFile);
           opt_fullerase = (int)ini_getl("Options", "full-erase", 0, txtCfgFile);
+          opt_incremental = (int)ini_getl("Options", "incremental", 0, txtCfgFile);
           opt_serialize = (int)ini_getl("Serialize", "option", 0, txtCfgFile);
           ini_gets("Serialize", "address", ".text:0", field, sizearray(field), txtCfgFile);
           if ((ptr = strchr(field, ':')) != NULL) {
@@ -886,11 +1369,26 @@ int main(int argc, char *argv[])
         load_options = 0;
       }
 
-      nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 3, nk_ratio(3, 0.2, 0.4, 0.4));
+      nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 5, nk_ratio(5, 0.2, 0.05, 0.3, 0.05, 0.4));
       if (nk_button_label(ctx, "Help") || nk_input_is_key_pressed(&ctx->input, NK_KEY_F1))
         help_active = 1;
       nk_spacing(ctx, 1);
-      if (nk_button_label(ctx, "Download") || nk_input_is_key_pressed(&ctx->input, NK_KEY_F5))
+      if (nk_button_label(ctx, "Read back") && curstate == STATE_IDLE) {
+        const char *s = noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                                             "Binary files\0*.bin\0All files\0*.*\0",
+                                             NULL, NULL, "Save Flash memory",
+                                             guidriver_apphandle());
+        if (s != NULL) {
+          if (strlen(s) < sizearray(txtReadback)) {
+            strcpy(txtReadback, s);
+            readback = 1;
+            curstate = STATE_ATTACH;  /* start the read-back sequence */
+          }
+          free((void*)s);
+        }
+      }
+      nk_spacing(ctx, 1);
+      if ((nk_button_label(ctx, "Download") || nk_input_is_key_pressed(&ctx->input, NK_KEY_F5)) && curstate != STATE_GANG)
         curstate = STATE_SAVE;  /* start the download sequence */
 
       if (help_active) {
@@ -917,15 +1415,24 @@ int main(int argc, char *argv[])
     guidriver_render(nk_rgb(30,30,30));
   }
 
-  if (strlen(txtConfigFile) > 0)
+  if (strlen(txtConfigFile) > 0) {
     ini_puts("Session", "recent", txtFilename, txtConfigFile);
+    ini_putl("Settings", "gang", opt_gang, txtConfigFile);
+  }
 
-  guidriver_close();
-  gdbrsp_packetsize(0);
-  if (rs232_isopen()) {
-    rs232_dtr(0);
-    rs232_rts(0);
-    rs232_close();
+  if (curstate == STATE_GANG && gang_count > 0) {
+    /* wait for the worker threads to complete */
+    int success;
+    while (!gang_finished(&success)) {
+      #if defined _WIN32
+        Sleep(50);
+      #else
+        usleep(50 * 1000);
+      #endif
+    }
   }
+
+  guidriver_close();
+  bmp_destroy(bmp);
   return 0;
 }
@@ -23,6 +23,7 @@
   #if defined _MSC_VER
     #define strdup(s)         _strdup(s)
     #define stricmp(s1,s2)    _stricmp((s1),(s2))
+    #define strnicmp(s1,s2,n) _strnicmp((s1),(s2),(n))
   #endif
 #else
   #include <unistd.h>
@@ -36,7 +37,8 @@
 #include "bmp-script.h"
 
 #if defined __linux__ || defined __FreeBSD__ || defined __APPLE__
-#  define stricmp(s1,s2)  strcasecmp((s1),(s2))
+#  define stricmp(s1,s2)    strcasecmp((s1),(s2))
+#  define strnicmp(s1,s2,n) strncasecmp((s1),(s2),(n))
 #endif
 #if !defined sizearray
 #  define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
@@ -90,6 +92,18 @@ static const REG_DEF registers[] = {
 
   { "DWT_CTRL",             0xE0001000, 4 },  /**< Control Register */
   { "DWT_CYCCNT",           0xE0001004, 4 },  /**< Cycle Count Register */
+  { "DWT_COMP0",            0xE0001020, 4 },  /**< Comparator Register 0 */
+  { "DWT_MASK0",            0xE0001024, 4 },  /**< Mask Register 0 */
+  { "DWT_FUNCTION0",        0xE0001028, 4 },  /**< Function Register 0 */
+  { "DWT_COMP1",            0xE0001030, 4 },  /**< Comparator Register 1 */
+  { "DWT_MASK1",            0xE0001034, 4 },  /**< Mask Register 1 */
+  { "DWT_FUNCTION1",        0xE0001038, 4 },  /**< Function Register 1 */
+  { "DWT_COMP2",            0xE0001040, 4 },  /**< Comparator Register 2 */
+  { "DWT_MASK2",            0xE0001044, 4 },  /**< Mask Register 2 */
+  { "DWT_FUNCTION2",        0xE0001048, 4 },  /**< Function Register 2 */
+  { "DWT_COMP3",            0xE0001050, 4 },  /**< Comparator Register 3 */
+  { "DWT_MASK3",            0xE0001054, 4 },  /**< Mask Register 3 */
+  { "DWT_FUNCTION3",        0xE0001058, 4 },  /**< Function Register 3 */
 
   { "ITM_TER",              0xE0000E00, 4 },  /**< Trace Enable Register */
   { "ITM_TPR",              0xE0000E40, 4 },  /**< Trace Privilege Register */
@@ -141,9 +155,9 @@ static const REG_SCRIPT scripts[] = {
     "TPIU_CSPSR = 1 \n"          /* protocol width = 1 bit */
     "TPIU_SSPSR = $0 \n"         /* 1 = Manchester, 2 = Asynchronous */
     "TPIU_ACPR = $1 \n"          /* CPU clock divider */
-    "TPIU_FFCR = 0 \n"           /* turn off formatter, discard ETM output */
+    "TPIU_FFCR = $3 \n"          /* 0 = bypass formatter, 0x102 = continuous formatting */
     "ITM_LAR = 0xC5ACCE55 \n"    /* unlock access to ITM registers */
-    "ITM_TCR = 0x11 \n"          /* (1 << 4) | 1 */
+    "ITM_TCR = $2 \n"            /* (1 << 16) | (1 << 4) | 1, or (1 << 16) | (1 << 1) | 1 for local timestamps on the CPU clock */
     "ITM_TPR = 0 \n"             /* privileged access is off */
   },
 
@@ -151,6 +165,42 @@ static const REG_SCRIPT scripts[] = {
     "ITM_TER = $0"              /* enable stimulus channel(s) */
   },
 
+  { "swo-profile", "*",
+    "DWT_CTRL ~ 0x13FE \n"      /* clear PCSAMPLENA, CYCTAP, POSTINIT & POSTPRESET */
+    "DWT_CTRL | $0 \n"          /* set sampling rate, enable PC sampling */
+    "ITM_TCR | 0x08 \n"         /* (1 << 3) forward DWT packets to ITM */
+  },
+
+  { "swo-exctrace", "*",
+    "DWT_CTRL ~ 0x10000 \n"     /* clear EXCTRCENA */
+    "DWT_CTRL | $0 \n"          /* (1 << 16) to enable exception trace */
+    "ITM_TCR ~ 0x10 \n"         /* timestamps count processor clock cycles */
+    "ITM_TCR | 0x0A \n"         /* (1 << 3) | (1 << 1) forward DWT packets, local timestamps */
+  },
+
+  /* comparators that are not used for live watches are left alone (the
+     parameters are SCRIPT_SKIP), because these may be in use for hardware
+     watchpoints and breakpoints */
+  { "swo-datatrace", "*",
+    "DWT_FUNCTION0 = $C \n"     /* disable comparators while changing them */
+    "DWT_FUNCTION1 = $D \n"
+    "DWT_FUNCTION2 = $E \n"
+    "DWT_FUNCTION3 = $F \n"
+    "DWT_COMP0 = $0 \n"         /* variable addresses */
+    "DWT_COMP1 = $1 \n"
+    "DWT_COMP2 = $2 \n"
+    "DWT_COMP3 = $3 \n"
+    "DWT_MASK0 = $4 \n"         /* log2 of the variable sizes */
+    "DWT_MASK1 = $5 \n"
+    "DWT_MASK2 = $6 \n"
+    "DWT_MASK3 = $7 \n"
+    "DWT_FUNCTION0 = $8 \n"     /* data trace mode */
+    "DWT_FUNCTION1 = $9 \n"
+    "DWT_FUNCTION2 = $A \n"
+    "DWT_FUNCTION3 = $B \n"
+    "ITM_TCR | 0x08 \n"         /* (1 << 3) forward DWT packets to ITM */
+  },
+
   /* ----- */
   { NULL, NULL, NULL }
 };
@@ -175,28 +225,73 @@ void bmscript_clearcache(void)
   cache.script_ptr = NULL;
 }
 
-/** bmp_scriptline() returns the next instruction from a script for a specific
- *  micro-controller. When this function is called with a new script name or a
- *  new mcu name, the first instruction for the requested script that matches
- *  the given mcu is returned. For every next call with the same parameters, the
- *  next instruction is returned, until the script completes.
+/* mcu_inlist() checks whether the MCU name is in a comma-separated list; a
+   name in the list may have the CPU architecture appended to it */
+static int mcu_inlist(const char *mcu, const char *list)
+{
+  size_t mculen = strlen(mcu);
+
+  while (*list != '\0') {
+    const char *tail = strchr(list, ',');
+    size_t len = (tail != NULL) ? (size_t)(tail - list) : strlen(list);
+    const char *space;
+    if (len == mculen && strnicmp(mcu, list, len) == 0)
+      return 1;
+    /* also check whether the CPU architecture is added to the name */
+    for (space = list + len - 1; space > list && *space != ' '; space--)
+      /* nothing */;
+    if (*space == ' ' && space[1] == 'M' && isdigit(space[2])
+        && (size_t)(space - list) == mculen && strnicmp(mcu, list, mculen) == 0)
+      return 1;
+    list += len;
+    if (*list == ',')
+      list += 1;
+  }
+  return 0;
+}
+
+/** bmscript_find() looks up a script for a specific micro-controller.
  *
- *  \param name     The name of te script; may be set to NULL to continue on the
- *                  last active script.
- *  \param mcu      The name of the MCU; may be set to NULL to use the MCU that
- *                  was previously set.
+ *  \param name     The name of the script.
+ *  \param mcu      The name of the MCU.
+ *
+ *  \return A pointer to the script, or NULL if no script matches. The script
+ *          can be passed to bmscript_parse(), to get the instructions one by
+ *          one.
+ *
+ *  \note The script can be for a specific device or it can be a generic script.
+ *        In this last case, the script has a "*" in its device list.
+ *
+ *  \note Unlike bmscript_line(), this function keeps no state, so that it can
+ *        be used from multiple threads.
+ */
+const char *bmscript_find(const char *name, const char *mcu)
+{
+  int idx;
+
+  assert(name != NULL && mcu != NULL);
+  for (idx = 0; scripts[idx].name != NULL; idx++) {
+    if (stricmp(name, scripts[idx].name) == 0
+        && (scripts[idx].mcu_list[0] == '*' || mcu_inlist(mcu, scripts[idx].mcu_list)))
+      return scripts[idx].script;
+  }
+  return NULL;
+}
+
+/** bmscript_parse() decodes the next instruction from a script.
+ *
+ *  \param script   A pointer in the script, as returned by bmscript_find() or
+ *                  by a previous call to bmscript_parse().
  *  \param oper     The operation code, should be '=', '|' or '~'.
  *  \param address  The address of the register or memory location to set.
  *  \param value    The value to set the register or memory location to.
  *  \param size     The size of the register in bytes.
  *
- *  \return 1 of success, 0 on failure. Failure can mean that no script matches,
- *          or that the script contains no more instructions.
+ *  \return A pointer to the next instruction, or NULL if the script contains
+ *          no more instructions (in which case the output parameters are not
+ *          set).
  *
- *  \note The script can be for a specific device or it can be a generic script.
- *        In this last case, the script has a "*" in its device list.
- *
- *        Each line in the script has a register/memory setting (it is assumed
+ *  \note Each line in the script has a register/memory setting (it is assumed
  *        that registers are memory-mapped). The setting consists of an address,
  *        a value, a size, and an operator. The size is typically 4 (32-bit
  *        reisters), but may be 1 or 2 as well. The operator is '=' for a simple
@@ -205,68 +300,21 @@ void bmscript_clearcache(void)
  *        1 bit in value, clears that bit im the register (so it is an AND with
  *        the inverse of "value").
  */
-int bmscript_line(const char *name, const char *mcu, char *oper,
-                  uint32_t *address, uint32_t *value, uint8_t *size)
+const char *bmscript_parse(const char *script, char *oper,
+                           uint32_t *address, uint32_t *value, uint8_t *size)
 {
   const char *head;
   int idx;
 
-  if (name == NULL)
-    name = cache.name;
-  if (mcu == NULL)
-    mcu = cache.mcu;
-  assert(name != NULL && mcu != NULL);
+  assert(script != NULL);
   assert(oper != NULL && address != NULL && value != NULL && size != NULL);
-
-  if (cache.name == NULL || strcmp(name, cache.name) != 0 || cache.mcu == NULL || strcmp(mcu, cache.mcu) != 0) {
-    /* find a script with the given name, where the MCU is in the list */
-    for (idx = 0; scripts[idx].name != NULL; idx++) {
-      if (stricmp(name, scripts[idx].name) == 0) {
-        char *list;
-        /* check whether this is a generic script (valid for all) */
-        if (scripts[idx].mcu_list[0] == '*')
-          break;  /* no need to search for a matching MCU */
-        /* check whether the MCU is in the list of MCUs */
-        list = strdup(scripts[idx].mcu_list);
-        if (list != NULL) {
-          char *tok, *space;
-          for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
-            if (stricmp(mcu, tok) == 0)
-              break;
-            /* also check whether the CPU architecture is added to the name */
-            if ((space = strrchr(tok, ' ')) != NULL && space[1] == 'M' && isdigit(space[2])) {
-              *space = '\0';
-              if (stricmp(mcu, tok) == 0)
-                break;
-              *space = ' '; /* restore string (although probably redundant) */
-            }
-          }
-          free((void*)list);
-          if (tok != NULL)
-            break;  /* script with matching name and mcu is found -> don't look further */
-        }
-      }
-    }
-    if (scripts[idx].name == NULL)
-      return 0;     /* no script with matching name and mcu is found */
-
-    if (cache.name != NULL)
-      free((void*)cache.name);
-    if (cache.mcu != NULL)
-      free((void*)cache.mcu);
-    cache.name = strdup(name);
-    cache.mcu = strdup(mcu);
-    cache.script_ptr = scripts[idx].script;
-  }
-
-  assert(cache.script_ptr != NULL);
-  while (*cache.script_ptr != '\0' && *cache.script_ptr <= ' ')
-    cache.script_ptr += 1;
-  if (*cache.script_ptr == '\0')
-    return 0; /* end of script reached */
+  while (*script != '\0' && *script <= ' ')
+    script += 1;
+  if (*script == '\0')
+    return NULL;  /* end of script reached */
 
   /* parse the line */
-  head = cache.script_ptr;
+  head = script;
   assert(*head > ' ');
   if (isdigit(*head)) {
     *address = strtoul(head, (char**)&head, 0);
@@ -293,7 +341,8 @@ int bmscript_line(const char *name, const char *mcu, char *oper,
     head += 1;
 
   if (*head == '$') {
-    *value = SCRIPT_MAGIC + (head[1] - '0');
+    /* parameters are $0..$9 and $A..$F */
+    *value = SCRIPT_MAGIC + (isdigit(head[1]) ? head[1] - '0' : toupper(head[1]) - 'A' + 10);
     head += 2;
   } else {
     *value = strtoul(head, (char**)&head, 0);
@@ -303,18 +352,85 @@ int bmscript_line(const char *name, const char *mcu, char *oper,
   assert(*head == '\n' || *head == '\0');
   if (*head == '\n')
     head += 1;
-  cache.script_ptr = head;
+
+  return head;
+}
+
+/** bmp_scriptline() returns the next instruction from a script for a specific
+ *  micro-controller. When this function is called with a new script name or a
+ *  new mcu name, the first instruction for the requested script that matches
+ *  the given mcu is returned. For every next call with the same parameters, the
+ *  next instruction is returned, until the script completes.
+ *
+ *  \param name     The name of te script; may be set to NULL to continue on the
+ *                  last active script.
+ *  \param mcu      The name of the MCU; may be set to NULL to use the MCU that
+ *                  was previously set.
+ *  \param oper     The operation code, should be '=', '|' or '~'.
+ *  \param address  The address of the register or memory location to set.
+ *  \param value    The value to set the register or memory location to.
+ *  \param size     The size of the register in bytes.
+ *
+ *  \return 1 of success, 0 on failure. Failure can mean that no script matches,
+ *          or that the script contains no more instructions.
+ *
+ *  \note See bmscript_find() and bmscript_parse() for the script format. This
+ *        function keeps the position in the script in a (global) cache; use
+ *        bmscript_find() and bmscript_parse() in multi-threaded code.
+ */
+int bmscript_line(const char *name, const char *mcu, char *oper,
+                  uint32_t *address, uint32_t *value, uint8_t *size)
+{
+  const char *next;
+
+  if (name == NULL)
+    name = cache.name;
+  if (mcu == NULL)
+    mcu = cache.mcu;
+  assert(name != NULL && mcu != NULL);
+  assert(oper != NULL && address != NULL && value != NULL && size != NULL);
+
+  if (cache.name == NULL || strcmp(name, cache.name) != 0 || cache.mcu == NULL || strcmp(mcu, cache.mcu) != 0) {
+    const char *script = bmscript_find(name, mcu);
+    if (script == NULL)
+      return 0;     /* no script with matching name and mcu is found */
+    if (cache.name != NULL)
+      free((void*)cache.name);
+    if (cache.mcu != NULL)
+      free((void*)cache.mcu);
+    cache.name = strdup(name);
+    cache.mcu = strdup(mcu);
+    cache.script_ptr = script;
+  }
+
+  assert(cache.script_ptr != NULL);
+  next = bmscript_parse(cache.script_ptr, oper, address, value, size);
+  if (next == NULL)
+    return 0; /* end of script reached */
+  cache.script_ptr = next;
 
   return 1;
 }
 
+/** bmscript_line_fmt() returns the next instruction from a script, as a
+ *  GDB command, with the parameters filled in. Lines for which the parameter
+ *  is SCRIPT_SKIP are skipped.
+ *
+ *  \return 1 on success, 0 on failure (see bmscript_line()).
+ */
 int bmscript_line_fmt(const char *name, const char *mcu, char *line, const unsigned long *params)
 {
   char oper;
   uint32_t address, value;
   uint8_t size;
-  if (bmscript_line(name, mcu, &oper, &address, &value, &size)) {
+  while (bmscript_line(name, mcu, &oper, &address, &value, &size)) {
     char operstr[10];
+    if ((value & ~0xf) == SCRIPT_MAGIC) {
+      assert(params != NULL);
+      if (params[value & 0xf] == SCRIPT_SKIP)
+        continue;
+      value = (uint32_t)params[value & 0xf];  /* replace parameters */
+    }
     switch (oper) {
     case '=':
       strcpy(operstr, "=");
@@ -328,10 +444,6 @@ int bmscript_line_fmt(const char *name, const char *mcu, char *line, const unsig
     default:
       assert(0);
     }
-    if ((value & ~0xf) == SCRIPT_MAGIC) {
-      assert(params != NULL);
-      value = (uint32_t)params[value & 0xf];  /* replace parameters */
-    }
     switch (size) {
     case 1:
       sprintf(line, "set {char}0x%x %s 0x%x\n", address, operstr, value & 0xff);
@@ -27,11 +27,16 @@
 #endif
 
 #define SCRIPT_MAGIC  0x6dce7fd0  /**< magic value for parameter replacement */
+#define SCRIPT_SKIP   (~0UL)      /**< parameter value to skip the script line */
 
 int bmscript_line(const char *name, const char *mcu, char *oper,
                   uint32_t *address, uint32_t *value, uint8_t *size);
 int bmscript_line_fmt(const char *name, const char *mcu, char *line, const unsigned long *params);
 
+const char *bmscript_find(const char *name, const char *mcu);
+const char *bmscript_parse(const char *script, char *oper,
+                           uint32_t *address, uint32_t *value, uint8_t *size);
+
 void bmscript_clearcache(void);
 
 #if defined __cplusplus
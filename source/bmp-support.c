@@ -38,7 +38,6 @@
 #include "crc32.h"
 #include "elf-postlink.h"
 #include "gdb-rsp.h"
-#include "rs232.h"
 #include "xmltractor.h"
 
 #if defined __linux__ || defined __FreeBSD__ || defined __APPLE__
@@ -56,97 +55,202 @@ typedef struct tagFLASHRGN {
 } FLASHRGN;
 #define MAX_FLASHRGN  8
 
-static int PacketSize = 0;
-static FLASHRGN FlashRgn[MAX_FLASHRGN];
-static int FlashRgnCount = 0;
+typedef struct tagMEMREQUEST {
+  size_t pos;     /* offset in the block */
+  size_t size;    /* number of bytes requested */
+} MEMREQUEST;
+#define FLASH_PAGE      16 /* granularity for merging segments */
+#define PIPELINE_DEPTH  4 /* max. requests in flight (only in no-ack mode) */
 
-static BMP_STATCALLBACK stat_callback = NULL;
+struct tagBMP_CONNECTION {
+  int seqnr;                  /* sequence number of the probe (for find_bmp()) */
+  GDBRSP *rsp;                /* connection to the gdbserver (NULL if closed) */
+  int packetsize;
+  int binaryupload;           /* probe supports the "x" packet */
+  int noackmode;
+  FLASHRGN flashrgn[MAX_FLASHRGN];
+  int flashrgncount;
+  BMP_STATCALLBACK callback;
+  void *callbackparam;
+};
 
 
-static int notice(int code, const char *fmt, ...)
+static int notice(BMP_CONNECTION *conn, int code, const char *fmt, ...)
 {
-  if (stat_callback != NULL) {
+  if (conn->callback != NULL) {
     char message[200];
     va_list args;
     va_start(args, fmt);
-    vsprintf(message, fmt, args);
+    vsnprintf(message, sizearray(message), fmt, args);
     va_end(args);
-    return stat_callback(code, message);
+    return conn->callback(code, message, conn->callbackparam);
   }
   return 0;
 }
 
+/** bmp_create() creates a context for the connection to a Black Magic Probe.
+ *  The connection is not yet made; see bmp_connect().
+ *
+ *  \param probe    The sequence number of the probe, in case that more than
+ *                  one Black Magic Probe is connected to the workstation; see
+ *                  find_bmp(). Use 0 for the first (or only) probe.
+ *
+ *  \return The connection context, or NULL on a memory allocation failure.
+ *          The context must be released with bmp_destroy().
+ *
+ *  \note All state of the connection is in the context, so that multiple
+ *        probes can be handled simultaneously, each from its own thread.
+ */
+BMP_CONNECTION *bmp_create(int probe)
+{
+  BMP_CONNECTION *conn = malloc(sizeof(BMP_CONNECTION));
+  if (conn != NULL) {
+    memset(conn, 0, sizeof(BMP_CONNECTION));
+    conn->seqnr = probe;
+  }
+  return conn;
+}
+
+/** bmp_destroy() closes the connection (if it is open) and releases the
+ *  context.
+ *
+ *  \param conn     The context returned by bmp_create(); may be NULL.
+ */
+void bmp_destroy(BMP_CONNECTION *conn)
+{
+  if (conn != NULL) {
+    bmp_disconnect(conn);
+    free(conn);
+  }
+}
+
 /** bmp_setcallback() sets the callback function for detailed status
  *  messages. The callback receives status codes as well as a text message.
  *  All error codes are negative.
+ *
+ *  \param conn     The connection context.
+ *  \param func     The callback function; may be NULL.
+ *  \param param    A user value that is passed to the callback unmodified.
  */
-void bmp_setcallback(BMP_STATCALLBACK func)
+void bmp_setcallback(BMP_CONNECTION *conn, BMP_STATCALLBACK func, void *param)
 {
-  stat_callback = func;
+  assert(conn != NULL);
+  conn->callback = func;
+  conn->callbackparam = param;
+}
+
+/** bmp_isopen() returns whether the connection to the Black Magic Probe is
+ *  open.
+ */
+int bmp_isopen(const BMP_CONNECTION *conn)
+{
+  return conn != NULL && gdbrsp_isopen(conn->rsp);
+}
+
+/** bmp_disconnect() closes the connection to the Black Magic Probe (without
+ *  detaching from the target). The context can be connected again.
+ */
+void bmp_disconnect(BMP_CONNECTION *conn)
+{
+  assert(conn != NULL);
+  if (conn->rsp != NULL) {
+    gdbrsp_close(conn->rsp);
+    conn->rsp = NULL;
+  }
+  conn->flashrgncount = 0;
 }
 
 /** bmp_connect() scans for the port of the Black Magic Probe and connects to
  *  it. It retrieves the essential "packet size" parameter, but does not issue
- *  any other command.
+ *  any other command. If the connection is already open, this function does
+ *  nothing.
+ *
+ *  \param conn     The connection context.
  *
  *  \return 1 on success, 0 on failure. Status and error messages are passed via
  *          the callback.
  */
-int bmp_connect(void)
+int bmp_connect(BMP_CONNECTION *conn)
 {
-  if (!rs232_isopen()) {
+  assert(conn != NULL);
+  if (conn->rsp != NULL && !gdbrsp_isopen(conn->rsp))
+    bmp_disconnect(conn); /* connection was lost, clean up the handle */
+  if (conn->rsp == NULL) {
     char devname[128];
-    FlashRgnCount = 0;
-    if (find_bmp(0, BMP_IF_GDB, devname, sizearray(devname))) {
+    conn->flashrgncount = 0;
+    if (find_bmp(conn->seqnr, BMP_IF_GDB, devname, sizearray(devname))) {
       char buffer[256], *ptr;
       size_t size;
-      /* connect to the port */
-      rs232_open(devname,115200,8,1,PAR_NONE);
-      if (!rs232_isopen()) {
-        notice(BMPERR_PORTACCESS, "Failure opening port %s", devname);
+      /* connect to the port (a new connection starts with acknowledgements) */
+      conn->rsp = gdbrsp_open(devname);
+      if (conn->rsp == NULL) {
+        notice(conn, BMPERR_PORTACCESS, "Failure opening port %s", devname);
         return 0;
       }
-      rs232_rts(1);
-      rs232_dtr(1); /* required by GDB RSP */
-      /* check for reception of the handshake */
-      size = gdbrsp_recv(buffer, sizearray(buffer), 500);
-      if (size == 0) {
-        /* toggle DTR, to be sure */
-        rs232_rts(0);
-        rs232_dtr(0);
-        #if defined _WIN32
-          Sleep(200);
-        #else
-          usleep(200 * 1000);
-        #endif
-        rs232_rts(1);
-        rs232_dtr(1);
-        size = gdbrsp_recv(buffer, sizearray(buffer), 500);
+      conn->noackmode = 0;
+      if (gdbrsp_transport(conn->rsp) == GDBRSP_SERIAL) {
+        gdbrsp_dtr(conn->rsp, 1); /* required by GDB RSP */
+        /* check for reception of the handshake */
+        size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 500);
+        if (size == 0) {
+          /* toggle DTR, to be sure */
+          gdbrsp_dtr(conn->rsp, 0);
+          #if defined _WIN32
+            Sleep(200);
+          #else
+            usleep(200 * 1000);
+          #endif
+          gdbrsp_dtr(conn->rsp, 1);
+          size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 500);
+        }
+        if (size != 2 || memcmp(buffer, "OK", size)!= 0) {
+          notice(conn, BMPERR_NORESPONSE, "No response on %s", devname);
+          bmp_disconnect(conn);
+          return 0;
+        }
+      } else {
+        /* a gdbserver on a socket may send the handshake on accepting the
+           connection, but it is not required (there is no DTR signal to
+           trigger it); the qSupported request below verifies the link */
+        size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 100);
       }
-      if (size != 2 || memcmp(buffer, "OK", size)!= 0) {
-        notice(BMPERR_NORESPONSE, "No response on %s", devname);
-        rs232_close();
+      /* query parameters */
+      gdbrsp_xmit(conn->rsp, "qSupported:multiprocess+", -1);
+      size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
+      if (size == 0) {
+        notice(conn, BMPERR_NORESPONSE, "No response on %s", devname);
+        bmp_disconnect(conn);
         return 0;
       }
-      /* query parameters */
-      gdbrsp_xmit("qSupported:multiprocess+", -1);
-      size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+      if (size >= sizearray(buffer))
+        size = sizearray(buffer) - 1;
       buffer[size] = '\0';
       if ((ptr = strstr(buffer, "PacketSize=")) != NULL)
-        PacketSize = (int)strtol(ptr + 11, NULL, 16);
-      gdbrsp_packetsize(PacketSize+16); /* allow for some margin */
+        conn->packetsize = (int)strtol(ptr + 11, NULL, 16);
+      gdbrsp_packetsize(conn->rsp, conn->packetsize+16); /* allow for some margin */
+      conn->binaryupload = (strstr(buffer, "binary-upload+") != NULL);
+      if (strstr(buffer, "QStartNoAckMode+") != NULL) {
+        /* the connection over USB is reliable, so the acknowledgements only
+           add round trips; the reply to this request is still acknowledged */
+        gdbrsp_xmit(conn->rsp, "QStartNoAckMode", -1);
+        size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
+        if (size == 2 && memcmp(buffer, "OK", size) == 0) {
+          gdbrsp_noack(conn->rsp, 1);
+          conn->noackmode = 1;
+        }
+      }
       //??? check for "qXfer:memory-map:read+" as well
       /* connect to gdbserver */
-      gdbrsp_xmit("!", -1);
-      size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+      gdbrsp_xmit(conn->rsp, "!", -1);
+      size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
       if (size != 2 || memcmp(buffer, "OK", size) != 0) {
-        notice(BMPERR_NOCONNECT, "Connect failed on %s", devname);
-        rs232_close();
+        notice(conn, BMPERR_NOCONNECT, "Connect failed on %s", devname);
+        bmp_disconnect(conn);
         return 0;
       }
-      notice(BMPSTAT_SUCCESS, "Connected to Black Magic Probe (%s)", devname);
+      notice(conn, BMPSTAT_SUCCESS, "Connected to Black Magic Probe (%s)", devname);
     } else {
-      notice(BMPERR_NODETECT, "Black Magic Probe not detected");
+      notice(conn, BMPERR_NODETECT, "Black Magic Probe not detected");
       return 0;
     }
   }
@@ -155,9 +259,9 @@ int bmp_connect(void)
 }
 
 /** bmp_break() interrupts a running target by sending a Ctrl-C byte. */
-int bmp_break(void)
+int bmp_break(BMP_CONNECTION *conn)
 {
-  gdbrsp_xmit("\3", 1);
+  gdbrsp_xmit(conn->rsp, "\3", 1);
   return 1; /* there is no reply on Ctrl-C */
 }
 
@@ -167,6 +271,7 @@ int bmp_break(void)
  *  The name of the driver for the MCU (that the Black Magic Probe uses) is
  *  returned.
  *
+ *  \param conn       The connection context.
  *  \param tpwr       Set to 1 to power up the voltage-sense pin, 0 to power-down,
  *                    or 2 to optionally power this pin if the initial scan returns
  *                    a power of 0.0V.
@@ -183,7 +288,7 @@ int bmp_break(void)
  *  \return 1 on success, 0 on failure. Status and error messages are passed via
  *          the callback.
  */
-int bmp_attach(int tpwr, char *name, size_t namelength, char *arch, size_t archlength)
+int bmp_attach(BMP_CONNECTION *conn, int tpwr, char *name, size_t namelength, char *arch, size_t archlength)
 {
   if (name != NULL && namelength > 0)
     *name = '\0';
@@ -191,17 +296,17 @@ int bmp_attach(int tpwr, char *name, size_t namelength, char *arch, size_t archl
     *arch = '\0';
 
 restart:
-  if (rs232_isopen()) {
+  if (gdbrsp_isopen(conn->rsp)) {
     char buffer[512];
     size_t size;
     int ok;
     if (tpwr == 1) {
-      gdbrsp_xmit("qRcmd,tpwr enable", -1);
+      gdbrsp_xmit(conn->rsp, "qRcmd,tpwr enable", -1);
       do {
-        size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+        size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
       } while (size > 0 && buffer[0] == 'o'); /* ignore console output */
       if (size != 2 || memcmp(buffer, "OK", size) != 0) {
-        notice(BMPERR_MONITORCMD, "Power to target failed");
+        notice(conn, BMPERR_MONITORCMD, "Power to target failed");
       } else {
         /* give the micro-controller a bit of time to start up, before issuing
            the swdp_scan command */
@@ -212,9 +317,9 @@ restart:
         #endif
       }
     }
-    gdbrsp_xmit("qRcmd,swdp_scan", -1);
+    gdbrsp_xmit(conn->rsp, "qRcmd,swdp_scan", -1);
     for ( ;; ) {
-      size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+      size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
       if (size > 2 && buffer[0] == 'o') {
         const char *ptr;
         buffer[size] = '\0';
@@ -222,7 +327,7 @@ restart:
         if (tpwr == 2 && strchr(buffer, '\n') != NULL && (ptr = strstr(buffer + 1, "voltage:")) != NULL) {
           double voltage = strtod(ptr + 8, (char**)&ptr);
           if (*ptr == 'V' && voltage < 0.1) {
-            notice(BMPSTAT_NOTICE, "Note: powering target");
+            notice(conn, BMPSTAT_NOTICE, "Note: powering target");
             tpwr = 1;
             goto restart;
           }
@@ -241,7 +346,7 @@ restart:
           }
           strlcpy(name, namebuffer, namelength);
         }
-        notice(BMPSTAT_NOTICE, buffer + 1);  /* skip the 'o' at the start */
+        notice(conn, BMPSTAT_NOTICE, buffer + 1);  /* skip the 'o' at the start */
       } else if (size != 2 || memcmp(buffer, "OK", size) != 0) {
         /* error message was already given by an "output"-response */
         return 0;
@@ -249,72 +354,72 @@ restart:
         break;  /* OK was received */
       }
     }
-    gdbrsp_xmit("vAttach;1", -1);
-    size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+    gdbrsp_xmit(conn->rsp, "vAttach;1", -1);
+    size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
     /* accept OK, S##, T## (but in fact, Black Magic Probe always sends T05) */
     ok = (size == 2 && memcmp(buffer, "OK", size) == 0)
          || (size == 3 && buffer[0] == 'S' && isxdigit(buffer[1]) && isxdigit(buffer[2]))
          || (size >= 3 && buffer[0] == 'T' && isxdigit(buffer[1]) && isxdigit(buffer[2]));
     if (!ok) {
-      notice(BMPERR_ATTACHFAIL, "Attach failed");
+      notice(conn, BMPERR_ATTACHFAIL, "Attach failed");
       return 0;
     }
-    notice(BMPSTAT_NOTICE, "Attached to target 1");
+    notice(conn, BMPSTAT_NOTICE, "Attached to target 1");
     /* check memory map and features of the target */
-    FlashRgnCount = 0;
-    sprintf(buffer, "qXfer:memory-map:read::0,%x", PacketSize - 4);
-    gdbrsp_xmit(buffer, -1);
-    size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+    conn->flashrgncount = 0;
+    sprintf(buffer, "qXfer:memory-map:read::0,%x", conn->packetsize - 4);
+    gdbrsp_xmit(conn->rsp, buffer, -1);
+    size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
     if (size > 10 && buffer[0] == 'm') {
       xt_Node* root = xt_parse(buffer + 1);
-      if (root != NULL && FlashRgnCount < MAX_FLASHRGN) {
+      if (root != NULL && conn->flashrgncount < MAX_FLASHRGN) {
         xt_Node* node = xt_find_child(root, "memory");
         while (node != NULL) {
           xt_Attrib* attrib = xt_find_attrib(node, "type");
           if (attrib != NULL && attrib->szvalue == 5 && strncmp(attrib->value, "flash", attrib->szvalue) == 0) {
             xt_Node* prop;
-            memset(&FlashRgn[FlashRgnCount], 0, sizeof(FLASHRGN));
+            memset(&conn->flashrgn[conn->flashrgncount], 0, sizeof(FLASHRGN));
             if ((attrib = xt_find_attrib(node, "start")) != NULL)
-              FlashRgn[FlashRgnCount].address = strtoul(attrib->value, NULL, 0);
+              conn->flashrgn[conn->flashrgncount].address = strtoul(attrib->value, NULL, 0);
             if ((attrib = xt_find_attrib(node, "length")) != NULL)
-              FlashRgn[FlashRgnCount].size = strtoul(attrib->value, NULL, 0);
+              conn->flashrgn[conn->flashrgncount].size = strtoul(attrib->value, NULL, 0);
             if ((prop = xt_find_child(node, "property")) != NULL
                 && (attrib = xt_find_attrib(prop, "name")) != NULL
                 && attrib->szvalue == 9 && strncmp(attrib->value, "blocksize", attrib->szvalue) == 0)
-              FlashRgn[FlashRgnCount].blocksize = strtoul(prop->content, NULL, 0);
-            FlashRgnCount += 1;
+              conn->flashrgn[conn->flashrgncount].blocksize = strtoul(prop->content, NULL, 0);
+            conn->flashrgncount += 1;
           }
           node = xt_find_sibling(node, "memory");
         }
         xt_destroy_node(root);
       }
     }
-    if (FlashRgnCount == 0)
-      notice(BMPERR_NOFLASH, "No Flash memory record");
+    if (conn->flashrgncount == 0)
+      notice(conn, BMPERR_NOFLASH, "No Flash memory record");
   }
 
   return 1;
 }
 
-int bmp_detach(int powerdown)
+int bmp_detach(BMP_CONNECTION *conn, int powerdown)
 {
   int result = 1;
 
-  if (rs232_isopen()) {
+  if (gdbrsp_isopen(conn->rsp)) {
     char buffer[100];
     size_t size;
     /* optionally disable power */
     if (powerdown) {
-      gdbrsp_xmit("qRcmd,tpwr disable", -1);
+      gdbrsp_xmit(conn->rsp, "qRcmd,tpwr disable", -1);
       do {
-        size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+        size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
       } while (size > 0 && buffer[0] == 'o'); /* ignore console output */
       if (size != 2 || memcmp(buffer, "OK", size) != 0)
         result = 0;
     }
     /* detach */
-    gdbrsp_xmit("D", -1);
-    size = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+    gdbrsp_xmit(conn->rsp, "D", -1);
+    size = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
     if (size != 2 || memcmp(buffer, "OK", size) != 0)
       result = 0;
   }
@@ -323,52 +428,52 @@ int bmp_detach(int powerdown)
 }
 
 
-int bmp_fullerase(void)
+int bmp_fullerase(BMP_CONNECTION *conn)
 {
   char *cmd;
   int rgn, rcvd, pktsize;
 
-  if (!rs232_isopen()) {
-    notice(BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
     return 0;
   }
-  if (FlashRgnCount == 0) {
-    notice(BMPERR_NOFLASH, "No Flash memory record");
+  if (conn->flashrgncount == 0) {
+    notice(conn, BMPERR_NOFLASH, "No Flash memory record");
     return 0;
   }
-  pktsize = (PacketSize > 0) ? PacketSize : 64;
+  pktsize = (conn->packetsize > 0) ? conn->packetsize : 64;
   cmd = malloc((pktsize + 16) * sizeof(char));
   if (cmd == NULL) {
-    notice(BMPERR_MEMALLOC, "Memory allocation error");
+    notice(conn, BMPERR_MEMALLOC, "Memory allocation error");
     return 0;
   }
 
-  for (rgn = 0; rgn < FlashRgnCount; rgn++) {
-    unsigned long size = FlashRgn[rgn].size;
+  for (rgn = 0; rgn < conn->flashrgncount; rgn++) {
+    unsigned long size = conn->flashrgn[rgn].size;
     int failed;
     do {
-      sprintf(cmd, "vFlashErase:%x,%x", (unsigned)FlashRgn[rgn].address, (unsigned)size);
-      gdbrsp_xmit(cmd, -1);
-      rcvd = gdbrsp_recv(cmd, pktsize, 500);
+      sprintf(cmd, "vFlashErase:%x,%x", (unsigned)conn->flashrgn[rgn].address, (unsigned)size);
+      gdbrsp_xmit(conn->rsp, cmd, -1);
+      rcvd = gdbrsp_recv(conn->rsp, cmd, pktsize, 500);
       failed = (rcvd != 2 || memcmp(cmd, "OK", rcvd) != 0);
       if (failed)
         size /= 2;
     } while (failed && size >= 1024);
     if (failed) {
-      notice(BMPERR_FLASHERASE, "Flash erase failed");
+      notice(conn, BMPERR_FLASHERASE, "Flash erase failed");
       free(cmd);
       return 0;
     } else {
       sprintf(cmd, "Erased Flash at 0x%08x, size %d KiB",
-              (unsigned)FlashRgn[rgn].address, (unsigned)size / 1024);
-      notice(BMPSTAT_SUCCESS, cmd);
+              (unsigned)conn->flashrgn[rgn].address, (unsigned)size / 1024);
+      notice(conn, BMPSTAT_SUCCESS, cmd);
     }
   }
 
-  gdbrsp_xmit("vFlashDone", -1);
-  rcvd = gdbrsp_recv(cmd, pktsize, 500);
+  gdbrsp_xmit(conn->rsp, "vFlashDone", -1);
+  rcvd = gdbrsp_recv(conn->rsp, cmd, pktsize, 500);
   if (rcvd != 2 || memcmp(cmd, "OK", rcvd)!= 0) {
-    notice(BMPERR_FLASHDONE, "Flash completion failed");
+    notice(conn, BMPERR_FLASHDONE, "Flash completion failed");
     free(cmd);
     return 0;
   }
@@ -377,119 +482,395 @@ int bmp_fullerase(void)
   return 1;
 }
 
-int bmp_download(FILE *fp)
+typedef struct tagIMAGERUN {
+  unsigned long address;
+  unsigned long size;
+  unsigned char *data;
+} IMAGERUN;
+
+static int imagerun_compare(const void *a, const void *b)
 {
-  char *cmd;
-  int rgn, rcvd, pktsize;
+  unsigned long addr1 = ((const IMAGERUN*)a)->address;
+  unsigned long addr2 = ((const IMAGERUN*)b)->address;
+  return (addr1 < addr2) ? -1 : (addr1 > addr2) ? 1 : 0;
+}
+
+static void image_free(IMAGERUN *runs, int count)
+{
+  int idx;
+  for (idx = 0; idx < count; idx++)
+    if (runs[idx].data != NULL)
+      free(runs[idx].data);
+  if (runs != NULL)
+    free(runs);
+}
+
+/* image_build() collects all loadable segments of the ELF file in a list of
+   runs, sorted on address. Segments that overlap or that are separated by a
+   gap that does not reach the next Flash page are merged into a single run;
+   the gap is filled with 0xff (the value of erased memory). Larger gaps are
+   kept, so that they are neither erased nor written. */
+static int image_build(FILE *fp, IMAGERUN **runs, int *count)
+{
+  IMAGERUN *list;
+  unsigned long paddr, fileoffs, filesize;
+  int segment, type, num, idx, cur;
 
-  if (!rs232_isopen()) {
-    notice(BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+  assert(runs != NULL && count != NULL);
+  *runs = NULL;
+  *count = 0;
+  num = 0;
+  for (segment = 0; elf_segment_by_index(fp, segment, &type, &fileoffs, &filesize, NULL, &paddr, NULL) == ELFERR_NONE; segment++)
+    if (type == 1 && filesize > 0)
+      num++;
+  if (num == 0)
+    return 1;
+  list = calloc(num, sizeof(IMAGERUN));
+  if (list == NULL)
     return 0;
+  idx = 0;
+  for (segment = 0; idx < num && elf_segment_by_index(fp, segment, &type, &fileoffs, &filesize, NULL, &paddr, NULL) == ELFERR_NONE; segment++) {
+    if (type != 1 || filesize == 0)
+      continue;
+    list[idx].address = paddr;
+    list[idx].size = filesize;
+    list[idx].data = malloc(filesize);
+    if (list[idx].data == NULL) {
+      image_free(list, idx);
+      return 0;
+    }
+    fseek(fp, fileoffs, SEEK_SET);
+    fread(list[idx].data, 1, filesize, fp);
+    idx++;
   }
-  if (FlashRgnCount == 0) {
-    notice(BMPERR_NOFLASH, "No Flash memory record");
-    return 0;
+  num = idx;
+  qsort(list, num, sizeof(IMAGERUN), imagerun_compare);
+
+  for (cur = 0, idx = 1; idx < num; idx++) {
+    IMAGERUN *run = &list[cur];
+    IMAGERUN *next = &list[idx];
+    unsigned long top = run->address + run->size;
+    if (next->address <= ((top + FLASH_PAGE - 1) & ~(unsigned long)(FLASH_PAGE - 1))) {
+      unsigned long newtop = (next->address + next->size > top) ? next->address + next->size : top;
+      unsigned char *data = realloc(run->data, newtop - run->address);
+      if (data == NULL) {
+        while (idx < num)
+          free(list[idx++].data);
+        image_free(list, cur + 1);
+        return 0;
+      }
+      if (next->address > top)
+        memset(data + run->size, 0xff, next->address - top);
+      memcpy(data + (next->address - run->address), next->data, next->size);
+      free(next->data);
+      run->data = data;
+      run->size = newtop - run->address;
+    } else if (++cur != idx) {
+      list[cur] = *next;
+    } else {
+      continue;
+    }
+    next->data = NULL;
   }
-  pktsize = (PacketSize > 0) ? PacketSize : 64;
-  cmd = malloc((pktsize + 16) * sizeof(char));
-  if (cmd == NULL) {
-    notice(BMPERR_MEMALLOC, "Memory allocation error");
-    return 0;
+
+  *runs = list;
+  *count = cur + 1;
+  return 1;
+}
+
+/* image_fill() copies the part of the image that overlaps the memory range
+   into the buffer; bytes that are not in the image are set to 0xff */
+static void image_fill(const IMAGERUN *runs, int count, unsigned long address,
+                       unsigned long size, unsigned char *buffer)
+{
+  int idx;
+
+  memset(buffer, 0xff, size);
+  for (idx = 0; idx < count && runs[idx].address < address + size; idx++) {
+    unsigned long low = (runs[idx].address > address) ? runs[idx].address : address;
+    unsigned long high = (runs[idx].address + runs[idx].size < address + size) ? runs[idx].address + runs[idx].size : address + size;
+    if (low < high)
+      memcpy(buffer + (low - address), runs[idx].data + (low - runs[idx].address), high - low);
   }
+}
 
-  assert(fp != NULL);
-  for (rgn = 0; rgn < FlashRgnCount; rgn++) {
-    int segment, type;
-    unsigned long topaddr, flashsectors, paddr, vaddr, fileoffs, filesize;
-    /* walk through all segments in the ELF file that fall into this region */
-    topaddr = 0;
-    for (segment = 0; elf_segment_by_index(fp, segment, &type, &fileoffs, &filesize, NULL, &paddr, NULL) == ELFERR_NONE; segment++)
-      if (type == 1 && paddr >= FlashRgn[rgn].address && paddr < FlashRgn[rgn].address + FlashRgn[rgn].size)
-        topaddr = paddr + filesize;
-    if (topaddr == 0)
-      continue; /* no segment fitting in this Flash sector */
-    /* erase the Flash memory */
-    assert(topaddr <= FlashRgn[rgn].address + FlashRgn[rgn].size);
-    flashsectors = ((topaddr - FlashRgn[rgn].address + (FlashRgn[rgn].blocksize - 1)) / FlashRgn[rgn].blocksize);
-    assert(flashsectors * FlashRgn[rgn].blocksize <= FlashRgn[rgn].address + FlashRgn[rgn].size);
-    sprintf(cmd, "vFlashErase:%x,%x", (unsigned)FlashRgn[rgn].address, (unsigned)(flashsectors * FlashRgn[rgn].blocksize));
-    gdbrsp_xmit(cmd, -1);
-    rcvd = gdbrsp_recv(cmd, pktsize, 500);
-    if (rcvd != 2 || memcmp(cmd, "OK", rcvd)!= 0) {
-      notice(BMPERR_FLASHERASE, "Flash erase failed");
-      free(cmd);
+/* fitpayload() returns how many bytes of "data" fit in "room" bytes of a
+   packet, taking the escaped characters of the binary encoding into account */
+static size_t fitpayload(const unsigned char *data, size_t size, size_t room)
+{
+  size_t count, used;
+
+  for (count = used = 0; count < size; count++) {
+    unsigned char c = data[count];
+    size_t len = (c == '$' || c == '#' || c == '}' || c == '*') ? 2 : 1;
+    if (used + len > room)
+      break;
+    used += len;
+  }
+  return count;
+}
+
+/* flash_write() writes a block of data to Flash memory, which must have been
+   erased. Each packet is filled up to PacketSize (taking escaped characters
+   into account); when the probe supports it, multiple packets are kept in
+   flight */
+static int flash_write(BMP_CONNECTION *conn, int pktsize, unsigned long address,
+                       const unsigned char *data, unsigned long size)
+{
+  unsigned long queue[PIPELINE_DEPTH];
+  unsigned long pos;
+  char reply[32];
+  int depth, head, count, result;
+
+  depth = conn->noackmode ? PIPELINE_DEPTH : 1;
+  result = 1;
+  head = count = 0;
+  pos = 0;
+  while (count > 0 || (result && pos < size)) {
+    size_t rcvd;
+    unsigned long req;
+    /* keep the pipeline filled */
+    while (result && count < depth && pos < size) {
+      GDBRSP_SEGMENT pkt[2];
+      char header[32];
+      size_t prefixlen, numbytes;
+      sprintf(header, "vFlashWrite:%lx:", address + pos);
+      prefixlen = strlen(header) + 4;  /* +1 for '$', +3 for '#nn' checksum */
+      numbytes = fitpayload(data + pos, size - pos, pktsize - prefixlen);
+      if (numbytes == 0)
+        numbytes = 1; /* avoid a stall on a tiny PacketSize */
+      pkt[0].data = header;
+      pkt[0].size = strlen(header);
+      pkt[1].data = data + pos;
+      pkt[1].size = numbytes;
+      gdbrsp_xmitv(conn->rsp, pkt, 2);
+      queue[(head + count) % PIPELINE_DEPTH] = pos;
+      pos += numbytes;
+      count++;
+    }
+    /* check the reply to the oldest packet */
+    req = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    rcvd = gdbrsp_recv(conn->rsp, reply, sizearray(reply), 500);
+    if (result && (rcvd != 2 || memcmp(reply, "OK", rcvd) != 0)) {
+      notice(conn, BMPERR_FLASHWRITE, "Flash write failed at 0x%lx", address + req);
+      result = 0; /* pending replies are still drained */
+    }
+  }
+
+  return result;
+}
+
+/* flash_crcs() retrieves the CRC of the blocks of Flash memory that are
+   flagged in "mask"; when the probe supports it, multiple requests are kept
+   in flight */
+static int flash_crcs(BMP_CONNECTION *conn, unsigned long address, unsigned long blocksize,
+                      const unsigned char *mask, unsigned long numblocks, uint32_t *crcs)
+{
+  unsigned long queue[PIPELINE_DEPTH];
+  unsigned long blk;
+  char buffer[40];
+  int depth, head, count, result;
+
+  depth = conn->noackmode ? PIPELINE_DEPTH : 1;
+  result = 1;
+  head = count = 0;
+  blk = 0;
+  for ( ;; ) {
+    size_t rcvd;
+    unsigned long req;
+    /* keep the pipeline filled */
+    while (result && count < depth) {
+      while (blk < numblocks && !mask[blk])
+        blk++;
+      if (blk >= numblocks)
+        break;
+      sprintf(buffer, "qCRC:%lx,%lx", address + blk * blocksize, blocksize);
+      gdbrsp_xmit(conn->rsp, buffer, -1);
+      queue[(head + count) % PIPELINE_DEPTH] = blk++;
+      count++;
+    }
+    if (count == 0)
+      break;
+    /* check the reply to the oldest request */
+    req = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    rcvd = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer) - 1, 3000);
+    if (rcvd == 0) {
+      /* no reply in time: the replies to the pending requests (and a late
+         reply to this one) would be taken for the replies to the commands
+         that follow, so these are discarded until the probe is silent */
+      while (gdbrsp_recv(conn->rsp, buffer, sizearray(buffer) - 1, 3000) > 0)
+        /* nothing */;
       return 0;
     }
-    /* walk through all segments again, to download the payload */
-    for (segment = 0; elf_segment_by_index(fp, segment, &type, &fileoffs, &filesize, &vaddr, &paddr, NULL) == ELFERR_NONE; segment++) {
-      unsigned char *data;
-      unsigned pos, numbytes, esccount, idx;
-      if (type != 1 || filesize == 0 || paddr < FlashRgn[rgn].address || paddr >= FlashRgn[rgn].address + FlashRgn[rgn].size)
-        continue;
-      notice(BMPSTAT_NOTICE, "%d: %s segment at 0x%x length 0x%x", segment, (vaddr == paddr) ? "Code" : "Data", (unsigned)paddr, (unsigned)filesize);
-      data = malloc(filesize);
-      if (data == NULL) {
-        notice(BMPERR_MEMALLOC, "Memory allocation failure");
-        free(cmd);
-        return 0;
-      }
-      fseek(fp, fileoffs, SEEK_SET);
-      fread(data, 1, filesize, fp);
-      for (pos = 0; pos < filesize; pos += numbytes) {
-        unsigned prefixlen;
-        sprintf(cmd, "vFlashWrite:%x:", (unsigned)(paddr + pos));
-        prefixlen = strlen(cmd) + 4;  /* +1 for '$', +3 for '#nn' checksum */
-        /* make blocks that are a multiple of 16 bytes (for guaranteed alignment)
-           that are less than (or equal to) PacketSize; start by subtracting the
-           prefix length */
-        numbytes = (pktsize - prefixlen) & ~0x0f;
-        if (pos + numbytes > filesize)
-          numbytes = filesize - pos;
-        /* check how many bytes in the packet must be escaped, then check
-           whether the packet would still fit (decrement the block length
-           otherwise) */
-        for ( ;; ) {
-          esccount = 0;
-          for (idx = 0; idx < numbytes; idx++)
-            if (data[pos + idx] == '$' || data[pos + idx] == '#' || data[pos + idx] == '}')
-              esccount += 1;
-          if (numbytes + esccount + prefixlen <= (unsigned)pktsize)
-            break;
-          numbytes -= 16;
-        }
-        memmove(cmd + (prefixlen - 4), data + pos, numbytes);
-        gdbrsp_xmit(cmd, (prefixlen - 4) + numbytes);
-        rcvd = gdbrsp_recv(cmd, pktsize, 500);
-        if (rcvd != 2 || memcmp(cmd, "OK", rcvd)!= 0) {
-          notice(BMPERR_FLASHWRITE, "Flash write failed");
-          free(data);
-          free(cmd);
-          return 0;
+    if (rcvd >= sizearray(buffer))
+      rcvd = sizearray(buffer) - 1;
+    buffer[rcvd] = '\0';
+    if (rcvd >= 2 && buffer[0] == 'C')
+      crcs[req] = (uint32_t)strtoul(buffer + 1, NULL, 16);
+    else
+      result = 0; /* pending replies are still drained */
+  }
+  return result;
+}
+
+/* download_region() erases and programs the blocks of a Flash region that
+   hold data from the image. In delta mode, the blocks whose CRCs match the
+   image are skipped. Runs of consecutive blocks are erased with a single
+   request. */
+static int download_region(BMP_CONNECTION *conn, int rgn, const IMAGERUN *runs, int count,
+                           int delta, int pktsize)
+{
+  const FLASHRGN *region = &conn->flashrgn[rgn];
+  unsigned long blocksize, numblocks, blk, total, changed, top;
+  unsigned char *dirty;
+  char cmd[64];
+  int idx, rcvd, result;
+
+  /* find the blocks that hold data */
+  blocksize = (region->blocksize > 0) ? region->blocksize : region->size;
+  top = region->address;
+  for (idx = 0; idx < count; idx++)
+    if (runs[idx].address < region->address + region->size && runs[idx].address + runs[idx].size > region->address)
+      top = runs[idx].address + runs[idx].size;
+  if (top == region->address)
+    return 1;   /* no data for this region */
+  if (top > region->address + region->size)
+    top = region->address + region->size;
+  numblocks = (top - region->address + blocksize - 1) / blocksize;
+  dirty = calloc(numblocks, sizeof(unsigned char));
+  if (dirty == NULL) {
+    notice(conn, BMPERR_MEMALLOC, "Memory allocation failure");
+    return 0;
+  }
+  for (idx = 0; idx < count; idx++) {
+    unsigned long low = (runs[idx].address > region->address) ? runs[idx].address : region->address;
+    unsigned long high = (runs[idx].address + runs[idx].size < top) ? runs[idx].address + runs[idx].size : top;
+    for (blk = (low - region->address) / blocksize; low < high && blk <= (high - 1 - region->address) / blocksize; blk++)
+      dirty[blk] = 1;
+  }
+  for (total = blk = 0; blk < numblocks; blk++)
+    total += dirty[blk];
+  changed = total;
+
+  /* in delta mode, compare the blocks (if the CRCs cannot be read, all
+     blocks with data are written) */
+  if (delta) {
+    uint32_t *crcs = malloc(numblocks * sizeof(uint32_t));
+    unsigned char *image = malloc(blocksize);
+    if (crcs != NULL && image != NULL && flash_crcs(conn, region->address, blocksize, dirty, numblocks, crcs)) {
+      for (blk = 0; blk < numblocks; blk++) {
+        if (!dirty[blk])
+          continue;
+        image_fill(runs, count, region->address + blk * blocksize, blocksize, image);
+        if (crcs[blk] == crc32(CRC32_INIT, image, blocksize)) {
+          dirty[blk] = 0;
+          changed--;
         }
       }
-      free(data);
     }
-    gdbrsp_xmit("vFlashDone", -1);
-    rcvd = gdbrsp_recv(cmd, pktsize, 500);
+    if (crcs != NULL)
+      free(crcs);
+    if (image != NULL)
+      free(image);
+    notice(conn, BMPSTAT_NOTICE, "Flash region 0x%lx: %lu of %lu sectors changed, %lu skipped",
+           region->address, changed, total, total - changed);
+  }
+
+  /* erase and write each run of blocks */
+  result = 1;
+  for (blk = 0; result && blk < numblocks; ) {
+    unsigned long first, address, size;
+    if (!dirty[blk]) {
+      blk++;
+      continue;
+    }
+    for (first = blk; blk < numblocks && dirty[blk]; blk++)
+      /* nothing */;
+    address = region->address + first * blocksize;
+    size = (blk - first) * blocksize;
+    sprintf(cmd, "vFlashErase:%lx,%lx", address, size);
+    gdbrsp_xmit(conn->rsp, cmd, -1);
+    rcvd = gdbrsp_recv(conn->rsp, cmd, sizearray(cmd), 500);
     if (rcvd != 2 || memcmp(cmd, "OK", rcvd)!= 0) {
-      notice(BMPERR_FLASHDONE, "Flash completion failed");
-      free(cmd);
-      return 0;
+      notice(conn, BMPERR_FLASHERASE, "Flash erase failed");
+      result = 0;
+      break;
+    }
+    for (idx = 0; result && idx < count; idx++) {
+      unsigned long low = (runs[idx].address > address) ? runs[idx].address : address;
+      unsigned long high = (runs[idx].address + runs[idx].size < address + size) ? runs[idx].address + runs[idx].size : address + size;
+      if (low >= high)
+        continue;
+      if (!delta)
+        notice(conn, BMPSTAT_NOTICE, "Writing 0x%lx bytes at 0x%lx", high - low, low);
+      result = flash_write(conn, pktsize, low, runs[idx].data + (low - runs[idx].address), high - low);
+    }
+  }
+  if (result && changed > 0) {
+    gdbrsp_xmit(conn->rsp, "vFlashDone", -1);
+    rcvd = gdbrsp_recv(conn->rsp, cmd, sizearray(cmd), 500);
+    if (rcvd != 2 || memcmp(cmd, "OK", rcvd)!= 0) {
+      notice(conn, BMPERR_FLASHDONE, "Flash completion failed");
+      result = 0;
     }
   }
 
-  free(cmd);
-  return 1;
+  free(dirty);
+  return result;
 }
 
-int bmp_verify(FILE *fp)
+/** bmp_download() downloads the loadable segments of an ELF file into Flash
+ *  memory. The segments are merged into an image, and only the Flash sectors
+ *  that hold data from the image are erased and written.
+ *
+ *  \param conn     The connection context.
+ *  \param fp       The ELF file.
+ *  \param delta    If non-zero, only the Flash sectors whose contents differ
+ *                  from the ELF file are erased and written (the others are
+ *                  skipped).
+ *
+ *  \return 1 on success, 0 on failure. Status and error messages are passed
+ *          via the callback.
+ */
+int bmp_download(BMP_CONNECTION *conn, FILE *fp, int delta)
+{
+  IMAGERUN *runs;
+  int rgn, count, pktsize, result;
+
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+    return 0;
+  }
+  if (conn->flashrgncount == 0) {
+    notice(conn, BMPERR_NOFLASH, "No Flash memory record");
+    return 0;
+  }
+  pktsize = (conn->packetsize > 0) ? conn->packetsize : 64;
+
+  assert(fp != NULL);
+  if (!image_build(fp, &runs, &count)) {
+    notice(conn, BMPERR_MEMALLOC, "Memory allocation failure");
+    return 0;
+  }
+  result = 1;
+  for (rgn = 0; result && rgn < conn->flashrgncount; rgn++)
+    result = download_region(conn, rgn, runs, count, delta, pktsize);
+  image_free(runs, count);
+  return result;
+}
+
+int bmp_verify(BMP_CONNECTION *conn, FILE *fp)
 {
   char cmd[100];
   int segment, sector, type, allmatch;
   unsigned long offset, filesize, paddr;
 
-  if (!rs232_isopen()) {
-    notice(BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
     return 0;
   }
 
@@ -507,34 +888,34 @@ int bmp_verify(FILE *fp)
     if (type != 1 || filesize == 0)
       continue;   /* no loadable data */
     /* also check that paddr falls within a Flash memory sector */
-    for (sector = 0; sector < FlashRgnCount; sector++)
-      if (paddr >= FlashRgn[sector].address && paddr < FlashRgn[sector].address + FlashRgn[sector].size)
+    for (sector = 0; sector < conn->flashrgncount; sector++)
+      if (paddr >= conn->flashrgn[sector].address && paddr < conn->flashrgn[sector].address + conn->flashrgn[sector].size)
         break;
-    if (sector >= FlashRgnCount)
+    if (sector >= conn->flashrgncount)
       continue; /* segment is outside of any Flash sector */
     /* read entire segment, calc CRC */
     data = malloc((size_t)filesize * sizeof (unsigned char));
     if (data == NULL) {
-      notice(BMPERR_MEMALLOC, "Memory allocation failure");
+      notice(conn, BMPERR_MEMALLOC, "Memory allocation failure");
       return 0;
     }
     fseek(fp, offset, SEEK_SET);
     fread(data, 1, filesize, fp);
-    crc_src = (unsigned)crc32((uint32_t)~0, data, filesize);
+    crc_src = (unsigned)crc32(CRC32_INIT, data, filesize);
     free(data);
     /* request CRC from Black Magic Probe */
     sprintf(cmd, "qCRC:%lx,%lx",paddr,filesize);
-    gdbrsp_xmit(cmd, -1);
-    rcvd = gdbrsp_recv(cmd, sizearray(cmd), 3000);
+    gdbrsp_xmit(conn->rsp, cmd, -1);
+    rcvd = gdbrsp_recv(conn->rsp, cmd, sizearray(cmd), 3000);
     cmd[rcvd] = '\0';
     crc_tgt = (rcvd >= 2 && cmd[0] == 'C') ? strtoul(cmd + 1, NULL, 16) : 0;
     if (crc_tgt != crc_src) {
-      notice(BMPERR_FLASHCRC, "Segment %d data mismatch", segment);
+      notice(conn, BMPERR_FLASHCRC, "Segment %d data mismatch", segment);
       allmatch = 0;
     }
   }
   if (allmatch)
-    notice(BMPSTAT_SUCCESS, "Verification successful");
+    notice(conn, BMPSTAT_SUCCESS, "Verification successful");
 
   return allmatch;
 }
@@ -543,50 +924,50 @@ int bmp_verify(FILE *fp)
  *  \param async_bitrate  The bitrate for ASYNC mode; set to 0 for manchester
  *         mode.
  */
-int bmp_enabletrace(int async_bitrate)
+int bmp_enabletrace(BMP_CONNECTION *conn, int async_bitrate)
 {
   char buffer[100], *ptr;
   int rcvd;
 
-  if (!rs232_isopen()) {
-    notice(BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
     return 0;
   }
 
   if (async_bitrate > 0)  {
     sprintf(buffer, "qRcmd,traceswo %d", async_bitrate);
-    gdbrsp_xmit(buffer, -1);
+    gdbrsp_xmit(conn->rsp, buffer, -1);
   } else {
-    gdbrsp_xmit("qRcmd,traceswo", -1);
+    gdbrsp_xmit(conn->rsp, "qRcmd,traceswo", -1);
   }
-  rcvd = gdbrsp_recv(buffer, sizearray(buffer), 1000);
+  rcvd = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 1000);
   /* a correct answer starts with 'o' and contains a serial number, the
      interface for trace capture (0x05) and the endpoint (0x85) */
   assert(rcvd >= 0);
   buffer[rcvd] = '\0';
   if ((ptr = strchr(buffer, ':')) == NULL || strtol(ptr + 1, &ptr, 16) != 5 || *ptr != ':' || strtol(ptr + 1, NULL, 16) != 0x85) {
-    notice(BMPERR_MONITORCMD, "Trace setup failed");
+    notice(conn, BMPERR_MONITORCMD, "Trace setup failed");
     return 0;
   }
   return 1;
 }
 
-int bmp_restart(void)
+int bmp_restart(BMP_CONNECTION *conn)
 {
   char buffer[100];
   int rcvd;
 
-  if (!rs232_isopen()) {
-    notice(BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
     return 0;
   }
 
-  gdbrsp_xmit("vRun;", -1);
-  rcvd = gdbrsp_recv(buffer, sizearray(buffer), 3000);
+  gdbrsp_xmit(conn->rsp, "vRun;", -1);
+  rcvd = gdbrsp_recv(conn->rsp, buffer, sizearray(buffer), 3000);
   buffer[rcvd] = '\0';
   if (buffer[0] == 'E')
     return 0;
-  gdbrsp_xmit("c", -1);
+  gdbrsp_xmit(conn->rsp, "c", -1);
   return 1;
 }
 
@@ -622,9 +1003,244 @@ static int hex2byte_array(const char *hex, unsigned char *byte)
   return *hex == '\0';
 }
 
+/** bmp_flashtotal() returns the address range that spans all Flash memory
+ *  regions of the target. The regions are retrieved on bmp_attach().
+ *
+ *  \param conn    The connection context.
+ *  \param low     Will be set to the lowest address of Flash memory.
+ *  \param high    Will be set to the address just above the top of Flash
+ *                  memory.
+ *
+ *  \return 1 on success, 0 if no Flash memory regions are known.
+ */
+int bmp_flashtotal(const BMP_CONNECTION *conn, unsigned long *low, unsigned long *high)
+{
+  int rgn;
+
+  assert(low != NULL && high != NULL);
+  if (conn->flashrgncount == 0)
+    return 0;
+  *low = conn->flashrgn[0].address;
+  *high = conn->flashrgn[0].address + conn->flashrgn[0].size;
+  for (rgn = 1; rgn < conn->flashrgncount; rgn++) {
+    if (conn->flashrgn[rgn].address < *low)
+      *low = conn->flashrgn[rgn].address;
+    if (conn->flashrgn[rgn].address + conn->flashrgn[rgn].size > *high)
+      *high = conn->flashrgn[rgn].address + conn->flashrgn[rgn].size;
+  }
+  return 1;
+}
+
+/* memread_request() sends a request to read target memory */
+static int memread_request(BMP_CONNECTION *conn, unsigned long address, size_t size)
+{
+  char cmd[40];
+  sprintf(cmd, "%c%lX,%X", conn->binaryupload ? 'x' : 'm', address, (unsigned)size);
+  return gdbrsp_xmit(conn->rsp, cmd, -1);
+}
+
+/* hex2bytes() converts "count" pairs of hexadecimal digits to bytes, using a
+   lookup table; it returns 0 if any of the digits is invalid */
+static int hex2bytes(const char *hex, size_t count, unsigned char *bytes)
+{
+  #define X -1
+  static const signed char lookup[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x00 */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x10 */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x20 */
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,   /* 0x30 '0'..'9' */
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,   /* 0x40 'A'..'F' */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x50 */
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,   /* 0x60 'a'..'f' */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x70 */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,   /* 0x80 */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  };
+  #undef X
+  int invalid;
+  size_t idx;
+
+  assert(hex != NULL && bytes != NULL);
+  invalid = 0;
+  for (idx = 0; idx < count; idx++) {
+    int h = lookup[(unsigned char)hex[2 * idx]];
+    int l = lookup[(unsigned char)hex[2 * idx + 1]];
+    invalid |= h | l;   /* becomes negative on any invalid digit */
+    bytes[idx] = (unsigned char)((h << 4) | l);
+  }
+  return invalid >= 0;
+}
+
+/** bmp_readmem() reads a block of target memory. The block is split into
+ *  transfers that fit in PacketSize. When the probe supports it, the data is
+ *  read with binary transfers ("x" packet), otherwise it is hex-encoded ("m"
+ *  packet). When acknowledgements are disabled, multiple requests are kept
+ *  in flight.
+ *
+ *  \param conn      The connection context.
+ *  \param address   The target address to read from.
+ *  \param data      Will hold the data read.
+ *  \param size      The number of bytes to read.
+ *
+ *  \return 1 on success, 0 on failure. Status and error messages are passed
+ *          via the callback.
+ */
+int bmp_readmem(BMP_CONNECTION *conn, unsigned long address, unsigned char *data, size_t size)
+{
+  MEMREQUEST queue[PIPELINE_DEPTH];
+  char *reply;
+  int pktsize, depth, head, count, result;
+  size_t chunk, issued;
+
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+    return 0;
+  }
+  pktsize = (conn->packetsize > 0) ? conn->packetsize : 64;
+  reply = malloc((pktsize + 16) * sizeof(char));
+  if (reply == NULL) {
+    notice(conn, BMPERR_MEMALLOC, "Memory allocation error");
+    return 0;
+  }
+
+  /* the reply must fit in PacketSize; a binary reply has a 'b' prefix and
+     leave room for escaped bytes (the probe returns fewer bytes if they do
+     not fit, but then the remainder costs an extra round trip), a hex reply
+     takes two characters per byte; keep the size a multiple of 4 for
+     word-aligned transfers */
+  if (conn->binaryupload)
+    chunk = ((pktsize - 5) * 7 / 8) & ~3;
+  else
+    chunk = ((pktsize - 4) / 2) & ~3;
+  depth = conn->noackmode ? PIPELINE_DEPTH : 1;
+
+  assert(data != NULL || size == 0);
+  result = 1;
+  head = count = 0;
+  issued = 0;
+  while (count > 0 || (result && issued < size)) {
+    MEMREQUEST req;
+    size_t rcvd, got;
+    /* keep the pipeline filled */
+    while (result && count < depth && issued < size) {
+      MEMREQUEST *next = &queue[(head + count) % PIPELINE_DEPTH];
+      next->pos = issued;
+      next->size = (size - issued > chunk) ? chunk : size - issued;
+      memread_request(conn, address + next->pos, next->size);
+      issued += next->size;
+      count++;
+    }
+    /* handle the reply to the oldest request */
+    req = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    rcvd = gdbrsp_recv(conn->rsp, reply, pktsize + 16, 1000);
+    if (!result)
+      continue;   /* an earlier request failed, drain the pending replies */
+    got = 0;
+    if (conn->binaryupload) {
+      if (rcvd >= 1 && rcvd <= (size_t)pktsize + 16 && reply[0] == 'b') {
+        got = (rcvd - 1 < req.size) ? rcvd - 1 : req.size;
+        memcpy(data + req.pos, reply + 1, got);
+      }
+    } else if (rcvd % 2 == 0 && rcvd <= (size_t)pktsize + 16) {
+      got = (rcvd / 2 < req.size) ? rcvd / 2 : req.size;
+      if (!hex2bytes(reply, got, data + req.pos))
+        got = 0;
+    }
+    if (got == 0) {
+      notice(conn, BMPERR_GENERAL, "Memory read failed at 0x%lx", address + req.pos);
+      result = 0;
+    } else if (got < req.size) {
+      /* short reply, request the remainder */
+      MEMREQUEST *next = &queue[(head + count) % PIPELINE_DEPTH];
+      next->pos = req.pos + got;
+      next->size = req.size - got;
+      memread_request(conn, address + next->pos, next->size);
+      count++;
+    }
+  }
+
+  free(reply);
+  return result;
+}
+
+/** bmp_writemem() writes a block of data to target memory, using binary
+ *  transfers. The block is split into packets that fit in PacketSize. When
+ *  acknowledgements are disabled, multiple packets are kept in flight.
+ *
+ *  \param conn      The connection context.
+ *  \param address   The target address to write to.
+ *  \param data      The data to write.
+ *  \param size      The number of bytes to write.
+ *
+ *  \return 1 on success, 0 on failure. Status and error messages are passed
+ *          via the callback.
+ */
+int bmp_writemem(BMP_CONNECTION *conn, unsigned long address, const unsigned char *data, size_t size)
+{
+  size_t queue[PIPELINE_DEPTH];
+  char reply[32];
+  int pktsize, depth, head, count, result;
+  size_t pos;
+
+  if (!gdbrsp_isopen(conn->rsp)) {
+    notice(conn, BMPERR_NOCONNECT, "Not connected to Black Magic Probe");
+    return 0;
+  }
+  pktsize = (conn->packetsize > 0) ? conn->packetsize : 64;
+  depth = conn->noackmode ? PIPELINE_DEPTH : 1;
+
+  assert(data != NULL || size == 0);
+  result = 1;
+  head = count = 0;
+  pos = 0;
+  while (count > 0 || (result && pos < size)) {
+    size_t rcvd, req;
+    /* keep the pipeline filled */
+    while (result && count < depth && pos < size) {
+      GDBRSP_SEGMENT pkt[2];
+      char header[32];
+      size_t prefixlen, numbytes;
+      sprintf(header, "X%lX,", address + pos);
+      prefixlen = strlen(header) + 8 + 1 + 4;  /* +8 for length, +1 for ':', +4 for '$' and '#nn' */
+      numbytes = fitpayload(data + pos, size - pos, pktsize - prefixlen);
+      if (numbytes == 0)
+        numbytes = 1; /* avoid a stall on a tiny PacketSize */
+      sprintf(header, "X%lX,%X:", address + pos, (unsigned)numbytes);
+      pkt[0].data = header;
+      pkt[0].size = strlen(header);
+      pkt[1].data = data + pos;
+      pkt[1].size = numbytes;
+      gdbrsp_xmitv(conn->rsp, pkt, 2);
+      queue[(head + count) % PIPELINE_DEPTH] = pos;
+      pos += numbytes;
+      count++;
+    }
+    /* check the reply to the oldest packet */
+    req = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    rcvd = gdbrsp_recv(conn->rsp, reply, sizearray(reply), 1000);
+    if (result && (rcvd != 2 || memcmp(reply, "OK", rcvd) != 0)) {
+      notice(conn, BMPERR_GENERAL, "Memory write failed at 0x%lx", address + req);
+      result = 0; /* pending replies are still drained */
+    }
+  }
+
+  return result;
+}
+
 /** bmp_runscript() executes a script with memory/register assignments, e.g.
  *  for device-specific initialization.
  *
+ *  \param conn     The connection context.
  *  \param name     The name of the script.
  *  \param driver   The name of the MCU driver.
  *  \param params   An optional array with parameters to the script, this number
@@ -633,43 +1249,51 @@ static int hex2byte_array(const char *hex, unsigned char *byte)
  *  \return 1 on success, 0 on failure.
  *
  *  \note When the line of a script has a magic value for the "value" field, it
- *        is replaced by a parameter.
+ *        is replaced by a parameter. If that parameter is SCRIPT_SKIP, the
+ *        line is skipped.
  */
-int bmp_runscript(const char *name, const char *driver, const unsigned long *params)
+int bmp_runscript(BMP_CONNECTION *conn, const char *name, const char *driver, const unsigned long *params)
 {
+  const char *script;
   uint32_t address, value;
   uint8_t size;
   char oper;
   int result;
 
-  bmscript_clearcache();
+  assert(conn != NULL);
+  if (!gdbrsp_isopen(conn->rsp))
+    return 0;
+  script = bmscript_find(name, driver);
   result = 1;
-  while (result && bmscript_line(name, driver, &oper, &address, &value, &size)) {
+  while (result && script != NULL
+         && (script = bmscript_parse(script, &oper, &address, &value, &size)) != NULL) {
     char cmd[100];
     size_t len = 0;
     if ((value & ~0xf) == SCRIPT_MAGIC) {
       assert(params != NULL);
+      if (params[value & 0xf] == SCRIPT_SKIP)
+        continue;
       value = (uint32_t)params[value & 0xf];  /* replace parameters */
     }
     if (oper == '|' || oper == '~') {
       uint32_t cur = 0;
       uint8_t bytes[4] = { 0, 0, 0, 0 };
       sprintf(cmd, "m%08X,%X:", address, size);
-      gdbrsp_xmit(cmd, -1);
-      len = gdbrsp_recv(cmd, sizearray(cmd), 1000);
+      gdbrsp_xmit(conn->rsp, cmd, -1);
+      len = gdbrsp_recv(conn->rsp, cmd, sizearray(cmd), 1000);
       cmd[len] = '\0';
       hex2byte_array(cmd, bytes);
       memmove(&cur, bytes, size);
       if (oper == '|')
         value |= cur;
       else
-        value &= ~cur;
+        value = cur & ~value;
     }
     sprintf(cmd, "X%08X,%X:", address, size);
     len = strlen(cmd);
     memmove(cmd + len, &value, size);
-    gdbrsp_xmit(cmd, len + size);
-    len = gdbrsp_recv(cmd, sizearray(cmd), 1000);
+    gdbrsp_xmit(conn->rsp, cmd, len + size);
+    len = gdbrsp_recv(conn->rsp, cmd, sizearray(cmd), 1000);
     result = (len == 2 && memcmp(cmd, "OK", len) == 0);
   }
 
@@ -42,24 +42,34 @@ enum {
   BMPERR_GENERAL    = -14,
 };
 
-typedef int (*BMP_STATCALLBACK)(int code, const char *message);
+typedef struct tagBMP_CONNECTION BMP_CONNECTION;
 
-void bmp_setcallback(BMP_STATCALLBACK func);
-int bmp_connect(void);
+typedef int (*BMP_STATCALLBACK)(int code, const char *message, void *param);
 
-int bmp_attach(int tpwr, char *name, size_t namelength, char *arch, size_t archlength);
-int bmp_detach(int powerdown);
+BMP_CONNECTION *bmp_create(int probe);
+void bmp_destroy(BMP_CONNECTION *conn);
+void bmp_setcallback(BMP_CONNECTION *conn, BMP_STATCALLBACK func, void *param);
 
-int bmp_fullerase(void);
-int bmp_download(FILE *fp);
-int bmp_verify(FILE *fp);
+int  bmp_connect(BMP_CONNECTION *conn);
+void bmp_disconnect(BMP_CONNECTION *conn);
+int  bmp_isopen(const BMP_CONNECTION *conn);
 
-int bmp_enabletrace(int async_bitrate);
+int bmp_attach(BMP_CONNECTION *conn, int tpwr, char *name, size_t namelength, char *arch, size_t archlength);
+int bmp_detach(BMP_CONNECTION *conn, int powerdown);
 
-int bmp_restart(void);
-int bmp_break(void);
+int bmp_fullerase(BMP_CONNECTION *conn);
+int bmp_download(BMP_CONNECTION *conn, FILE *fp, int delta);
+int bmp_verify(BMP_CONNECTION *conn, FILE *fp);
+int bmp_flashtotal(const BMP_CONNECTION *conn, unsigned long *low, unsigned long *high);
 
-int bmp_runscript(const char *name, const char *driver, const unsigned long *params);
+int bmp_enabletrace(BMP_CONNECTION *conn, int async_bitrate);
+
+int bmp_restart(BMP_CONNECTION *conn);
+int bmp_break(BMP_CONNECTION *conn);
+
+int bmp_runscript(BMP_CONNECTION *conn, const char *name, const char *driver, const unsigned long *params);
+int bmp_readmem(BMP_CONNECTION *conn, unsigned long address, unsigned char *data, size_t size);
+int bmp_writemem(BMP_CONNECTION *conn, unsigned long address, const unsigned char *data, size_t size);
 
 #if defined __cplusplus
   }
@@ -0,0 +1,830 @@
+/*
+ * Simulated Black Magic Probe: it opens a pseudo-terminal and answers the
+ * subset of the GDB Remote Serial Protocol that bmp-support.c uses, on a
+ * simulated Flash memory array. Link latency and bandwidth are configurable,
+ * and faults can be injected, for testing and timing download and verify
+ * runs without hardware. Set the environment variable BMP_PORT to the name
+ * of the pseudo-terminal, to let the utilities connect to it. Alternatively,
+ * the simulator listens on a TCP port or a local socket (option -s); BMP_PORT
+ * is then set to the socket address. To simulate several probes (e.g. for
+ * gang programming), run an instance per probe and list all ports in BMP_PORT,
+ * separated by semicolons.
+ *
+ * This utility requires pseudo-terminals, and is therefore only available
+ * for Linux (and other POSIX systems).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+
+#include "crc32.h"
+
+
+#if !defined sizearray
+  #define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
+#endif
+
+#define DEFAULT_FLASHBASE   0x08000000UL
+#define DEFAULT_FLASHSIZE   128         /* in KiB */
+#define DEFAULT_BLOCKSIZE   1024
+#define DEFAULT_PACKETSIZE  0x400
+#define RAM_BASE            0x20000000UL
+#define RAM_SIZE            (32 * 1024)
+
+typedef struct tagOUTPUT {
+  struct tagOUTPUT *next;
+  double due;           /* time at which the data is to be sent */
+  size_t size;
+  unsigned char data[]; /* raw data, including framing */
+} OUTPUT;
+
+static volatile sig_atomic_t quit = 0;
+
+static unsigned char *flash = NULL;
+static unsigned long flash_base = DEFAULT_FLASHBASE;
+static unsigned long flash_size = DEFAULT_FLASHSIZE * 1024;
+static unsigned long flash_blocksize = DEFAULT_BLOCKSIZE;
+static unsigned char ram[RAM_SIZE];
+static unsigned long packet_size = DEFAULT_PACKETSIZE;
+static char target_name[64] = "Simulated M3";
+
+static double link_latency = 0.0;   /* in seconds */
+static double link_bandwidth = 0.0; /* in bytes per second, 0 = unlimited */
+static int fault_nak = 0;           /* fault rates, in 1/100 percent */
+static int fault_checksum = 0;
+static int fault_erase = 0;
+static int opt_binary = 0;
+static int opt_noack = 1;
+static int opt_verbose = 0;
+
+static int noack_mode = 0;
+static OUTPUT *output_head = NULL, *output_tail = NULL;
+static double last_due = 0.0;
+static unsigned char *last_packet = NULL; /* for retransmission on a NAK */
+static size_t last_packet_size = 0;
+
+static struct {
+  unsigned long packets;
+  unsigned long naks_sent;
+  unsigned long naks_received;
+  unsigned long bad_checksums;
+  unsigned long erase_failures;
+  unsigned long flash_bytes;
+} stats;
+
+
+static void sighandler(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+static double timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fault() returns 1 at the given rate (in 1/100 percent) */
+static int fault(int rate)
+{
+  return rate > 0 && rand() % 10000 < rate;
+}
+
+static int hex2int(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return 0;
+}
+
+/* emit() queues raw data for transmission at the due time; data is always
+   sent in order, so the due time never goes below that of earlier data */
+static void emit(const unsigned char *data, size_t size, double due)
+{
+  OUTPUT *item = malloc(sizeof(OUTPUT) + size);
+  if (item == NULL)
+    return;
+  if (due < last_due)
+    due = last_due;
+  last_due = due;
+  item->next = NULL;
+  item->due = due;
+  item->size = size;
+  memcpy(item->data, data, size);
+  if (output_tail != NULL)
+    output_tail->next = item;
+  else
+    output_head = item;
+  output_tail = item;
+}
+
+/* flush_output() sends all queued data whose due time has passed */
+static void flush_output(int fd, double now)
+{
+  while (output_head != NULL && output_head->due <= now) {
+    OUTPUT *item = output_head;
+    if (write(fd, item->data, item->size) < 0)
+      perror("write");
+    output_head = item->next;
+    if (output_head == NULL)
+      output_tail = NULL;
+    free(item);
+  }
+}
+
+/* reply() frames and queues a response packet; binary data is escaped */
+static void reply(const char *payload, size_t size, int binary, double arrival, size_t reqsize)
+{
+  unsigned char *packet;
+  unsigned sum;
+  size_t idx, len;
+  double due;
+
+  packet = malloc(2 * size + 8);
+  if (packet == NULL)
+    return;
+  len = 0;
+  sum = 0;
+  packet[len++] = '$';
+  for (idx = 0; idx < size; idx++) {
+    unsigned char c = (unsigned char)payload[idx];
+    if (binary && (c == '$' || c == '#' || c == '}' || c == '*')) {
+      packet[len++] = '}';
+      sum += '}';
+      c ^= 0x20;
+    }
+    packet[len++] = c;
+    sum += c;
+  }
+  len += sprintf((char*)packet + len, "#%02x", sum & 0xff);
+
+  /* the reply arrives after the link latency plus the time it takes to
+     transfer the request and the reply over the link */
+  due = arrival + link_latency;
+  if (link_bandwidth > 0.0)
+    due += (reqsize + len) / link_bandwidth;
+  if (fault(fault_checksum)) {
+    unsigned char bad[8];
+    size_t hdr = len - 3;
+    stats.bad_checksums++;
+    memcpy(bad, packet + hdr, 3);
+    bad[1] = (unsigned char)(bad[1] == '0' ? '1' : '0');  /* corrupt the checksum */
+    emit(packet, hdr, due);
+    emit(bad, 3, due);
+  } else {
+    emit(packet, len, due);
+  }
+  if (opt_verbose)
+    printf("  -> %.*s%s\n", (int)(size < 60 ? size : 60), binary ? "(binary)" : payload, size > 60 ? "..." : "");
+
+  free(last_packet);
+  last_packet = packet;
+  last_packet_size = len;
+}
+
+static void reply_string(const char *payload, double arrival, size_t reqsize)
+{
+  reply(payload, strlen(payload), 0, arrival, reqsize);
+}
+
+/* console() sends a line of console output (as an 'O' packet) */
+static void console(const char *text, double arrival)
+{
+  char buffer[256];
+  size_t idx;
+
+  buffer[0] = 'O';
+  for (idx = 0; text[idx] != '\0' && 2 * idx + 3 < sizeof buffer; idx++)
+    sprintf(buffer + 1 + 2 * idx, "%02x", (unsigned char)text[idx]);
+  reply_string(buffer, arrival, 0);
+}
+
+/* memory_at() returns a pointer to the simulated memory for a range, or NULL
+   if the range is not fully inside Flash or RAM */
+static unsigned char *memory_at(unsigned long address, unsigned long size, int *isflash)
+{
+  if (address >= flash_base && size <= flash_size && address - flash_base <= flash_size - size) {
+    if (isflash != NULL)
+      *isflash = 1;
+    return flash + (address - flash_base);
+  }
+  if (address >= RAM_BASE && size <= RAM_SIZE && address - RAM_BASE <= RAM_SIZE - size) {
+    if (isflash != NULL)
+      *isflash = 0;
+    return ram + (address - RAM_BASE);
+  }
+  return NULL;
+}
+
+static void monitor_command(const char *cmd, double arrival, size_t reqsize)
+{
+  if (strcmp(cmd, "swdp_scan") == 0 || strcmp(cmd, "jtag_scan") == 0) {
+    char line[128];
+    console("Target voltage: 3.30V\n", arrival);
+    console("Available Targets:\n", arrival);
+    console("No. Att Driver\n", arrival);
+    snprintf(line, sizeof line, " 1      %s\n", target_name);
+    console(line, arrival);
+    reply_string("OK", arrival, reqsize);
+  } else if (strcmp(cmd, "erase_mass") == 0) {
+    memset(flash, 0xff, flash_size);
+    reply_string("OK", arrival, reqsize);
+  } else {
+    /* tpwr, traceswo and other settings are accepted without effect */
+    reply_string("OK", arrival, reqsize);
+  }
+}
+
+static void handle_packet(const char *pkt, size_t size, double arrival, size_t reqsize)
+{
+  unsigned long address, length;
+  unsigned char *mem;
+  const char *ptr;
+  char *buffer;
+  int isflash;
+
+  stats.packets++;
+  if (opt_verbose)
+    printf("%.*s%s\n", (int)(size < 60 ? size : 60), pkt, size > 60 ? "..." : "");
+
+  if (size == 1 && pkt[0] == '!') {
+    reply_string("OK", arrival, reqsize);
+  } else if (size == 1 && pkt[0] == '\x03') {
+    reply_string("T02", arrival, reqsize);
+  } else if (strncmp(pkt, "qSupported", 10) == 0) {
+    char features[128];
+    sprintf(features, "PacketSize=%lX;qXfer:memory-map:read+%s%s",
+            packet_size, opt_noack ? ";QStartNoAckMode+" : "", opt_binary ? ";binary-upload+" : "");
+    reply_string(features, arrival, reqsize);
+  } else if (strcmp(pkt, "QStartNoAckMode") == 0 && opt_noack) {
+    reply_string("OK", arrival, reqsize);
+    noack_mode = 1;
+  } else if (strncmp(pkt, "qRcmd,", 6) == 0) {
+    char cmd[128];
+    size_t idx;
+    for (idx = 0; 6 + 2 * idx + 1 < size && idx < sizeof cmd - 1; idx++)
+      cmd[idx] = (char)((hex2int(pkt[6 + 2 * idx]) << 4) | hex2int(pkt[6 + 2 * idx + 1]));
+    cmd[idx] = '\0';
+    monitor_command(cmd, arrival, reqsize);
+  } else if (strncmp(pkt, "vAttach;", 8) == 0 || strncmp(pkt, "vRun;", 5) == 0) {
+    reply_string("T05", arrival, reqsize);
+  } else if (strcmp(pkt, "D") == 0) {
+    reply_string("OK", arrival, reqsize);
+  } else if (strcmp(pkt, "c") == 0) {
+    /* target runs, there is no reply until it is interrupted */
+  } else if (strncmp(pkt, "qXfer:memory-map:read::", 23) == 0) {
+    char map[512];
+    unsigned long offset, maplen;
+    /* like the probe, send the map without XML prolog */
+    sprintf(map, "<memory-map>"
+                 "<memory type=\"flash\" start=\"0x%lx\" length=\"0x%lx\">"
+                 "<property name=\"blocksize\">0x%lx</property>"
+                 "</memory>"
+                 "<memory type=\"ram\" start=\"0x%lx\" length=\"0x%x\"/>"
+                 "</memory-map>",
+            flash_base, flash_size, flash_blocksize, RAM_BASE, RAM_SIZE);
+    offset = strtoul(pkt + 23, (char**)&ptr, 16);
+    length = (*ptr == ',') ? strtoul(ptr + 1, NULL, 16) : 0;
+    maplen = strlen(map);
+    if (offset >= maplen) {
+      reply_string("l", arrival, reqsize);
+    } else {
+      if (length > maplen - offset)
+        length = maplen - offset;
+      if (length > packet_size - 5)
+        length = packet_size - 5;
+      memmove(map + 1, map + offset, length);
+      map[0] = 'm';
+      reply(map, length + 1, 1, arrival, reqsize);
+    }
+  } else if (strncmp(pkt, "vFlashErase:", 12) == 0) {
+    address = strtoul(pkt + 12, (char**)&ptr, 16);
+    length = (*ptr == ',') ? strtoul(ptr + 1, NULL, 16) : 0;
+    mem = memory_at(address, length, &isflash);
+    if (fault(fault_erase)) {
+      stats.erase_failures++;
+      reply_string("E01", arrival, reqsize);
+    } else if (mem == NULL || !isflash
+               || (address - flash_base) % flash_blocksize != 0 || length % flash_blocksize != 0) {
+      reply_string("E01", arrival, reqsize);
+    } else {
+      memset(mem, 0xff, length);
+      reply_string("OK", arrival, reqsize);
+    }
+  } else if (strncmp(pkt, "vFlashWrite:", 12) == 0) {
+    address = strtoul(pkt + 12, (char**)&ptr, 16);
+    length = (*ptr == ':') ? size - (ptr + 1 - pkt) : 0;
+    mem = memory_at(address, length, &isflash);
+    if (*ptr != ':' || mem == NULL || !isflash) {
+      reply_string("E01", arrival, reqsize);
+    } else {
+      /* programming Flash can only clear bits */
+      unsigned long idx;
+      for (idx = 0; idx < length; idx++)
+        mem[idx] &= (unsigned char)ptr[1 + idx];
+      stats.flash_bytes += length;
+      reply_string("OK", arrival, reqsize);
+    }
+  } else if (strcmp(pkt, "vFlashDone") == 0) {
+    reply_string("OK", arrival, reqsize);
+  } else if (strncmp(pkt, "qCRC:", 5) == 0) {
+    address = strtoul(pkt + 5, (char**)&ptr, 16);
+    length = (*ptr == ',') ? strtoul(ptr + 1, NULL, 16) : 0;
+    mem = memory_at(address, length, NULL);
+    if (mem == NULL) {
+      reply_string("E01", arrival, reqsize);
+    } else {
+      char crc[16];
+      sprintf(crc, "C%08x", (unsigned)crc32(CRC32_INIT, mem, length));
+      reply_string(crc, arrival, reqsize);
+    }
+  } else if (pkt[0] == 'm' || (pkt[0] == 'x' && opt_binary)) {
+    address = strtoul(pkt + 1, (char**)&ptr, 16);
+    length = (*ptr == ',') ? strtoul(ptr + 1, NULL, 16) : 0;
+    mem = memory_at(address, length, NULL);
+    if (mem == NULL || length == 0) {
+      reply_string("E01", arrival, reqsize);
+    } else if (pkt[0] == 'm') {
+      unsigned long idx;
+      if (2 * length > packet_size)
+        length = packet_size / 2;   /* short reply */
+      buffer = malloc(2 * length + 1);
+      if (buffer != NULL) {
+        for (idx = 0; idx < length; idx++)
+          sprintf(buffer + 2 * idx, "%02x", mem[idx]);
+        reply(buffer, 2 * length, 0, arrival, reqsize);
+        free(buffer);
+      }
+    } else {
+      /* reply with as many bytes as fit in a packet, after escaping */
+      unsigned long idx, used;
+      for (idx = 0, used = 1; idx < length; idx++) {
+        unsigned char c = mem[idx];
+        used += (c == '$' || c == '#' || c == '}' || c == '*') ? 2 : 1;
+        if (used > packet_size - 4)
+          break;
+      }
+      buffer = malloc(idx + 1);
+      if (buffer != NULL) {
+        buffer[0] = 'b';
+        memcpy(buffer + 1, mem, idx);
+        reply(buffer, idx + 1, 1, arrival, reqsize);
+        free(buffer);
+      }
+    }
+  } else if (pkt[0] == 'X') {
+    address = strtoul(pkt + 1, (char**)&ptr, 16);
+    length = (*ptr == ',') ? strtoul(ptr + 1, (char**)&ptr, 16) : 0;
+    mem = memory_at(address, length, &isflash);
+    /* a plain memory write to Flash fails on real hardware too */
+    if (*ptr != ':' || mem == NULL || isflash || (size_t)(ptr + 1 - pkt) + length != size) {
+      reply_string("E01", arrival, reqsize);
+    } else {
+      memcpy(mem, ptr + 1, length);
+      reply_string("OK", arrival, reqsize);
+    }
+  } else {
+    reply_string("", arrival, reqsize);  /* not supported */
+  }
+}
+
+/* receive() processes incoming data; it returns the number of bytes used */
+static size_t receive(const unsigned char *buffer, size_t size, double arrival)
+{
+  static const unsigned char ack[] = "+", nak[] = "-";
+  size_t start, idx, count, first;
+  unsigned sum;
+  char *payload;
+
+  for (start = 0; start < size && buffer[start] != '$'; start++) {
+    if (buffer[start] == '-' && last_packet != NULL) {
+      stats.naks_received++;
+      emit(last_packet, last_packet_size, arrival + link_latency);
+    } else if (buffer[start] == '\x03') {
+      reply_string("T02", arrival, 1);
+    }
+  }
+  if (start == size)
+    return size;
+
+  /* find the end of the packet */
+  for (idx = start + 1; idx < size && buffer[idx] != '#'; idx++)
+    {}
+  if (idx + 2 >= size)
+    return start;   /* packet is not complete yet */
+
+  /* verify the checksum and decode the payload */
+  payload = malloc(idx - start);
+  if (payload == NULL)
+    return idx + 3;
+  sum = 0;
+  count = 0;
+  first = start;
+  for (start += 1; start < idx; start++) {
+    unsigned char c = buffer[start];
+    sum += c;
+    if (c == '}' && start + 1 < idx) {
+      start++;
+      sum += buffer[start];
+      c = (unsigned char)(buffer[start] ^ 0x20);
+    }
+    payload[count++] = (char)c;
+  }
+  payload[count] = '\0';
+  if ((sum & 0xff) != (unsigned)((hex2int(buffer[idx + 1]) << 4) | hex2int(buffer[idx + 2]))) {
+    if (!noack_mode)
+      emit(nak, 1, arrival + link_latency);
+  } else if (fault(fault_nak)) {
+    /* pretend the packet was corrupted; in no-ack mode it is dropped */
+    stats.naks_sent++;
+    if (!noack_mode)
+      emit(nak, 1, arrival + link_latency);
+  } else {
+    if (!noack_mode)
+      emit(ack, 1, arrival + link_latency);
+    handle_packet(payload, count, arrival, idx + 3 - first);
+  }
+  free(payload);
+  return idx + 3;
+}
+
+/* reset_link() is called when a client opens or closes the port; the probe
+   sends "OK" on a new connection */
+static void reset_link(int opened, double now)
+{
+  static const unsigned char hello[] = "$OK#9a";
+  while (output_head != NULL) {
+    OUTPUT *item = output_head;
+    output_head = item->next;
+    free(item);
+  }
+  output_tail = NULL;
+  last_due = 0.0;
+  noack_mode = 0;
+  if (opened) {
+    emit(hello, sizeof hello - 1, now + link_latency);
+    if (opt_verbose)
+      printf("(connected)\n");
+  } else if (opt_verbose) {
+    printf("(disconnected)\n");
+  }
+}
+
+/* open_listener() creates a socket that listens on a TCP port ("port",
+   "host:port" or "tcp:host:port") or on a local socket ("unix:path"); it
+   returns the address that a client must use in "name" */
+static int open_listener(const char *address, char *name, size_t namesize)
+{
+  int sock, one = 1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    if (strlen(address + 5) >= sizearray(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", address + 5);
+      return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address + 5);
+    unlink(addr.sun_path);  /* remove a stale socket of an earlier run */
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (const struct sockaddr*)&addr, sizeof addr) != 0) {
+      perror("bind");
+      return -1;
+    }
+    strlcpy(name, address, namesize);
+  } else {
+    char host[128];
+    const char *port;
+    struct addrinfo hints, *list;
+    if (strncmp(address, "tcp:", 4) == 0)
+      address += 4;
+    if ((port = strrchr(address, ':')) != NULL) {
+      size_t len = port - address;
+      if (len >= sizearray(host))
+        len = sizearray(host) - 1;
+      memcpy(host, address, len);
+      host[len] = '\0';
+      port += 1;
+    } else {
+      strcpy(host, "localhost");
+      port = address;
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo((host[0] != '\0') ? host : NULL, port, &hints, &list) != 0) {
+      fprintf(stderr, "Invalid address %s\n", address);
+      return -1;
+    }
+    sock = socket(list->ai_family, list->ai_socktype, list->ai_protocol);
+    if (sock >= 0)
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (sock < 0 || bind(sock, list->ai_addr, list->ai_addrlen) != 0) {
+      perror("bind");
+      freeaddrinfo(list);
+      return -1;
+    }
+    freeaddrinfo(list);
+    snprintf(name, namesize, "tcp:%s:%s", (host[0] != '\0') ? host : "localhost", port);
+  }
+  if (listen(sock, 1) != 0) {
+    perror("listen");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static double getpercentage(const char *ptr)
+{
+  if (*ptr == '=' || *ptr == ':')
+    ptr++;
+  return strtod(ptr, NULL);
+}
+
+static const char *getvalue(const char *ptr)
+{
+  if (*ptr == '=' || *ptr == ':')
+    ptr++;
+  return ptr;
+}
+
+static void usage(void)
+{
+  printf("bmpsim - simulated Black Magic Probe on a pseudo-terminal, for testing\n"
+         "         and timing Flash downloads without hardware.\n\n"
+         "Usage: bmpsim [options]\n\n"
+         "Options:\n"
+         "-a=address Base address of Flash memory (default 0x%lx).\n"
+         "-b=size  Flash block (sector) size in bytes (default %d).\n"
+         "-f=size  Flash memory size in KiB (default %d).\n"
+         "-p=size  Packet size that is reported to the host (default %d).\n"
+         "-l=usec  Link latency in microseconds (default 0).\n"
+         "-w=KiB/s Link bandwidth (default unlimited).\n"
+         "-n=pct   Rate of received packets that are NAKed (percent).\n"
+         "-c=pct   Rate of replies with a bad checksum (percent).\n"
+         "-e=pct   Rate of Flash erase commands that fail (percent).\n"
+         "-k\t Keep acknowledgements: do not offer the no-ack mode.\n"
+         "-r=seed  Seed for the fault injection (default 1).\n"
+         "-s=addr  Listen on a socket instead of a pseudo-terminal: a TCP port\n"
+         "\t (\"port\" or \"host:port\") or a local socket (\"unix:path\").\n"
+         "-t=name  Target name, as reported on a scan (default \"%s\").\n"
+         "-x\t Support binary memory reads (\"x\" packet).\n"
+         "-v\t Verbose: print all packets.\n\n"
+         "Set the environment variable BMP_PORT to the reported port or address, so that the\n"
+         "utilities connect to the simulator instead of scanning for a probe.\n",
+         DEFAULT_FLASHBASE, DEFAULT_BLOCKSIZE, DEFAULT_FLASHSIZE, DEFAULT_PACKETSIZE,
+         target_name);
+}
+
+int main(int argc, char *argv[])
+{
+  static unsigned char buffer[65536], chunk[4096];
+  struct termios tio;
+  char portname[160];
+  const char *sockaddr = NULL;
+  size_t length;
+  int idx, one;
+  int master = -1, slave = -1, listener = -1, client = -1;
+  unsigned seed = 1;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 'a':
+        flash_base = strtoul(getvalue(&argv[idx][2]), NULL, 0);
+        break;
+      case 'b':
+        flash_blocksize = strtoul(getvalue(&argv[idx][2]), NULL, 0);
+        if (flash_blocksize < 16 || (flash_blocksize & (flash_blocksize - 1)) != 0) {
+          fprintf(stderr, "Invalid block size %s; it must be a power of 2.\n", getvalue(&argv[idx][2]));
+          return 1;
+        }
+        break;
+      case 'c':
+        fault_checksum = (int)(getpercentage(&argv[idx][2]) * 100);
+        break;
+      case 'e':
+        fault_erase = (int)(getpercentage(&argv[idx][2]) * 100);
+        break;
+      case 'f':
+        flash_size = strtoul(getvalue(&argv[idx][2]), NULL, 0) * 1024;
+        break;
+      case 'k':
+        opt_noack = 0;
+        break;
+      case 'l':
+        link_latency = strtod(getvalue(&argv[idx][2]), NULL) / 1e6;
+        break;
+      case 'n':
+        fault_nak = (int)(getpercentage(&argv[idx][2]) * 100);
+        break;
+      case 'p':
+        packet_size = strtoul(getvalue(&argv[idx][2]), NULL, 0);
+        if (packet_size < 64) {
+          fprintf(stderr, "Invalid packet size %s; it must be at least 64.\n", getvalue(&argv[idx][2]));
+          return 1;
+        }
+        break;
+      case 'r':
+        seed = (unsigned)strtoul(getvalue(&argv[idx][2]), NULL, 0);
+        break;
+      case 's':
+        sockaddr = getvalue(&argv[idx][2]);
+        break;
+      case 't':
+        strlcpy(target_name, getvalue(&argv[idx][2]), sizearray(target_name));
+        break;
+      case 'v':
+        opt_verbose = 1;
+        break;
+      case 'w':
+        link_bandwidth = strtod(getvalue(&argv[idx][2]), NULL) * 1024;
+        break;
+      case 'x':
+        opt_binary = 1;
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    }
+  }
+  if (flash_size == 0 || flash_size % flash_blocksize != 0) {
+    fprintf(stderr, "Flash size must be a multiple of the block size.\n");
+    return 1;
+  }
+  flash = malloc(flash_size);
+  if (flash == NULL) {
+    fprintf(stderr, "Memory allocation error.\n");
+    return 1;
+  }
+  memset(flash, 0xff, flash_size);
+  memset(ram, 0, sizeof ram);
+  srand(seed);
+
+  if (sockaddr != NULL) {
+    listener = open_listener(sockaddr, portname, sizearray(portname));
+    if (listener < 0)
+      return 1;
+  } else {
+    if (openpty(&master, &slave, portname, NULL, NULL) != 0) {
+      perror("openpty");
+      return 1;
+    }
+    /* the slave side stays open, so that the pseudo-terminal survives the
+       client closing and re-opening it */
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    /* in packet mode, the flushes that the client does on opening and closing
+       the port are reported, so that these events can be detected */
+    one = 1;
+    ioctl(master, TIOCPKT, &one);
+  }
+
+  signal(SIGINT, sighandler);
+  signal(SIGTERM, sighandler);
+  signal(SIGPIPE, SIG_IGN); /* a client closing the socket is handled on read */
+  printf("Simulated Black Magic Probe on %s, press Ctrl+C to stop.\n", portname);
+  printf("Flash 0x%lx-0x%lx, %lu byte blocks; use: export BMP_PORT=%s\n",
+         flash_base, flash_base + flash_size - 1, flash_blocksize, portname);
+  fflush(stdout);
+
+  length = 0;
+  while (!quit) {
+    struct pollfd pfd;
+    int timeout = -1;
+    double now = timestamp();
+    if (output_head != NULL) {
+      double wait = output_head->due - now;
+      timeout = (wait <= 0.0) ? 0 : (int)(wait * 1000) + 1;
+    }
+    if (listener >= 0)
+      pfd.fd = (client >= 0) ? client : listener;
+    else
+      pfd.fd = master;
+    pfd.events = POLLIN | POLLPRI;
+    pfd.revents = 0;
+    if (timeout != 0 && poll(&pfd, 1, (timeout > 0 && timeout < 2) ? 0 : timeout) > 0) {
+      const unsigned char *data = NULL;
+      size_t datasize = 0;
+      if (pfd.fd == listener) {
+        /* a single client is served at a time (like a real probe) */
+        client = accept(listener, NULL, NULL);
+        if (client >= 0) {
+          one = 1;
+          setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+          reset_link(1, timestamp());
+          length = 0;
+        }
+      } else if (pfd.fd == client) {
+        ssize_t count = read(client, chunk, sizeof chunk);
+        if (count > 0) {
+          data = chunk;
+          datasize = count;
+        } else {
+          reset_link(0, timestamp());
+          close(client);
+          client = -1;
+        }
+      } else {
+        ssize_t count = read(master, chunk, sizeof chunk);
+        if (count > 1 && chunk[0] == TIOCPKT_DATA) {
+          data = chunk + 1;
+          datasize = count - 1;
+        } else if (count == 1 && (chunk[0] & (TIOCPKT_FLUSHREAD | TIOCPKT_FLUSHWRITE)) != 0) {
+          /* a client flushes its write queue only on closing the port */
+          reset_link((chunk[0] & TIOCPKT_FLUSHWRITE) == 0, timestamp());
+          length = 0;
+        }
+      }
+      if (datasize > 0) {
+        size_t used;
+        now = timestamp();
+        if (datasize > sizeof buffer - length)
+          length = 0; /* overrun, drop all */
+        memcpy(buffer + length, data, datasize);
+        length += datasize;
+        while (length > 0 && (used = receive(buffer, length, now)) > 0) {
+          memmove(buffer, buffer + used, length - used);
+          length -= used;
+        }
+      }
+    } else if (timeout > 0 && timeout < 2) {
+      /* sub-millisecond wait: spin, because poll() is not accurate enough */
+      while (timestamp() < output_head->due)
+        {}
+    }
+    if (listener < 0)
+      flush_output(master, timestamp());
+    else if (client >= 0)
+      flush_output(client, timestamp());
+  }
+
+  printf("\n%lu packets, %lu bytes written to Flash\n", stats.packets, stats.flash_bytes);
+  if (fault_nak > 0 || fault_checksum > 0 || fault_erase > 0)
+    printf("Injected: %lu NAKs, %lu bad checksums, %lu erase failures; %lu NAKs received\n",
+           stats.naks_sent, stats.bad_checksums, stats.erase_failures, stats.naks_received);
+  while (output_head != NULL) {
+    OUTPUT *item = output_head;
+    output_head = item->next;
+    free(item);
+  }
+  free(last_packet);
+  free(flash);
+  if (listener >= 0) {
+    if (client >= 0)
+      close(client);
+    close(listener);
+    if (strncmp(portname, "unix:", 5) == 0)
+      unlink(portname + 5);
+  } else {
+    close(slave);
+    close(master);
+  }
+  return 0;
+}
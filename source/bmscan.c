@@ -72,11 +72,30 @@ int find_bmp(int seqnr, int iface, TCHAR *name, size_t namelen)
   TCHAR regpath[128];
   DWORD maxlen;
   int idx_device;
+  const TCHAR *port;
 
   assert(name != NULL);
   assert(namelen > 0);
   *name = '\0';
 
+  /* an explicit port (e.g. for a simulated probe) overrides the scan; it may
+     be a list of ports, separated by semicolons */
+  if (iface == BMP_IF_GDB && (port = _tgetenv(_T("BMP_PORT"))) != NULL && *port != '\0') {
+    const TCHAR *tail;
+    size_t len;
+    while (seqnr-- > 0 && port != NULL)
+      if ((port = _tcschr(port, ';')) != NULL)
+        port++;
+    if (port == NULL || *port == '\0' || *port == ';')
+      return 0;
+    len = ((tail = _tcschr(port, ';')) != NULL) ? (size_t)(tail - port) : _tcslen(port);
+    if (len >= namelen)
+      len = namelen - 1;
+    memcpy(name, port, len * sizeof(TCHAR));
+    name[len] = '\0';
+    return 1;
+  }
+
   /* find the device path */
   _stprintf(regpath, _T("SYSTEM\\CurrentControlSet\\Enum\\USB\\VID_%04X&PID_%04X&MI_%02X"),
             BMP_VID, BMP_PID, iface);
@@ -213,11 +232,30 @@ int find_bmp(int seqnr, int iface, char *name, size_t namelen)
 {
   DIR *dsys;
   struct dirent *dir;
+  const char *port;
 
   assert(name != NULL);
   assert(namelen > 0);
   *name = '\0';
 
+  /* an explicit port (e.g. for a simulated probe) overrides the scan; it may
+     be a list of ports, separated by semicolons */
+  if (iface == BMP_IF_GDB && (port = getenv("BMP_PORT")) != NULL && *port != '\0') {
+    const char *tail;
+    size_t len;
+    while (seqnr-- > 0 && port != NULL)
+      if ((port = strchr(port, ';')) != NULL)
+        port++;
+    if (port == NULL || *port == '\0' || *port == ';')
+      return 0;
+    len = ((tail = strchr(port, ';')) != NULL) ? (size_t)(tail - port) : strlen(port);
+    if (len >= namelen)
+      len = namelen - 1;
+    memcpy(name, port, len);
+    name[len] = '\0';
+    return 1;
+  }
+
   /* run through directories in the sysfs branch */
   #define SYSFS_ROOT  "/sys/bus/usb/devices"
   dsys = opendir(SYSFS_ROOT);
@@ -35,7 +35,10 @@
 #define BMP_EP_TRACE      0x85  /* endpoint 5 is bulk data endpoint for trace interface */
 
 /* find_bmp() returns 1 on success and 0 on failure; the interface must be either
-   BMP_IF_GDB or BMP_IF_UART. */
+   BMP_IF_GDB or BMP_IF_UART. When the environment variable BMP_PORT is set,
+   it is returned as the port of the GDB server, without scanning; BMP_PORT
+   may hold several ports separated by semicolons, where "seqnr" selects one
+   of them. */
 #if defined WIN32 || defined _WIN32
   #include <tchar.h>
   int find_bmp(int seqnr, int iface, TCHAR *name, size_t namelen);
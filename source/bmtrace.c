@@ -50,15 +50,20 @@
 #include "bmp-script.h"
 #include "bmp-support.h"
 #include "bmscan.h"
-#include "gdb-rsp.h"
+#include "capture.h"
 #include "minIni.h"
 #include "noc_file_dialog.h"
-#include "rs232.h"
 #include "specialfolder.h"
 
 #include "parsetsdl.h"
 #include "decodectf.h"
+#include "ctfstore.h"
+#include "decodeitm.h"
+#include "exctrace.h"
+#include "profiler.h"
+#include "swousb.h"
 #include "swotrace.h"
+#include "tracetime.h"
 
 #include "res/btn_folder.h"
 #if defined __linux__ || defined __unix__
@@ -79,6 +84,7 @@
 #endif
 
 
+static BMP_CONNECTION *bmp = NULL;
 static int recent_statuscode = 0;
 
 int ctf_error_notify(int code, int linenr, const char *message)
@@ -100,8 +106,9 @@ int ctf_error_notify(int code, int linenr, const char *message)
   return 0;
 }
 
-static int bmp_callback(int code, const char *message)
+static int bmp_callback(int code, const char *message, void *param)
 {
+  (void)param;
   recent_statuscode = code;
   tracelog_statusmsg(TRACESTATMSG_BMP, message, code);
   return code >= 0;
@@ -116,7 +123,7 @@ static int bmp_callback(int code, const char *message)
 
 static float *nk_ratio(int count, ...)
 {
-  #define MAX_ROW_FIELDS 10
+  #define MAX_ROW_FIELDS 12
   static float r_array[MAX_ROW_FIELDS];
   va_list ap;
   int i;
@@ -164,6 +171,164 @@ static void set_style(struct nk_context *ctx)
   nk_style_from_table(ctx, table);
 }
 
+/* run-time event filter, for the control block that tracegen generates with
+   option -c; the host keeps a copy of the enable bits and the dividers, which
+   is read from the target when the control block is verified */
+static int filter_count = 0;
+static unsigned long *filter_enabled = NULL;
+static unsigned short *filter_divider = NULL;
+static unsigned long filter_address = 0;  /* verified control block, 0 if none */
+static char filter_error[64] = "";
+
+static void filter_clear(void)
+{
+  if (filter_enabled != NULL) {
+    free(filter_enabled);
+    filter_enabled = NULL;
+  }
+  if (filter_divider != NULL) {
+    free(filter_divider);
+    filter_divider = NULL;
+  }
+  filter_count = 0;
+  filter_address = 0;
+}
+
+static int filter_init(int count)
+{
+  int idx;
+
+  filter_clear();
+  if (count <= 0)
+    return 0;
+  filter_enabled = malloc(((count + 31) / 32) * sizeof(unsigned long));
+  filter_divider = malloc(count * sizeof(unsigned short));
+  if (filter_enabled == NULL || filter_divider == NULL) {
+    filter_clear();
+    return 0;
+  }
+  for (idx = 0; idx < (count + 31) / 32; idx++)
+    filter_enabled[idx] = ~0UL;
+  for (idx = 0; idx < count; idx++)
+    filter_divider[idx] = 1;
+  filter_count = count;
+  return 1;
+}
+
+#define LE16(p)  ((unsigned)(p)[0] | ((unsigned)(p)[1] << 8))
+#define LE32(p)  ((unsigned long)LE16(p) | ((unsigned long)LE16((p) + 2) << 16))
+
+/** filter_attach() reads the control block at the address from the target
+ *  and checks that it is a control block for the events in the TSDL file.
+ *  On success, the enable bits and the dividers are copied from the target.
+ *  The control block is only written to after it is verified.
+ *
+ *  \return 1 on success, 0 on failure (filter_error holds the reason).
+ */
+static int filter_attach(unsigned long address)
+{
+  unsigned char *data;
+  size_t size;
+  int idx;
+
+  filter_address = 0;
+  if (filter_count == 0)
+    return 0;
+  if (address == 0) {
+    strcpy(filter_error, "Set the address of the control block");
+    return 0;
+  }
+  if (!bmp_isopen(bmp)) {
+    strcpy(filter_error, "Not connected to the target");
+    return 0;
+  }
+  size = CTF_CONTROL_DIVIDER(filter_count, filter_count);
+  data = malloc(size);
+  if (data == NULL) {
+    strcpy(filter_error, "Memory allocation failure");
+    return 0;
+  }
+  if (!bmp_readmem(bmp, address, data, size)) {
+    strcpy(filter_error, "Control block cannot be read");
+    free(data);
+    return 0;
+  }
+  if (LE32(data) != CTF_CONTROL_MAGIC) {
+    strcpy(filter_error, "No control block at this address");
+    free(data);
+    return 0;
+  }
+  if ((int)LE16(data + 4) != filter_count) {
+    strcpy(filter_error, "Control block does not match the TSDL file");
+    free(data);
+    return 0;
+  }
+  for (idx = 0; idx < (filter_count + 31) / 32; idx++)
+    filter_enabled[idx] = LE32(data + CTF_CONTROL_ENABLED(32 * idx));
+  for (idx = 0; idx < filter_count; idx++) {
+    filter_divider[idx] = (unsigned short)LE16(data + CTF_CONTROL_DIVIDER(filter_count, idx));
+    if (filter_divider[idx] == 0)
+      filter_divider[idx] = 1;  /* 0 and 1 both mean "no decimation" */
+  }
+  free(data);
+  filter_address = address;
+  filter_error[0] = '\0';
+  return 1;
+}
+
+/** filter_update() writes the enable bit and the divider for an event to the
+ *  verified control block in the target. Only the bit for the event is
+ *  changed in the word with enable bits (the word is re-read from the target).
+ *
+ *  \return 1 on success, 0 on failure (filter_error holds the reason).
+ */
+static int filter_update(int idx)
+{
+  unsigned char data[4];
+  unsigned long word, mask;
+  unsigned short divider;
+
+  assert(idx >= 0 && idx < filter_count);
+  if (filter_address == 0 || !bmp_isopen(bmp)) {
+    strcpy(filter_error, "Not connected to the target");
+    return 0;
+  }
+  mask = 1UL << (idx % 32);
+  if (!bmp_readmem(bmp, filter_address + CTF_CONTROL_ENABLED(idx), data, 4))
+    goto failed;
+  word = LE32(data);
+  word = (word & ~mask) | (filter_enabled[idx / 32] & mask);
+  data[0] = (unsigned char)word;    /* target is Little Endian */
+  data[1] = (unsigned char)(word >> 8);
+  data[2] = (unsigned char)(word >> 16);
+  data[3] = (unsigned char)(word >> 24);
+  if (!bmp_writemem(bmp, filter_address + CTF_CONTROL_ENABLED(idx), data, 4))
+    goto failed;
+  divider = filter_divider[idx];
+  data[0] = (unsigned char)divider;
+  data[1] = (unsigned char)(divider >> 8);
+  if (!bmp_writemem(bmp, filter_address + CTF_CONTROL_DIVIDER(filter_count, idx), data, 2))
+    goto failed;
+  filter_error[0] = '\0';
+  return 1;
+failed:
+  sprintf(filter_error, "Failed to update event %d", idx);
+  return 0;
+}
+
+/** trace_hwpacket() handles the packets from the DWT, for the profiler and
+ *  the exception statistics. It is called from the decoder thread, so the
+ *  GUI locks the decoder while it reads or resets the statistics.
+ */
+static void trace_hwpacket(const ITMPACKET *packet, double timestamp)
+{
+  (void)timestamp;
+  if (packet->type == ITMPKT_PCSAMPLE)
+    profile_sample((packet->size == 1) ? PROFILE_SLEEP : (unsigned long)packet->value);
+  else
+    exctrace_packet(packet);
+}
+
 #define TOOLTIP_DELAY 1000
 static int tooltip(struct nk_context *ctx, struct nk_rect bounds, const char *text, struct nk_rect *viewport)
 {
@@ -206,6 +371,8 @@ int main(void)
   char txtConfigFile[256], findtext[128] = "", valstr[128] = "";
   char txtTSDLfile[256] = "";
   char cpuclock_str[15] = "", bitrate_str[15] = "";
+  char ctrladdr_str[15] = "";
+  char txtELFfile[256] = "";
   unsigned long cpuclock = 0, bitrate = 0;
   int chan, cur_chan_edit = -1;
   unsigned long channelmask = 0;
@@ -217,6 +384,24 @@ int main(void)
   int reload_format = 1;
   int cur_match_line = -1;
   int find_popup = 0;
+  int filter_popup = 0;
+  int filter_verify = 0;
+  int profile_popup = 0;
+  int profile_interval = 0;
+  int reload_profile = 1;
+  int exctrace_popup = 0;
+  int opt_exctrace = 0;
+  int opt_timestamps = 0;
+  int opt_formatter = 0;
+  int capture_popup = 0;
+  int capture_saved = 0;
+  int capture_pre = 256, capture_post = 64;  /* in KiB */
+  char capture_text[128] = "", capture_ctf[128] = "", capture_file[256] = "";
+  const char *capture_error = NULL;
+  int query_popup = 0;
+  char query_text[256] = "", query_result[2048] = "";
+  int opt_graph = 0;
+  char graph_event[CTF_NAME_LENGTH] = "", graph_field[CTF_NAME_LENGTH] = "";
 
   /* locate the configuration file */
   if (folder_AppConfig(txtConfigFile, sizearray(txtConfigFile))) {
@@ -247,6 +432,21 @@ int main(void)
   ini_gets("Settings", "tsdl", "", txtTSDLfile, sizearray(txtTSDLfile), txtConfigFile);
   ini_gets("Settings", "mcu-freq", "48000000", cpuclock_str, sizearray(cpuclock_str), txtConfigFile);
   ini_gets("Settings", "bitrate", "100000", bitrate_str, sizearray(bitrate_str), txtConfigFile);
+  ini_gets("Settings", "ctrl-address", "", ctrladdr_str, sizearray(ctrladdr_str), txtConfigFile);
+  ini_gets("Settings", "elf", "", txtELFfile, sizearray(txtELFfile), txtConfigFile);
+  profile_interval = (int)ini_getl("Settings", "profile-interval", 0, txtConfigFile);
+  opt_exctrace = (int)ini_getl("Settings", "exception-trace", 0, txtConfigFile);
+  opt_timestamps = (int)ini_getl("Settings", "timestamps", 0, txtConfigFile);
+  opt_formatter = (int)ini_getl("Settings", "formatter", 0, txtConfigFile);
+  capture_pre = (int)ini_getl("Capture", "pre-trigger", 256, txtConfigFile);
+  capture_post = (int)ini_getl("Capture", "post-trigger", 64, txtConfigFile);
+  ini_gets("Capture", "text", "", capture_text, sizearray(capture_text), txtConfigFile);
+  ini_gets("Capture", "ctf-event", "", capture_ctf, sizearray(capture_ctf), txtConfigFile);
+  ini_gets("Capture", "file", "", capture_file, sizearray(capture_file), txtConfigFile);
+  ini_gets("Settings", "query", "", query_text, sizearray(query_text), txtConfigFile);
+  opt_graph = (int)ini_getl("Graph", "visible", 0, txtConfigFile);
+  ini_gets("Graph", "event", "", graph_event, sizearray(graph_event), txtConfigFile);
+  ini_gets("Graph", "field", "", graph_field, sizearray(graph_field), txtConfigFile);
   ini_gets("Settings", "size", "", valstr, sizearray(valstr), txtConfigFile);
   if (sscanf(valstr, "%d %d", &canvas_width, &canvas_height) != 2 || canvas_width < 100 || canvas_height < 50) {
     canvas_width = WINDOW_WIDTH;
@@ -256,7 +456,9 @@ int main(void)
   trace_status = trace_init();
   if (trace_status != TRACESTAT_OK)
     trace_running = 0;
-  bmp_setcallback(bmp_callback);
+  bmp = bmp_create(0);
+  bmp_setcallback(bmp, bmp_callback, NULL);
+  trace_sethwhandler(trace_hwpacket);
   reinitialize = 2; /* skip first iteration, so window is updated */
   recent_statuscode = BMPSTAT_SUCCESS;  /* must be a non-zero code to display anything */
   tracelog_statusmsg(TRACESTATMSG_BMP, "Initializing...", recent_statuscode);
@@ -267,51 +469,65 @@ int main(void)
 
   for ( ;; ) {
     if (reinitialize == 1) {
-      if (rs232_isopen())
-        bmp_break();
+      if (bmp_isopen(bmp))
+        bmp_break(bmp);
       if (opt_mode == MODE_PASSIVE) {
-        gdbrsp_packetsize(0);
-        if (rs232_isopen()) {
-          bmp_detach(1);
-          rs232_dtr(0);
-          rs232_rts(0);
-          rs232_close();
+        if (bmp_isopen(bmp)) {
+          bmp_detach(bmp, 1);
+          bmp_disconnect(bmp);
         }
       } else {
-        int result = bmp_connect();
+        int result = bmp_connect(bmp);
         if (result)
-          result = bmp_attach(2, mcu_driver, sizearray(mcu_driver), mcu_arch, sizearray(mcu_arch)); //??? can check architecture: no SWO on Cortex-M0
+          result = bmp_attach(bmp, 2, mcu_driver, sizearray(mcu_driver), mcu_arch, sizearray(mcu_arch)); //??? can check architecture: no SWO on Cortex-M0
         if (result) {
-          unsigned long params[2];
-          bmp_enabletrace((opt_mode == MODE_ASYNC) ? bitrate : 0);
-          bmp_runscript("swo-device", mcu_driver, NULL);
+          unsigned long params[4];
+          bmp_enabletrace(bmp, (opt_mode == MODE_ASYNC) ? bitrate : 0);
+          bmp_runscript(bmp, "swo-device", mcu_driver, NULL);
           if ((cpuclock = strtol(cpuclock_str, NULL, 10)) == 0)
             cpuclock = 48000000;
           if ((bitrate = strtol(bitrate_str, NULL, 10)) == 0)
             bitrate = 100000;
           params[0] = opt_mode;
           params[1] = cpuclock / bitrate - 1;
-          bmp_runscript("swo-generic", mcu_driver, params);
+          params[2] = opt_timestamps ? 0x10003 : 0x10011;  /* ITM_TCR: trace bus ID 1; with TSENA, SWOENA is cleared so that timestamps count CPU cycles */
+          params[3] = opt_formatter ? 0x102 : 0;            /* TPIU_FFCR */
+          bmp_runscript(bmp, "swo-generic", mcu_driver, params);
+          trace_lock();
+          tracetime_setclock(cpuclock);
+          trace_unlock();
           /* enable active channels in the target (disable inactive channels) */
           channelmask = 0;
           for (chan = 0; chan < NUM_CHANNELS; chan++)
             if (channel_getenabled(chan))
               channelmask |= (1 << chan);
           params[0] = channelmask;
-          bmp_runscript("swo-channels", mcu_driver, params);
-          bmp_restart();
+          bmp_runscript(bmp, "swo-channels", mcu_driver, params);
+          if (profile_interval > 0) {
+            params[0] = profile_dwtctrl(profile_interval, NULL);
+            bmp_runscript(bmp, "swo-profile", mcu_driver, params);
+          }
+          if (opt_exctrace) {
+            params[0] = 0x10000;  /* EXCTRCENA */
+            bmp_runscript(bmp, "swo-exctrace", mcu_driver, params);
+          }
+          bmp_restart(bmp);
         }
       }
       tracestring_clear();
+      trace_lock();
+      exctrace_reset();
+      trace_unlock();
+      trace_setformatter(opt_formatter);
       switch (trace_status) {
       case TRACESTAT_OK:
         recent_statuscode = BMPSTAT_SUCCESS;
         if (opt_mode == MODE_PASSIVE) {
-          tracelog_statusmsg(TRACESTATMSG_BMP, "Listening...", recent_statuscode);
+          tracelog_statusmsg(TRACESTATMSG_BMP, trace_isshared() ? "Listening (shared)..." : "Listening...", recent_statuscode);
         } else if (recent_statuscode >= 0) {
           char msg[100];
           assert(strlen(mcu_driver) > 0);
-          sprintf(msg, "Connected [%s]", mcu_driver);
+          sprintf(msg, "Connected [%s]%s", mcu_driver, trace_isshared() ? " (shared)" : "");
           tracelog_statusmsg(TRACESTATMSG_BMP, msg, recent_statuscode);
         }
         break;
@@ -337,11 +553,13 @@ int main(void)
     }
 
     if (reload_format) {
+      trace_lock();   /* pause the decoder while the TSDL file is reloaded */
       ctf_parse_cleanup();
       ctf_decode_cleanup();
       tracestring_clear();
       cur_match_line = -1;
       trace_enablectf(0);
+      filter_clear();
       tracelog_statusmsg(TRACESTATMSG_CTF, NULL, 0);
       ctf_error_notify(CTFERR_NONE, 0, NULL);
       if (opt_format == 1 && strlen(txtTSDLfile)> 0 && access(txtTSDLfile, 0) == 0) {
@@ -349,6 +567,7 @@ int main(void)
           const CTF_STREAM *stream;
           int seqnr;
           trace_enablectf(1);
+          filter_init(event_count());
           /* stream names overrule configured channel names */
           for (seqnr = 0; (stream = stream_by_seqnr(seqnr)) != NULL; seqnr++)
             if (stream->name != NULL && strlen(stream->name) > 0)
@@ -357,9 +576,17 @@ int main(void)
           ctf_parse_cleanup();
         }
       }
+      trace_unlock();
       reload_format = 0;
     }
 
+    if (reload_profile) {
+      trace_lock();
+      profile_init(txtELFfile);
+      trace_unlock();
+      reload_profile = 0;
+    }
+
     /* Input */
     nk_input_begin(ctx);
     if (!guidriver_poll(1))
@@ -369,10 +596,12 @@ int main(void)
     /* GUI */
     guidriver_appsize(&canvas_width, &canvas_height);
     if (nk_begin(ctx, "MainPanel", nk_rect(0, 0, canvas_width, canvas_height), 0)) {
-      int numrows, numcolumns, row, result;
+      int numrows, numcolumns, row, result, source;
+      unsigned long overruns;
+      float logheight;
       const char *ptr;
 
-      nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 6);
+      nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 8);
       nk_layout_row_push(ctx, 45);
       nk_label(ctx, "Mode", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
       nk_layout_row_push(ctx, 125);
@@ -393,6 +622,16 @@ int main(void)
         result = nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD | NK_EDIT_SIG_ENTER, bitrate_str, sizearray(bitrate_str), nk_filter_decimal);
         if ((result & NK_EDIT_COMMITED) != 0 || ((result & NK_EDIT_DEACTIVATED) && strtoul(bitrate_str, NULL, 10) != bitrate))
           reinitialize = 1;
+        nk_layout_row_push(ctx, 100);
+        result = opt_timestamps;
+        nk_checkbox_label(ctx, "Timestamps", &opt_timestamps);
+        if (opt_timestamps != result)
+          reinitialize = 1;
+        nk_layout_row_push(ctx, 100);
+        result = opt_formatter;
+        nk_checkbox_label(ctx, "Formatter", &opt_formatter);
+        if (opt_formatter != result)
+          reinitialize = 1;
       }
 
       nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 5);
@@ -406,7 +645,7 @@ int main(void)
       if (opt_format > 0) {
         nk_layout_row_push(ctx, 70);
         nk_label(ctx, "TSDL file", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
-        nk_layout_row_push(ctx, canvas_width - 309);
+        nk_layout_row_push(ctx, canvas_width - 364);
         result = nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD | NK_EDIT_SIG_ENTER, txtTSDLfile, sizearray(txtTSDLfile), nk_filter_ascii);
         if (result & (NK_EDIT_COMMITED | NK_EDIT_DEACTIVATED))
           reload_format = 1;
@@ -421,6 +660,11 @@ int main(void)
             free((void*)s);
           }
         }
+        nk_layout_row_push(ctx, 50);
+        if (nk_button_label(ctx, "Filter") && filter_count > 0) {
+          filter_popup = 1;
+          filter_verify = 1;
+        }
       }
       nk_layout_row_end(ctx);
 
@@ -450,7 +694,7 @@ int main(void)
               channelmask |= (1 << chan);
             else
               channelmask &= ~(1 << chan);
-            bmp_runscript("swo-channels", mcu_driver, &channelmask);
+            bmp_runscript(bmp, "swo-channels", mcu_driver, &channelmask);
           }
           nk_style_pop_color(ctx);
           nk_style_pop_color(ctx);
@@ -496,10 +740,60 @@ int main(void)
       nk_spacing(ctx, 1);
 
       tracestring_process(trace_running);
-      nk_layout_row_dynamic(ctx, canvas_height - 4.1 * ROW_HEIGHT - 1.25 * numrows * FONT_HEIGHT - 20, 1);
+      if (capture_state() == CAPTURE_FROZEN && !capture_saved) {
+        /* save the snapshot right away, for unattended captures */
+        if (strlen(capture_file) > 0 && !trace_savesnapshot(capture_file))
+          capture_error = "Failed to save the snapshot";
+        capture_saved = 1;
+      }
+      logheight = canvas_height - 4.1 * ROW_HEIGHT - 1.25 * numrows * FONT_HEIGHT - 20;
+      source = trace_sourcestate(&overruns);
+      if (source != TRACESRC_NORMAL || overruns > 0)
+        logheight -= FONT_HEIGHT + 4; /* room for the status line */
+      /* density strip: overview of the full trace, click to jump to a time */
+      nk_layout_row_dynamic(ctx, 2 * FONT_HEIGHT, 1);
+      result = tracedensity_widget(ctx);
+      if (result >= 0) {
+        cur_match_line = result;
+        trace_running = 0;
+      }
+      logheight -= 2 * FONT_HEIGHT + 4;
+      if (opt_graph) {
+        /* graph panel, with a selection for the event field to plot */
+        float graphheight = logheight / 3;
+        int reset = 0;
+        char label[2 * CTF_NAME_LENGTH];
+        nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.85, 0.15));
+        if (strlen(graph_event) > 0)
+          sprintf(label, "%s.%s", graph_event, graph_field);
+        else
+          strcpy(label, "(select a field)");
+        if (nk_combo_begin_label(ctx, label, nk_vec2(nk_widget_width(ctx), 10 * ROW_HEIGHT))) {
+          char event[CTF_NAME_LENGTH], field[CTF_NAME_LENGTH];
+          int idx;
+          nk_layout_row_dynamic(ctx, FONT_HEIGHT, 1);
+          trace_lock();
+          for (idx = 0; ctfstore_series(idx, event, sizearray(event), field, sizearray(field)); idx++) {
+            sprintf(label, "%s.%s", event, field);
+            if (nk_combo_item_label(ctx, label, NK_TEXT_LEFT)) {
+              strcpy(graph_event, event);
+              strcpy(graph_field, field);
+              reset = 1;
+            }
+          }
+          trace_unlock();
+          nk_combo_end(ctx);
+        }
+        if (nk_button_label(ctx, "Fit"))
+          reset = 1;
+        nk_layout_row_dynamic(ctx, graphheight, 1);
+        traceplot_widget(ctx, graph_event, graph_field, reset);
+        logheight -= graphheight + ROW_HEIGHT + 8;
+      }
+      nk_layout_row_dynamic(ctx, logheight, 1);
       tracelog_widget(ctx, "tracelog", FONT_HEIGHT, cur_match_line, NK_WINDOW_BORDER);
 
-      nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 7, nk_ratio(7, 0.19, 0.08, 0.19, 0.08, 0.19, 0.08, 0.19));
+      nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 17, nk_ratio(17, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088, 0.026, 0.088));
       ptr = trace_running ? "Stop" : tracestring_isempty() ? "Start" : "Resume";
       if (nk_button_label(ctx, ptr) || nk_input_is_key_pressed(&ctx->input, NK_KEY_F5)) {
         trace_running = !trace_running;
@@ -512,12 +806,22 @@ int main(void)
       nk_spacing(ctx, 1);
       if (nk_button_label(ctx, "Clear")) {
         tracestring_clear();
+        trace_lock();
+        profile_reset();
+        exctrace_reset();
+        trace_unlock();
         cur_match_line = -1;
       }
       nk_spacing(ctx, 1);
       if (nk_button_label(ctx, "Search") || nk_input_is_key_pressed(&ctx->input, NK_KEY_FIND))
         find_popup = 1;
       nk_spacing(ctx, 1);
+      if (nk_button_label(ctx, "Query"))
+        query_popup = 1;
+      nk_spacing(ctx, 1);
+      if (nk_button_label(ctx, "Graph"))
+        opt_graph = !opt_graph;
+      nk_spacing(ctx, 1);
       if (nk_button_label(ctx, "Save") || nk_input_is_key_pressed(&ctx->input, NK_KEY_SAVE)) {
         const char *s = noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                                              "CSV files\0*.csv\0All files\0*.*\0",
@@ -527,8 +831,31 @@ int main(void)
           free((void*)s);
         }
       }
-      //??? histogram, showing trace density
-      //??? show numeric traces in a graph
+      nk_spacing(ctx, 1);
+      if (nk_button_label(ctx, "Profile"))
+        profile_popup = 1;
+      nk_spacing(ctx, 1);
+      if (nk_button_label(ctx, "IRQs"))
+        exctrace_popup = 1;
+      nk_spacing(ctx, 1);
+      if (nk_button_label(ctx, "Capture"))
+        capture_popup = 1;
+
+      /* status line, when data was lost or the capture daemon quit */
+      if (source != TRACESRC_NORMAL || overruns > 0) {
+        if (source == TRACESRC_LOST)
+          strcpy(valstr, "Trace source lost: the capture daemon quit");
+        else if (source == TRACESRC_FALLBACK)
+          strcpy(valstr, "Capture daemon quit, reading from the probe");
+        else
+          valstr[0] = '\0';
+        if (overruns > 0)
+          sprintf(valstr + strlen(valstr), "%sData lost in the shared buffer (%lu overruns)",
+                  (valstr[0] != '\0') ? "; " : "", overruns);
+        nk_layout_row_dynamic(ctx, FONT_HEIGHT, 1);
+        nk_label_colored(ctx, valstr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE,
+                         (source == TRACESRC_LOST) ? nk_rgb(255, 100, 128) : nk_rgb(255, 255, 128));
+      }
 
       /* popup dialogs */
       if (find_popup > 0) {
@@ -571,6 +898,340 @@ int main(void)
           find_popup = 0;
         }
       }
+      if (query_popup) {
+        struct nk_rect rc;
+        rc.x = canvas_width - 420;
+        rc.y = canvas_height - 14.5 * ROW_HEIGHT;
+        rc.w = 400;
+        rc.h = 13 * ROW_HEIGHT;
+        if (nk_popup_begin(ctx, NK_POPUP_STATIC, "Query", 0, rc)) {
+          const char *head, *tail;
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.15, 0.85));
+          nk_label(ctx, "Query", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_edit_focus(ctx, 0);
+          nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD, query_text, sizearray(query_text), nk_filter_ascii);
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 3);
+          nk_spacing(ctx, 1);
+          if (nk_button_label(ctx, "Run") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ENTER)) {
+            if (strlen(query_text) > 0) {
+              trace_lock();
+              ctfstore_query(query_text, query_result, sizearray(query_result));
+              trace_unlock();
+            }
+          }
+          if (nk_button_label(ctx, "Close") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ESCAPE)) {
+            query_popup = 0;
+            nk_popup_close(ctx);
+          }
+          /* result, one label per line */
+          nk_layout_row_dynamic(ctx, FONT_HEIGHT, 1);
+          for (head = query_result; *head != '\0'; head = (*tail != '\0') ? tail + 1 : tail) {
+            char line[128];
+            size_t len;
+            tail = strchr(head, '\n');
+            if (tail == NULL)
+              tail = head + strlen(head);
+            len = tail - head;
+            if (len >= sizearray(line))
+              len = sizearray(line) - 1;
+            memcpy(line, head, len);
+            line[len] = '\0';
+            nk_label(ctx, line, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          }
+          nk_popup_end(ctx);
+        } else {
+          query_popup = 0;
+        }
+      }
+      if (filter_popup) {
+        struct nk_rect rc;
+        rc.x = canvas_width - 320;
+        rc.y = 2 * ROW_HEIGHT;
+        rc.w = 300;
+        rc.h = canvas_height - 4 * ROW_HEIGHT;
+        if (nk_popup_begin(ctx, NK_POPUP_STATIC, "Filter", 0, rc)) {
+          const CTF_EVENT *evt;
+          unsigned long ctrladdr;
+          int idx;
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.4, 0.6));
+          nk_label(ctx, "Control block", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          result = nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD | NK_EDIT_SIG_ENTER, ctrladdr_str, sizearray(ctrladdr_str), nk_filter_hex);
+          if (result & (NK_EDIT_COMMITED | NK_EDIT_DEACTIVATED))
+            filter_verify = 1;
+          if (filter_verify) {
+            /* (re-)read the control block from the target before any write */
+            ctrladdr = strtoul(ctrladdr_str, NULL, 16);
+            filter_attach(ctrladdr);
+            filter_verify = 0;
+          }
+          if (strlen(filter_error) > 0) {
+            nk_layout_row_dynamic(ctx, ROW_HEIGHT, 1);
+            nk_label_colored(ctx, filter_error, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, nk_rgb(255, 100, 128));
+          }
+          for (evt = event_next(NULL), idx = 0; filter_address != 0 && evt != NULL && idx < filter_count; evt = event_next(evt), idx++) {
+            int enabled = (filter_enabled[idx / 32] & (1UL << (idx % 32))) != 0;
+            int divider = filter_divider[idx];
+            nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.6, 0.4));
+            if (nk_checkbox_label(ctx, evt->name, &enabled)) {
+              if (enabled)
+                filter_enabled[idx / 32] |= (1UL << (idx % 32));
+              else
+                filter_enabled[idx / 32] &= ~(1UL << (idx % 32));
+              filter_update(idx);
+            }
+            divider = nk_propertyi(ctx, "#1/", 1, divider, 0xffff, 1, 1);
+            if (divider != filter_divider[idx]) {
+              filter_divider[idx] = (unsigned short)divider;
+              filter_update(idx);
+            }
+          }
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 3);
+          nk_spacing(ctx, 2);
+          if (nk_button_label(ctx, "Close") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ESCAPE)) {
+            filter_popup = 0;
+            nk_popup_close(ctx);
+          }
+          nk_popup_end(ctx);
+        } else {
+          filter_popup = 0;
+        }
+      }
+      if (profile_popup) {
+        struct nk_rect rc;
+        rc.x = canvas_width - 370;
+        rc.y = 2 * ROW_HEIGHT;
+        rc.w = 350;
+        rc.h = canvas_height - 4 * ROW_HEIGHT;
+        if (nk_popup_begin(ctx, NK_POPUP_STATIC, "Profile", 0, rc)) {
+          const PROFILE_ENTRY *list;
+          unsigned long total, actual;
+          int count, idx;
+          nk_layout_row_begin(ctx, NK_DYNAMIC, ROW_HEIGHT, 3);
+          nk_layout_row_push(ctx, 0.2f);
+          nk_label(ctx, "ELF file", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_layout_row_push(ctx, 0.7f);
+          result = nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD | NK_EDIT_SIG_ENTER, txtELFfile, sizearray(txtELFfile), nk_filter_ascii);
+          if (result & (NK_EDIT_COMMITED | NK_EDIT_DEACTIVATED))
+            reload_profile = 1;
+          nk_layout_row_push(ctx, 0.1f);
+          if (nk_button_image(ctx, btn_folder)) {
+            const char *s = noc_file_dialog_open(NOC_FILE_DIALOG_OPEN,
+                                                 "ELF Executables\0*.elf;*.\0All files\0*.*\0",
+                                                 NULL, NULL, NULL, guidriver_apphandle());
+            if (s != NULL && strlen(s) < sizearray(txtELFfile)) {
+              strcpy(txtELFfile, s);
+              reload_profile = 1;
+              free((void*)s);
+            }
+          }
+          nk_layout_row_end(ctx);
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.6, 0.4));
+          idx = (profile_interval >= 1024) ? 1024 : 64;  /* step size */
+          result = nk_propertyi(ctx, "#Interval (cycles)", 0, profile_interval, 16384, idx, (float)idx);
+          profile_dwtctrl(result, &actual);
+          if ((int)actual != profile_interval) {
+            unsigned long params[1];
+            profile_interval = (int)actual;
+            params[0] = profile_dwtctrl(profile_interval, NULL);
+            if (opt_mode > MODE_PASSIVE && bmp_isopen(bmp))
+              bmp_runscript(bmp, "swo-profile", mcu_driver, params);
+            trace_lock();
+            profile_reset();
+            trace_unlock();
+          }
+          trace_lock();
+          total = profile_total();
+          sprintf(valstr, "%lu samples", total);
+          nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 3, nk_ratio(3, 0.6, 0.2, 0.2));
+          nk_label(ctx, "Function", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Samples", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "%", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          count = profile_results(&list);
+          for (idx = 0; idx < count; idx++) {
+            nk_layout_row(ctx, NK_DYNAMIC, FONT_HEIGHT, 3, nk_ratio(3, 0.6, 0.2, 0.2));
+            nk_label(ctx, list[idx].name, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%lu", list[idx].count);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.1f", (total > 0) ? 100.0 * list[idx].count / total : 0.0);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          }
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 3);
+          nk_spacing(ctx, 1);
+          if (nk_button_label(ctx, "Reset"))
+            profile_reset();
+          trace_unlock();
+          if (nk_button_label(ctx, "Close") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ESCAPE)) {
+            profile_popup = 0;
+            nk_popup_close(ctx);
+          }
+          nk_popup_end(ctx);
+        } else {
+          profile_popup = 0;
+        }
+      }
+      if (capture_popup) {
+        struct nk_rect rc;
+        rc.x = canvas_width - 370;
+        rc.y = canvas_height - 10.5 * ROW_HEIGHT;
+        rc.w = 350;
+        rc.h = 9 * ROW_HEIGHT;
+        if (nk_popup_begin(ctx, NK_POPUP_STATIC, "Capture", NK_WINDOW_NO_SCROLLBAR, rc)) {
+          int state = capture_state();
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 2);
+          capture_pre = nk_propertyi(ctx, "#Pre (KiB)", 0, capture_pre, 65536, 64, 16.0f);
+          capture_post = nk_propertyi(ctx, "#Post (KiB)", 0, capture_post, 65536, 64, 16.0f);
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 2, nk_ratio(2, 0.25, 0.75));
+          nk_label(ctx, "Text", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD, capture_text, sizearray(capture_text), nk_filter_ascii);
+          if (opt_format > 0) {
+            nk_label(ctx, "CTF event", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+            nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD, capture_ctf, sizearray(capture_ctf), nk_filter_ascii);
+          }
+          nk_layout_row_begin(ctx, NK_DYNAMIC, ROW_HEIGHT, 3);
+          nk_layout_row_push(ctx, 0.25f);
+          nk_label(ctx, "Save to", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_layout_row_push(ctx, 0.65f);
+          nk_edit_string_zero_terminated(ctx, NK_EDIT_FIELD, capture_file, sizearray(capture_file), nk_filter_ascii);
+          nk_layout_row_push(ctx, 0.1f);
+          if (nk_button_image(ctx, btn_folder)) {
+            const char *s = noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                                                 "CSV files\0*.csv\0All files\0*.*\0",
+                                                 NULL, NULL, NULL, guidriver_apphandle());
+            if (s != NULL && strlen(s) < sizearray(capture_file)) {
+              strcpy(capture_file, s);
+              free((void*)s);
+            }
+          }
+          nk_layout_row_end(ctx);
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 1);
+          if (capture_error != NULL) {
+            nk_label_colored(ctx, capture_error, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, nk_rgb(255, 100, 128));
+          } else {
+            switch (state) {
+            case CAPTURE_OFF:
+              strcpy(valstr, "Off");
+              break;
+            case CAPTURE_ARMED:
+              strcpy(valstr, "Armed, waiting for trigger");
+              break;
+            case CAPTURE_TRIGGERED:
+              sprintf(valstr, "Triggered on %s", capture_reason());
+              break;
+            case CAPTURE_FROZEN:
+              sprintf(valstr, "Snapshot complete (%s)", capture_reason());
+              break;
+            }
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          }
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 3);
+          if (nk_button_label(ctx, (state == CAPTURE_ARMED || state == CAPTURE_TRIGGERED) ? "Disarm" : "Arm")) {
+            capture_error = NULL;
+            trace_lock();
+            if (state == CAPTURE_ARMED || state == CAPTURE_TRIGGERED) {
+              capture_disarm();
+            } else if (!capture_setup((unsigned long)capture_pre * 1024, (unsigned long)capture_post * 1024)) {
+              capture_error = "Insufficient memory for the capture";
+            } else if (!trace_settrigger_ctf((opt_format > 0) ? capture_ctf : NULL)) {
+              capture_error = "CTF event not found";
+            } else {
+              trace_settrigger_text(capture_text);
+              tracestring_clear();
+              capture_arm();
+              capture_saved = 0;
+              trace_running = 1;
+              cur_match_line = -1;
+            }
+            trace_unlock();
+          }
+          if (nk_button_label(ctx, "Trigger")) {
+            trace_lock();
+            capture_trigger("manual trigger");
+            trace_unlock();
+          }
+          if (nk_button_label(ctx, "Close") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ESCAPE)) {
+            capture_popup = 0;
+            nk_popup_close(ctx);
+          }
+          nk_popup_end(ctx);
+        } else {
+          capture_popup = 0;
+        }
+      }
+      if (exctrace_popup) {
+        struct nk_rect rc;
+        rc.x = (canvas_width > 560) ? canvas_width - 560 : 0;
+        rc.y = 2 * ROW_HEIGHT;
+        rc.w = (canvas_width > 540) ? 540 : canvas_width;
+        rc.h = canvas_height - 4 * ROW_HEIGHT;
+        if (nk_popup_begin(ctx, NK_POPUP_STATIC, "Exceptions", 0, rc)) {
+          unsigned long long elapsed;
+          double ticks_us;
+          int number;
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 1);
+          result = opt_exctrace;
+          nk_checkbox_label(ctx, "Exception trace", &opt_exctrace);
+          if (result != opt_exctrace) {
+            unsigned long params[1];
+            params[0] = opt_exctrace ? 0x10000 : 0; /* EXCTRCENA */
+            if (opt_mode > MODE_PASSIVE && bmp_isopen(bmp))
+              bmp_runscript(bmp, "swo-exctrace", mcu_driver, params);
+            trace_lock();
+            exctrace_reset();
+            trace_unlock();
+          }
+          /* timestamps count CPU cycles, so durations are converted to
+             micro-seconds using the CPU clock */
+          ticks_us = (cpuclock > 0) ? cpuclock / 1000000.0 : 1.0;
+          trace_lock();
+          elapsed = exctrace_elapsed();
+          nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 8, nk_ratio(8, 0.2, 0.12, 0.11, 0.11, 0.11, 0.08, 0.15, 0.12));
+          nk_label(ctx, "Exception", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Count", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Min", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Avg", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Max", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Nest", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Latency", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          nk_label(ctx, "Load %", NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          for (number = 1; number < EXC_NUMBERS; number++) {
+            const EXCSTATS *stats = exctrace_stats(number);
+            assert(stats != NULL);
+            if (stats->count == 0)
+              continue;
+            nk_layout_row(ctx, NK_DYNAMIC, FONT_HEIGHT, 8, nk_ratio(8, 0.2, 0.12, 0.11, 0.11, 0.11, 0.08, 0.15, 0.12));
+            nk_label(ctx, exctrace_name(number, valstr, sizearray(valstr)), NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%lu", stats->count);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.1f", stats->min / ticks_us);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.1f", (double)stats->total / stats->count / ticks_us);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.1f", stats->max / ticks_us);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%d", stats->max_nesting);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.1f", stats->max_preempt / ticks_us);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+            sprintf(valstr, "%.2f", (elapsed > 0) ? 100.0 * stats->total / elapsed : 0.0);
+            nk_label(ctx, valstr, NK_TEXT_ALIGN_RIGHT | NK_TEXT_ALIGN_MIDDLE);
+          }
+          nk_layout_row_dynamic(ctx, FONT_HEIGHT, 1);
+          nk_label(ctx, "Times in micro-seconds; durations exclude nested exceptions", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+          nk_layout_row_dynamic(ctx, ROW_HEIGHT, 3);
+          nk_spacing(ctx, 1);
+          if (nk_button_label(ctx, "Reset"))
+            exctrace_reset();
+          trace_unlock();
+          if (nk_button_label(ctx, "Close") || nk_input_is_key_pressed(&ctx->input, NK_KEY_ESCAPE)) {
+            exctrace_popup = 0;
+            nk_popup_close(ctx);
+          }
+          nk_popup_end(ctx);
+        } else {
+          exctrace_popup = 0;
+        }
+      }
 
     }
     nk_end(ctx);
@@ -593,20 +1254,33 @@ int main(void)
   ini_puts("Settings", "tsdl", txtTSDLfile, txtConfigFile);
   ini_puts("Settings", "mcu-freq", cpuclock_str, txtConfigFile);
   ini_puts("Settings", "bitrate", bitrate_str, txtConfigFile);
+  ini_puts("Settings", "ctrl-address", ctrladdr_str, txtConfigFile);
+  ini_puts("Settings", "elf", txtELFfile, txtConfigFile);
+  ini_putl("Settings", "profile-interval", profile_interval, txtConfigFile);
+  ini_putl("Settings", "exception-trace", opt_exctrace, txtConfigFile);
+  ini_putl("Settings", "timestamps", opt_timestamps, txtConfigFile);
+  ini_putl("Settings", "formatter", opt_formatter, txtConfigFile);
+  ini_putl("Capture", "pre-trigger", capture_pre, txtConfigFile);
+  ini_putl("Capture", "post-trigger", capture_post, txtConfigFile);
+  ini_puts("Capture", "text", capture_text, txtConfigFile);
+  ini_puts("Capture", "ctf-event", capture_ctf, txtConfigFile);
+  ini_puts("Capture", "file", capture_file, txtConfigFile);
+  ini_puts("Settings", "query", query_text, txtConfigFile);
+  ini_putl("Graph", "visible", opt_graph, txtConfigFile);
+  ini_puts("Graph", "event", graph_event, txtConfigFile);
+  ini_puts("Graph", "field", graph_field, txtConfigFile);
   sprintf(valstr, "%d %d", canvas_width, canvas_height);
   ini_puts("Settings", "size", valstr, txtConfigFile);
 
   trace_close();
   guidriver_close();
   tracestring_clear();
-  gdbrsp_packetsize(0);
   ctf_parse_cleanup();
   ctf_decode_cleanup();
-  if (rs232_isopen()) {
-    rs232_dtr(0);
-    rs232_rts(0);
-    rs232_close();
-  }
+  filter_clear();
+  profile_cleanup();
+  capture_cleanup();
+  bmp_destroy(bmp);
   return 0;
 }
 
@@ -0,0 +1,133 @@
+/*
+ * SWO capture daemon: it claims the trace interface of the Black Magic Probe
+ * and publishes the raw trace packets in a shared-memory ring, from which
+ * any number of viewers (bmtrace, bmdebug) can read them at the same time.
+ * The probe's trace interface can otherwise only be opened by a single
+ * process.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined WIN32 || defined _WIN32
+  #define STRICT
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include "sworing.h"
+#include "swousb.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+static void usage(void)
+{
+  printf("bmtraced - capture daemon for SWO tracing with the Black Magic Probe;\n"
+         "           it lets several viewers show the trace data at the same time.\n\n"
+         "Usage: bmtraced [options]\n\n"
+         "Options:\n"
+         "-s=slots Number of packets (of %d bytes) in the shared ring (default %d).\n"
+         "-v\t Verbose: print throughput statistics every few seconds.\n",
+         SWORING_PKTSIZE, SWORING_SLOTS);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char buffer[SWORING_PKTSIZE];
+  unsigned long slots = SWORING_SLOTS;
+  unsigned long packets = 0, bytes = 0;
+  double mark;
+  int idx, result, opt_verbose = 0;
+  char *ptr;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 's':
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        slots = strtoul(ptr, NULL, 0);
+        if (slots < 16) {
+          fprintf(stderr, "Invalid ring size %s; it must be at least 16.\n", ptr);
+          return 1;
+        }
+        break;
+      case 'v':
+        opt_verbose = 1;
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    }
+  }
+
+  result = swousb_open();
+  if (result != TRACESTAT_OK) {
+    fprintf(stderr, "Failed to open the trace interface of the Black Magic Probe (error %d).\n", result);
+    return 1;
+  }
+  if (!sworing_create((unsigned)slots)) {
+    fprintf(stderr, "Failed to create the shared ring; is another instance of bmtraced running?\n");
+    swousb_close();
+    return 1;
+  }
+
+  signal(SIGINT, sighandler);
+  signal(SIGTERM, sighandler);
+  printf("Capturing SWO trace data, press Ctrl+C to stop.\n");
+
+  mark = swousb_timestamp();
+  while (!quit) {
+    int numread = swousb_read(buffer, sizeof buffer);
+    if (numread > 0) {
+      sworing_write(buffer, numread, swousb_timestamp());
+      packets++;
+      bytes += numread;
+    } else if (numread < 0) {
+      #if defined WIN32 || defined _WIN32
+        Sleep(100);
+      #else
+        usleep(100 * 1000);
+      #endif
+    }
+    if (opt_verbose && swousb_timestamp() - mark >= 5.0) {
+      printf("%lu packets, %lu bytes\n", packets, bytes);
+      mark = swousb_timestamp();
+      packets = bytes = 0;
+    }
+  }
+
+  sworing_close();
+  swousb_close();
+  return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Trigger-based capture of the raw trace data: a "flight recorder" that keeps
+ * a bounded history of the trace packets before a trigger, plus a window of
+ * packets after the trigger, and then freezes. The memory use is fixed when
+ * the capture is set up, so that it may run unattended for a long time.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+
+#if !defined sizearray
+  #define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#endif
+
+typedef struct tagCAPTUREPKT {
+  double timestamp;
+  unsigned short length;
+  unsigned char data[CAPTURE_PKTSIZE];
+} CAPTUREPKT;
+
+static CAPTUREPKT *ring = NULL;
+static unsigned long ring_size = 0;   /* capacity, in packets */
+static unsigned long ring_head = 0;   /* index of the oldest packet */
+static unsigned long ring_count = 0;  /* number of packets in the ring */
+static unsigned long post_size = 0;   /* post-trigger window, in packets */
+static unsigned long post_count = 0;  /* packets received since the trigger */
+static int state = CAPTURE_OFF;
+static char reason[64] = "";
+
+/** capture_setup() allocates the buffer for the capture. The capture is
+ *  disarmed.
+ *  \param pretrigger   The amount of data to keep before the trigger, in
+ *                      bytes.
+ *  \param posttrigger  The amount of data to record after the trigger, in
+ *                      bytes.
+ *
+ *  \return 1 on success, 0 on failure (memory allocation error).
+ *
+ *  \note The sizes are rounded up to whole packets. Since packets are not
+ *        always full, the effective amount of data may be less.
+ */
+int capture_setup(unsigned long pretrigger, unsigned long posttrigger)
+{
+  unsigned long size;
+
+  capture_cleanup();
+  post_size = (posttrigger + CAPTURE_PKTSIZE - 1) / CAPTURE_PKTSIZE;
+  size = (pretrigger + CAPTURE_PKTSIZE - 1) / CAPTURE_PKTSIZE + post_size;
+  if (size == 0)
+    return 1;
+  ring = malloc(size * sizeof(CAPTUREPKT));
+  if (ring == NULL)
+    return 0;
+  ring_size = size;
+  return 1;
+}
+
+/** capture_cleanup() frees the capture buffer.
+ */
+void capture_cleanup(void)
+{
+  if (ring != NULL) {
+    free((void*)ring);
+    ring = NULL;
+  }
+  ring_size = ring_head = ring_count = 0;
+  post_size = post_count = 0;
+  state = CAPTURE_OFF;
+  reason[0] = '\0';
+}
+
+/** capture_arm() clears the buffer and starts recording, waiting for a
+ *  trigger.
+ */
+void capture_arm(void)
+{
+  ring_head = ring_count = 0;
+  post_count = 0;
+  reason[0] = '\0';
+  state = (ring != NULL) ? CAPTURE_ARMED : CAPTURE_OFF;
+}
+
+/** capture_disarm() stops the capture, but keeps the data in the buffer.
+ */
+void capture_disarm(void)
+{
+  state = CAPTURE_OFF;
+}
+
+/** capture_trigger() fires the trigger, if the capture is armed; it is
+ *  ignored in any other state.
+ *  \param description  The trigger condition, for display.
+ */
+void capture_trigger(const char *description)
+{
+  if (state != CAPTURE_ARMED)
+    return;
+  strncpy(reason, (description != NULL) ? description : "", sizearray(reason) - 1);
+  reason[sizearray(reason) - 1] = '\0';
+  post_count = 0;
+  state = (post_size > 0) ? CAPTURE_TRIGGERED : CAPTURE_FROZEN;
+}
+
+/** capture_state() returns one of the CAPTURE_xxx values.
+ */
+int capture_state(void)
+{
+  return state;
+}
+
+/** capture_reason() returns the description of the trigger that fired, or
+ *  an empty string if the trigger has not yet fired.
+ */
+const char *capture_reason(void)
+{
+  return reason;
+}
+
+/** capture_add() stores a trace packet in the buffer, if the capture is
+ *  armed or triggered.
+ *  \param data       The raw trace data.
+ *  \param length     The size of the packet, up to CAPTURE_PKTSIZE bytes.
+ *  \param timestamp  The timestamp of the packet.
+ *
+ *  \return 1 if the packet should be processed, 0 if the capture is frozen
+ *          (the packet falls outside the snapshot and must be dropped).
+ */
+int capture_add(const unsigned char *data, size_t length, double timestamp)
+{
+  CAPTUREPKT *pkt;
+
+  assert(data != NULL || length == 0);
+  if (state == CAPTURE_FROZEN)
+    return 0;
+  if (state == CAPTURE_OFF)
+    return 1;
+  assert(ring != NULL && ring_size > 0);
+  if (length > CAPTURE_PKTSIZE)
+    length = CAPTURE_PKTSIZE;
+  if (ring_count < ring_size) {
+    pkt = &ring[(ring_head + ring_count) % ring_size];
+    ring_count++;
+  } else {
+    pkt = &ring[ring_head];   /* overwrite the oldest packet */
+    ring_head = (ring_head + 1) % ring_size;
+  }
+  pkt->timestamp = timestamp;
+  pkt->length = (unsigned short)length;
+  memcpy(pkt->data, data, length);
+  if (state == CAPTURE_TRIGGERED && ++post_count >= post_size)
+    state = CAPTURE_FROZEN;
+  return 1;
+}
+
+/** capture_oldest() returns the timestamp of the oldest packet in the
+ *  buffer. Anything older than this has fallen out of the capture.
+ *
+ *  \return 1 on success, 0 if there is no capture or if the buffer is not
+ *          yet full.
+ */
+int capture_oldest(double *timestamp)
+{
+  assert(timestamp != NULL);
+  if (state == CAPTURE_OFF || ring_count < ring_size)
+    return 0;
+  *timestamp = ring[ring_head].timestamp;
+  return 1;
+}
+
+/** capture_save() writes the packets in the buffer to a file. Each packet is
+ *  stored as a line with the timestamp and the size, followed by the raw
+ *  bytes of the packet:
+ *      <timestamp> <length>\n<data>
+ *
+ *  \return 1 on success, 0 on failure.
+ */
+int capture_save(const char *filename)
+{
+  FILE *fp;
+  unsigned long idx;
+
+  assert(filename != NULL);
+  if ((fp = fopen(filename, "wb")) == NULL)
+    return 0;
+  for (idx = 0; idx < ring_count; idx++) {
+    const CAPTUREPKT *pkt = &ring[(ring_head + idx) % ring_size];
+    fprintf(fp, "%.6f %u\n", pkt->timestamp, pkt->length);
+    fwrite(pkt->data, 1, pkt->length, fp);
+  }
+  fclose(fp);
+  return 1;
+}
@@ -0,0 +1,51 @@
+/*
+ * Trigger-based capture of the raw trace data: a "flight recorder" that keeps
+ * a bounded history of the trace packets before a trigger, plus a window of
+ * packets after the trigger, and then freezes.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define CAPTURE_PKTSIZE 64  /* maximum size of a trace packet (USB transfer) */
+
+enum {
+  CAPTURE_OFF,
+  CAPTURE_ARMED,      /* recording, waiting for a trigger */
+  CAPTURE_TRIGGERED,  /* recording the post-trigger window */
+  CAPTURE_FROZEN,     /* snapshot complete, new data is dropped */
+};
+
+int  capture_setup(unsigned long pretrigger, unsigned long posttrigger);
+void capture_cleanup(void);
+void capture_arm(void);
+void capture_disarm(void);
+void capture_trigger(const char *reason);
+int  capture_state(void);
+const char *capture_reason(void);
+int  capture_add(const unsigned char *data, size_t length, double timestamp);
+int  capture_oldest(double *timestamp);
+int  capture_save(const char *filename);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _CAPTURE_H */
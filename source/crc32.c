@@ -1,4 +1,14 @@
-
+#include <stddef.h>
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+  #include <cpuid.h>
+  #include <immintrin.h>
+  #define CRC32_CLMUL_SUPPORT
+  #define TARGET_CLMUL  __attribute__((target("pclmul,ssse3")))
+#elif defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+  #define CRC32_CLMUL_SUPPORT
+  #define TARGET_CLMUL
+#endif
+#include "atomics.h"
 #include "crc32.h"
 
 /* CRC32 table is copied from the GDB source
@@ -71,22 +81,217 @@ static const unsigned long crc_table[256] =
   0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
+/* tables for slice-by-N; slice_table[k][b] is the CRC of byte b followed by
+   k zero bytes (so slice_table[0] is equal to crc_table) */
+static uint32_t slice_table[16][256];
+static volatile long tables_state = 0;  /* 0 = not built, 1 = being built, 2 = ready */
+static volatile long engine = -1;       /* only set after the tables are ready */
+
+/* make_tables() builds the slice-by-N tables, once. The CRC functions may be
+   called from several threads (e.g. gang programming), so the first thread
+   builds the tables and any other thread waits until they are ready. */
+static void make_tables(void)
+{
+  int k, b;
+
+  if (ATOMIC_LOAD(&tables_state) == 2)
+    return;
+  if (!ATOMIC_CAS(&tables_state, 0, 1)) {
+    while (ATOMIC_LOAD(&tables_state) != 2)
+      /* another thread is building the tables */;
+    return;
+  }
+  for (b = 0; b < 256; b++)
+    slice_table[0][b] = (uint32_t)crc_table[b];
+  for (k = 1; k < 16; k++)
+    for (b = 0; b < 256; b++) {
+      uint32_t c = slice_table[k - 1][b];
+      slice_table[k][b] = (c << 8) ^ (uint32_t)crc_table[c >> 24];
+    }
+  ATOMIC_STORE(&tables_state, 2);
+}
+
+static uint32_t crc32_byte(uint32_t crc, const unsigned char *data, size_t size)
+{
+  while (size--)
+    crc = (crc << 8) ^ (uint32_t)crc_table[((crc >> 24) ^ *data++) & 0xff];
+  return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *data, size_t size)
+{
+  uint32_t (*t)[256] = slice_table;
+
+  while (size >= 8) {
+    crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    crc = t[7][crc >> 24] ^ t[6][(crc >> 16) & 0xff] ^ t[5][(crc >> 8) & 0xff] ^ t[4][crc & 0xff]
+          ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    data += 8;
+    size -= 8;
+  }
+  return crc32_byte(crc, data, size);
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char *data, size_t size)
+{
+  uint32_t (*t)[256] = slice_table;
+
+  while (size >= 16) {
+    crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    crc = t[15][crc >> 24] ^ t[14][(crc >> 16) & 0xff] ^ t[13][(crc >> 8) & 0xff] ^ t[12][crc & 0xff]
+          ^ t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]]
+          ^ t[7][data[8]] ^ t[6][data[9]] ^ t[5][data[10]] ^ t[4][data[11]]
+          ^ t[3][data[12]] ^ t[2][data[13]] ^ t[1][data[14]] ^ t[0][data[15]];
+    data += 16;
+    size -= 16;
+  }
+  return crc32_byte(crc, data, size);
+}
+
+#if defined CRC32_CLMUL_SUPPORT
+
+static int has_clmul(void)
+{
+  #if defined _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) != 0 && (info[2] & (1 << 9)) != 0;
+  #else
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+      return 0;
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSSE3) != 0;
+  #endif
+}
+
+/* fold() multiplies the 128-bit polynomial in "x" by x^D modulo P, where the
+   constants in "k" are x^(D+64) mod P (high half) and x^D mod P (low half);
+   the result has 95 significant bits */
+TARGET_CLMUL static __m128i fold(__m128i x, __m128i k)
+{
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/* crc32_clmul() folds the data in blocks of 64 bytes with carry-less
+   multiplication. The CRC is MSB-first, so each 16-byte block is byte-swapped
+   to put the first byte in the highest bits of the register. The 128-bit
+   remainder is then reduced with the table. */
+TARGET_CLMUL static uint32_t crc32_clmul(uint32_t crc, const unsigned char *data, size_t size)
+{
+  const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  const __m128i k512 = _mm_set_epi32(0, (int)0x8833794c, 0, (int)0xe6228b11);  /* x^576, x^512 mod P */
+  const __m128i k128 = _mm_set_epi32(0, (int)0xc5b9cd4c, 0, (int)0xe8a45605);  /* x^192, x^128 mod P */
+  __m128i x0, x1, x2, x3;
+  unsigned char rem[16];
+
+  if (size < 64)
+    return crc32_slice8(crc, data, size);
+
+  /* the CRC is added to the first 32 bits of the data */
+  x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap);
+  x0 = _mm_xor_si128(x0, _mm_set_epi32((int)crc, 0, 0, 0));
+  x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap);
+  x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap);
+  x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap);
+  data += 64;
+  size -= 64;
+
+  while (size >= 64) {
+    x0 = _mm_xor_si128(fold(x0, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap));
+    x1 = _mm_xor_si128(fold(x1, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap));
+    x2 = _mm_xor_si128(fold(x2, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap));
+    x3 = _mm_xor_si128(fold(x3, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap));
+    data += 64;
+    size -= 64;
+  }
+
+  /* combine the four lanes into one, then fold any remaining 16-byte blocks */
+  x0 = _mm_xor_si128(fold(x0, k128), x1);
+  x0 = _mm_xor_si128(fold(x0, k128), x2);
+  x0 = _mm_xor_si128(fold(x0, k128), x3);
+  while (size >= 16) {
+    x0 = _mm_xor_si128(fold(x0, k128), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap));
+    data += 16;
+    size -= 16;
+  }
+
+  /* the CRC of the remainder (with zero initial value) gives R(x).x^32 mod P */
+  _mm_storeu_si128((__m128i*)rem, _mm_shuffle_epi8(x0, bswap));
+  crc = crc32_slice16(0, rem, sizeof rem);
+  return crc32_slice8(crc, data, size);
+}
+
+#endif /* CRC32_CLMUL_SUPPORT */
+
+/** crc32_setengine() selects the implementation of the CRC calculation. This
+ *  is only needed for testing and benchmarking; by default, the fastest
+ *  engine that the CPU supports is selected automatically.
+ *
+ *  \param eng    One of the CRC32_ENGINE_xxx values, or CRC32_ENGINE_AUTO to
+ *                select the fastest engine.
+ *
+ *  \return The engine that is selected. This is different from the requested
+ *          engine if the CPU does not support it.
+ */
+int crc32_setengine(int eng)
+{
+  make_tables();
+  #if defined CRC32_CLMUL_SUPPORT
+    if ((eng == CRC32_ENGINE_AUTO || eng == CRC32_ENGINE_CLMUL) && !has_clmul())
+      eng = CRC32_ENGINE_SLICE16;
+    if (eng == CRC32_ENGINE_AUTO)
+      eng = CRC32_ENGINE_CLMUL;
+  #else
+    if (eng == CRC32_ENGINE_AUTO || eng == CRC32_ENGINE_CLMUL)
+      eng = CRC32_ENGINE_SLICE16;
+  #endif
+  ATOMIC_STORE(&engine, eng);
+  return eng;
+}
+
+/** crc32_engine() returns the engine that is currently selected (see
+ *  crc32_setengine()).
+ */
+int crc32_engine(void)
+{
+  int eng = (int)ATOMIC_LOAD(&engine);
+  if (eng < 0)
+    eng = crc32_setengine(CRC32_ENGINE_AUTO);
+  return eng;
+}
+
 /** crc32()
- *  \param crc    The initial CRC, set to ~0 on the first call.
+ *  \param crc    The initial CRC, set to CRC32_INIT (~0) on the first call.
  *  \param data   The data block to calculate the CRC on.
  *  \param size   The size of the data block in bytes.
  *
  *  \return The updated CRC32 value.
  *
- *  \note This is a non-standard CRC32 implementation. It is designed such that
- *        you can call it iteratively in small blocks over a big buffer. On the
- *        first call, the value of the crc param is set to ~0, on every next
- *        call, it is set the the output of the previous call.
+ *  \note This is a non-standard CRC32 implementation (it is the variant that
+ *        GDB uses for the "qCRC" request). It is designed such that you can
+ *        call it iteratively in small blocks over a big buffer. On the first
+ *        call, the value of the crc param is set to ~0, on every next call, it
+ *        is set the the output of the previous call. The result does not
+ *        depend on how the data is split into blocks.
  */
-uint32_t crc32(uint32_t crc, const unsigned char *data, unsigned size)
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size)
 {
-  while (size--)
-    crc = (crc << 8) ^ crc_table[((crc >> 24) ^ *data++) & 0xff];
-  return crc;
+  /* the engine is stored after the tables are built, so when it is set, the
+     tables are ready */
+  int eng = (int)ATOMIC_LOAD(&engine);
+  if (eng < 0)
+    eng = crc32_setengine(CRC32_ENGINE_AUTO);
+  switch (eng) {
+  case CRC32_ENGINE_BYTE:
+    return crc32_byte(crc, data, size);
+  case CRC32_ENGINE_SLICE8:
+    return crc32_slice8(crc, data, size);
+#if defined CRC32_CLMUL_SUPPORT
+  case CRC32_ENGINE_CLMUL:
+    return crc32_clmul(crc, data, size);
+#endif
+  default:
+    return crc32_slice16(crc, data, size);
+  }
 }
 
@@ -1,7 +1,36 @@
+/*
+ * CRC32 calculation, in the (MSB-first) variant that GDB uses for the "qCRC"
+ * request. The implementation is selected at run time: a carry-less multiply
+ * (PCLMULQDQ) folding engine on CPUs that support it, or a slice-by-16 table
+ * lookup otherwise.
+ */
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
 #include <stdint.h>
 
 #if defined __cplusplus
-  extern "C"
+  extern "C" {
+#endif
+
+#define CRC32_INIT  (~(uint32_t)0)  /* initial value for a new CRC */
+
+enum {
+  CRC32_ENGINE_AUTO = -1,
+  CRC32_ENGINE_BYTE,    /* one table lookup per byte */
+  CRC32_ENGINE_SLICE8,  /* slice-by-8 */
+  CRC32_ENGINE_SLICE16, /* slice-by-16 */
+  CRC32_ENGINE_CLMUL,   /* carry-less multiply folding (x86) */
+};
+
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size);
+
+int crc32_setengine(int eng);
+int crc32_engine(void);
+
+#if defined __cplusplus
+  }
 #endif
-uint32_t crc32(uint32_t crc, const unsigned char *data, unsigned size);
 
+#endif /* _CRC32_H */
@@ -0,0 +1,238 @@
+/*
+ * Test and benchmark for the CRC32 engines. It first verifies that all
+ * engines give the same result as the byte-wise engine (which is the
+ * reference implementation), for block sizes and alignments around the
+ * block sizes of the engines, and for a calculation that is split into
+ * random blocks. It also verifies that the lazy initialization of the tables
+ * is safe when the first calls are made from several threads at once. Then
+ * it measures the throughput of each engine, for blocks from 64 bytes to
+ * 16 MiB.
+ *
+ * This utility uses POSIX threads and clocks, and is therefore only available
+ * for Linux (and other POSIX systems).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+
+
+#if !defined sizearray
+  #define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
+#endif
+
+#define CHECK_SIZE    70000
+#define BENCH_MAX     (16UL << 20)
+#define NUM_THREADS   8
+
+static const char *engine_names[] = { "byte", "slice8", "slice16", "clmul" };
+
+static unsigned char check_data[CHECK_SIZE];
+static volatile int threads_go = 0;
+
+static void *thread_crc(void *arg)
+{
+  while (!__atomic_load_n(&threads_go, __ATOMIC_ACQUIRE))
+    /* wait until all threads are started */;
+  *(uint32_t*)arg = crc32(CRC32_INIT, check_data, sizeof check_data);
+  return NULL;
+}
+
+/** check_threads() calls crc32() for the first time from several threads at
+ *  once, so that all of these race to initialize the tables.
+ *
+ *  \return The number of threads that returned a wrong CRC.
+ */
+static int check_threads(void)
+{
+  pthread_t threads[NUM_THREADS];
+  uint32_t results[NUM_THREADS], ref;
+  int idx, started, fails = 0;
+
+  for (started = 0; started < NUM_THREADS; started++)
+    if (pthread_create(&threads[started], NULL, thread_crc, &results[started]) != 0)
+      break;
+  __atomic_store_n(&threads_go, 1, __ATOMIC_RELEASE);
+  for (idx = 0; idx < started; idx++)
+    pthread_join(threads[idx], NULL);
+
+  crc32_setengine(CRC32_ENGINE_BYTE);
+  ref = crc32(CRC32_INIT, check_data, sizeof check_data);
+  crc32_setengine(CRC32_ENGINE_AUTO);
+  for (idx = 0; idx < started; idx++)
+    if (results[idx] != ref)
+      fails++;
+  printf("Concurrent initialization (%d threads): %s\n", started, (fails == 0) ? "ok" : "FAILED");
+  return fails;
+}
+
+/** check_engine() compares the results of an engine to those of the
+ *  byte-wise engine.
+ *
+ *  \return The number of mismatches.
+ */
+static int check_engine(int eng)
+{
+  uint32_t crc, ref, init;
+  size_t len, offs, pos, size;
+  int selected, fails = 0;
+
+  selected = crc32_setengine(eng);
+  if (selected != eng) {
+    printf("Engine %-8s not supported (uses %s)\n", engine_names[eng], engine_names[selected]);
+    return 0;
+  }
+
+  /* all sizes up to a few blocks of the largest engine, at odd alignments */
+  for (len = 0; len <= 2000; len++) {
+    for (offs = 0; offs < 3; offs++) {
+      init = (len & 1) ? CRC32_INIT : (uint32_t)rand();
+      crc32_setengine(eng);
+      crc = crc32(init, check_data + offs, len);
+      crc32_setengine(CRC32_ENGINE_BYTE);
+      ref = crc32(init, check_data + offs, len);
+      if (crc != ref)
+        fails++;
+    }
+  }
+
+  /* the result must not depend on how the data is split into blocks */
+  crc32_setengine(eng);
+  crc = CRC32_INIT;
+  for (pos = 0; pos < sizeof check_data; pos += size) {
+    size = rand() % 3000;
+    if (pos + size > sizeof check_data)
+      size = sizeof check_data - pos;
+    crc = crc32(crc, check_data + pos, size);
+  }
+  crc32_setengine(CRC32_ENGINE_BYTE);
+  if (crc != crc32(CRC32_INIT, check_data, sizeof check_data))
+    fails++;
+
+  printf("Engine %-8s %s\n", engine_names[eng], (fails == 0) ? "ok" : "FAILED");
+  return fails;
+}
+
+static double timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(void)
+{
+  unsigned char *data;
+  volatile uint32_t sink = 0;
+  size_t size, total, idx;
+  double start, stop;
+  int eng, rep;
+
+  data = malloc(BENCH_MAX);
+  if (data == NULL) {
+    fprintf(stderr, "Memory allocation failure.\n");
+    return;
+  }
+  for (idx = 0; idx < BENCH_MAX; idx++)
+    data[idx] = (unsigned char)((idx * 2654435761UL) >> 13);
+
+  printf("\n%-10s", "Size");
+  for (eng = 0; eng < (int)sizearray(engine_names); eng++)
+    printf("%10s", engine_names[eng]);
+  printf("   (GB/s)\n");
+  for (size = 64; size <= BENCH_MAX; size *= 4) {
+    printf("%-10lu", (unsigned long)size);
+    for (eng = 0; eng < (int)sizearray(engine_names); eng++) {
+      if (crc32_setengine(eng) != eng) {
+        printf("%10s", "-");
+        continue;
+      }
+      total = 0;
+      start = timestamp();
+      do {
+        for (rep = 0; rep < 16; rep++) {
+          sink ^= crc32(CRC32_INIT, data, size);
+          total += size;
+        }
+        stop = timestamp();
+      } while (stop - start < 0.2);
+      printf("%10.2f", total / (stop - start) / 1e9);
+    }
+    printf("\n");
+  }
+  crc32_setengine(CRC32_ENGINE_AUTO);
+  free(data);
+}
+
+static void usage(void)
+{
+  printf("crc32bench - verify the CRC32 engines against each other, and measure\n"
+         "             their throughput.\n\n"
+         "Usage: crc32bench [options]\n\n"
+         "Options:\n"
+         "-c\t Only run the checks, skip the benchmark.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int idx, eng, fails, opt_bench = 1;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 'c':
+        opt_bench = 0;
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+      return 1;
+    }
+  }
+
+  srand(1);
+  for (idx = 0; idx < CHECK_SIZE; idx++)
+    check_data[idx] = (unsigned char)rand();
+
+  /* this must be the first test, before any other call initializes the tables */
+  fails = check_threads();
+  for (eng = 0; eng < (int)sizearray(engine_names); eng++)
+    fails += check_engine(eng);
+  crc32_setengine(CRC32_ENGINE_AUTO);
+  if (crc32(CRC32_INIT, (const unsigned char*)"123456789", 9) != 0x0376e6e7) {
+    printf("Check value FAILED\n");
+    fails++;
+  }
+  if (fails > 0)
+    return 1;
+
+  if (opt_bench)
+    benchmark();
+  return 0;
+}
@@ -0,0 +1,1032 @@
+/*
+ * Columnar store for the decoded CTF events: one table per event type, with
+ * a typed column per field plus a timestamp column. The store has a small
+ * query language for filters and aggregates over the columns.
+ *
+ * The query syntax is:
+ *
+ *   aggregate [ "(" field [ "," bins ] ")" ] event [ "where" condition { "and" condition } ]
+ *
+ * where "aggregate" is one of count, min, max, avg, sum or hist; "bins" is
+ * the number of bins in the histogram (default 10); and a condition is
+ * "field operator value", with operator one of <, <=, >, >=, == (or =), !=.
+ * The value is a number, or a name for an enumeration field. The pseudo-field
+ * "time" refers to the timestamp of the event. Examples:
+ *
+ *   count adc_sample where value > 3000
+ *   avg(value) adc_sample where channel == 2 and time > 10.5
+ *   hist(value, 16) adc_sample
+ *
+ * Columns are scanned in blocks: each condition of the filter is applied to
+ * all rows of the block in a tight loop that sets a selection mask (which
+ * the compiler can vectorize), and the aggregate is then computed over the
+ * selected rows of the block.
+ *
+ * For plotting, every numeric column also has a pyramid of min/max values,
+ * where each level summarizes 16 entries of the level below. The pyramid
+ * is updated on every row that is added (in constant time), and it allows
+ * to get the range of the values between any two rows in logarithmic time.
+ * A plot thus needs only one such lookup per horizontal pixel, independent
+ * of the number of events in the visible range.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parsetsdl.h"
+#include "decodectf.h"
+#include "ctfstore.h"
+
+#if !defined sizearray
+  #define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define BLOCKSIZE       1024  /* number of rows per block, in a column scan */
+#define INITIAL_ROWS    1024
+#define MAX_CONDITIONS  8
+#define MAX_BINS        64
+#define COLUMN_TIME     (-1)  /* pseudo-column for the timestamp */
+#define LOD_SHIFT       4     /* each pyramid level summarizes 2^4 entries */
+#define LOD_LEVELS      5
+
+typedef struct tagCOLUMN {
+  char name[CTF_NAME_LENGTH];
+  int type;               /* CTFCOL_xxx */
+  void *data;             /* array of int64_t or double */
+  double *lodmin[LOD_LEVELS]; /* min/max pyramid */
+  double *lodmax[LOD_LEVELS];
+} COLUMN;
+
+typedef struct tagTABLE {
+  char name[CTF_NAME_LENGTH]; /* event name */
+  int numcolumns;
+  COLUMN columns[CTF_MAXFIELDS];
+  double *time;
+  size_t rows, capacity;
+  size_t stale;           /* rows at the start that are older than the capture */
+} TABLE;
+
+static TABLE *tables = NULL;
+static int numtables = 0;
+static int recent_table = -1;
+
+static TABLE *table_find(const char *name)
+{
+  int idx;
+
+  assert(name != NULL);
+  if (recent_table >= 0 && strcmp(tables[recent_table].name, name) == 0)
+    return &tables[recent_table];
+  for (idx = 0; idx < numtables; idx++) {
+    if (strcmp(tables[idx].name, name) == 0) {
+      recent_table = idx;
+      return &tables[idx];
+    }
+  }
+  return NULL;
+}
+
+static TABLE *table_create(const CTF_EVENT *event)
+{
+  const CTF_EVENT_FIELD *field;
+  TABLE *list, *table;
+
+  list = (TABLE*)realloc(tables, (numtables + 1) * sizeof(TABLE));
+  if (list == NULL)
+    return NULL;
+  tables = list;
+  table = &tables[numtables];
+  memset(table, 0, sizeof(TABLE));
+  strcpy(table->name, event->name);
+  for (field = event->field_root.next; field != NULL && table->numcolumns < CTF_MAXFIELDS; field = field->next) {
+    COLUMN *column = &table->columns[table->numcolumns++];
+    strcpy(column->name, field->name);
+    switch (field->type.typeclass) {
+    case CLASS_INTEGER:
+    case CLASS_ENUM:
+      column->type = CTFCOL_INT;
+      break;
+    case CLASS_FLOAT:
+      column->type = CTFCOL_FLOAT;
+      break;
+    default:
+      column->type = CTFCOL_NONE;
+    }
+  }
+  recent_table = numtables++;
+  return table;
+}
+
+static int table_grow(TABLE *table)
+{
+  size_t newcap = (table->capacity > 0) ? 2 * table->capacity : INITIAL_ROWS;
+  double *time;
+  int col, level;
+
+  time = (double*)realloc(table->time, newcap * sizeof(double));
+  if (time == NULL)
+    return 0;
+  table->time = time;
+  for (col = 0; col < table->numcolumns; col++) {
+    COLUMN *column = &table->columns[col];
+    void *data;
+    if (column->type == CTFCOL_NONE)
+      continue;
+    assert(sizeof(int64_t) == sizeof(double));
+    data = realloc(column->data, newcap * sizeof(double));
+    if (data == NULL)
+      return 0;
+    column->data = data;
+    for (level = 0; level < LOD_LEVELS; level++) {
+      size_t nodes = (newcap >> (LOD_SHIFT * (level + 1))) + 1;
+      data = realloc(column->lodmin[level], nodes * sizeof(double));
+      if (data == NULL)
+        return 0;
+      column->lodmin[level] = (double*)data;
+      data = realloc(column->lodmax[level], nodes * sizeof(double));
+      if (data == NULL)
+        return 0;
+      column->lodmax[level] = (double*)data;
+    }
+  }
+  table->capacity = newcap;
+  return 1;
+}
+
+static double column_value(const COLUMN *column, size_t row)
+{
+  if (column->type == CTFCOL_INT)
+    return (double)((const int64_t*)column->data)[row];
+  return ((const double*)column->data)[row];
+}
+
+static void lod_update(COLUMN *column, size_t row, double value)
+{
+  int level;
+
+  for (level = 0; level < LOD_LEVELS; level++) {
+    unsigned shift = LOD_SHIFT * (level + 1);
+    size_t node = row >> shift;
+    if ((row & (((size_t)1 << shift) - 1)) == 0) {
+      /* first entry in this node */
+      column->lodmin[level][node] = column->lodmax[level][node] = value;
+    } else {
+      if (value < column->lodmin[level][node])
+        column->lodmin[level][node] = value;
+      if (value > column->lodmax[level][node])
+        column->lodmax[level][node] = value;
+    }
+  }
+}
+
+/** lod_range() returns the minimum and maximum values of the rows from
+ *  "first" up to (but not including) "last". It uses the largest nodes of
+ *  the pyramid that fit in the range.
+ */
+static void lod_range(const COLUMN *column, size_t first, size_t last, double *min, double *max)
+{
+  double lo = DBL_MAX, hi = -DBL_MAX;
+
+  while (first < last) {
+    int level;
+    size_t span = 1;
+    for (level = LOD_LEVELS; level > 0; level--) {
+      span = (size_t)1 << (LOD_SHIFT * level);
+      if ((first & (span - 1)) == 0 && first + span <= last)
+        break;
+    }
+    if (level == 0) {
+      double v = column_value(column, first);
+      if (v < lo)
+        lo = v;
+      if (v > hi)
+        hi = v;
+      first += 1;
+    } else {
+      size_t node = first >> (LOD_SHIFT * level);
+      if (column->lodmin[level - 1][node] < lo)
+        lo = column->lodmin[level - 1][node];
+      if (column->lodmax[level - 1][node] > hi)
+        hi = column->lodmax[level - 1][node];
+      first += span;
+    }
+  }
+  *min = lo;
+  *max = hi;
+}
+
+/** ctfstore_add() adds a decoded event to the store.
+ *  \param event      The event definition.
+ *  \param timestamp  The timestamp of the event, in seconds. It is clamped to
+ *                    the timestamp of the previous row of the same event.
+ *  \param values     The values of the fields, in the order of the fields in
+ *                    the event definition (see msgstack_peekvalues()).
+ *  \param count      The number of entries in "values".
+ */
+void ctfstore_add(const CTF_EVENT *event, double timestamp, const CTF_VALUE *values, int count)
+{
+  TABLE *table;
+  size_t row;
+  int col;
+
+  assert(event != NULL);
+  table = table_find(event->name);
+  if (table == NULL && (table = table_create(event)) == NULL)
+    return;
+  if (table->rows >= table->capacity && !table_grow(table))
+    return;
+  row = table->rows;
+  /* the time column is searched with a bisection, so it must not go back in
+     time; the mapping of the target clock is refined while the capture runs,
+     and events without a clock field get the time of the host */
+  if (row > 0 && timestamp < table->time[row - 1])
+    timestamp = table->time[row - 1];
+  table->time[row] = timestamp;
+  for (col = 0; col < table->numcolumns; col++) {
+    COLUMN *column = &table->columns[col];
+    CTF_VALUE v;
+    if (values != NULL && col < count)
+      v = values[col];
+    else
+      v.i = 0;
+    if (column->type == CTFCOL_INT) {
+      ((int64_t*)column->data)[row] = v.i;
+      lod_update(column, row, (double)v.i);
+    } else if (column->type == CTFCOL_FLOAT) {
+      ((double*)column->data)[row] = v.f;
+      lod_update(column, row, v.f);
+    }
+  }
+  table->rows = row + 1;
+}
+
+/* table_compact() removes the stale rows at the start of the table, and
+   rebuilds the min/max pyramids for the remaining rows */
+static void table_compact(TABLE *table)
+{
+  size_t stale = table->stale;
+  size_t rows = table->rows - stale;
+  size_t row;
+  int col;
+
+  assert(stale <= table->rows);
+  memmove(table->time, table->time + stale, rows * sizeof(double));
+  for (col = 0; col < table->numcolumns; col++) {
+    COLUMN *column = &table->columns[col];
+    if (column->type == CTFCOL_NONE)
+      continue;
+    memmove(column->data, (double*)column->data + stale, rows * sizeof(double));
+    for (row = 0; row < rows; row++)
+      lod_update(column, row, column_value(column, row));
+  }
+  table->rows = rows;
+  table->stale = 0;
+}
+
+/** ctfstore_trim() removes the events that are older than a timestamp, from
+ *  the start of each table. This keeps the memory use bounded, when the
+ *  decoded strings are trimmed to the history of a capture. To avoid moving
+ *  the columns on every call, a table is only compacted when the events to
+ *  remove are a quarter of the table; until then, they remain in the store.
+ *
+ *  \param oldest   The timestamp of the oldest event to keep.
+ */
+void ctfstore_trim(double oldest)
+{
+  int idx;
+
+  for (idx = 0; idx < numtables; idx++) {
+    TABLE *table = &tables[idx];
+    while (table->stale < table->rows && table->time[table->stale] < oldest)
+      table->stale++;
+    if (table->stale > 0 && table->stale >= table->rows / 4)
+      table_compact(table);
+  }
+}
+
+/** ctfstore_clear() removes all events (and all tables) from the store.
+ */
+void ctfstore_clear(void)
+{
+  int idx, col, level;
+
+  for (idx = 0; idx < numtables; idx++) {
+    for (col = 0; col < tables[idx].numcolumns; col++) {
+      COLUMN *column = &tables[idx].columns[col];
+      if (column->data != NULL)
+        free(column->data);
+      for (level = 0; level < LOD_LEVELS; level++) {
+        if (column->lodmin[level] != NULL)
+          free((void*)column->lodmin[level]);
+        if (column->lodmax[level] != NULL)
+          free((void*)column->lodmax[level]);
+      }
+    }
+    if (tables[idx].time != NULL)
+      free((void*)tables[idx].time);
+  }
+  if (tables != NULL)
+    free((void*)tables);
+  tables = NULL;
+  numtables = 0;
+  recent_table = -1;
+}
+
+/** ctfstore_rows() returns the number of events of a type in the store.
+ */
+size_t ctfstore_rows(const char *event)
+{
+  const TABLE *table = table_find(event);
+  return (table != NULL) ? table->rows : 0;
+}
+
+
+/* ----- query parser ----- */
+
+enum {
+  AGG_COUNT,
+  AGG_MIN,
+  AGG_MAX,
+  AGG_AVG,
+  AGG_SUM,
+  AGG_HIST,
+};
+
+enum {
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_NEVER,   /* condition that no row satisfies (e.g. int == 2.5) */
+  OP_ALWAYS,
+};
+
+enum {
+  TOK_END,
+  TOK_NAME,
+  TOK_NUMBER,
+  TOK_OPERATOR,
+  TOK_PUNCT,
+  TOK_INVALID,
+};
+
+typedef struct tagLEXER {
+  const char *pos;
+  const char *start;      /* start of the current token */
+  int type;
+  char text[CTF_NAME_LENGTH];
+  double number;
+} LEXER;
+
+typedef struct tagCONDITION {
+  int column;             /* index of the column, or COLUMN_TIME */
+  int op;
+  int64_t ivalue;         /* for integer columns */
+  double fvalue;          /* for floating-point columns and the timestamp */
+} CONDITION;
+
+static int lex_next(LEXER *lex)
+{
+  const char *p = lex->pos;
+  size_t len;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+  lex->start = p;
+  lex->text[0] = '\0';
+  if (*p == '\0') {
+    lex->type = TOK_END;
+  } else if (isalpha((unsigned char)*p) || *p == '_') {
+    len = 0;
+    while (isalnum((unsigned char)p[len]) || p[len] == '_')
+      len++;
+    if (len >= sizearray(lex->text))
+      len = sizearray(lex->text) - 1;
+    memcpy(lex->text, p, len);
+    lex->text[len] = '\0';
+    while (isalnum((unsigned char)*p) || *p == '_')
+      p++;
+    lex->type = TOK_NAME;
+  } else if (isdigit((unsigned char)*p) || ((*p == '-' || *p == '+' || *p == '.') && (isdigit((unsigned char)p[1]) || p[1] == '.'))) {
+    char *end;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+      lex->number = (double)strtoull(p, &end, 16);
+    else
+      lex->number = strtod(p, &end);
+    p = end;
+    lex->type = TOK_NUMBER;
+  } else if (strchr("<>=!", *p) != NULL) {
+    len = (p[1] == '=') ? 2 : 1;
+    memcpy(lex->text, p, len);
+    lex->text[len] = '\0';
+    p += len;
+    lex->type = (strcmp(lex->text, "!") == 0) ? TOK_INVALID : TOK_OPERATOR;
+  } else if (*p == '(' || *p == ')' || *p == ',') {
+    lex->text[0] = *p++;
+    lex->text[1] = '\0';
+    lex->type = TOK_PUNCT;
+  } else {
+    lex->type = TOK_INVALID;
+  }
+  lex->pos = p;
+  return lex->type;
+}
+
+static int lex_punct(LEXER *lex, char c)
+{
+  return lex->type == TOK_PUNCT && lex->text[0] == c;
+}
+
+static int keyword(const char *text, const char *word)
+{
+  while (*text != '\0' && tolower((unsigned char)*text) == *word) {
+    text++;
+    word++;
+  }
+  return (*text == '\0' && *word == '\0');
+}
+
+static int column_find(const TABLE *table, const char *name)
+{
+  int col;
+  if (keyword(name, "time") || keyword(name, "timestamp"))
+    return COLUMN_TIME;
+  for (col = 0; col < table->numcolumns; col++)
+    if (strcmp(table->columns[col].name, name) == 0)
+      return col;
+  return -2;
+}
+
+/** enum_value() looks up the name of an enumeration constant for a field
+ *  of an event (in the parsed TSDL file).
+ */
+static int enum_value(const char *event, const char *field, const char *name, double *value)
+{
+  const CTF_EVENT *evt;
+  const CTF_EVENT_FIELD *fld;
+  const CTF_KEYVALUE *kv;
+
+  for (evt = event_next(NULL); evt != NULL && strcmp(evt->name, event) != 0; evt = event_next(evt))
+    /* nothing */;
+  if (evt == NULL)
+    return 0;
+  for (fld = evt->field_root.next; fld != NULL && strcmp(fld->name, field) != 0; fld = fld->next)
+    /* nothing */;
+  if (fld == NULL || fld->type.typeclass != CLASS_ENUM || fld->type.keys == NULL)
+    return 0;
+  for (kv = fld->type.keys->next; kv != NULL; kv = kv->next) {
+    if (strcmp(kv->name, name) == 0) {
+      *value = (double)kv->value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** condition_set() stores the comparison value for the condition in the
+ *  type of the column. For an integer column, a fractional value is
+ *  rounded such that the comparison keeps the same meaning.
+ */
+static void condition_set(CONDITION *cond, const TABLE *table, double value)
+{
+  cond->fvalue = value;
+  if (cond->column == COLUMN_TIME || table->columns[cond->column].type == CTFCOL_FLOAT)
+    return;
+  if (value == floor(value)) {
+    cond->ivalue = (int64_t)value;
+    return;
+  }
+  switch (cond->op) {
+  case OP_LT:
+  case OP_GE:
+    cond->ivalue = (int64_t)ceil(value);
+    break;
+  case OP_LE:
+  case OP_GT:
+    cond->ivalue = (int64_t)floor(value);
+    break;
+  case OP_EQ:
+    cond->op = OP_NEVER;
+    break;
+  case OP_NE:
+    cond->op = OP_ALWAYS;
+    break;
+  }
+}
+
+
+/* ----- column scan ----- */
+
+static void filter_int(const int64_t *col, size_t count, int op, int64_t value, unsigned char *mask)
+{
+  size_t i;
+  switch (op) {
+  case OP_LT:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] < value);
+    break;
+  case OP_LE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] <= value);
+    break;
+  case OP_GT:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] > value);
+    break;
+  case OP_GE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] >= value);
+    break;
+  case OP_EQ:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] == value);
+    break;
+  case OP_NE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] != value);
+    break;
+  }
+}
+
+static void filter_float(const double *col, size_t count, int op, double value, unsigned char *mask)
+{
+  size_t i;
+  switch (op) {
+  case OP_LT:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] < value);
+    break;
+  case OP_LE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] <= value);
+    break;
+  case OP_GT:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] > value);
+    break;
+  case OP_GE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] >= value);
+    break;
+  case OP_EQ:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] == value);
+    break;
+  case OP_NE:
+    for (i = 0; i < count; i++)
+      mask[i] &= (col[i] != value);
+    break;
+  }
+}
+
+/** block_filter() sets the selection mask for a block of rows.
+ */
+static void block_filter(const TABLE *table, const CONDITION *conds, int numconds,
+                         size_t start, size_t count, unsigned char *mask)
+{
+  int idx;
+
+  memset(mask, 1, count);
+  for (idx = 0; idx < numconds; idx++) {
+    const CONDITION *cond = &conds[idx];
+    if (cond->op == OP_ALWAYS)
+      continue;
+    if (cond->op == OP_NEVER) {
+      memset(mask, 0, count);
+      break;
+    }
+    if (cond->column == COLUMN_TIME)
+      filter_float(table->time + start, count, cond->op, cond->fvalue, mask);
+    else if (table->columns[cond->column].type == CTFCOL_INT)
+      filter_int((const int64_t*)table->columns[cond->column].data + start, count, cond->op, cond->ivalue, mask);
+    else
+      filter_float((const double*)table->columns[cond->column].data + start, count, cond->op, cond->fvalue, mask);
+  }
+}
+
+/** block_values() copies the values of a column for a block of rows, as
+ *  floating-point values.
+ */
+static const double *block_values(const TABLE *table, int column, size_t start, size_t count, double *buffer)
+{
+  const int64_t *src;
+  size_t i;
+
+  if (column == COLUMN_TIME)
+    return table->time + start;
+  if (table->columns[column].type == CTFCOL_FLOAT)
+    return (const double*)table->columns[column].data + start;
+  src = (const int64_t*)table->columns[column].data + start;
+  for (i = 0; i < count; i++)
+    buffer[i] = (double)src[i];
+  return buffer;
+}
+
+typedef struct tagSCANRESULT {
+  size_t count;
+  double sum, min, max;
+} SCANRESULT;
+
+static void scan_aggregate(const TABLE *table, const CONDITION *conds, int numconds, int column, SCANRESULT *result)
+{
+  unsigned char mask[BLOCKSIZE];
+  double buffer[BLOCKSIZE];
+  size_t start, i;
+
+  result->count = 0;
+  result->sum = 0.0;
+  result->min = DBL_MAX;
+  result->max = -DBL_MAX;
+  for (start = 0; start < table->rows; start += BLOCKSIZE) {
+    size_t count = table->rows - start;
+    unsigned blockcount = 0;
+    if (count > BLOCKSIZE)
+      count = BLOCKSIZE;
+    block_filter(table, conds, numconds, start, count, mask);
+    for (i = 0; i < count; i++)
+      blockcount += mask[i];
+    result->count += blockcount;
+    if (column != -2 && blockcount > 0) {
+      const double *v = block_values(table, column, start, count, buffer);
+      double sum = 0.0, min = result->min, max = result->max;
+      for (i = 0; i < count; i++) {
+        double x = v[i];
+        sum += mask[i] ? x : 0.0;
+        min = (mask[i] && x < min) ? x : min;
+        max = (mask[i] && x > max) ? x : max;
+      }
+      result->sum += sum;
+      result->min = min;
+      result->max = max;
+    }
+  }
+}
+
+static void scan_histogram(const TABLE *table, const CONDITION *conds, int numconds, int column,
+                           double low, double high, unsigned long *bins, int numbins)
+{
+  unsigned char mask[BLOCKSIZE];
+  double buffer[BLOCKSIZE];
+  double scale = (high > low) ? numbins / (high - low) : 0.0;
+  size_t start, i;
+
+  memset(bins, 0, numbins * sizeof(unsigned long));
+  for (start = 0; start < table->rows; start += BLOCKSIZE) {
+    size_t count = table->rows - start;
+    const double *v;
+    if (count > BLOCKSIZE)
+      count = BLOCKSIZE;
+    block_filter(table, conds, numconds, start, count, mask);
+    v = block_values(table, column, start, count, buffer);
+    for (i = 0; i < count; i++) {
+      if (mask[i]) {
+        int bin = (int)((v[i] - low) * scale);
+        if (bin >= numbins)
+          bin = numbins - 1;
+        bins[bin]++;
+      }
+    }
+  }
+}
+
+static void format_number(char *text, double value, int isint)
+{
+  if (isint && fabs(value) < 1e15)
+    sprintf(text, "%.0f", value);
+  else
+    sprintf(text, "%.6g", value);
+}
+
+/** ctfstore_query() runs a query on the store, see the top of this file for
+ *  the syntax.
+ *  \param query    The query text.
+ *  \param result   Is set to the result, or to an error message. The result
+ *                  may have multiple lines (for a histogram).
+ *  \param size     The size of the "result" buffer.
+ *
+ *  \return 1 on success, 0 on error.
+ */
+int ctfstore_query(const char *query, char *result, size_t size)
+{
+  static const char *aggnames[] = { "count", "min", "max", "avg", "sum", "hist" };
+  static const char *opnames[] = { "<", "<=", ">", ">=", "==", "!=" };
+  LEXER lex;
+  CONDITION conds[MAX_CONDITIONS];
+  char fieldname[CTF_NAME_LENGTH] = "";
+  char condfield[CTF_NAME_LENGTH];
+  char line[128], num1[32], num2[32];
+  const TABLE *table;
+  SCANRESULT res;
+  int agg, numbins = 10, column = -2, numconds = 0, isint, idx;
+
+  assert(query != NULL && result != NULL && size > 0);
+  *result = '\0';
+  memset(&lex, 0, sizeof lex);
+  lex.pos = query;
+
+  /* aggregate function, with optional field and bin count */
+  if (lex_next(&lex) != TOK_NAME) {
+    snprintf(result, size, "Expected an aggregate (count, min, max, avg, sum or hist)");
+    return 0;
+  }
+  for (agg = 0; agg < (int)sizearray(aggnames) && !keyword(lex.text, aggnames[agg]); agg++)
+    /* nothing */;
+  if (agg >= (int)sizearray(aggnames)) {
+    snprintf(result, size, "Unknown aggregate '%s'", lex.text);
+    return 0;
+  }
+  lex_next(&lex);
+  if (lex_punct(&lex, '(')) {
+    if (lex_next(&lex) != TOK_NAME) {
+      snprintf(result, size, "Expected a field name after '('");
+      return 0;
+    }
+    strcpy(fieldname, lex.text);
+    lex_next(&lex);
+    if (lex_punct(&lex, ',')) {
+      if (lex_next(&lex) != TOK_NUMBER || lex.number < 1 || lex.number > MAX_BINS) {
+        snprintf(result, size, "The number of bins must be between 1 and %d", MAX_BINS);
+        return 0;
+      }
+      numbins = (int)lex.number;
+      lex_next(&lex);
+    }
+    if (!lex_punct(&lex, ')')) {
+      snprintf(result, size, "Expected ')' near '%s'", lex.start);
+      return 0;
+    }
+    lex_next(&lex);
+  }
+  if (agg != AGG_COUNT && fieldname[0] == '\0') {
+    snprintf(result, size, "%s() needs a field name", aggnames[agg]);
+    return 0;
+  }
+
+  /* event */
+  if (lex.type == TOK_NUMBER) {
+    const CTF_EVENT *evt = event_by_id((int)lex.number);
+    table = (evt != NULL) ? table_find(evt->name) : NULL;
+  } else if (lex.type == TOK_NAME) {
+    table = table_find(lex.text);
+  } else {
+    snprintf(result, size, "Expected an event name");
+    return 0;
+  }
+  if (table == NULL) {
+    snprintf(result, size, "No events '%s' in the trace", lex.text);
+    return 0;
+  }
+  if (fieldname[0] != '\0') {
+    column = column_find(table, fieldname);
+    if (column == -2) {
+      snprintf(result, size, "Unknown field '%s' in event '%s'", fieldname, table->name);
+      return 0;
+    }
+    if (column >= 0 && table->columns[column].type == CTFCOL_NONE) {
+      snprintf(result, size, "Field '%s' is not numeric", fieldname);
+      return 0;
+    }
+  }
+
+  /* conditions */
+  lex_next(&lex);
+  if (lex.type == TOK_NAME && keyword(lex.text, "where")) {
+    do {
+      CONDITION *cond;
+      double value;
+      if (numconds >= MAX_CONDITIONS) {
+        snprintf(result, size, "Too many conditions");
+        return 0;
+      }
+      cond = &conds[numconds];
+      if (lex_next(&lex) != TOK_NAME) {
+        snprintf(result, size, "Expected a field name near '%s'", lex.start);
+        return 0;
+      }
+      cond->column = column_find(table, lex.text);
+      if (cond->column == -2 || (cond->column >= 0 && table->columns[cond->column].type == CTFCOL_NONE)) {
+        snprintf(result, size, "Unknown or non-numeric field '%s'", lex.text);
+        return 0;
+      }
+      strcpy(condfield, lex.text);  /* keep the name, for enum lookup */
+      if (lex_next(&lex) != TOK_OPERATOR) {
+        snprintf(result, size, "Expected an operator near '%s'", lex.start);
+        return 0;
+      }
+      for (cond->op = 0; cond->op < (int)sizearray(opnames) && strcmp(lex.text, opnames[cond->op]) != 0; cond->op++)
+        /* nothing */;
+      if (strcmp(lex.text, "=") == 0)
+        cond->op = OP_EQ;
+      if (cond->op >= (int)sizearray(opnames)) {
+        snprintf(result, size, "Unknown operator '%s'", lex.text);
+        return 0;
+      }
+      lex_next(&lex);
+      if (lex.type == TOK_NUMBER) {
+        value = lex.number;
+      } else if (lex.type == TOK_NAME && enum_value(table->name, condfield, lex.text, &value)) {
+        /* value was set */
+      } else {
+        snprintf(result, size, "Expected a value near '%s'", lex.start);
+        return 0;
+      }
+      condition_set(cond, table, value);
+      numconds++;
+      lex_next(&lex);
+    } while (lex.type == TOK_NAME && keyword(lex.text, "and"));
+  }
+  if (lex.type != TOK_END) {
+    snprintf(result, size, "Syntax error near '%s'", lex.start);
+    return 0;
+  }
+
+  /* run the query */
+  scan_aggregate(table, conds, numconds, column, &res);
+  isint = (column >= 0 && table->columns[column].type == CTFCOL_INT);
+  switch (agg) {
+  case AGG_COUNT:
+    snprintf(result, size, "count = %lu", (unsigned long)res.count);
+    break;
+  case AGG_MIN:
+  case AGG_MAX:
+  case AGG_SUM:
+    if (res.count == 0) {
+      snprintf(result, size, "%s(%s): no matching events", aggnames[agg], fieldname);
+    } else {
+      double value = (agg == AGG_MIN) ? res.min : (agg == AGG_MAX) ? res.max : res.sum;
+      format_number(num1, value, isint);
+      snprintf(result, size, "%s(%s) = %s  (%lu events)", aggnames[agg], fieldname, num1, (unsigned long)res.count);
+    }
+    break;
+  case AGG_AVG:
+    if (res.count == 0)
+      snprintf(result, size, "avg(%s): no matching events", fieldname);
+    else
+      snprintf(result, size, "avg(%s) = %.6g  (%lu events)", fieldname, res.sum / res.count, (unsigned long)res.count);
+    break;
+  case AGG_HIST: {
+    unsigned long bins[MAX_BINS];
+    double width;
+    size_t len;
+    if (res.count == 0) {
+      snprintf(result, size, "hist(%s): no matching events", fieldname);
+      break;
+    }
+    if (isint && res.max - res.min + 1 < numbins)
+      numbins = (int)(res.max - res.min + 1);   /* one bin per value */
+    scan_histogram(table, conds, numconds, column, res.min, isint ? res.max + 1 : res.max, bins, numbins);
+    width = ((isint ? res.max + 1 : res.max) - res.min) / numbins;
+    format_number(num1, res.min, isint);
+    format_number(num2, res.max, isint);
+    snprintf(result, size, "hist(%s): %lu events, range %s .. %s", fieldname, (unsigned long)res.count, num1, num2);
+    for (idx = 0; idx < numbins; idx++) {
+      double low = res.min + idx * width;
+      if (isint) {
+        double high = ceil(res.min + (idx + 1) * width) - 1;
+        format_number(num1, ceil(low), 1);
+        format_number(num2, high, 1);
+        if (ceil(low) >= high)
+          sprintf(line, "\n%s: %lu", num1, bins[idx]);
+        else
+          sprintf(line, "\n%s .. %s: %lu", num1, num2, bins[idx]);
+      } else {
+        sprintf(line, "\n%.6g .. %.6g: %lu", low, low + width, bins[idx]);
+      }
+      len = strlen(result);
+      if (len + strlen(line) < size)
+        strcpy(result + len, line);
+    }
+    break;
+  } /* case */
+  }
+  return 1;
+}
+
+
+/* ----- plotting ----- */
+
+/** ctfstore_series() returns the names of the event and the field of a
+ *  numeric column in the store.
+ *  \param index      The sequence number of the column, starting at 0.
+ *  \param event      Is set to the name of the event.
+ *  \param eventsize  The size of the "event" buffer.
+ *  \param field      Is set to the name of the field.
+ *  \param fieldsize  The size of the "field" buffer.
+ *
+ *  \return 1 on success, 0 if "index" is out of range.
+ */
+int ctfstore_series(int index, char *event, size_t eventsize, char *field, size_t fieldsize)
+{
+  int idx, col;
+
+  assert(event != NULL && eventsize > 0);
+  assert(field != NULL && fieldsize > 0);
+  for (idx = 0; idx < numtables; idx++) {
+    for (col = 0; col < tables[idx].numcolumns; col++) {
+      if (tables[idx].columns[col].type == CTFCOL_NONE)
+        continue;
+      if (index-- == 0) {
+        strncpy(event, tables[idx].name, eventsize);
+        event[eventsize - 1] = '\0';
+        strncpy(field, tables[idx].columns[col].name, fieldsize);
+        field[fieldsize - 1] = '\0';
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/** ctfstore_timerange() returns the timestamps of the first and the last
+ *  event of a type.
+ *  \return 1 on success, 0 if there are no events of this type.
+ */
+int ctfstore_timerange(const char *event, double *first, double *last)
+{
+  const TABLE *table = table_find(event);
+
+  assert(first != NULL && last != NULL);
+  if (table == NULL || table->rows == 0)
+    return 0;
+  *first = table->time[0];
+  *last = table->time[table->rows - 1];
+  return 1;
+}
+
+/* time_search() returns the first row with a timestamp at or after "time" */
+static size_t time_search(const TABLE *table, double time)
+{
+  size_t low = 0, high = table->rows;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (table->time[mid] < time)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/** ctfstore_plot() summarizes the values of a field in a time range, in a
+ *  number of bins of equal duration (typically one bin per pixel).
+ *  \param event    The name of the event.
+ *  \param field    The name of the field (which must be numeric).
+ *  \param start    The start of the time range.
+ *  \param end      The end of the time range.
+ *  \param bins     An array that is filled with the summary per bin.
+ *  \param count    The number of elements in the "bins" array.
+ *
+ *  \return The number of bins that hold at least one value.
+ */
+int ctfstore_plot(const char *event, const char *field, double start, double end,
+                  CTF_PLOTBIN *bins, int count)
+{
+  const TABLE *table;
+  const COLUMN *column;
+  size_t row;
+  int col, idx, valid;
+
+  assert(bins != NULL && count > 0);
+  memset(bins, 0, count * sizeof(CTF_PLOTBIN));
+  if ((table = table_find(event)) == NULL || (col = column_find(table, field)) < 0)
+    return 0;
+  column = &table->columns[col];
+  if (column->type == CTFCOL_NONE || end <= start)
+    return 0;
+  valid = 0;
+  row = time_search(table, start);
+  for (idx = 0; idx < count && row < table->rows; idx++) {
+    size_t next = time_search(table, start + (end - start) * (idx + 1) / count);
+    if (next > row) {
+      bins[idx].count = next - row;
+      lod_range(column, row, next, &bins[idx].min, &bins[idx].max);
+      bins[idx].first = column_value(column, row);
+      bins[idx].last = column_value(column, next - 1);
+      valid++;
+      row = next;
+    }
+  }
+  return valid;
+}
@@ -0,0 +1,54 @@
+/*
+ * Columnar store for the decoded CTF events: one table per event type, with
+ * a typed column per field plus a timestamp column. The store has a small
+ * query language for filters and aggregates over the columns.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _CTFSTORE_H
+#define _CTFSTORE_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+enum {
+  CTFCOL_NONE,    /* field is not stored (string or structure) */
+  CTFCOL_INT,     /* int64_t */
+  CTFCOL_FLOAT,   /* double */
+};
+
+typedef struct tagCTF_PLOTBIN {
+  size_t count;         /* number of events in the bin (other fields are invalid if 0) */
+  double min, max;      /* range of the values in the bin */
+  double first, last;   /* first and last value in the bin */
+} CTF_PLOTBIN;
+
+void   ctfstore_add(const CTF_EVENT *event, double timestamp, const CTF_VALUE *values, int count);
+void   ctfstore_clear(void);
+void   ctfstore_trim(double oldest);
+size_t ctfstore_rows(const char *event);
+int    ctfstore_query(const char *query, char *result, size_t size);
+
+int    ctfstore_series(int index, char *event, size_t eventsize, char *field, size_t fieldsize);
+int    ctfstore_timerange(const char *event, double *first, double *last);
+int    ctfstore_plot(const char *event, const char *field, double start, double end,
+                     CTF_PLOTBIN *bins, int count);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _CTFSTORE_H */
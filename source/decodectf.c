@@ -43,6 +43,9 @@ typedef struct tagTRACEMSG {
   uint16_t streamid;
   double timestamp;
   const char *message;
+  const CTF_EVENT *event;
+  CTF_VALUE *values;      /* decoded field values, for the columnar store */
+  int numvalues;
 } TRACEMSG;
 
 static const unsigned char magic[] = { 0xc1, 0x1f, 0xfc, 0xc1 };
@@ -62,6 +65,7 @@ static const CTF_EVENT *event = NULL;               /* event currently being par
 static const CTF_EVENT_FIELD *field = NULL;         /* field currently being parsed */
 static const CTF_CLOCK *clock;                      /* clock set for the stream */
 static double timestamp = 0.0;                      /* timestamp in the event header */
+static long stream_channel = -1;                    /* stream id in the packet header (-1 if none) */
 
 static unsigned char *cache = NULL;
 static size_t cache_size = 0;
@@ -71,12 +75,36 @@ static char *msgbuffer = NULL;
 static size_t msgbuffer_size = 0;
 static size_t msgbuffer_filled = 0;
 
+static CTF_VALUE fieldvalues[CTF_MAXFIELDS];       /* values of the fields of the current event */
+static int fieldcount = 0;
+
+static CTF_EVENT lost_event;                        /* built-in "lost events" event */
+static CTF_EVENT_FIELD lost_count;
+
 static TRACEMSG *msgstack = NULL;
 static size_t msgstack_size = 0;
 static size_t msgstack_head = 0;
 static size_t msgstack_tail = 0;
 
 
+/** event_lost() returns the built-in event for the "lost events" record,
+ *  which the buffered trace functions (by tracegen) transmit after a buffer
+ *  overflow. It is not declared in the TSDL file.
+ */
+static const CTF_EVENT *event_lost(int stream_id)
+{
+  if (lost_event.field_root.next == NULL) {
+    strlcpy(lost_event.name, "lost_events", sizearray(lost_event.name));
+    strlcpy(lost_count.name, "count", sizearray(lost_count.name));
+    lost_count.type.typeclass = CLASS_INTEGER;
+    lost_count.type.size = 32;
+    lost_count.type.base = 10;
+    lost_event.field_root.next = &lost_count;
+  }
+  lost_event.stream_id = stream_id;
+  return &lost_event;
+}
+
 static void cache_grow(size_t extra)
 {
   if (cache_filled + extra > cache_size) {
@@ -172,7 +200,7 @@ static void msgstack_grow(void)
     idx = 0;
     while (msgstack_head != msgstack_tail) {
       msgstack[idx++] = curstack[msgstack_head];
-      if (++msgstack_head > cursize)
+      if (++msgstack_head >= cursize)
         msgstack_head = 0;
     }
     msgstack_head = 0;
@@ -191,7 +219,9 @@ static void msgstack_clear(void)
   if (msgstack != NULL) {
     while (msgstack_head != msgstack_tail) {
       free((void*)(msgstack[msgstack_head].message));
-      if (++msgstack_head > msgstack_size)
+      if (msgstack[msgstack_head].values != NULL)
+        free((void*)(msgstack[msgstack_head].values));
+      if (++msgstack_head >= msgstack_size)
         msgstack_head = 0;
     }
     free((void*)msgstack);
@@ -208,7 +238,17 @@ static void msgstack_push(uint16_t streamid, double timestamp, const char *messa
   msgstack[msgstack_tail].streamid = streamid;
   msgstack[msgstack_tail].timestamp = timestamp;
   msgstack[msgstack_tail].message = strdup(message);
-  if (++msgstack_tail > msgstack_size)
+  msgstack[msgstack_tail].event = event;
+  msgstack[msgstack_tail].values = NULL;
+  msgstack[msgstack_tail].numvalues = 0;
+  if (fieldcount > 0) {
+    msgstack[msgstack_tail].values = (CTF_VALUE*)malloc(fieldcount * sizeof(CTF_VALUE));
+    if (msgstack[msgstack_tail].values != NULL) {
+      memcpy(msgstack[msgstack_tail].values, fieldvalues, fieldcount * sizeof(CTF_VALUE));
+      msgstack[msgstack_tail].numvalues = fieldcount;
+    }
+  }
+  if (++msgstack_tail >= msgstack_size)
     msgstack_tail = 0;
 }
 
@@ -229,7 +269,9 @@ int msgstack_pop(uint16_t *streamid, double *timestamp, char *message, size_t si
   if (message != NULL && size > 0)
     strlcpy(message, msgstack[msgstack_head].message, size);
   free((void*)(msgstack[msgstack_head].message));
-  if (++msgstack_head > msgstack_size)
+  if (msgstack[msgstack_head].values != NULL)
+    free((void*)(msgstack[msgstack_head].values));
+  if (++msgstack_head >= msgstack_size)
     msgstack_head = 0;
   return 1;
 }
@@ -252,6 +294,26 @@ int msgstack_peek(uint16_t *streamid, double *timestamp, const char **message)
   return 1;
 }
 
+/** msgstack_peekvalues() returns the event definition and the decoded field
+ *  values of the message at the head. The values are in the order of the
+ *  fields in the event: integers and enumerations are in the "i" member
+ *  of the CTF_VALUE union, floating-point values are in the "f" member,
+ *  other fields (strings, structures) are set to zero.
+ *  \return 1 on success, 0 on failure.
+ */
+int msgstack_peekvalues(const CTF_EVENT **event, const CTF_VALUE **values, int *count)
+{
+  if (msgstack_head == msgstack_tail)
+    return 0;
+  if (event != NULL)
+    *event = msgstack[msgstack_head].event;
+  if (values != NULL)
+    *values = msgstack[msgstack_head].values;
+  if (count != NULL)
+    *count = msgstack[msgstack_head].numvalues;
+  return 1;
+}
+
 static void str_reverse(char *str, int length)
 {
   char *tail;
@@ -422,11 +484,50 @@ static void format_field(const char *fieldname, const CTF_TYPE *type, const unsi
   } /* switch (typeclass) */
 }
 
+/** field_value() converts the raw data of a field to a value, for the
+ *  columnar store.
+ */
+static CTF_VALUE field_value(const CTF_TYPE *type, const unsigned char *data)
+{
+  CTF_VALUE v;
+
+  v.i = 0;
+  switch (type->typeclass) {
+  case CLASS_INTEGER:
+  case CLASS_ENUM:      /* the value of the enum's base type */
+    if (type->size >= 8 && type->size <= 64) {
+      uint64_t raw = 0;
+      memcpy(&raw, data, type->size / 8);
+      if ((type->flags & TYPEFLAG_SIGNED) && type->size < 64) {
+        unsigned shift = 64 - type->size;
+        v.i = (int64_t)(raw << shift) >> shift;   /* sign-extend */
+      } else {
+        v.i = (int64_t)raw;
+      }
+    }
+    break;
+  case CLASS_FLOAT:
+    if (type->size > 32) {
+      memcpy(&v.f, data, sizeof(double));
+    } else {
+      float f = 0;
+      memcpy(&f, data, sizeof(float));
+      v.f = f;
+    }
+    break;
+  }
+  return v;
+}
+
 int ctf_decode(const unsigned char *stream, size_t size, long channel)
 {
   size_t idx, len, result;
 
-  cache_reset();
+  /* the cache holds a partially received item from the previous call, so it
+     is not reset here (but in ctf_decode_reset()); likewise, a stream id that
+     was already decoded overrules the parameter */
+  if (state > STATE_GET_STREAMID && stream_channel >= 0)
+    channel = stream_channel;
   result = 0;
   idx = 0;
 
@@ -476,7 +577,7 @@ restart:
           len = pkt_header->header.magic_size / 8;
           if (idx + len > size)
             len = size - idx;
-          if (memcmp(stream, magic + cache_filled, len) == 0) {
+          if (memcmp(stream + idx, magic, len) == 0) {
             /* match, check whether this is still a patial match */
             if (len == pkt_header->header.magic_size / 8) {
               state++;  /* full match -> advance state & restart */
@@ -489,6 +590,7 @@ restart:
               return result; /* nothing to do further, wait for more bytes */
             }
           }
+          idx++;  /* no match at this position, continue scanning */
         }
       }
     }
@@ -510,6 +612,7 @@ restart:
     break;
 
   case STATE_GET_STREAMID:
+    stream_channel = -1;
     if (pkt_header->header.streamid_size == 0) {
       state++;
       assert(cache_filled == 0);
@@ -523,6 +626,7 @@ restart:
         memcpy((unsigned char*)&streamid, cache, cache_filled);
       memcpy((unsigned char*)&streamid + cache_filled, stream + idx, len);
       channel = (long)streamid; /* stream id in the header overrules the parameter */
+      stream_channel = channel;
       state++;
       idx += len;
       cache_reset();
@@ -565,9 +669,12 @@ restart:
       memcpy((unsigned char*)&id + cache_filled, stream + idx, len);
       /* get the event from the id */
       event = event_by_id(id);
+      if (event == NULL && id == CTF_EVENTID_LOST(evt_header->header.id_size))
+        event = event_lost((int)channel);
       if (event != NULL) {
         assert(msgbuffer_filled == 0);
         msgbuffer_append(event->name, -1);
+        fieldcount = 0;
         state++;
         idx += len;
         field = event->field_root.next;
@@ -666,6 +773,8 @@ restart:
     else
       msgbuffer_append(", ", 2);  /* next field */
     format_field(field->name, &field->type, cache);
+    if (fieldcount < CTF_MAXFIELDS)
+      fieldvalues[fieldcount++] = field_value(&field->type, cache);
     cache_reset();
     /* move to the next field */
     field = field->next;
@@ -676,7 +785,7 @@ restart:
       result += 1;  /* flag: one more trace message completed */
       state = STATE_SCAN_MAGIC;
     }
-    break;
+    goto restart;   /* continue with the next field or the next event */
   }
 
   return result;
@@ -19,11 +19,19 @@
 #ifndef _DECODECTF_H
 #define _DECODECTF_H
 
+#define CTF_MAXFIELDS 32  /* max. number of fields per event, for the columnar store */
+
+typedef union tagCTF_VALUE {
+  int64_t i;      /* integer and enumeration fields */
+  double f;       /* floating-point fields */
+} CTF_VALUE;
+
 int ctf_decode(const unsigned char *stream, size_t size, long channel);
 void ctf_decode_reset(void);
 void ctf_decode_cleanup(void);
 int msgstack_pop(uint16_t *streamid, double *timestamp, char *message, size_t size);
 int msgstack_peek(uint16_t *streamid, double *timestamp, const char **message);
+int msgstack_peekvalues(const struct tagCTF_EVENT **event, const CTF_VALUE **values, int *count);
 
 #endif /* _DECODECTF_H */
 
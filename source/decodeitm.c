@@ -0,0 +1,467 @@
+/*
+ * Streaming decoder for the ITM/DWT packet protocol, as it is transmitted
+ * over SWO (with the TPIU formatter bypassed). The decoder handles all packet
+ * types (synchronization, overflow, timestamps, extension, software and
+ * hardware source packets) and keeps its state across calls, so that packets
+ * may be split over USB transfers.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined __AVX2__
+  #include <immintrin.h>
+  #define ITM_SSE2
+  #define ITM_AVX2
+#elif defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define ITM_SSE2
+#endif
+#if defined _MSC_VER && defined ITM_SSE2
+  #include <intrin.h>
+#endif
+
+#include "decodeitm.h"
+
+#if !defined sizearray
+  #define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define HDR_CONT  0x80  /* payload uses continuation bits, low bits are the maximum size */
+
+typedef struct tagHDRINFO {
+  unsigned char type;
+  unsigned char size;
+} HDRINFO;
+
+enum {
+  STATE_HEADER,
+  STATE_PAYLOAD,
+};
+
+static HDRINFO hdr_table[256];
+static int hdr_table_valid = 0;
+
+static int state = STATE_HEADER;
+static ITMPACKET packet;
+static unsigned char payload_size;    /* (maximum) payload size of the current packet */
+static int zero_count = 0;            /* consecutive zero bytes, for synchronization */
+static unsigned long overflow_count = 0;
+
+
+/** hdr_table_build() sets up the lookup table for the packet header byte; each
+ *  entry holds the packet type and the payload size.
+ */
+static void hdr_table_build(void)
+{
+  static const unsigned char source_size[] = { 0, 1, 2, 4 };
+  int hdr;
+
+  for (hdr = 0; hdr < (int)sizearray(hdr_table); hdr++) {
+    HDRINFO *info = &hdr_table[hdr];
+    info->size = 0;
+    if ((hdr & 0x03) != 0) {
+      /* source packet */
+      info->size = source_size[hdr & 0x03];
+      if ((hdr & 0x04) == 0) {
+        info->type = ITMPKT_STIMULUS;
+      } else {
+        int disc = hdr >> 3;
+        if (disc == 0)
+          info->type = ITMPKT_EVENTCOUNTER;
+        else if (disc == 1)
+          info->type = ITMPKT_EXCEPTION;
+        else if (disc == 2)
+          info->type = ITMPKT_PCSAMPLE;
+        else if (disc >= 8 && disc < 16)
+          info->type = (disc & 1) ? ITMPKT_DATAADDR : ITMPKT_DATAPC;
+        else if (disc >= 16 && disc < 24)
+          info->type = ITMPKT_DATAVALUE;
+        else
+          info->type = ITMPKT_HARDWARE;
+      }
+    } else if (hdr == 0x00) {
+      info->type = ITMPKT_SYNC;       /* partial synchronization packet */
+    } else if (hdr == 0x70) {
+      info->type = ITMPKT_OVERFLOW;
+    } else if ((hdr & 0x0f) == 0x00) {
+      if ((hdr & 0x80) == 0) {
+        info->type = ITMPKT_LOCALTS;  /* format 2, timestamp in the header */
+      } else if ((hdr & 0xc0) == 0xc0) {
+        info->type = ITMPKT_LOCALTS;  /* format 1 */
+        info->size = HDR_CONT | 4;
+      } else {
+        info->type = ITMPKT_RESERVED;
+      }
+    } else if ((hdr & 0x0b) == 0x08) {
+      info->type = ITMPKT_EXTENSION;
+      if (hdr & 0x80)
+        info->size = HDR_CONT | 4;
+    } else if (hdr == 0x94) {
+      info->type = ITMPKT_GLOBALTS1;
+      info->size = HDR_CONT | 4;
+    } else if (hdr == 0xb4) {
+      info->type = ITMPKT_GLOBALTS2;
+      info->size = HDR_CONT | 6;
+    } else {
+      info->type = ITMPKT_RESERVED;
+    }
+  }
+  hdr_table_valid = 1;
+}
+
+/** packet_complete() decodes the fields of the packet from the header and the
+ *  raw payload.
+ */
+static void packet_complete(void)
+{
+  unsigned long long value;
+  int idx;
+
+  value = 0;
+  if (payload_size & HDR_CONT) {
+    for (idx = packet.size - 1; idx >= 0; idx--)
+      value = (value << 7) | (packet.payload[idx] & 0x7f);
+  } else {
+    for (idx = packet.size - 1; idx >= 0; idx--)
+      value = (value << 8) | packet.payload[idx];
+  }
+
+  packet.address = 0;
+  packet.flags = 0;
+  switch (packet.type) {
+  case ITMPKT_OVERFLOW:
+    overflow_count++;
+    break;
+  case ITMPKT_LOCALTS:
+    if (packet.header & 0x80)
+      packet.flags = (packet.header >> 4) & 0x03; /* TC field */
+    else
+      value = (packet.header >> 4) & 0x07;
+    break;
+  case ITMPKT_GLOBALTS1:
+    if (packet.size == 4) {
+      /* bits 5 and 6 of the last byte are flags, instead of timestamp bits */
+      packet.flags = (packet.payload[3] >> 5) & 0x03;
+      value &= 0x03ffffffUL;
+    }
+    break;
+  case ITMPKT_EXTENSION:
+    packet.flags = (packet.header >> 2) & 0x01;
+    value = (value << 3) | ((packet.header >> 4) & 0x07);
+    break;
+  case ITMPKT_STIMULUS:
+  case ITMPKT_EVENTCOUNTER:
+  case ITMPKT_PCSAMPLE:
+  case ITMPKT_HARDWARE:
+    packet.address = packet.header >> 3;
+    break;
+  case ITMPKT_EXCEPTION:
+    packet.address = packet.header >> 3;
+    packet.flags = (unsigned char)((value >> 12) & 0x03);
+    value &= 0x01ff;
+    break;
+  case ITMPKT_DATAPC:
+  case ITMPKT_DATAADDR:
+    packet.address = (packet.header >> 4) & 0x03;
+    break;
+  case ITMPKT_DATAVALUE:
+    packet.address = (packet.header >> 4) & 0x03;
+    packet.flags = (packet.header >> 3) & 0x01;
+    break;
+  }
+  packet.value = value;
+}
+
+/** decode_bytes() runs the decoder over the buffer, until either the buffer
+ *  is exhausted, or the maximum number of packets is decoded. It returns the
+ *  number of bytes consumed.
+ */
+static size_t decode_bytes(const unsigned char *buffer, size_t length, ITM_CALLBACK callback, void *arg,
+                           int maxpackets, int *count)
+{
+  size_t idx;
+
+  assert(count != NULL);
+  if (!hdr_table_valid)
+    hdr_table_build();
+
+  for (idx = 0; idx < length && *count < maxpackets; idx++) {
+    unsigned char byte = buffer[idx];
+
+    /* synchronization packet: at least 47 zero bits followed by a 1 bit; this
+       is checked in any state, so that the decoder re-synchronizes */
+    if (byte == 0) {
+      zero_count++;
+      if (state == STATE_HEADER)
+        continue;
+    } else {
+      if (byte == 0x80 && zero_count >= 5) {
+        zero_count = 0;
+        state = STATE_HEADER;
+        memset(&packet, 0, sizeof packet);
+        packet.type = ITMPKT_SYNC;
+        packet.header = byte;
+        callback(&packet, arg);
+        *count += 1;
+        continue;
+      }
+      zero_count = 0;
+    }
+
+    if (state == STATE_HEADER) {
+      const HDRINFO *info = &hdr_table[byte];
+      packet.type = info->type;
+      packet.header = byte;
+      packet.size = 0;
+      payload_size = info->size;
+      if (payload_size == 0) {
+        packet_complete();
+        callback(&packet, arg);
+        *count += 1;
+      } else {
+        state = STATE_PAYLOAD;
+      }
+    } else {
+      int done;
+      assert(state == STATE_PAYLOAD);
+      assert(packet.size < sizearray(packet.payload));
+      packet.payload[packet.size++] = byte;
+      if (payload_size & HDR_CONT)
+        done = (byte & 0x80) == 0 || packet.size >= (payload_size & ~HDR_CONT);
+      else
+        done = packet.size >= payload_size;
+      if (done) {
+        packet_complete();
+        callback(&packet, arg);
+        *count += 1;
+        state = STATE_HEADER;
+      }
+    }
+  }
+
+  return idx;
+}
+
+/** itm_decode() decodes a block of bytes from the SWO stream, and calls the
+ *  callback function for every complete packet.
+ *
+ *  \param buffer     The raw SWO data.
+ *  \param length     The number of bytes in the buffer.
+ *  \param callback   The function that receives the decoded packets.
+ *  \param arg        A user value that is passed to the callback.
+ *
+ *  \return The number of packets that were decoded.
+ *
+ *  \note A packet may be split over two consecutive calls. After data loss,
+ *        the decoder re-synchronizes on a synchronization packet.
+ */
+int itm_decode(const unsigned char *buffer, size_t length, ITM_CALLBACK callback, void *arg)
+{
+  int count = 0;
+
+  assert(buffer != NULL || length == 0);
+  assert(callback != NULL);
+  decode_bytes(buffer, length, callback, arg, INT_MAX, &count);
+  return count;
+}
+
+/** itm_decode_packet() decodes bytes from the SWO stream up to (and including)
+ *  the first complete packet, for which it calls the callback function.
+ *
+ *  \return The number of bytes consumed from the buffer.
+ */
+size_t itm_decode_packet(const unsigned char *buffer, size_t length, ITM_CALLBACK callback, void *arg)
+{
+  int count = 0;
+
+  assert(buffer != NULL || length == 0);
+  assert(callback != NULL);
+  return decode_bytes(buffer, length, callback, arg, 1, &count);
+}
+
+#if defined ITM_SSE2
+  #if defined _MSC_VER
+    static int ctz(unsigned long value)
+    {
+      unsigned long index;
+      _BitScanForward(&index, value);
+      return (int)index;
+    }
+  #else
+    #define ctz(v)  __builtin_ctz(v)
+  #endif
+#endif
+
+/** itm_demux() is the fast path for the common case of a stream with 1-byte
+ *  stimulus packets only (2-byte pairs with the port number in the header and
+ *  a data byte). It splits the longest sequence of these packets at the start
+ *  of the buffer into an array with port numbers and an array with the data
+ *  bytes.
+ *
+ *  \param buffer    The raw SWO data.
+ *  \param length    The number of bytes in the buffer.
+ *  \param ports     Is set to the port numbers; must have space for length/2
+ *                   bytes.
+ *  \param data      Is set to the data bytes; must have space for length/2
+ *                   bytes.
+ *
+ *  \return The number of packets stored in "ports" and "data". This is zero
+ *          if the buffer does not start with a 1-byte stimulus packet, or if
+ *          the decoder is halfway a packet; in that case, the next packet
+ *          must be handled with itm_decode_packet().
+ */
+size_t itm_demux(const unsigned char *buffer, size_t length, unsigned char *ports, unsigned char *data)
+{
+  size_t pairs = 0, idx = 0;
+
+  assert(buffer != NULL || length == 0);
+  assert(ports != NULL && data != NULL);
+  if (state != STATE_HEADER)
+    return 0;
+
+  #if defined ITM_AVX2
+    {
+      const __m256i hdrmask = _mm256_set1_epi16(0x0007);
+      const __m256i hdrmatch = _mm256_set1_epi16(0x0001);
+      const __m256i lowmask = _mm256_set1_epi16(0x00ff);
+      while (idx + 64 <= length) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(buffer + idx));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(buffer + idx + 32));
+        __m256i p, d;
+        unsigned m0 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v0, hdrmask), hdrmatch));
+        unsigned m1 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v1, hdrmask), hdrmatch));
+        if ((m0 & m1) != 0xffffffffu)
+          break;  /* handle the remainder with SSE2 */
+        /* pack the headers (shifted to the port numbers) and the data bytes;
+           the pack instruction works per 128-bit lane, so fix up the order */
+        p = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_and_si256(v0, lowmask), 3),
+                                _mm256_srli_epi16(_mm256_and_si256(v1, lowmask), 3));
+        d = _mm256_packus_epi16(_mm256_srli_epi16(v0, 8), _mm256_srli_epi16(v1, 8));
+        _mm256_storeu_si256((__m256i*)(ports + pairs), _mm256_permute4x64_epi64(p, 0xd8));
+        _mm256_storeu_si256((__m256i*)(data + pairs), _mm256_permute4x64_epi64(d, 0xd8));
+        idx += 64;
+        pairs += 32;
+      }
+    }
+  #endif
+  #if defined ITM_SSE2
+    {
+      const __m128i hdrmask = _mm_set1_epi16(0x0007);
+      const __m128i hdrmatch = _mm_set1_epi16(0x0001);
+      const __m128i lowmask = _mm_set1_epi16(0x00ff);
+      while (idx + 32 <= length) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(buffer + idx));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(buffer + idx + 16));
+        unsigned m0 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v0, hdrmask), hdrmatch));
+        unsigned m1 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v1, hdrmask), hdrmatch));
+        if ((m0 & m1) != 0xffff)
+          break;  /* handle the remainder with the scalar loop */
+        _mm_storeu_si128((__m128i*)(ports + pairs),
+                         _mm_packus_epi16(_mm_srli_epi16(_mm_and_si128(v0, lowmask), 3),
+                                          _mm_srli_epi16(_mm_and_si128(v1, lowmask), 3)));
+        _mm_storeu_si128((__m128i*)(data + pairs),
+                         _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8)));
+        idx += 32;
+        pairs += 16;
+      }
+    }
+  #endif
+  while (idx + 2 <= length && (buffer[idx] & 0x07) == 0x01) {
+    ports[pairs] = buffer[idx] >> 3;
+    data[pairs] = buffer[idx + 1];
+    idx += 2;
+    pairs++;
+  }
+
+  /* keep the synchronization detection in the scalar decoder consistent */
+  if (pairs > 0)
+    zero_count = (data[pairs - 1] == 0) ? 1 : 0;
+  return pairs;
+}
+
+/** itm_samerun() returns the number of bytes at the start of the array that
+ *  are equal to the first byte (e.g. packets for the same port).
+ */
+size_t itm_samerun(const unsigned char *bytes, size_t count)
+{
+  size_t idx = 0;
+
+  if (count == 0)
+    return 0;
+  #if defined ITM_SSE2
+    {
+      const __m128i first = _mm_set1_epi8((char)bytes[0]);
+      while (idx + 16 <= count) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(bytes + idx)), first));
+        if (mask != 0xffff)
+          return idx + ctz(~mask);
+        idx += 16;
+      }
+    }
+  #endif
+  while (idx < count && bytes[idx] == bytes[0])
+    idx++;
+  return idx;
+}
+
+/** itm_textrun() returns the number of bytes at the start of the array up to
+ *  the first CR, LF or zero byte.
+ */
+size_t itm_textrun(const unsigned char *bytes, size_t count)
+{
+  size_t idx = 0;
+
+  #if defined ITM_SSE2
+    {
+      const __m128i cr = _mm_set1_epi8('\r');
+      const __m128i lf = _mm_set1_epi8('\n');
+      const __m128i zero = _mm_setzero_si128();
+      while (idx + 16 <= count) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bytes + idx));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, zero));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0)
+          return idx + ctz(mask);
+        idx += 16;
+      }
+    }
+  #endif
+  while (idx < count && bytes[idx] != '\r' && bytes[idx] != '\n' && bytes[idx] != 0)
+    idx++;
+  return idx;
+}
+
+/** itm_decode_reset() drops any partially received packet and clears the
+ *  overflow counter.
+ */
+void itm_decode_reset(void)
+{
+  state = STATE_HEADER;
+  zero_count = 0;
+  overflow_count = 0;
+}
+
+/** itm_overflows() returns the number of overflow packets received since the
+ *  most recent reset.
+ */
+unsigned long itm_overflows(void)
+{
+  return overflow_count;
+}
@@ -0,0 +1,80 @@
+/*
+ * Streaming decoder for the ITM/DWT packet protocol, as it is transmitted
+ * over SWO (with the TPIU formatter bypassed).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _DECODEITM_H
+#define _DECODEITM_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+enum {
+  ITMPKT_SYNC,
+  ITMPKT_OVERFLOW,
+  ITMPKT_LOCALTS,       /* local timestamp, "flags" holds the TC field */
+  ITMPKT_GLOBALTS1,     /* global timestamp, low bits; "flags" holds ClkCh & Wrap */
+  ITMPKT_GLOBALTS2,     /* global timestamp, high bits */
+  ITMPKT_EXTENSION,     /* "flags" holds the SH bit */
+  ITMPKT_RESERVED,
+  ITMPKT_STIMULUS,      /* software source, "address" is the stimulus port */
+  ITMPKT_EVENTCOUNTER,  /* hardware source, discriminator 0 */
+  ITMPKT_EXCEPTION,     /* hardware source, discriminator 1; "flags" holds the function */
+  ITMPKT_PCSAMPLE,      /* hardware source, discriminator 2; size 1 = sleep */
+  ITMPKT_DATAPC,        /* data trace PC value, "address" is the comparator */
+  ITMPKT_DATAADDR,      /* data trace address offset, "address" is the comparator */
+  ITMPKT_DATAVALUE,     /* data trace value, "address" is the comparator; "flags" is 1 for write */
+  ITMPKT_HARDWARE,      /* other hardware source packet, "address" is the discriminator */
+};
+
+/* exception trace functions (ITMPKT_EXCEPTION) */
+enum {
+  ITMEXC_ENTER = 1,
+  ITMEXC_EXIT,
+  ITMEXC_RETURN,
+};
+
+/* flags for the global timestamp (ITMPKT_GLOBALTS1) */
+#define ITMGTS_CLKCH  0x01  /* system clock changed */
+#define ITMGTS_WRAP   0x02  /* high order bits of the timestamp changed */
+
+typedef struct tagITMPACKET {
+  unsigned char type;       /* one of the ITMPKT_xxx values */
+  unsigned char header;     /* raw header byte */
+  unsigned char address;    /* stimulus port, discriminator or comparator */
+  unsigned char flags;      /* packet-type specific */
+  unsigned char size;       /* payload size in bytes (raw) */
+  unsigned char payload[7]; /* raw payload */
+  unsigned long long value; /* decoded value (payload in Little Endian, continuation bits removed) */
+} ITMPACKET;
+
+typedef void (*ITM_CALLBACK)(const ITMPACKET *packet, void *arg);
+
+int  itm_decode(const unsigned char *buffer, size_t length, ITM_CALLBACK callback, void *arg);
+size_t itm_decode_packet(const unsigned char *buffer, size_t length, ITM_CALLBACK callback, void *arg);
+void itm_decode_reset(void);
+unsigned long itm_overflows(void);
+
+size_t itm_demux(const unsigned char *buffer, size_t length, unsigned char *ports, unsigned char *data);
+size_t itm_samerun(const unsigned char *bytes, size_t count);
+size_t itm_textrun(const unsigned char *bytes, size_t count);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _DECODEITM_H */
@@ -0,0 +1,250 @@
+/*
+ * Decoder for the frames of the TPIU formatter, which multiplexes several
+ * trace sources (ITM, ETM) into a single stream of 16-byte frames. Each
+ * frame holds 15 data bytes and an auxiliary byte. The bytes at even
+ * positions are either an ID change (bit 0 set) or a data byte whose bit 0
+ * is stored in the auxiliary byte; the bytes at odd positions are always
+ * data. Frames are aligned on the full synchronization packet (FF FF FF 7F)
+ * that the formatter inserts in continuous mode; the decoder searches for it
+ * at start-up, and again after it detects an invalid frame.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define TPIU_SSE2
+#endif
+
+#include "decodetpiu.h"
+
+#if !defined sizearray
+  #define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define ID_RESERVED 0x7f    /* used in the half-synchronization packet (FF 7F) */
+
+static unsigned char frame[TPIU_FRAMESIZE];
+static unsigned frame_len = 0;
+static unsigned sync_len = 0;     /* number of bytes of a full sync matched while searching */
+static int synchronized = 0;
+static unsigned current_id = TPIU_ID_NULL;
+static unsigned long syncerrors = 0;
+
+/* the data of consecutive frames for the same source is collected, so that
+   the callback is invoked for runs of bytes, rather than per frame */
+static unsigned char run[256];
+static size_t run_len = 0;
+static unsigned run_id = TPIU_ID_NULL;
+
+static void run_flush(TPIU_CALLBACK callback, void *arg)
+{
+  if (run_len > 0) {
+    if (run_id != TPIU_ID_NULL)
+      callback(run_id, run, run_len, arg);
+    run_len = 0;
+  }
+}
+
+static void run_add(unsigned id, const unsigned char *data, size_t length, TPIU_CALLBACK callback, void *arg)
+{
+  if (id != run_id || run_len + length > sizearray(run)) {
+    run_flush(callback, arg);
+    run_id = id;
+  }
+  memcpy(run + run_len, data, length);
+  run_len += length;
+}
+
+/** frame_plain() handles the common case of a frame without ID changes: all
+ *  15 bytes are data for the current source. Returns 0 if the frame holds an
+ *  ID change, in which case it must be handled by frame_decode().
+ */
+static int frame_plain(const unsigned char *f, TPIU_CALLBACK callback, void *arg)
+{
+  unsigned char data[TPIU_FRAMESIZE];
+
+  #if defined TPIU_SSE2
+    {
+      const __m128i auxbits = _mm_setr_epi8(1, 0, 2, 0, 4, 0, 8, 0, 16, 0, 32, 0, 64, 0, -128, 0);
+      const __m128i evenlsb = _mm_setr_epi8(1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0);
+      __m128i v = _mm_loadu_si128((const __m128i*)f);
+      __m128i aux, lsb;
+      /* bit 0 of every byte to bit 7, so that movemask collects them */
+      if ((_mm_movemask_epi8(_mm_slli_epi16(v, 7)) & 0x5555) != 0)
+        return 0;
+      /* spread the auxiliary bits over the even bytes (whose bit 0 is
+         already zero, because they are not ID changes) */
+      aux = _mm_set1_epi8((char)f[TPIU_FRAMESIZE - 1]);
+      lsb = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(aux, auxbits), auxbits), evenlsb);
+      _mm_storeu_si128((__m128i*)data, _mm_or_si128(v, lsb));
+    }
+  #else
+    {
+      unsigned idx, aux = f[TPIU_FRAMESIZE - 1];
+      for (idx = 0; idx < TPIU_FRAMESIZE - 1; idx += 2)
+        if (f[idx] & 0x01)
+          return 0;
+      for (idx = 0; idx < TPIU_FRAMESIZE - 1; idx += 2) {
+        data[idx] = (unsigned char)(f[idx] | ((aux >> (idx / 2)) & 0x01));
+        data[idx + 1] = f[idx + 1];
+      }
+    }
+  #endif
+  run_add(current_id, data, TPIU_FRAMESIZE - 1, callback, arg);
+  return 1;
+}
+
+/** frame_decode() handles a frame with ID changes. Returns 0 if the frame is
+ *  invalid (which means that frame synchronization is lost).
+ */
+static int frame_decode(const unsigned char *f, TPIU_CALLBACK callback, void *arg)
+{
+  unsigned k, aux = f[TPIU_FRAMESIZE - 1];
+
+  for (k = 0; k < TPIU_FRAMESIZE / 2; k++) {
+    unsigned char b = f[2 * k];
+    int last = (k == TPIU_FRAMESIZE / 2 - 1); /* byte 14 has no odd byte after it */
+    unsigned auxbit = (aux >> k) & 0x01;
+    if (b & 0x01) {
+      unsigned id = b >> 1;
+      if (id == ID_RESERVED) {
+        if (!last && f[2 * k + 1] == 0x7f)
+          continue;   /* half-sync, padding */
+        return 0;
+      }
+      /* the auxiliary bit tells whether the byte after the ID change still
+         belongs to the previous source */
+      if (!last && auxbit)
+        run_add(current_id, f + 2 * k + 1, 1, callback, arg);
+      current_id = id;
+      if (!last && !auxbit)
+        run_add(current_id, f + 2 * k + 1, 1, callback, arg);
+    } else {
+      b |= (unsigned char)auxbit;
+      run_add(current_id, &b, 1, callback, arg);
+      if (!last)
+        run_add(current_id, f + 2 * k + 1, 1, callback, arg);
+    }
+  }
+  return 1;
+}
+
+static int frame_handle(const unsigned char *f, TPIU_CALLBACK callback, void *arg)
+{
+  if (frame_plain(f, callback, arg) || frame_decode(f, callback, arg))
+    return 1;
+  /* invalid frame, search for the next full sync */
+  synchronized = 0;
+  sync_len = 0;
+  current_id = TPIU_ID_NULL;
+  syncerrors++;
+  return 0;
+}
+
+/** tpiu_decode() decodes a buffer with TPIU formatter frames, and calls the
+ *  callback function with the data for each trace source.
+ *
+ *  \param buffer   The raw trace data.
+ *  \param length   The number of bytes in the buffer.
+ *  \param callback The function that receives the data; it is called with
+ *                  runs of bytes for the same trace source ID. Data for the
+ *                  null source (ID 0) is discarded.
+ *  \param arg      A user value passed on to the callback.
+ *
+ *  \return The number of frames that were decoded.
+ *
+ *  \note A frame may be split over two consecutive calls. Full sync packets
+ *        between frames are skipped.
+ */
+int tpiu_decode(const unsigned char *buffer, size_t length, TPIU_CALLBACK callback, void *arg)
+{
+  int count = 0;
+  size_t pos = 0;
+
+  assert(buffer != NULL || length == 0);
+  assert(callback != NULL);
+  while (pos < length) {
+    if (!synchronized) {
+      /* full sync is FF FF FF 7F (the trailing FF bytes may be longer) */
+      unsigned char b = buffer[pos++];
+      if (b == 0xff) {
+        sync_len++;
+      } else if (b == 0x7f && sync_len >= 3) {
+        synchronized = 1;
+        frame_len = 0;
+      } else {
+        sync_len = 0;
+      }
+      continue;
+    }
+    if (frame_len == 0) {
+      /* fast path: complete frames straight from the buffer */
+      while (pos + TPIU_FRAMESIZE <= length && synchronized) {
+        if (memcmp(buffer + pos, "\xff\xff\xff\x7f", 4) == 0) {
+          pos += 4;
+          continue;
+        }
+        if (frame_handle(buffer + pos, callback, arg))
+          count++;
+        pos += TPIU_FRAMESIZE;
+      }
+      if (pos >= length || !synchronized)
+        continue;
+    }
+    /* collect a partial frame */
+    frame[frame_len++] = buffer[pos++];
+    if (frame_len == 4 && memcmp(frame, "\xff\xff\xff\x7f", 4) == 0) {
+      frame_len = 0;  /* full sync between frames */
+    } else if (frame_len == TPIU_FRAMESIZE) {
+      if (frame_handle(frame, callback, arg))
+        count++;
+      frame_len = 0;
+    }
+  }
+  run_flush(callback, arg);
+  return count;
+}
+
+/** tpiu_decode_reset() resets the decoder, for example when the trace is
+ *  restarted. The decoder searches for a full sync packet.
+ */
+void tpiu_decode_reset(void)
+{
+  frame_len = 0;
+  sync_len = 0;
+  synchronized = 0;
+  current_id = TPIU_ID_NULL;
+  syncerrors = 0;
+  run_len = 0;
+}
+
+/** tpiu_synchronized() returns whether the decoder is aligned on the frames.
+ */
+int tpiu_synchronized(void)
+{
+  return synchronized;
+}
+
+/** tpiu_syncerrors() returns the number of times that the decoder lost frame
+ *  synchronization (on an invalid frame), since the last reset.
+ */
+unsigned long tpiu_syncerrors(void)
+{
+  return syncerrors;
+}
@@ -0,0 +1,41 @@
+/*
+ * Decoder for the frames of the TPIU formatter, which multiplexes several
+ * trace sources (ITM, ETM) into a single stream of 16-byte frames.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _DECODETPIU_H
+#define _DECODETPIU_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define TPIU_FRAMESIZE  16
+#define TPIU_ID_NULL    0x00  /* null trace source, data is discarded */
+#define TPIU_ID_ITM     0x01  /* trace source ID that the swo-generic script assigns to the ITM */
+
+typedef void (*TPIU_CALLBACK)(unsigned id, const unsigned char *data, size_t length, void *arg);
+
+int  tpiu_decode(const unsigned char *buffer, size_t length, TPIU_CALLBACK callback, void *arg);
+void tpiu_decode_reset(void);
+int  tpiu_synchronized(void);
+unsigned long tpiu_syncerrors(void);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _DECODETPIU_H */
@@ -147,6 +147,15 @@ typedef struct tagELF64SECTION {
   uint64_t entsize;     /* entry size, for sections that have fixed-length entries */
 } PACKED ELF64SECTION;
 
+typedef struct tagELF32SYMBOL {
+  uint32_t name;        /* index in the string table */
+  uint32_t value;       /* symbol value (address) */
+  uint32_t size;        /* size of the object or function */
+  uint8_t  info;        /* type (low nibble) and binding (high nibble) */
+  uint8_t  other;       /* visibility */
+  uint16_t shndx;       /* section index, 0 = undefined */
+} PACKED ELF32SYMBOL;
+
 /* a subset of "machine" types */
 #define EM_386      3   /* Intel 80386 */
 #define EM_PPC      20  /* PowerPC */
@@ -182,6 +191,13 @@ typedef struct tagELF64SECTION {
 #define SHT_SYMTAB_SHNDX  0x12  /* Extended section indices */
 #define SHT_NUM           0x13  /* Number of defined types */
 
+#define STT_NOTYPE        0     /* Symbol type is unspecified */
+#define STT_OBJECT        1     /* Symbol is a data object */
+#define STT_FUNC          2     /* Symbol is a code object */
+#define STT_SECTION       3     /* Symbol associated with a section */
+#define STT_FILE          4     /* Symbol's name is file name */
+#define ELF32_ST_TYPE(i)  ((i) & 0x0f)
+
 
 #if defined __linux__ || defined __FreeBSD__ || defined __APPLE__
 #  pragma pack()        /* reset default packing */
@@ -657,6 +673,211 @@ int elf_patch_vecttable(FILE *fp,const char *driver,unsigned int *checksum)
 }
 
 
+static int symbol_compare(const void *p1,const void *p2)
+{
+  unsigned long a1=((const ELF_SYMBOL*)p1)->address;
+  unsigned long a2=((const ELF_SYMBOL*)p2)->address;
+  if (a1<a2)
+    return -1;
+  if (a1>a2)
+    return 1;
+  /* for aliases at the same address, put the one with a size first */
+  return (((const ELF_SYMBOL*)p1)->size==0) - (((const ELF_SYMBOL*)p2)->size==0);
+}
+
+/** elf_load_symbols() reads the symbol table from the ELF file and creates an
+ *  index of the function and/or data symbols, sorted on address.
+ *  \param fp           File handle to the ELF file.
+ *  \param types        A bit mask for the kinds of symbols to load,
+ *                      ELFSYM_FUNCTION and/or ELFSYM_OBJECT.
+ *  \param table        Set to the symbol table. The table must be freed with
+ *                      elf_clear_symbols().
+ *
+ *  \return An error code.
+ *
+ *  \note For ARM, the "Thumb" bit is removed from the function addresses.
+ *        When multiple symbols share the same address, only one is kept.
+ */
+int elf_load_symbols(FILE *fp,int types,ELF_SYMTABLE *table)
+{
+  ELF32HDR hdr;
+
+  assert(table!=NULL);
+  table->symbols=NULL;
+  table->count=0;
+  table->strings=NULL;
+
+  memset(&hdr,0,sizeof(hdr));
+  fseek(fp,0,SEEK_SET);
+  fread(&hdr,sizeof(hdr),1,fp);
+  if (memcmp(hdr.magic,"\177ELF",4)!=0)
+    return ELFERR_FILEFORMAT; /* magic not found, not a valid ELF file */
+  if (hdr.shoff==0)
+    return ELFERR_FILEFORMAT; /* we consider an ELF file without section header table as invalid */
+
+  if (hdr.wordsize==1) {
+    ELF32SECTION section;
+    ELF32SYMBOL symbol;
+    uint32_t offs=hdr.shoff;
+    int num=hdr.shnum;
+    int size=hdr.shentsize;
+    int machine=hdr.machine;
+    uint32_t sym_offs,sym_size,str_offs,str_size,link;
+    unsigned idx,count;
+
+    if (hdr.endian==2) {
+      offs=SWAP32(offs);
+      num=SWAP16(num);
+      size=SWAP16(size);
+      machine=SWAP16(machine);
+    }
+    assert(size==sizeof(section));
+
+    /* find the symbol table */
+    fseek(fp,offs,SEEK_SET);
+    for (idx=0; (int)idx<num; idx++) {
+      fread(&section,sizeof(section),1,fp);
+      if (((hdr.endian==2) ? SWAP32(section.type) : section.type)==SHT_SYMTAB)
+        break;
+    }
+    if ((int)idx>=num)
+      return ELFERR_NOMATCH;  /* no symbol table (stripped executable) */
+    sym_offs=section.offset;
+    sym_size=section.size;
+    link=section.link;
+    if (hdr.endian==2) {
+      sym_offs=SWAP32(sym_offs);
+      sym_size=SWAP32(sym_size);
+      link=SWAP32(link);
+    }
+    if ((int)link>=num)
+      return ELFERR_FILEFORMAT;
+
+    /* read the string table that goes with the symbol table */
+    fseek(fp,offs+link*size,SEEK_SET);
+    fread(&section,sizeof(section),1,fp);
+    str_offs=section.offset;
+    str_size=section.size;
+    if (hdr.endian==2) {
+      str_offs=SWAP32(str_offs);
+      str_size=SWAP32(str_size);
+    }
+    table->strings=malloc(str_size+1);
+    if (table->strings==NULL)
+      return ELFERR_MEMORY;
+    fseek(fp,str_offs,SEEK_SET);
+    fread(table->strings,1,str_size,fp);
+    table->strings[str_size]='\0';
+
+    /* allocate for the worst case, the array is shrunk afterwards */
+    count=sym_size/sizeof(ELF32SYMBOL);
+    table->symbols=malloc((count>0 ? count : 1)*sizeof(ELF_SYMBOL));
+    if (table->symbols==NULL) {
+      elf_clear_symbols(table);
+      return ELFERR_MEMORY;
+    }
+    fseek(fp,sym_offs,SEEK_SET);
+    for (idx=0; idx<count; idx++) {
+      uint32_t name,value,symsize;
+      int type;
+      fread(&symbol,sizeof(symbol),1,fp);
+      name=symbol.name;
+      value=symbol.value;
+      symsize=symbol.size;
+      if (hdr.endian==2) {
+        name=SWAP32(name);
+        value=SWAP32(value);
+        symsize=SWAP32(symsize);
+      }
+      if (symbol.shndx==0 || name==0 || name>=str_size)
+        continue; /* undefined or nameless symbol */
+      type=ELF32_ST_TYPE(symbol.info);
+      if (type==STT_FUNC && (types & ELFSYM_FUNCTION)!=0) {
+        if (machine==EM_ARM)
+          value&=~1;  /* strip Thumb bit */
+      } else if (type!=STT_OBJECT || (types & ELFSYM_OBJECT)==0) {
+        continue;
+      }
+      table->symbols[table->count].name=table->strings+name;
+      table->symbols[table->count].address=value;
+      table->symbols[table->count].size=symsize;
+      table->count++;
+    }
+
+    /* sort on address, then remove duplicates */
+    qsort(table->symbols,table->count,sizeof(ELF_SYMBOL),symbol_compare);
+    if (table->count>1) {
+      unsigned tgt=0;
+      for (idx=1; idx<table->count; idx++)
+        if (table->symbols[idx].address!=table->symbols[tgt].address)
+          table->symbols[++tgt]=table->symbols[idx];
+      table->count=tgt+1;
+    }
+    if (table->count>0 && table->count<count) {
+      ELF_SYMBOL *list=realloc(table->symbols,table->count*sizeof(ELF_SYMBOL));
+      if (list!=NULL)
+        table->symbols=list;
+    }
+
+  } else {
+    //??? re-read the header, but now using the 64-bit structure
+    return ELFERR_FILEFORMAT;
+  }
+
+  return ELFERR_NONE;
+}
+
+/** elf_clear_symbols() frees the memory of a symbol table that was loaded
+ *  with elf_load_symbols().
+ */
+void elf_clear_symbols(ELF_SYMTABLE *table)
+{
+  assert(table!=NULL);
+  if (table->symbols!=NULL)
+    free(table->symbols);
+  if (table->strings!=NULL)
+    free(table->strings);
+  table->symbols=NULL;
+  table->strings=NULL;
+  table->count=0;
+}
+
+/** elf_symbol_by_address() returns the symbol that an address falls in, with
+ *  a binary search.
+ *  \param table        The symbol table, loaded with elf_load_symbols().
+ *  \param address      The address to look up.
+ *
+ *  \return A pointer to the symbol, or NULL if the address does not fall in
+ *          the range of any symbol.
+ *
+ *  \note If the size of a symbol is not set, it is assumed to run up to the
+ *        next symbol.
+ */
+const ELF_SYMBOL *elf_symbol_by_address(const ELF_SYMTABLE *table,unsigned long address)
+{
+  const ELF_SYMBOL *sym;
+  unsigned low,high;
+
+  assert(table!=NULL);
+  if (table->count==0 || address<table->symbols[0].address)
+    return NULL;
+  /* find the last symbol with an address at or below the requested address */
+  low=0;
+  high=table->count;
+  while (high-low>1) {
+    unsigned mid=low+(high-low)/2;
+    if (table->symbols[mid].address<=address)
+      low=mid;
+    else
+      high=mid;
+  }
+  sym=&table->symbols[low];
+  if (sym->size>0 && address>=sym->address+sym->size)
+    return NULL;  /* address is in a gap between symbols */
+  return sym;
+}
+
+
 #if defined STANDALONE
 
 #define FLAG_HEADER   0x01
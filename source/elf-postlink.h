@@ -33,8 +33,24 @@ enum {
   ELFERR_UNKNOWNDRIVER,    /* unknown microcontroller driver name */
   ELFERR_FILEFORMAT,       /* unsupported file format */
   ELFERR_NOMATCH,          /* no matching section / segment */
+  ELFERR_MEMORY,           /* memory allocation error */
 };
 
+#define ELFSYM_FUNCTION 0x01
+#define ELFSYM_OBJECT   0x02
+
+typedef struct tagELF_SYMBOL {
+  const char *name;
+  unsigned long address;
+  unsigned long size;
+} ELF_SYMBOL;
+
+typedef struct tagELF_SYMTABLE {
+  ELF_SYMBOL *symbols;  /* sorted on address */
+  unsigned count;
+  char *strings;        /* string table, which the names point into */
+} ELF_SYMTABLE;
+
 int elf_info(FILE *fp,int *wordsize,int *bigendian,int *machine);
 
 int elf_segment_by_index(FILE *fp,int index,
@@ -52,6 +68,10 @@ int elf_section_by_address(FILE *fp,unsigned long baseaddr,
 
 int elf_patch_vecttable(FILE *fp,const char *driver,unsigned int *checksum);
 
+int elf_load_symbols(FILE *fp,int types,ELF_SYMTABLE *table);
+void elf_clear_symbols(ELF_SYMTABLE *table);
+const ELF_SYMBOL *elf_symbol_by_address(const ELF_SYMTABLE *table,unsigned long address);
+
 #if defined __cplusplus
   }
 #endif
@@ -0,0 +1,220 @@
+/*
+ * Exception trace statistics, from the exception entry/exit/return packets
+ * that the DWT unit in the Cortex-M3/M4/M7 emits. Run-time statistics are kept
+ * for every exception/IRQ number.
+ *
+ * The DWT emits a local timestamp after the packet(s) that it applies to; it
+ * holds the delta since the previous timestamp. Therefore, exception packets
+ * are queued until the timestamp arrives.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decodeitm.h"
+#include "exctrace.h"
+
+#if !defined sizearray
+  #define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
+#endif
+
+#define MAX_NESTING   32    /* deeper nesting is not possible with 8-bit priorities, but the trace may be corrupt */
+#define MAX_PENDING   8     /* exception packets that wait for a timestamp */
+
+typedef struct tagEXCFRAME {
+  unsigned short number;
+  unsigned char preempted;        /* 1 while a higher priority exception runs */
+  unsigned long long entry;       /* timestamp of entry */
+  unsigned long long preempt_start;
+  unsigned long long preempt_time;/* total time preempted in this activation */
+} EXCFRAME;
+
+typedef struct tagEXCEVENT {
+  unsigned short number;
+  unsigned char function;         /* ITMEXC_ENTER, ITMEXC_EXIT or ITMEXC_RETURN */
+} EXCEVENT;
+
+static EXCSTATS stats[EXC_NUMBERS];
+static EXCFRAME stack[MAX_NESTING];
+static int stack_top = 0;
+static EXCEVENT pending[MAX_PENDING];
+static int pending_count = 0;
+static unsigned long long curtime = 0;
+static unsigned long long starttime = 0;
+static int started = 0;
+
+void exctrace_reset(void)
+{
+  memset(stats, 0, sizeof stats);
+  stack_top = 0;
+  pending_count = 0;
+  curtime = 0;
+  starttime = 0;
+  started = 0;
+}
+
+static void exc_enter(int number, unsigned long long timestamp)
+{
+  if (stack_top > 0 && !stack[stack_top - 1].preempted) {
+    stack[stack_top - 1].preempted = 1;
+    stack[stack_top - 1].preempt_start = timestamp;
+  }
+  if (stack_top >= MAX_NESTING) {
+    stack_top = 0;  /* trace is inconsistent, start over */
+    return;
+  }
+  stack[stack_top].number = (unsigned short)number;
+  stack[stack_top].preempted = 0;
+  stack[stack_top].entry = timestamp;
+  stack[stack_top].preempt_time = 0;
+  stack_top++;
+  if (stats[number].max_nesting < stack_top)
+    stats[number].max_nesting = (unsigned char)stack_top;
+}
+
+static void exc_exit(int number, unsigned long long timestamp)
+{
+  EXCSTATS *item;
+  unsigned long duration;
+
+  if (stack_top == 0 || stack[stack_top - 1].number != number) {
+    stack_top = 0;  /* entry was missed (e.g. on starting the trace), or the trace is inconsistent */
+    return;
+  }
+  stack_top--;
+  duration = (unsigned long)(timestamp - stack[stack_top].entry - stack[stack_top].preempt_time);
+  item = &stats[number];
+  if (item->count == 0 || duration < item->min)
+    item->min = duration;
+  if (duration > item->max)
+    item->max = duration;
+  if (stack[stack_top].preempt_time > item->max_preempt)
+    item->max_preempt = (unsigned long)stack[stack_top].preempt_time;
+  item->total += duration;
+  item->count++;
+}
+
+static void exc_return(int number, unsigned long long timestamp)
+{
+  /* number 0 is a return to thread mode; the stack must then be empty */
+  if (number == 0) {
+    stack_top = 0;
+    return;
+  }
+  if (stack_top == 0 || stack[stack_top - 1].number != number) {
+    stack_top = 0;  /* the resumed exception was not seen on entry */
+    return;
+  }
+  if (stack[stack_top - 1].preempted) {
+    stack[stack_top - 1].preempt_time += timestamp - stack[stack_top - 1].preempt_start;
+    stack[stack_top - 1].preempted = 0;
+  }
+}
+
+static void flush_pending(void)
+{
+  int idx;
+
+  for (idx = 0; idx < pending_count; idx++) {
+    switch (pending[idx].function) {
+    case ITMEXC_ENTER:
+      exc_enter(pending[idx].number, curtime);
+      break;
+    case ITMEXC_EXIT:
+      exc_exit(pending[idx].number, curtime);
+      break;
+    case ITMEXC_RETURN:
+      exc_return(pending[idx].number, curtime);
+      break;
+    }
+  }
+  pending_count = 0;
+}
+
+/** exctrace_packet() processes a packet from the ITM decoder. Only exception
+ *  trace packets, local timestamps and overflow packets are relevant; other
+ *  packets are ignored.
+ */
+void exctrace_packet(const ITMPACKET *packet)
+{
+  assert(packet != NULL);
+  switch (packet->type) {
+  case ITMPKT_EXCEPTION:
+    assert(packet->value < EXC_NUMBERS);
+    if (pending_count >= MAX_PENDING)
+      flush_pending();  /* timestamps are apparently disabled */
+    pending[pending_count].number = (unsigned short)packet->value;
+    pending[pending_count].function = packet->flags;
+    pending_count++;
+    break;
+  case ITMPKT_LOCALTS:
+    curtime += packet->value;
+    if (!started) {
+      starttime = curtime;
+      started = 1;
+    }
+    flush_pending();
+    break;
+  case ITMPKT_OVERFLOW:
+    /* packets were lost, the nesting state is unknown */
+    pending_count = 0;
+    stack_top = 0;
+    break;
+  }
+}
+
+/** exctrace_stats() returns the statistics for an exception number, or NULL
+ *  if the exception number is invalid. Exception numbers 1..15 are system
+ *  exceptions, and IRQ n has exception number 16 + n.
+ */
+const EXCSTATS *exctrace_stats(int number)
+{
+  if (number <= 0 || number >= EXC_NUMBERS)
+    return NULL;
+  return &stats[number];
+}
+
+/** exctrace_elapsed() returns the number of timestamp ticks since the first
+ *  timestamp, for calculating the interrupt load.
+ */
+unsigned long long exctrace_elapsed(void)
+{
+  return curtime - starttime;
+}
+
+/** exctrace_name() returns a name for the exception number.
+ */
+const char *exctrace_name(int number, char *buffer, size_t size)
+{
+  static const char *system[] = { "Thread", "Reset", "NMI", "HardFault",
+                                  "MemManage", "BusFault", "UsageFault",
+                                  NULL, NULL, NULL, NULL, "SVCall",
+                                  "DebugMon", NULL, "PendSV", "SysTick" };
+  char name[24];
+
+  assert(buffer != NULL && size > 0);
+  if (number >= 0 && number < (int)sizearray(system) && system[number] != NULL)
+    strcpy(name, system[number]);
+  else if (number >= 16)
+    sprintf(name, "IRQ %d", number - 16);
+  else
+    sprintf(name, "Exception %d", number);
+  strncpy(buffer, name, size);
+  buffer[size - 1] = '\0';
+  return buffer;
+}
@@ -0,0 +1,50 @@
+/*
+ * Exception trace statistics, from the exception entry/exit/return packets
+ * that the DWT unit in the Cortex-M3/M4/M7 emits. Run-time statistics are kept
+ * for every exception/IRQ number.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _EXCTRACE_H
+#define _EXCTRACE_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define EXC_NUMBERS   512   /* exception numbers are 9-bit */
+
+/* all durations are in timestamp ticks */
+typedef struct tagEXCSTATS {
+  unsigned long count;        /* number of completed activations */
+  unsigned long min, max;     /* shortest & longest duration (excluding nested exceptions) */
+  unsigned long long total;   /* sum of durations (excluding nested exceptions) */
+  unsigned long max_preempt;  /* longest time that the handler was held up by higher priority exceptions */
+  unsigned char max_nesting;  /* highest nesting level that the exception was active at (1 = not nested) */
+} EXCSTATS;
+
+struct tagITMPACKET;
+
+void exctrace_reset(void);
+void exctrace_packet(const struct tagITMPACKET *packet);
+const EXCSTATS *exctrace_stats(int number);
+unsigned long long exctrace_elapsed(void);
+const char *exctrace_name(int number, char *buffer, size_t size);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _EXCTRACE_H */
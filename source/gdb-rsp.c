@@ -20,22 +20,36 @@
   #include <windows.h>
 #endif
 #if defined __linux__
+  #include <time.h>
   #include <unistd.h>
 #endif
 #include <assert.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include "gdb-rsp.h"
+#include "netsock.h"
 #include "rs232.h"
 
 #define TIMEOUT       500
-#define POLL_INTERVAL 50
 #define RETRIES       3
 
 
-static unsigned char *cache = NULL; /* cache for received data */
-static size_t cache_size = 0;       /* maximum size of the cache */
-static size_t cache_idx = 0;        /* index to the free area of the cache */
+/* the connection context; received data is kept in a ring buffer, where
+   the size is a power of 2, and the head and tail indices run freely (they
+   are masked on access) */
+struct tagGDBRSP {
+  int type;                   /* GDBRSP_SERIAL, GDBRSP_TCP or GDBRSP_LOCAL */
+  HCOM *hcom;                 /* for a serial port */
+  NETSOCK *sock;              /* for a socket */
+  unsigned char *ring;
+  size_t ring_mask;           /* size of the ring - 1 */
+  size_t ring_head;           /* position where new data is stored */
+  size_t ring_tail;           /* start of the data not yet processed */
+  unsigned char *xmit_buffer; /* buffer for encoded packets */
+  size_t xmit_size;
+  int noack_mode;             /* packets are not acknowledged */
+};
 
 
 static int hex2int(char ch)
@@ -57,42 +71,225 @@ static char int2hex(int v)
   return digits[v];
 }
 
+/* gettimestamp() returns a time stamp in milliseconds */
+static unsigned long gettimestamp(void)
+{
+  #if defined _WIN32
+    return GetTickCount();
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  #endif
+}
 
-/** gdbrsp_packetsize() sets the maximum size of incoming packets. It uses
- *  this to allocate a buffer for incoming data. If the size is set to 0, the
- *  current buffer is freed. Otherwise, the cache for incoming packets is only
- *  adjusted to receive bigger packets (it does not shrink).
+/* the transport is either a (virtual) serial port or a socket; the functions
+   of both modules have the same semantics */
+static int tp_isopen(const GDBRSP *rsp)
+{
+  return (rsp->type == GDBRSP_SERIAL) ? rs232_isopen(rsp->hcom) : netsock_isopen(rsp->sock);
+}
+
+static size_t tp_send(GDBRSP *rsp, const unsigned char *buffer, size_t size)
+{
+  return (rsp->type == GDBRSP_SERIAL) ? rs232_send(rsp->hcom, buffer, size) : netsock_send(rsp->sock, buffer, size);
+}
+
+static size_t tp_recv(GDBRSP *rsp, unsigned char *buffer, size_t size)
+{
+  return (rsp->type == GDBRSP_SERIAL) ? rs232_recv(rsp->hcom, buffer, size) : netsock_recv(rsp->sock, buffer, size);
+}
+
+static int tp_wait(GDBRSP *rsp, int timeout)
+{
+  return (rsp->type == GDBRSP_SERIAL) ? rs232_wait(rsp->hcom, timeout) : netsock_wait(rsp->sock, timeout);
+}
+
+/* waitdata() waits until data arrives on the port, or until the timeout
+   (in ms, relative to "start") expires; a negative timeout waits forever */
+static int waitdata(GDBRSP *rsp, unsigned long start, int timeout)
+{
+  long remaining;
+
+  if (!tp_isopen(rsp))
+    return 0;
+  if (timeout < 0)
+    return tp_wait(rsp, -1);
+  remaining = timeout - (long)(gettimestamp() - start);
+  if (remaining <= 0)
+    return 0;
+  return tp_wait(rsp, (int)remaining);
+}
+
+
+/** gdbrsp_open() opens the connection to the gdbserver. The port name
+ *  selects the transport:
+ *  - "tcp:host:port" or "host:port" for a TCP connection;
+ *  - "unix:path" for a local socket (Linux only);
+ *  - anything else is taken as the name of a serial port (e.g. "COM3" or
+ *    "/dev/ttyACM0").
+ *
+ *  \param port     The port name.
+ *
+ *  \return A handle to the connection, or NULL on failure. The handle must be
+ *          released with gdbrsp_close().
+ *
+ *  \note The connection starts with acknowledgements enabled.
+ *
+ *  \note All state of the connection is in the handle, so that multiple
+ *        connections can be used at the same time (each from its own thread).
  */
-void gdbrsp_packetsize(size_t size)
+GDBRSP *gdbrsp_open(const char *port)
 {
-  if (size == 0) {
-    if (cache != NULL) {
-      free(cache);
-      cache = NULL;
+  GDBRSP *rsp;
+
+  assert(port != NULL);
+  rsp = malloc(sizeof(GDBRSP));
+  if (rsp == NULL)
+    return NULL;
+  memset(rsp, 0, sizeof(GDBRSP));
+  switch (netsock_addrtype(port)) {
+  case NETSOCK_TCP:
+    rsp->type = GDBRSP_TCP;
+    rsp->sock = netsock_open(port);
+    break;
+  case NETSOCK_UNIX:
+    rsp->type = GDBRSP_LOCAL;
+    rsp->sock = netsock_open(port);
+    break;
+  default:
+    rsp->type = GDBRSP_SERIAL;
+    rsp->hcom = rs232_open(port, 115200, 8, 1, PAR_NONE);
+  }
+  if (!tp_isopen(rsp)) {
+    free(rsp);
+    return NULL;
+  }
+  return rsp;
+}
+
+/** gdbrsp_close() closes the connection and releases the handle. For a
+ *  serial port, the DTR and RTS lines are dropped first (signalling the
+ *  gdbserver that the client has gone).
+ *
+ *  \param rsp      The handle returned by gdbrsp_open(); may be NULL.
+ */
+void gdbrsp_close(GDBRSP *rsp)
+{
+  if (rsp == NULL)
+    return;
+  if (rsp->type == GDBRSP_SERIAL) {
+    if (rs232_isopen(rsp->hcom)) {
+      rs232_dtr(rsp->hcom, 0);
+      rs232_rts(rsp->hcom, 0);
     }
-    cache_size = size;
-    cache_idx = 0;
-  } else if (size > cache_size) {
-    unsigned char *buf = malloc(size * sizeof(char));
+    rs232_close(rsp->hcom);
+  } else {
+    netsock_close(rsp->sock);
+  }
+  if (rsp->ring != NULL)
+    free(rsp->ring);
+  if (rsp->xmit_buffer != NULL)
+    free(rsp->xmit_buffer);
+  free(rsp);
+}
+
+/** gdbrsp_isopen() returns whether the connection is open. A connection is
+ *  also considered closed when the port is disconnected, or when the peer
+ *  closed the socket.
+ */
+int gdbrsp_isopen(const GDBRSP *rsp)
+{
+  return rsp != NULL && tp_isopen(rsp);
+}
+
+/** gdbrsp_transport() returns the type of the connection, one of
+ *  GDBRSP_SERIAL, GDBRSP_TCP or GDBRSP_LOCAL; or GDBRSP_NONE if no
+ *  connection is open.
+ */
+int gdbrsp_transport(const GDBRSP *rsp)
+{
+  return gdbrsp_isopen(rsp) ? rsp->type : GDBRSP_NONE;
+}
+
+/** gdbrsp_dtr() sets or clears the DTR and RTS lines of a serial port; the
+ *  gdbserver of the Black Magic Probe starts a session when DTR is set. For
+ *  a socket, this function does nothing.
+ */
+void gdbrsp_dtr(GDBRSP *rsp, int set)
+{
+  assert(rsp != NULL);
+  if (rsp->type == GDBRSP_SERIAL) {
+    rs232_rts(rsp->hcom, set);
+    rs232_dtr(rsp->hcom, set);
+  }
+}
+
+
+/** gdbrsp_packetsize() sets the maximum size of incoming packets. It uses
+ *  this to allocate a buffer for incoming data. The buffer for incoming
+ *  packets is only adjusted to receive bigger packets (it does not shrink);
+ *  it is freed on gdbrsp_close().
+ */
+void gdbrsp_packetsize(GDBRSP *rsp, size_t size)
+{
+  /* room for a full packet plus the start of the next */
+  size_t ringsize = 256;
+  assert(rsp != NULL);
+  while (ringsize < 2 * size)
+    ringsize *= 2;
+  if (rsp->ring == NULL || ringsize > rsp->ring_mask + 1) {
+    unsigned char *buf = malloc(ringsize * sizeof(unsigned char));
     if (buf != NULL) {
-      memcpy(buf, cache, cache_idx * sizeof(char));
-      if (cache != NULL)
-        free(cache);
-      cache = buf;
-      cache_size = size;
+      /* copy pending data, and make it start at the beginning */
+      size_t count = rsp->ring_head - rsp->ring_tail;
+      size_t idx;
+      for (idx = 0; idx < count; idx++)
+        buf[idx] = rsp->ring[(rsp->ring_tail + idx) & rsp->ring_mask];
+      if (rsp->ring != NULL)
+        free(rsp->ring);
+      rsp->ring = buf;
+      rsp->ring_mask = ringsize - 1;
+      rsp->ring_tail = 0;
+      rsp->ring_head = count;
     }
   }
 }
 
+/* ring_fill() reads all data that is waiting on the port into the ring */
+static void ring_fill(GDBRSP *rsp)
+{
+  while (rsp->ring_head - rsp->ring_tail <= rsp->ring_mask) {
+    size_t pos = rsp->ring_head & rsp->ring_mask;
+    size_t space = (rsp->ring_mask + 1) - (rsp->ring_head - rsp->ring_tail);
+    size_t count;
+    if (space > (rsp->ring_mask + 1) - pos)
+      space = (rsp->ring_mask + 1) - pos;  /* up to the end of the ring */
+    count = tp_recv(rsp, rsp->ring + pos, space);
+    if (count == 0)
+      break;
+    rsp->ring_head += count;
+  }
+}
+
+/** gdbrsp_noack() turns the acknowledgement of packets on or off. The
+ *  "no-acknowledgement" mode must first be negotiated with the gdbserver
+ *  (QStartNoAckMode). In this mode, the gdbserver no longer sends '+' on
+ *  each packet and it does not expect it either; corrupted packets are not
+ *  retransmitted.
+ */
+void gdbrsp_noack(GDBRSP *rsp, int enable)
+{
+  rsp->noack_mode = enable;
+}
+
 /** gdbrsp_recv() returns a received packet (from the gdbserver).
  *
  *  \param buffer   Will hold the received data, but the payload only (so the
  *                  '$' at the start and the checksum at the end are stripped
- *                  off).
- *  \param size     The maximum number of bytes that the buffer can hold. Note
- *                  that the checksum bytes are stored in this buffer before
- *                  analysis, so the buffer must be 3 bytes larger than the
- *                  largest expected response).
+ *                  off). Escaped bytes and run-length encoded sequences are
+ *                  decoded.
+ *  \param size     The maximum number of bytes that the buffer can hold.
  *  \param timeout  Time to wait for a response, in ms.
  *
  *  \return The number of bytes received, or zero on time-out (or error). The
@@ -104,108 +301,272 @@ void gdbrsp_packetsize(size_t size)
  *        the start of the output buffer (not an upper case letter). The message
  *        has already been translated from hex encoding to ASCII.
  */
-size_t gdbrsp_recv(char *buffer, size_t size, int timeout)
+size_t gdbrsp_recv(GDBRSP *rsp, char *buffer, size_t size, int timeout)
 {
-  size_t head, tail, idx;
-  int cycles, chk_cache;
+  enum { RX_IDLE, RX_DATA, RX_ESCAPE, RX_RLE, RX_CHECKSUM1, RX_CHECKSUM2 };
+  size_t scan, count;
+  unsigned long start;
+  int state, sum, chksum;
+  char last;
 
-  if (!rs232_isopen())
+  assert(buffer != NULL);
+  if (!gdbrsp_isopen(rsp))
     return 0;
-  if (cache == NULL) {
-    gdbrsp_packetsize(256);
-    if (cache == NULL)
+  if (rsp->ring == NULL) {
+    gdbrsp_packetsize(rsp, 256);
+    if (rsp->ring == NULL)
       return 0;
   }
 
-  cycles = (timeout < 0) ? -1 : timeout / POLL_INTERVAL;
-  chk_cache = (cache_idx > 0);  /* analyse data in the cache even if no new data is received */
-  head = tail = 0;
-  while (cache_idx < cache_size) {
-    size_t count = rs232_recv(cache + cache_idx, cache_size - cache_idx);
-    cache_idx += count;
-    if (count > 0 || chk_cache) {
-      chk_cache = 0;
-      /* check start character (throw away everything before this) */
-      if (head == 0) {
-        for (idx = 0; idx < cache_idx && cache[idx] != '$'; idx++)
-          /* nothing */;
-        if (idx == cache_idx) {
-          cache_idx = 0;        /* throw away all received data */
-        } else {
-          assert(idx < cache_idx && cache[idx] == '$');
-          head = idx + 1;       /* also skip '$' */
+  /* decode the payload while scanning for the end of the packet, but keep
+     the raw packet in the ring until it is complete (on a time-out, the
+     packet is decoded again on the next call) */
+  #define STORE(c)  do { if (count < size) buffer[count] = (c); count++; } while (0)
+  start = gettimestamp();
+  scan = rsp->ring_tail;
+  state = RX_IDLE;
+  count = 0;
+  sum = chksum = 0;
+  last = 0;
+  for ( ;; ) {
+    ring_fill(rsp);
+    while (scan != rsp->ring_head) {
+      char ch;
+      if (state == RX_DATA && count < size) {
+        /* fast path: copy a run of plain payload bytes (no framing, escape
+           or RLE characters), up to the end of the ring or the buffer */
+        size_t pos = scan & rsp->ring_mask;
+        size_t run = rsp->ring_head - scan;
+        size_t idx;
+        if (run > rsp->ring_mask + 1 - pos)
+          run = rsp->ring_mask + 1 - pos;
+        if (run > size - count)
+          run = size - count;
+        for (idx = 0; idx < run; idx++) {
+          unsigned char c = rsp->ring[pos + idx];
+          if (c == '$' || c == '#' || c == '}' || c == '*')
+            break;
+          sum += c;
+          buffer[count + idx] = (char)c;
+        }
+        if (idx > 0) {
+          count += idx;
+          scan += idx;
+          last = buffer[count - 1];
+          continue;
         }
       }
-      /* check whether we have an end mark and a checksum */
-      for (tail = head + 1; tail < cache_idx && cache[tail] != '#'; tail++)
-        /* nothing */;
-      if (tail + 2 < cache_idx) {
-        /* '#' found and 2 characters follow, verify the checksum */
-        int chksum = (hex2int(cache[tail + 1]) << 4) | hex2int(cache[tail + 2]);
-        int sum = 0;
-        for (idx = head; idx < tail; idx++)
-          sum += cache[idx];
-        sum &= 0xff;
-        if (sum == chksum) {
-          /* confirm reception and copy to the buffer */
-          rs232_send((const unsigned char*)"+", 1);
-          count = tail - head;  /* number of payload bytes */
-          if (count >= 3 && cache[head] == 'O' && isxdigit(cache[head + 1]) && isxdigit(cache[head + 2])) {
-            unsigned c;
+      ch = (char)rsp->ring[scan & rsp->ring_mask];
+      scan++;
+      switch (state) {
+      case RX_IDLE:
+        if (ch == '$') {
+          state = RX_DATA;
+          count = 0;
+          sum = 0;
+          rsp->ring_tail = scan - 1;
+        } else {
+          rsp->ring_tail = scan;   /* throw away everything before the '$' */
+        }
+        break;
+      case RX_DATA:
+        if (ch == '#') {
+          state = RX_CHECKSUM1;
+        } else if (ch == '$') {
+          count = 0;          /* packet restarts (previous one was broken) */
+          sum = 0;
+          rsp->ring_tail = scan - 1;
+        } else {
+          sum += (unsigned char)ch;
+          if (ch == '}') {
+            state = RX_ESCAPE;
+          } else if (ch == '*' && count > 0) {
+            state = RX_RLE;
+          } else {
+            last = ch;
+            STORE(ch);
+          }
+        }
+        break;
+      case RX_ESCAPE:
+        sum += (unsigned char)ch;
+        last = (char)(ch ^ 0x20);
+        STORE(last);
+        state = RX_DATA;
+        break;
+      case RX_RLE: {
+        int repeat = (unsigned char)ch - 29;  /* count is encoded as a printable character */
+        sum += (unsigned char)ch;
+        while (repeat-- > 0)
+          STORE(last);
+        state = RX_DATA;
+        break;
+      } /* case */
+      case RX_CHECKSUM1:
+        chksum = hex2int(ch) << 4;
+        state = RX_CHECKSUM2;
+        break;
+      case RX_CHECKSUM2:
+        chksum |= hex2int(ch);
+        rsp->ring_tail = scan;     /* remove the packet from the ring */
+        if ((sum & 0xff) == chksum) {
+          /* confirm reception */
+          if (!rsp->noack_mode)
+            tp_send(rsp, (const unsigned char*)"+", 1);
+          if (count >= 3 && count <= size && buffer[0] == 'O' && isxdigit(buffer[1]) && isxdigit(buffer[2])) {
+            size_t c, idx;
             /* convert the first letter to a lower-case 'o', so that an output
                message of the single letter 'K' won't be mis-interpreted as 'OK' */
             buffer[0] = 'o';
             count = (count + 1) / 2;
-            for (c = 1, idx = head + 1; c < count && c < size; c += 1, idx += 2)
-              buffer[c] = (char)((hex2int(cache[idx]) << 4) | hex2int(cache[idx + 1]));
-          } else {
-            unsigned c;
-            for (c = 0, idx = head; c < count && c < size; c += 1, idx += 1) {
-              if (cache[idx] == '}') {
-                /* escaped binary encoding */
-                idx += 1;
-                buffer[c] = cache[idx] ^ 0x20;
-              } else {
-                buffer[c] = cache[idx];
-              }
-            }
+            for (c = 1, idx = 1; c < count; c += 1, idx += 2)
+              buffer[c] = (char)((hex2int(buffer[idx]) << 4) | hex2int(buffer[idx + 1]));
           }
-          /* remove the packet from the cache */
-          tail += 3;
-          assert(tail <= cache_idx);
-          if (tail < cache_idx)
-            memmove(cache, cache + tail, cache_idx - tail);
-          cache_idx -= tail;
           return count; /* return payload size (excluding checksum) */
-        } else {
-          /* send NAK */
-          rs232_send((const unsigned char*)"-", 1);
-          head = tail = 0;
         }
-        /* remove the packet from the cache */
-        tail += 3;
-        assert(tail <= cache_idx);
-        if (tail < cache_idx)
-          memmove(cache, cache + tail, cache_idx - tail);
-        cache_idx -= tail;
+        /* send NAK (in no-ack mode, the packet is dropped) */
+        if (!rsp->noack_mode)
+          tp_send(rsp, (const unsigned char*)"-", 1);
+        state = RX_IDLE;
+        break;
       }
     }
-    if (cycles > 0 && --cycles == 0)
+    if (rsp->ring_head - rsp->ring_tail > rsp->ring_mask) {
+      /* the ring is full, but no complete packet was yet received, meaning
+         that the packet is bigger than the ring (see gdbrsp_packetsize());
+         the packet is dropped (the remainder of it is skipped on the next
+         call, while looking for the '$' of the next packet) */
+      rsp->ring_tail = rsp->ring_head;
+      return 0;
+    }
+    if (!waitdata(rsp, start, timeout))
       return 0;       /* nothing received within timeout period */
-    #if defined _WIN32
-      Sleep(POLL_INTERVAL);
-    #else
-      usleep(POLL_INTERVAL * 1000);
-    #endif
   }
+  #undef STORE
+}
+
+/* xmit_reserve() makes sure that the buffer for the encoded packet can hold
+   at least "size" bytes */
+static int xmit_reserve(GDBRSP *rsp, size_t size)
+{
+  if (size > rsp->xmit_size) {
+    unsigned char *buf;
+    if (size < 256)
+      size = 256;
+    buf = malloc(size * sizeof(unsigned char));
+    if (buf == NULL)
+      return 0;
+    if (rsp->xmit_buffer != NULL)
+      free(rsp->xmit_buffer);
+    rsp->xmit_buffer = buf;
+    rsp->xmit_size = size;
+  }
+  return 1;
+}
+
+/* encode_binary() copies the data, escaping special characters, and adds
+   the bytes to the checksum */
+static unsigned char *encode_binary(unsigned char *dest, const unsigned char *src, size_t size, unsigned *sum)
+{
+  unsigned s = *sum;
+  while (size-- > 0) {
+    unsigned char ch = *src++;
+    if (ch == '$' || ch == '#' || ch == '}' || ch == '*') {
+      *dest++ = '}';            /* these characters must be escaped */
+      s += '}';
+      ch ^= 0x20;
+    }
+    *dest++ = ch;
+    s += ch;
+  }
+  *sum = s;
+  return dest;
+}
 
-  /* when arrived here, tail == size (so the buffer is filled to its maximum),
-     but no end mark with checksum was yet received, meaning that the buffer was
-     too small; this should never happen */
-  assert(0);
+/* encode_hex() copies the data in hexadecimal, and adds it to the checksum */
+static unsigned char *encode_hex(unsigned char *dest, const unsigned char *src, size_t size, unsigned *sum)
+{
+  unsigned s = *sum;
+  while (size-- > 0) {
+    unsigned char h = (unsigned char)int2hex((*src >> 4) & 0x0f);
+    unsigned char l = (unsigned char)int2hex(*src & 0x0f);
+    *dest++ = h;
+    *dest++ = l;
+    s += h + l;
+    src++;
+  }
+  *sum = s;
+  return dest;
+}
+
+/* xmit_packet() adds the checksum to the packet in the transmit buffer,
+   sends it and waits for the acknowledgement */
+static int xmit_packet(GDBRSP *rsp, unsigned char *tail, unsigned sum)
+{
+  size_t size, count;
+  unsigned long start;
+  unsigned char buf[10];
+  int retry;
+
+  *tail++ = '#';
+  *tail++ = (unsigned char)int2hex((sum >> 4) & 0x0f);
+  *tail++ = (unsigned char)int2hex(sum & 0x0f);
+  size = tail - rsp->xmit_buffer;
+
+  if (rsp->noack_mode)
+    return tp_send(rsp, rsp->xmit_buffer, size) == size;
+
+  for (retry = 0; retry < RETRIES; retry++) {
+    int nak = 0;
+    tp_send(rsp, rsp->xmit_buffer, size);
+    start = gettimestamp();
+    do {
+      while (!nak && (count = tp_recv(rsp, buf, 1)) == 1) {
+        if (buf[0] == '+')
+          return 1;
+        if (buf[0] == '-')
+          nak = 1;  /* retransmit without timeout */
+      }
+    } while (!nak && waitdata(rsp, start, TIMEOUT));
+  }
   return 0;
 }
 
+/** gdbrsp_xmitv() transmits a packet that is made up of several segments
+ *  (for example, a command header and a block of data), without first
+ *  copying these into a single buffer.
+ *
+ *  \param segments The segments, in the order of the packet. Each segment
+ *                  holds the data without the '$' prefix and the '#nn'
+ *                  suffix. Special characters are escaped.
+ *  \param count    The number of segments.
+ *
+ *  \return 1 on success, 0 on timeout or error.
+ */
+int gdbrsp_xmitv(GDBRSP *rsp, const GDBRSP_SEGMENT *segments, int count)
+{
+  unsigned char *dest;
+  unsigned sum;
+  size_t total;
+  int idx;
+
+  assert(segments != NULL || count == 0);
+  if (!gdbrsp_isopen(rsp))
+    return 0;
+
+  total = 0;
+  for (idx = 0; idx < count; idx++)
+    total += segments[idx].size;
+  if (!xmit_reserve(rsp, 2 * total + 4))  /* worst case: every byte is escaped */
+    return 0;
+  dest = rsp->xmit_buffer;
+  *dest++ = '$';
+  sum = 0;
+  for (idx = 0; idx < count; idx++)
+    dest = encode_binary(dest, (const unsigned char*)segments[idx].data, segments[idx].size, &sum);
+  return xmit_packet(rsp, dest, sum);
+}
+
 /** gdbrsp_xmit() transmits a packet to the gdbserver.
  *
  *  \param buffer   The buffer. It must contain a complete command, but without
@@ -216,93 +577,27 @@ size_t gdbrsp_recv(char *buffer, size_t size, int timeout)
  *
  *  \return 1 on success, 0 on timeout or error.
  */
-int gdbrsp_xmit(const char *buffer, int size)
+int gdbrsp_xmit(GDBRSP *rsp, const char *buffer, int size)
 {
-  size_t buflen, count, idx;
-  int retry, cycle, sum;
-  unsigned char buf[10], *fullbuffer;
+  GDBRSP_SEGMENT segment;
+  size_t buflen;
 
   assert(buffer != NULL);
-  if (!rs232_isopen())
-    return 0;
-
-  buflen = (size == -1) ? strlen(buffer) : size;
+  buflen = (size == -1) ? strlen(buffer) : (size_t)size;
   if (buflen > 6 && memcmp(buffer, "qRcmd,", 6) == 0) {
-    size = ((buflen - 6) * 2) + 6;  /* payload is hex-encoded */
-  } else {
-    size = 0;
-    for (idx = 0; idx < buflen; idx++) {
-      size += 1;
-      if (buffer[idx] == '$' || buffer[idx] == '#' || buffer[idx] == '}')
-        size += 1;      /* these characters must be escaped */
-    }
-  }
-  size += 4;            /* add '$' prefix and '#nn' suffix */
-
-  fullbuffer = malloc(size);
-  if (fullbuffer == NULL)
-    return 0;
-
-  /* add prefix, handle payload */
-  *fullbuffer = '$';
-  if (buflen > 6 && memcmp(buffer, "qRcmd,", 6) == 0) {
-    const char *src = buffer + 6;
-    unsigned char *dest = fullbuffer + 6 + 1;
-    count = buflen - 6;
-    memcpy(fullbuffer + 1, buffer, 6);
-    while (count > 0) {
-      *dest++ = int2hex((*src >> 4) & 0x0f);
-      *dest++ = int2hex(*src & 0x0f);
-      src++;
-      count--;
-    }
-  } else {
-    const char *src = buffer;
-    unsigned char *dest = fullbuffer + 1;
-    for (idx = 0; idx < buflen; idx++) {
-      for (idx = 0; idx < buflen; idx++) {
-        if (*src == '$' || *src == '#' || *src == '}') {
-          *dest++ = '}';        /* these characters must be escaped */
-          *dest++ = *src++ ^ 0x20;
-        } else {
-          *dest++ = *src++;
-        }
-      }
-    }
-  }
-  /* add checksum */
-  sum = 0;
-  for (idx = 1; idx < (unsigned)size - 3; idx++)
-    sum += fullbuffer[idx];     /* run over fullbuffer, so that the checksum is over the translated buffer */
-  *(fullbuffer + size - 3) = '#';
-  *(fullbuffer + size - 2) = int2hex((sum >> 4) & 0x0f);
-  *(fullbuffer + size - 1) = int2hex(sum & 0x0f);
-
-  for (retry = 0; retry < RETRIES; retry++) {
-    rs232_send(fullbuffer, size);
-    for (cycle = 0; cycle < TIMEOUT / POLL_INTERVAL; cycle++) {
-      do {
-        count = rs232_recv(buf, 1);
-        if (count == 1) {
-          if (buf[0] == '+') {
-            free(fullbuffer);
-            return 1;
-          }
-          if (buf[0] == '-') {
-            cycle = TIMEOUT / POLL_INTERVAL;  /* retransmit without timeout */
-            break;
-          }
-        }
-      } while (count == 1);
-      #if defined _WIN32
-        Sleep(POLL_INTERVAL);
-      #else
-        usleep(POLL_INTERVAL * 1000);
-      #endif
-    }
+    /* payload of a monitor command is hex-encoded */
+    unsigned char *dest;
+    unsigned sum;
+    if (!gdbrsp_isopen(rsp) || !xmit_reserve(rsp, 6 + 2 * (buflen - 6) + 4))
+      return 0;
+    dest = rsp->xmit_buffer;
+    *dest++ = '$';
+    sum = 0;
+    dest = encode_binary(dest, (const unsigned char*)buffer, 6, &sum);
+    dest = encode_hex(dest, (const unsigned char*)buffer + 6, buflen - 6, &sum);
+    return xmit_packet(rsp, dest, sum);
   }
-
-  free(fullbuffer);
-  return 0;
+  segment.data = buffer;
+  segment.size = buflen;
+  return gdbrsp_xmitv(rsp, &segment, 1);
 }
-
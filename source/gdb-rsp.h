@@ -22,9 +22,31 @@
   extern "C" {
 #endif
 
-void   gdbrsp_packetsize(size_t size);
-size_t gdbrsp_recv(char *buffer, size_t size, int timeout);
-int    gdbrsp_xmit(const char *buffer, int size);
+enum {
+  GDBRSP_NONE,
+  GDBRSP_SERIAL,    /* (virtual) serial port */
+  GDBRSP_TCP,       /* TCP/IP socket */
+  GDBRSP_LOCAL,     /* local (Unix domain) socket */
+};
+
+typedef struct tagGDBRSP_SEGMENT {
+  const void *data;
+  size_t size;
+} GDBRSP_SEGMENT;
+
+typedef struct tagGDBRSP GDBRSP;
+
+GDBRSP *gdbrsp_open(const char *port);
+void   gdbrsp_close(GDBRSP *rsp);
+int    gdbrsp_isopen(const GDBRSP *rsp);
+int    gdbrsp_transport(const GDBRSP *rsp);
+void   gdbrsp_dtr(GDBRSP *rsp, int set);
+
+void   gdbrsp_packetsize(GDBRSP *rsp, size_t size);
+size_t gdbrsp_recv(GDBRSP *rsp, char *buffer, size_t size, int timeout);
+int    gdbrsp_xmit(GDBRSP *rsp, const char *buffer, int size);
+int    gdbrsp_xmitv(GDBRSP *rsp, const GDBRSP_SEGMENT *segments, int count);
+void   gdbrsp_noack(GDBRSP *rsp, int enable);
 
 #if defined __cplusplus
   }
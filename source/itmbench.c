@@ -0,0 +1,301 @@
+/*
+ * Test and benchmark for the fast path of the ITM decoder. It first verifies
+ * that itm_demux() (together with itm_decode_packet() for the packets that
+ * itm_demux() does not handle) gives the same packets as itm_decode(), on a
+ * random stream with runs of 1-byte stimulus packets between other packets,
+ * fed in blocks of random size. It also verifies itm_samerun() and
+ * itm_textrun() against a plain loop. Then it measures the throughput of
+ * itm_decode() and itm_demux() on a stream with only 1-byte stimulus packets,
+ * for blocks from 64 bytes to 1 MiB.
+ *
+ * This utility uses POSIX clocks, and is therefore only available for Linux
+ * (and other POSIX systems).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "decodeitm.h"
+
+
+#define CHECK_SIZE    200000
+#define BENCH_MAX     (1UL << 20)
+
+#if defined __AVX2__
+  #define SIMD_NAME   "AVX2"
+#elif defined __SSE2__
+  #define SIMD_NAME   "SSE2"
+#else
+  #define SIMD_NAME   "none"
+#endif
+
+typedef struct tagPKTLIST {
+  ITMPACKET *packets;
+  size_t count;
+  size_t size;
+} PKTLIST;
+
+static unsigned char check_data[CHECK_SIZE];
+static size_t check_length;
+
+static void pktlist_add(PKTLIST *list, unsigned char type, unsigned char address, unsigned long long value)
+{
+  if (list->count >= list->size) {
+    list->size = (list->size == 0) ? 1024 : 2 * list->size;
+    list->packets = realloc(list->packets, list->size * sizeof(ITMPACKET));
+    if (list->packets == NULL) {
+      fprintf(stderr, "Memory allocation failure.\n");
+      exit(1);
+    }
+  }
+  memset(&list->packets[list->count], 0, sizeof(ITMPACKET));
+  list->packets[list->count].type = type;
+  list->packets[list->count].address = address;
+  list->packets[list->count].value = value;
+  list->count++;
+}
+
+static void collect(const ITMPACKET *packet, void *arg)
+{
+  pktlist_add((PKTLIST*)arg, packet->type, packet->address, packet->value);
+}
+
+static void discard(const ITMPACKET *packet, void *arg)
+{
+  (void)packet;
+  (*(size_t*)arg)++;
+}
+
+/** make_stream() fills the check buffer with runs of 1-byte stimulus packets
+ *  (of random length, so that both the vector loops and the scalar tail of
+ *  itm_demux() are used), separated by 2-byte stimulus packets, local
+ *  timestamps and overflow packets.
+ */
+static void make_stream(void)
+{
+  size_t pos = 0;
+  int run;
+
+  while (pos + 300 < CHECK_SIZE) {
+    for (run = rand() % 100; run > 0; run--) {
+      check_data[pos++] = (unsigned char)(((rand() % 32) << 3) | 0x01);
+      check_data[pos++] = (unsigned char)((rand() % 8 == 0) ? 0 : rand());
+    }
+    switch (rand() % 3) {
+    case 0:
+      check_data[pos++] = (unsigned char)(((rand() % 32) << 3) | 0x02);
+      check_data[pos++] = (unsigned char)rand();
+      check_data[pos++] = (unsigned char)rand();
+      break;
+    case 1:
+      check_data[pos++] = (unsigned char)(((rand() % 6) + 1) << 4); /* format 2 local timestamp */
+      break;
+    case 2:
+      check_data[pos++] = 0x70;
+      break;
+    }
+  }
+  check_length = pos;
+}
+
+/** check_demux() decodes the check stream with itm_decode() and with the
+ *  fast path, and compares the packets.
+ *
+ *  \return The number of mismatches.
+ */
+static int check_demux(void)
+{
+  static unsigned char ports[CHECK_SIZE / 2], data[CHECK_SIZE / 2];
+  PKTLIST ref = { NULL, 0, 0 }, test = { NULL, 0, 0 };
+  size_t pos, end, idx, pairs;
+  int fails = 0;
+
+  itm_decode_reset();
+  itm_decode(check_data, check_length, collect, &ref);
+
+  itm_decode_reset();
+  for (pos = 0; pos < check_length; ) {
+    end = pos + rand() % 700;   /* blocks of random size, packets get split */
+    if (end > check_length)
+      end = check_length;
+    while (pos < end) {
+      pairs = itm_demux(check_data + pos, end - pos, ports, data);
+      if (pairs > 0) {
+        for (idx = 0; idx < pairs; idx++)
+          pktlist_add(&test, ITMPKT_STIMULUS, ports[idx], data[idx]);
+        pos += 2 * pairs;
+      } else {
+        pos += itm_decode_packet(check_data + pos, end - pos, collect, &test);
+      }
+    }
+  }
+
+  if (test.count != ref.count)
+    fails++;
+  for (idx = 0; idx < ref.count && idx < test.count; idx++)
+    if (test.packets[idx].type != ref.packets[idx].type
+        || test.packets[idx].address != ref.packets[idx].address
+        || test.packets[idx].value != ref.packets[idx].value)
+      fails++;
+  printf("Demux, %-8lu packets  %s\n", (unsigned long)ref.count, (fails == 0) ? "ok" : "FAILED");
+  free(ref.packets);
+  free(test.packets);
+  return fails;
+}
+
+/** check_runs() compares itm_samerun() and itm_textrun() to a plain loop, for
+ *  all run lengths up to a few vector widths.
+ *
+ *  \return The number of mismatches.
+ */
+static int check_runs(void)
+{
+  unsigned char bytes[100];
+  size_t len, run, count, ref;
+  int fails = 0;
+
+  for (len = 0; len < sizeof bytes; len++) {
+    for (run = 0; run <= len; run++) {
+      memset(bytes, 'a', len);
+      if (run < len)
+        bytes[run] = "b\r\n"[rand() % 3];
+      for (count = run + 1; count < len; count++)
+        bytes[count] = (unsigned char)rand();
+      for (ref = 0; ref < len && bytes[ref] == bytes[0]; ref++)
+        {}
+      if (itm_samerun(bytes, len) != ref)
+        fails++;
+      for (ref = 0; ref < len && bytes[ref] != '\r' && bytes[ref] != '\n' && bytes[ref] != 0; ref++)
+        {}
+      if (itm_textrun(bytes, len) != ref)
+        fails++;
+    }
+  }
+  printf("Runs                    %s\n", (fails == 0) ? "ok" : "FAILED");
+  return fails;
+}
+
+static double timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(void)
+{
+  unsigned char *stream, *ports, *data;
+  size_t size, total, idx, packets = 0;
+  volatile size_t sink = 0;
+  double start, stop;
+  int rep;
+
+  stream = malloc(BENCH_MAX);
+  ports = malloc(BENCH_MAX / 2);
+  data = malloc(BENCH_MAX / 2);
+  if (stream == NULL || ports == NULL || data == NULL) {
+    fprintf(stderr, "Memory allocation failure.\n");
+    free(stream);
+    free(ports);
+    free(data);
+    return;
+  }
+  for (idx = 0; idx < BENCH_MAX; idx += 2) {
+    stream[idx] = (unsigned char)((((idx * 2654435761UL) >> 20) % 4 << 3) | 0x01);
+    stream[idx + 1] = (unsigned char)(' ' + (idx / 2) % 95);
+  }
+
+  printf("\nVector extensions: %s\n", SIMD_NAME);
+  printf("%-10s%10s%10s   (GB/s)\n", "Size", "decode", "demux");
+  for (size = 64; size <= BENCH_MAX; size *= 4) {
+    printf("%-10lu", (unsigned long)size);
+
+    itm_decode_reset();
+    total = 0;
+    start = timestamp();
+    do {
+      for (rep = 0; rep < 16; rep++) {
+        itm_decode(stream, size, discard, &packets);
+        total += size;
+      }
+      stop = timestamp();
+    } while (stop - start < 0.2);
+    printf("%10.2f", total / (stop - start) / 1e9);
+
+    itm_decode_reset();
+    total = 0;
+    start = timestamp();
+    do {
+      for (rep = 0; rep < 16; rep++) {
+        sink += itm_demux(stream, size, ports, data);
+        total += size;
+      }
+      stop = timestamp();
+    } while (stop - start < 0.2);
+    printf("%10.2f\n", total / (stop - start) / 1e9);
+  }
+  free(stream);
+  free(ports);
+  free(data);
+}
+
+static void usage(void)
+{
+  printf("itmbench - verify the fast path of the ITM decoder against the general\n"
+         "           decoder, and measure the throughput of both.\n\n"
+         "Usage: itmbench [options]\n\n"
+         "Options:\n"
+         "-c\t Only run the checks, skip the benchmark.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int idx, fails, opt_bench = 1;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 'c':
+        opt_bench = 0;
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+      return 1;
+    }
+  }
+
+  srand(1);
+  make_stream();
+  fails = check_demux();
+  fails += check_runs();
+  if (fails > 0)
+    return 1;
+
+  if (opt_bench)
+    benchmark();
+  return 0;
+}
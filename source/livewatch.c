@@ -0,0 +1,175 @@
+/*
+ * Live watches, using the data trace of the DWT unit in the Cortex-M3/M4/M7.
+ * Each variable is assigned to a DWT comparator, and the values that the
+ * target writes to it are received over SWO, while the target keeps running.
+ *
+ * The comparators are set up to emit a data address offset packet, followed
+ * by a data value packet, on every write to the variable. The address offset
+ * makes it possible to merge partial writes (e.g. a byte write to a 32-bit
+ * variable) into the current value.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bmp-script.h"
+#include "decodeitm.h"
+#include "livewatch.h"
+
+/* DWT_FUNCTION: address offset + data value on write transfers (0b1111),
+   with EMITRANGE (bit 5) set */
+#define DWT_FUNC_DATAWRITE  0x2f
+
+static LIVEVAR livevars[LIVE_MAXVARS];
+static unsigned live_programmed = 0;  /* bit mask of comparators set for data trace */
+
+/** live_add() assigns a free comparator to the expression. The address of
+ *  the expression must subsequently be set with live_resolve().
+ *
+ *  \return The index of the comparator, or -1 if all comparators are in use.
+ */
+int live_add(const char *expr)
+{
+  int idx;
+
+  assert(expr != NULL);
+  if (strlen(expr) == 0 || strlen(expr) >= LIVE_EXPRLEN)
+    return -1;
+  for (idx = 0; idx < LIVE_MAXVARS && livevars[idx].expr[0] != '\0'; idx++)
+    /* nothing */;
+  if (idx >= LIVE_MAXVARS)
+    return -1;
+  memset(&livevars[idx], 0, sizeof(LIVEVAR));
+  strcpy(livevars[idx].expr, expr);
+  return idx;
+}
+
+int live_remove(int index)
+{
+  if (index < 0 || index >= LIVE_MAXVARS || livevars[index].expr[0] == '\0')
+    return 0;
+  memset(&livevars[index], 0, sizeof(LIVEVAR));
+  return 1;
+}
+
+void live_clear(void)
+{
+  memset(livevars, 0, sizeof livevars);
+}
+
+/** live_unresolved() returns the index of the first live watch for which
+ *  the address is not yet known, or -1 if there is none.
+ */
+int live_unresolved(void)
+{
+  int idx;
+
+  for (idx = 0; idx < LIVE_MAXVARS; idx++)
+    if (livevars[idx].expr[0] != '\0' && livevars[idx].size == 0)
+      return idx;
+  return -1;
+}
+
+/** live_resolve() sets the address and the size of the variable for a live
+ *  watch. The size is clamped to 8 bytes (a single value is tracked per
+ *  watch).
+ */
+void live_resolve(int index, unsigned long address, unsigned size)
+{
+  assert(index >= 0 && index < LIVE_MAXVARS);
+  if (size == 0)
+    size = 1;
+  else if (size > sizeof(livevars[index].value))
+    size = sizeof(livevars[index].value);
+  livevars[index].address = address;
+  livevars[index].size = (unsigned short)size;
+}
+
+const LIVEVAR *live_get(int index)
+{
+  if (index < 0 || index >= LIVE_MAXVARS || livevars[index].expr[0] == '\0')
+    return NULL;
+  return &livevars[index];
+}
+
+/** live_packet() handles data trace packets; other packets are ignored.
+ */
+void live_packet(const ITMPACKET *packet)
+{
+  LIVEVAR *var;
+  int idx;
+
+  assert(packet != NULL);
+  if (packet->type != ITMPKT_DATAADDR && packet->type != ITMPKT_DATAVALUE)
+    return;
+  assert(packet->address < LIVE_MAXVARS);
+  var = &livevars[packet->address];
+  if (var->size == 0)
+    return;   /* comparator not in use (or not yet configured) */
+
+  if (packet->type == ITMPKT_DATAADDR) {
+    /* the packet holds the low 16 bits of the address that was written to */
+    var->offset = (unsigned short)((packet->value - var->address) & 0xffff);
+    return;
+  }
+
+  if (packet->flags == 0)
+    return;   /* read access, ignore */
+  for (idx = 0; idx < packet->size && var->offset + idx < var->size; idx++) {
+    int shift = 8 * (var->offset + idx);
+    var->value = (var->value & ~(0xffULL << shift)) | ((unsigned long long)packet->payload[idx] << shift);
+  }
+  var->offset = 0;
+  var->history[var->hist_head] = var->value;
+  var->hist_head = (var->hist_head + 1) % LIVE_HISTORY;
+  if (var->hist_count < LIVE_HISTORY)
+    var->hist_count++;
+  var->updates++;
+}
+
+/** live_dwtparams() fills in the parameters for the "swo-datatrace" script:
+ *  the COMP registers for all comparators in params[0..3], MASK registers in
+ *  params[4..7] and FUNCTION registers in params[8..11]; params[12..15] are
+ *  for disabling the comparators before they are changed. Only comparators
+ *  for live watches are set; a comparator that was set for a live watch that
+ *  has since been removed, is disabled. The parameters for all other
+ *  comparators are SCRIPT_SKIP, so that hardware watchpoints and breakpoints
+ *  that use these comparators are left intact.
+ */
+void live_dwtparams(unsigned long *params)
+{
+  int idx;
+
+  assert(params != NULL);
+  for (idx = 0; idx < LIVE_MAXVARS; idx++) {
+    params[idx] = params[idx + 4] = params[idx + 8] = params[idx + 12] = SCRIPT_SKIP;
+    if (livevars[idx].size > 0) {
+      unsigned mask = 0;
+      while ((1u << mask) < livevars[idx].size)
+        mask++;
+      params[idx] = livevars[idx].address & ~((1UL << mask) - 1);
+      params[idx + 4] = mask;
+      params[idx + 8] = DWT_FUNC_DATAWRITE;
+      params[idx + 12] = 0;
+      live_programmed |= 1u << idx;
+    } else if (live_programmed & (1u << idx)) {
+      params[idx + 8] = 0;
+      live_programmed &= ~(1u << idx);
+    }
+  }
+}
@@ -0,0 +1,57 @@
+/*
+ * Live watches, using the data trace of the DWT unit in the Cortex-M3/M4/M7.
+ * Each variable is assigned to a DWT comparator, and the values that the
+ * target writes to it are received over SWO, while the target keeps running.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _LIVEWATCH_H
+#define _LIVEWATCH_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define LIVE_MAXVARS  4     /* number of DWT comparators (Cortex-M3/M4) */
+#define LIVE_HISTORY  32    /* number of recent values kept per variable */
+#define LIVE_EXPRLEN  64
+
+typedef struct tagLIVEVAR {
+  char expr[LIVE_EXPRLEN];  /* expression as typed (empty if the slot is free) */
+  unsigned long address;
+  unsigned short size;      /* size in bytes, 0 if the address is not yet resolved */
+  unsigned short offset;    /* byte offset in the variable for the next data value packet */
+  unsigned long long value; /* most recent value */
+  unsigned long long history[LIVE_HISTORY];
+  int hist_head, hist_count;
+  unsigned long updates;    /* number of writes received */
+} LIVEVAR;
+
+struct tagITMPACKET;
+
+int  live_add(const char *expr);
+int  live_remove(int index);
+void live_clear(void);
+int  live_unresolved(void);
+void live_resolve(int index, unsigned long address, unsigned size);
+const LIVEVAR *live_get(int index);
+void live_packet(const struct tagITMPACKET *packet);
+void live_dwtparams(unsigned long *params);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _LIVEWATCH_H */
@@ -0,0 +1,361 @@
+/*
+ * Network socket support (TCP and local sockets), limited to the functions
+ * that the GDB RSP needs. It is the counterpart of the rs232 module, for
+ * probes that are reached over a network or through a multiplexing daemon.
+ *
+ * The GDB RSP consists of small request/reply packets, so the latency of
+ * each round trip matters more than throughput. Therefore, Nagle's algorithm
+ * is disabled (otherwise, a packet that follows an acknowledgement would be
+ * held back until the acknowledgement is confirmed by the peer).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined _WIN32
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  typedef SOCKET SOCKFD;
+  #define INVALID_SOCKFD  INVALID_SOCKET
+  #define closesocket_(s) closesocket(s)
+#else
+  #include <netdb.h>
+  #include <poll.h>
+  #include <unistd.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  typedef int SOCKFD;
+  #define INVALID_SOCKFD  (-1)
+  #define closesocket_(s) close(s)
+#endif
+#include "netsock.h"
+
+
+#if !defined sizearray
+  #define sizearray(a)    (sizeof(a) / sizeof((a)[0]))
+#endif
+
+struct tagNETSOCK {
+  SOCKFD sock;
+};
+
+
+/** netsock_addrtype() checks whether a port name is a socket address. A TCP
+ *  address has the form "tcp:host:port" or "host:port" (where "port" is a
+ *  number); for an IPv6 address, the host must be enclosed in brackets. A
+ *  local socket has the form "unix:path".
+ *
+ *  \param address  The port name, e.g. as returned by find_bmp().
+ *
+ *  \return NETSOCK_TCP or NETSOCK_UNIX for a socket address, or NETSOCK_NONE
+ *          for anything else (e.g. a serial port).
+ */
+int netsock_addrtype(const char *address)
+{
+  const char *ptr;
+
+  assert(address != NULL);
+  if (strncmp(address, "tcp:", 4) == 0)
+    return NETSOCK_TCP;
+  if (strncmp(address, "unix:", 5) == 0)
+    return NETSOCK_UNIX;
+  /* "host:port", but not a device path (that may contain a colon) */
+  if (address[0] == '/' || address[0] == '\\' || (ptr = strrchr(address, ':')) == NULL
+      || ptr == address || ptr[1] == '\0')
+    return NETSOCK_NONE;
+  for (ptr += 1; *ptr != '\0'; ptr++)
+    if (!isdigit((unsigned char)*ptr))
+      return NETSOCK_NONE;
+  return NETSOCK_TCP;
+}
+
+static SOCKFD open_tcp(const char *address)
+{
+  SOCKFD sock = INVALID_SOCKFD;
+  char host[128];
+  const char *port;
+  struct addrinfo hints, *list, *item;
+  size_t len;
+  int flag;
+
+  if (strncmp(address, "tcp:", 4) == 0)
+    address += 4;
+  port = strrchr(address, ':');
+  assert(port != NULL);   /* checked in netsock_addrtype() */
+  len = port - address;
+  if (len >= 2 && address[0] == '[' && address[len - 1] == ']') {
+    address += 1;         /* strip brackets of an IPv6 address */
+    len -= 2;
+  }
+  if (len >= sizearray(host))
+    return INVALID_SOCKFD;
+  memcpy(host, address, len);
+  host[len] = '\0';
+  port += 1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  if (getaddrinfo(host, port, &hints, &list) != 0)
+    return INVALID_SOCKFD;
+  for (item = list; item != NULL; item = item->ai_next) {
+    sock = socket(item->ai_family, item->ai_socktype, item->ai_protocol);
+    if (sock == INVALID_SOCKFD)
+      continue;
+    if (connect(sock, item->ai_addr, (int)item->ai_addrlen) == 0)
+      break;
+    closesocket_(sock);
+    sock = INVALID_SOCKFD;
+  }
+  freeaddrinfo(list);
+  if (sock == INVALID_SOCKFD)
+    return INVALID_SOCKFD;
+
+  /* send each packet immediately */
+  flag = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof flag);
+  return sock;
+}
+
+static SOCKFD open_local(const char *address)
+{
+  #if defined _WIN32
+    (void)address;
+    return INVALID_SOCKFD;  /* not supported */
+  #else
+    struct sockaddr_un addr;
+    SOCKFD sock;
+    assert(strncmp(address, "unix:", 5) == 0);
+    address += 5;
+    if (strlen(address) >= sizearray(addr.sun_path))
+      return INVALID_SOCKFD;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKFD)
+      return INVALID_SOCKFD;
+    if (connect(sock, (const struct sockaddr*)&addr, sizeof addr) != 0) {
+      close(sock);
+      return INVALID_SOCKFD;
+    }
+    return sock;
+  #endif
+}
+
+/* shutdown_sock() closes the socket, but keeps the handle (so that the
+   connection is flagged as closed when the peer closes it) */
+static void shutdown_sock(NETSOCK *ns)
+{
+  assert(ns != NULL);
+  if (ns->sock != INVALID_SOCKFD) {
+    closesocket_(ns->sock);
+    ns->sock = INVALID_SOCKFD;
+  }
+}
+
+/** netsock_open() connects to a socket.
+ *
+ *  \param address  The address, see netsock_addrtype() for the syntax.
+ *
+ *  \return A handle to the connection, or NULL on failure. The handle must
+ *          be released with netsock_close().
+ */
+NETSOCK *netsock_open(const char *address)
+{
+  NETSOCK *ns;
+
+  assert(address != NULL);
+  #if defined _WIN32
+  {
+    /* calls to WSAStartup() are reference counted; each is matched with a
+       call to WSACleanup() in netsock_close() */
+    WSADATA wsadata;
+    if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+      return NULL;
+  }
+  #endif
+
+  ns = malloc(sizeof(NETSOCK));
+  if (ns != NULL) {
+    switch (netsock_addrtype(address)) {
+    case NETSOCK_TCP:
+      ns->sock = open_tcp(address);
+      break;
+    case NETSOCK_UNIX:
+      ns->sock = open_local(address);
+      break;
+    default:
+      ns->sock = INVALID_SOCKFD;
+    }
+    if (ns->sock == INVALID_SOCKFD) {
+      free(ns);
+      ns = NULL;
+    }
+  }
+  if (ns == NULL) {
+    #if defined _WIN32
+      WSACleanup();
+    #endif
+    return NULL;
+  }
+
+  /* reads never block (netsock_wait() is used to wait for data) */
+  #if defined _WIN32
+  {
+    u_long mode = 1;
+    ioctlsocket(ns->sock, FIONBIO, &mode);
+  }
+  #endif
+  return ns;
+}
+
+/** netsock_close() closes the connection and releases the handle.
+ *
+ *  \param ns       The handle returned by netsock_open(); may be NULL.
+ */
+void netsock_close(NETSOCK *ns)
+{
+  if (ns != NULL) {
+    shutdown_sock(ns);
+    free(ns);
+    #if defined _WIN32
+      WSACleanup();
+    #endif
+  }
+}
+
+int netsock_isopen(const NETSOCK *ns)
+{
+  return ns != NULL && ns->sock != INVALID_SOCKFD;
+}
+
+size_t netsock_send(NETSOCK *ns, const unsigned char *buffer, size_t size)
+{
+  size_t sent = 0;
+
+  assert(ns != NULL);
+  assert(buffer != NULL);
+  while (ns->sock != INVALID_SOCKFD && sent < size) {
+    #if defined _WIN32
+      int num = send(ns->sock, (const char*)buffer + sent, (int)(size - sent), 0);
+      if (num == SOCKET_ERROR) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+          fd_set fds;
+          FD_ZERO(&fds);
+          FD_SET(ns->sock, &fds);
+          select(0, NULL, &fds, NULL, NULL);
+          continue;
+        }
+        shutdown_sock(ns);
+        break;
+      }
+    #else
+      ssize_t num = send(ns->sock, buffer + sent, size - sent, MSG_NOSIGNAL);
+      if (num < 0) {
+        if (errno == EINTR)
+          continue;
+        shutdown_sock(ns);
+        break;
+      }
+    #endif
+    sent += num;
+  }
+  return sent;
+}
+
+/** netsock_recv() returns the data that is waiting on the socket, without
+ *  blocking.
+ *
+ *  \return The number of bytes read, 0 if no data is available. When the peer
+ *          closed the connection, the socket is closed as well.
+ */
+size_t netsock_recv(NETSOCK *ns, unsigned char *buffer, size_t size)
+{
+  assert(ns != NULL);
+  assert(buffer != NULL);
+  if (ns->sock == INVALID_SOCKFD)
+    return 0;
+  #if defined _WIN32
+  {
+    int num = recv(ns->sock, (char*)buffer, (int)size, 0);
+    if (num == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSAEWOULDBLOCK)
+        shutdown_sock(ns);
+      return 0;
+    }
+    if (num == 0)
+      shutdown_sock(ns);  /* connection closed by the peer */
+    return (size_t)num;
+  }
+  #else
+  {
+    ssize_t num = recv(ns->sock, buffer, size, MSG_DONTWAIT);
+    if (num < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        shutdown_sock(ns);
+      return 0;
+    }
+    if (num == 0)
+      shutdown_sock(ns);  /* connection closed by the peer */
+    return (size_t)num;
+  }
+  #endif
+}
+
+/** netsock_wait() waits until data is received, or until a timeout.
+ *
+ *  \param timeout  The maximum time to wait, in milliseconds; -1 to wait
+ *                  without limit.
+ *
+ *  \return 1 if data is available (or the connection was closed, so that
+ *          netsock_recv() will detect it), 0 on timeout.
+ */
+int netsock_wait(NETSOCK *ns, int timeout)
+{
+  assert(ns != NULL);
+  if (ns->sock == INVALID_SOCKFD)
+    return 0;
+  #if defined _WIN32
+  {
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO(&fds);
+    FD_SET(ns->sock, &fds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    return select(0, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv) != 0;
+  }
+  #else
+  {
+    struct pollfd pfd;
+    int result;
+    pfd.fd = ns->sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+      result = poll(&pfd, 1, timeout);
+    } while (result < 0 && errno == EINTR);
+    return result != 0;
+  }
+  #endif
+}
@@ -0,0 +1,47 @@
+/*
+ * Network socket support (TCP and local sockets), limited to the functions
+ * that the GDB RSP needs. It is the counterpart of the rs232 module, for
+ * probes that are reached over a network or through a multiplexing daemon.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _NETSOCK_H
+#define _NETSOCK_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+enum {
+  NETSOCK_NONE,   /* not a socket address (e.g. a serial port) */
+  NETSOCK_TCP,    /* "tcp:host:port" or "host:port" */
+  NETSOCK_UNIX,   /* "unix:path" (Linux only) */
+};
+
+typedef struct tagNETSOCK NETSOCK;
+
+int      netsock_addrtype(const char *address);
+NETSOCK *netsock_open(const char *address);
+void     netsock_close(NETSOCK *ns);
+int      netsock_isopen(const NETSOCK *ns);
+size_t   netsock_send(NETSOCK *ns, const unsigned char *buffer, size_t size);
+size_t   netsock_recv(NETSOCK *ns, unsigned char *buffer, size_t size);
+int      netsock_wait(NETSOCK *ns, int timeout);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _NETSOCK_H */
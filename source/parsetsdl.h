@@ -67,6 +67,21 @@ enum {
 #define CTF_NAME_LENGTH   64
 #define CTF_UUID_LENGTH   16
 
+/* reserved event id (all bits set) for the "lost events" record that the
+   buffered trace functions generated by tracegen insert on overflow */
+#define CTF_EVENTID_LOST(id_size) (0xffffffffUL >> (32 - (id_size)))
+
+/* control block for run-time event filtering (tracegen option -c); layout:
+     uint32_t magic             CTF_CONTROL_MAGIC
+     uint16_t count             number of events
+     uint16_t reserved
+     uint32_t enabled[]         one bit per event, (count + 31) / 32 words
+     uint16_t divider[]         1-in-N decimation per event, count entries
+   events are indexed on their order in the TSDL file */
+#define CTF_CONTROL_MAGIC         0x31435254UL  /* "TRC1" */
+#define CTF_CONTROL_ENABLED(idx)  (8 + 4 * ((idx) / 32))
+#define CTF_CONTROL_DIVIDER(count,idx) (8 + 4 * (((count) + 31) / 32) + 2 * (idx))
+
 typedef struct tagCTF_KEYVALUE {
   struct tagCTF_KEYVALUE *next;
   char name[CTF_NAME_LENGTH];
@@ -0,0 +1,208 @@
+/*
+ * Statistical profiler, based on the periodic PC sampling of the DWT unit in
+ * the Cortex-M3/M4/M7. The sampled PC values are mapped to functions, using
+ * the symbol table in the ELF file.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elf-postlink.h"
+#include "profiler.h"
+
+/* bits in the DWT_CTRL register for PC sampling */
+#define DWT_CYCCNTENA   0x00000001
+#define DWT_POSTPRESET  0x0000001e  /* bits 1..4 */
+#define DWT_CYCTAP      0x00000200
+#define DWT_PCSAMPLENA  0x00001000
+
+static ELF_SYMTABLE symtable = { NULL, 0, NULL };
+static unsigned long *sample_counts = NULL; /* one count per symbol */
+static unsigned long sample_sleep = 0;      /* samples while the core sleeps */
+static unsigned long sample_unknown = 0;    /* samples outside any function */
+static unsigned long sample_total = 0;
+
+static PROFILE_ENTRY *result_list = NULL;   /* sorted on count, rebuilt on request */
+static int result_count = 0;
+static int result_dirty = 0;
+
+/** profile_init() loads the function symbols from the ELF file, and resets
+ *  the sample counts.
+ *
+ *  \param elffile    The path to the ELF file of the target firmware.
+ *
+ *  \return The number of functions, or 0 on failure.
+ */
+int profile_init(const char *elffile)
+{
+  FILE *fp;
+  int result;
+
+  profile_cleanup();
+  if (elffile == NULL || strlen(elffile) == 0 || (fp = fopen(elffile, "rb")) == NULL)
+    return 0;
+  result = elf_load_symbols(fp, ELFSYM_FUNCTION, &symtable);
+  fclose(fp);
+  if (result != ELFERR_NONE || symtable.count == 0) {
+    elf_clear_symbols(&symtable);
+    return 0;
+  }
+
+  sample_counts = malloc(symtable.count * sizeof(unsigned long));
+  result_list = malloc((symtable.count + 2) * sizeof(PROFILE_ENTRY));
+  if (sample_counts == NULL || result_list == NULL) {
+    profile_cleanup();
+    return 0;
+  }
+  profile_reset();
+  return (int)symtable.count;
+}
+
+void profile_cleanup(void)
+{
+  elf_clear_symbols(&symtable);
+  if (sample_counts != NULL) {
+    free(sample_counts);
+    sample_counts = NULL;
+  }
+  if (result_list != NULL) {
+    free(result_list);
+    result_list = NULL;
+  }
+  result_count = 0;
+  sample_sleep = sample_unknown = sample_total = 0;
+}
+
+void profile_reset(void)
+{
+  if (sample_counts != NULL)
+    memset(sample_counts, 0, symtable.count * sizeof(unsigned long));
+  sample_sleep = sample_unknown = sample_total = 0;
+  result_count = 0;
+  result_dirty = 1;
+}
+
+/** profile_sample() adds a PC sample to the histogram.
+ *
+ *  \param pc     The sampled program counter, or PROFILE_SLEEP for a sample
+ *                that was taken while the core was in a sleep mode.
+ */
+void profile_sample(unsigned long pc)
+{
+  if (pc == PROFILE_SLEEP) {
+    sample_sleep += 1;
+  } else {
+    const ELF_SYMBOL *sym = elf_symbol_by_address(&symtable, pc);
+    if (sym != NULL) {
+      assert(sample_counts != NULL);
+      sample_counts[sym - symtable.symbols] += 1;
+    } else {
+      sample_unknown += 1;
+    }
+  }
+  sample_total += 1;
+  result_dirty = 1;
+}
+
+unsigned long profile_total(void)
+{
+  return sample_total;
+}
+
+static int entry_compare(const void *p1, const void *p2)
+{
+  unsigned long c1 = ((const PROFILE_ENTRY*)p1)->count;
+  unsigned long c2 = ((const PROFILE_ENTRY*)p2)->count;
+  if (c1 != c2)
+    return (c1 < c2) ? 1 : -1;
+  return strcmp(((const PROFILE_ENTRY*)p1)->name, ((const PROFILE_ENTRY*)p2)->name);
+}
+
+/** profile_results() returns the flat profile: the functions that have at
+ *  least one sample, sorted on the sample count (highest first).
+ *
+ *  \param list   Set to point to the array with results. The array remains
+ *                valid until the next call to any of the profile functions.
+ *
+ *  \return The number of entries in the list.
+ */
+int profile_results(const PROFILE_ENTRY **list)
+{
+  assert(list != NULL);
+  if (result_dirty && result_list != NULL) {
+    unsigned idx;
+    result_count = 0;
+    for (idx = 0; idx < symtable.count; idx++) {
+      if (sample_counts[idx] > 0) {
+        result_list[result_count].name = symtable.symbols[idx].name;
+        result_list[result_count].address = symtable.symbols[idx].address;
+        result_list[result_count].count = sample_counts[idx];
+        result_count++;
+      }
+    }
+    if (sample_sleep > 0) {
+      result_list[result_count].name = "(sleep)";
+      result_list[result_count].address = PROFILE_SLEEP;
+      result_list[result_count].count = sample_sleep;
+      result_count++;
+    }
+    if (sample_unknown > 0) {
+      result_list[result_count].name = "(unknown)";
+      result_list[result_count].address = 0;
+      result_list[result_count].count = sample_unknown;
+      result_count++;
+    }
+    qsort(result_list, result_count, sizeof(PROFILE_ENTRY), entry_compare);
+    result_dirty = 0;
+  }
+  *list = result_list;
+  return result_count;
+}
+
+/** profile_dwtctrl() calculates the bits for the DWT_CTRL register, for a
+ *  sampling interval that is closest to the requested interval. The DWT takes
+ *  a sample every 64 or 1024 cycles, times a divider in the range 1..16.
+ *
+ *  \param interval   The requested interval in CPU clock cycles, or 0 to
+ *                    disable PC sampling.
+ *  \param actual     Set to the interval that is achieved. This parameter may
+ *                    be NULL.
+ *
+ *  \return The value for the DWT_CTRL bits that the "swo-profile" script sets.
+ */
+unsigned long profile_dwtctrl(unsigned long interval, unsigned long *actual)
+{
+  unsigned long tap, divider;
+
+  if (interval == 0) {
+    if (actual != NULL)
+      *actual = 0;
+    return DWT_CYCCNTENA;
+  }
+  tap = (interval > 16 * 64) ? 1024 : 64;
+  divider = (interval + tap / 2) / tap;
+  if (divider < 1)
+    divider = 1;
+  else if (divider > 16)
+    divider = 16;
+  if (actual != NULL)
+    *actual = divider * tap;
+  return DWT_PCSAMPLENA | ((tap == 1024) ? DWT_CYCTAP : 0)
+         | (((divider - 1) << 1) & DWT_POSTPRESET) | DWT_CYCCNTENA;
+}
@@ -0,0 +1,48 @@
+/*
+ * Statistical profiler, based on the periodic PC sampling of the DWT unit in
+ * the Cortex-M3/M4/M7. The sampled PC values are mapped to functions, using
+ * the symbol table in the ELF file.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define PROFILE_SLEEP   ((unsigned long)-1) /* pseudo-address for samples taken while the core sleeps */
+
+typedef struct tagPROFILE_ENTRY {
+  const char *name;         /* function name, or a pseudo-name in parentheses */
+  unsigned long address;    /* start address of the function */
+  unsigned long count;      /* number of samples */
+} PROFILE_ENTRY;
+
+int  profile_init(const char *elffile);
+void profile_cleanup(void);
+void profile_reset(void);
+void profile_sample(unsigned long pc);
+unsigned long profile_total(void);
+int  profile_results(const PROFILE_ENTRY **list);
+
+unsigned long profile_dwtctrl(unsigned long interval, unsigned long *actual);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _PROFILER_H */
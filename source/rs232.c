@@ -16,12 +16,14 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #if defined _WIN32
   #include <windows.h>
 #else
   #include <stdio.h>
   #include <fcntl.h>
+  #include <poll.h>
   #include <termios.h>
   #include <unistd.h>
   #include <sys/ioctl.h>
@@ -33,12 +35,17 @@
   #define sizearray(a)    (sizeof(a) / sizeof((a)[0]))
 #endif
 
-#if defined _WIN32
-  static HANDLE hCom = INVALID_HANDLE_VALUE;
-#else /* _WIN32 */
-  static int fdCom = -1;
-  static struct termios oldtio;
-#endif /* _WIN32 */
+struct tagHCOM {
+  #if defined _WIN32
+    HANDLE handle;
+    OVERLAPPED ovRead, ovWrite, ovWait;
+    DWORD waitmask;
+    BOOL waitpending;
+  #else /* _WIN32 */
+    int fd;
+    struct termios oldtio;
+  #endif /* _WIN32 */
+};
 
 
 /** rs232_open() opens the RS232 port and sets the initial parameters.
@@ -53,34 +60,54 @@
  *                  0 to keep the default value.
  *  \param parity   The parity setting for the serial connection.
  *
- *  \return An error code, 0 on success.
+ *  \return A handle to the port, or NULL on failure. The handle must be
+ *          released with rs232_close().
  *
  *  \note Flow control settings are currently not supported.
+ *
+ *  \note Each handle holds all state of its port, so that multiple ports can
+ *        be used at the same time (each from its own thread).
  */
-int rs232_open(const char *port, unsigned baud, int databits, int stopbits, int parity)
+HCOM *rs232_open(const char *port, unsigned baud, int databits, int stopbits, int parity)
 {
+  HCOM *hcom = malloc(sizeof(HCOM));
+  if (hcom == NULL)
+    return NULL;
+  memset(hcom, 0, sizeof(HCOM));
+
   #if defined _WIN32
+  {
     DCB dcb;
     COMMTIMEOUTS commtimeouts;
 
-    /* set up the connection */
-    hCom=CreateFileA(port,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
-    if (hCom==INVALID_HANDLE_VALUE && strlen(port)<10) {
+    /* set up the connection (with overlapped I/O, so that rs232_wait() can
+       wait on an event) */
+    hcom->handle=CreateFileA(port,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED,NULL);
+    if (hcom->handle==INVALID_HANDLE_VALUE && strlen(port)<10) {
       /* try with prefix */
       char buffer[40]="\\\\.\\";
       strcat(buffer,port);
-      hCom=CreateFileA(buffer,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+      hcom->handle=CreateFileA(buffer,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED,NULL);
+    }
+    if (hcom->handle==INVALID_HANDLE_VALUE) {
+      free(hcom);
+      return NULL;
     }
-    if (hCom==INVALID_HANDLE_VALUE)
-      return ENXIO;
+    memset(&hcom->ovRead,0,sizeof hcom->ovRead);
+    memset(&hcom->ovWrite,0,sizeof hcom->ovWrite);
+    memset(&hcom->ovWait,0,sizeof hcom->ovWait);
+    hcom->ovRead.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+    hcom->ovWrite.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+    hcom->ovWait.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+    hcom->waitpending=FALSE;
 
-    GetCommState(hCom,&dcb);
+    GetCommState(hcom->handle,&dcb);
     /* first set the baud rate only, because this may fail for a non-standard
      * baud rate
      */
     if (baud!=0) {
       dcb.BaudRate=baud;
-      if (!SetCommState(hCom,&dcb) || dcb.BaudRate!=baud) {
+      if (!SetCommState(hcom->handle,&dcb) || dcb.BaudRate!=baud) {
         /* find the highest standard baud rate below the requated rate */
         static const unsigned stdbaud[] = {1200, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600, 115200, 230400 };
         int i;
@@ -100,16 +127,20 @@ int rs232_open(const char *port, unsigned baud, int databits, int stopbits, int
     dcb.fInX=FALSE;
     dcb.fNull=FALSE;
     dcb.fRtsControl=RTS_CONTROL_DISABLE;
-    SetCommState(hCom,&dcb);
-    SetCommMask(hCom,EV_RXCHAR|EV_TXEMPTY);
+    SetCommState(hcom->handle,&dcb);
+    SetCommMask(hcom->handle,EV_RXCHAR);
 
-    commtimeouts.ReadIntervalTimeout        =0x7fffffff;
+    /* ReadFile() returns immediately, with the bytes that are already
+       received; rs232_wait() waits for data */
+    commtimeouts.ReadIntervalTimeout        =MAXDWORD;
     commtimeouts.ReadTotalTimeoutMultiplier =0;
-    commtimeouts.ReadTotalTimeoutConstant   =1;
+    commtimeouts.ReadTotalTimeoutConstant   =0;
     commtimeouts.WriteTotalTimeoutMultiplier=0;
     commtimeouts.WriteTotalTimeoutConstant  =0;
-    SetCommTimeouts(hCom,&commtimeouts);
+    SetCommTimeouts(hcom->handle,&commtimeouts);
+  }
   #else /* _WIN32 */
+  {
     struct termios newtio;
 
     /* open the serial port device file
@@ -119,16 +150,18 @@ int rs232_open(const char *port, unsigned baud, int databits, int stopbits, int
      *              process for the port. The driver will not send
      *              this process signals due to keyboard aborts, etc.
      */
-    fdCom = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY);
-    if (fdCom < 0) {
+    hcom->fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY);
+    if (hcom->fd < 0) {
       char portdev[60];
       sprintf(portdev, "/dev/%s", port);
-      fdCom = open(portdev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY);
-      if (fdCom < 0)
-        return errno;
+      hcom->fd = open(portdev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY);
+      if (hcom->fd < 0) {
+        free(hcom);
+        return NULL;
+      }
     } /* if */
 
-    tcgetattr(fdCom, &oldtio); /* save current port settings */
+    tcgetattr(hcom->fd, &hcom->oldtio); /* save current port settings */
     memset(&newtio, 0, sizeof newtio);
 
     /* CREAD  - receiver enabled
@@ -180,134 +213,263 @@ int rs232_open(const char *port, unsigned baud, int databits, int stopbits, int
     newtio.c_cc[VTIME]=0; /* inter-character timer used (increments of 0.1 second) */
     newtio.c_cc[VMIN] =0; /* blocking read until 0 chars received */
 
-    tcflush(fdCom, TCIFLUSH);
-    if (tcsetattr(fdCom, TCSANOW, &newtio))
-      return EPROTONOSUPPORT;
+    tcflush(hcom->fd, TCIFLUSH);
+    if (tcsetattr(hcom->fd, TCSANOW, &newtio)) {
+      close(hcom->fd);
+      free(hcom);
+      return NULL;
+    }
 
     /* Set up for no delay, ie non-blocking reads will occur. When we read, we'll
      * get what's in the input buffer or nothing
      */
-    fcntl(fdCom, F_SETFL,FNDELAY);
+    fcntl(hcom->fd, F_SETFL,FNDELAY);
+  }
   #endif /* _WIN32 */
 
-  return 0;
+  return hcom;
 }
 
-void rs232_close(void)
+/* port_shutdown() closes the port, but keeps the handle (so that the port is
+   flagged as closed when a transfer fails) */
+static void port_shutdown(HCOM *hcom)
 {
+  assert(hcom != NULL);
   #if defined _WIN32
-    if (hCom != INVALID_HANDLE_VALUE) {
-      BOOL result = FlushFileBuffers(hCom);
+    if (hcom->handle != INVALID_HANDLE_VALUE) {
+      BOOL result;
+      if (hcom->waitpending) {
+        CancelIo(hcom->handle);
+        hcom->waitpending = FALSE;
+      }
+      result = FlushFileBuffers(hcom->handle);
       if (result || GetLastError() != ERROR_INVALID_HANDLE)
-        CloseHandle(hCom);
-      hCom = INVALID_HANDLE_VALUE;
+        CloseHandle(hcom->handle);
+      hcom->handle = INVALID_HANDLE_VALUE;
+      CloseHandle(hcom->ovRead.hEvent);
+      CloseHandle(hcom->ovWrite.hEvent);
+      CloseHandle(hcom->ovWait.hEvent);
     }
   #else /* _WIN32 */
-    if (fdCom >= 0) {
-      tcflush(fdCom, TCOFLUSH);
-      tcflush(fdCom, TCIFLUSH);
-      tcsetattr(fdCom, TCSANOW, &oldtio);
-      close(fdCom);
-      fdCom = -1;
+    if (hcom->fd >= 0) {
+      tcflush(hcom->fd, TCOFLUSH);
+      tcflush(hcom->fd, TCIFLUSH);
+      tcsetattr(hcom->fd, TCSANOW, &hcom->oldtio);
+      close(hcom->fd);
+      hcom->fd = -1;
     }
   #endif /* _WIN32 */
 }
 
-int rs232_isopen(void)
+/** rs232_close() closes the port and releases the handle.
+ *
+ *  \param hcom     The handle returned by rs232_open(); may be NULL.
+ */
+void rs232_close(HCOM *hcom)
+{
+  if (hcom != NULL) {
+    port_shutdown(hcom);
+    free(hcom);
+  }
+}
+
+/** rs232_isopen() returns whether the port is open. A port is closed
+ *  automatically when it is disconnected (e.g. a USB virtual serial port that
+ *  is unplugged).
+ */
+int rs232_isopen(const HCOM *hcom)
 {
+  if (hcom == NULL)
+    return 0;
   #if defined _WIN32
-    return hCom != INVALID_HANDLE_VALUE;
+    return hcom->handle != INVALID_HANDLE_VALUE;
   #else /* _WIN32 */
-    return fdCom >= 0;
+    return hcom->fd >= 0;
   #endif /* _WIN32 */
 }
 
-size_t rs232_send(const unsigned char *buffer, size_t size)
+/** rs232_send() transmits the data, and waits until all of it is sent, or
+ *  until an error or a time-out occurs.
+ *
+ *  \return The number of bytes sent (which is less than "size" on an error).
+ */
+size_t rs232_send(HCOM *hcom, const unsigned char *buffer, size_t size)
 {
   #if defined _WIN32
     DWORD written = 0;
-    if (hCom != INVALID_HANDLE_VALUE) {
-      if (!WriteFile(hCom, buffer, size, &written, NULL))
-        written = 0;
+    assert(hcom != NULL);
+    if (hcom->handle != INVALID_HANDLE_VALUE) {
+      if (!WriteFile(hcom->handle, buffer, size, &written, &hcom->ovWrite)) {
+        if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hcom->handle, &hcom->ovWrite, &written, TRUE))
+          written = 0;
+      }
     }
     return (size_t)written;
   #else /* _WIN32 */
-    return (fdCom>=0) ? write(fdCom, buffer, size) : 0;
+    size_t sent = 0;
+    assert(hcom != NULL);
+    if (hcom->fd < 0)
+      return 0;
+    /* the port is non-blocking, so a write may be partial, or fail with
+       EAGAIN when the output buffer is full; wait until there is room */
+    while (sent < size) {
+      ssize_t num = write(hcom->fd, buffer + sent, size - sent);
+      if (num > 0) {
+        sent += num;
+      } else if (num < 0 && errno == EAGAIN) {
+        struct pollfd pfd;
+        int result;
+        pfd.fd = hcom->fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        do {
+          result = poll(&pfd, 1, 1000);
+        } while (result < 0 && errno == EINTR);
+        if (result <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+          break;  /* time-out or error */
+      } else if (num == 0 || errno != EINTR) {
+        break;
+      }
+    }
+    return sent;
   #endif /* _WIN32 */
 }
 
-size_t rs232_recv(unsigned char *buffer, size_t size)
+size_t rs232_recv(HCOM *hcom, unsigned char *buffer, size_t size)
 {
   #if defined _WIN32
     DWORD read = 0;
-    if (hCom != INVALID_HANDLE_VALUE) {
-      if (!ReadFile(hCom, buffer, size, &read, NULL)) {
+    assert(hcom != NULL);
+    if (hcom->handle != INVALID_HANDLE_VALUE) {
+      if (!ReadFile(hcom->handle, buffer, size, &read, &hcom->ovRead)) {
         DWORD error = GetLastError();
+        if (error == ERROR_IO_PENDING) {
+          if (!GetOverlappedResult(hcom->handle, &hcom->ovRead, &read, TRUE))
+            read = 0;
+          return (size_t)read;
+        }
         if (error == ERROR_INVALID_HANDLE)
-          hCom = INVALID_HANDLE_VALUE;
+          hcom->handle = INVALID_HANDLE_VALUE;
         else if (error == ERROR_ACCESS_DENIED)
-          rs232_close();
+          port_shutdown(hcom);
         read = 0;
       }
     }
     return (size_t)read;
   #else /* _WIN32 */
-    if (fdCom >= 0) {
-      int num = (int)read(fdCom, buffer, size);
-      if (num < 0)
-        rs232_close();
+    assert(hcom != NULL);
+    if (hcom->fd >= 0) {
+      int num = (int)read(hcom->fd, buffer, size);
+      if (num < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+          port_shutdown(hcom);
+        num = 0;
+      }
       return num;
     }
     return 0;
   #endif /* _WIN32 */
 }
 
-void rs232_break(void)
+/** rs232_wait() waits until data is received, or until a timeout.
+ *
+ *  \param timeout  The maximum time to wait, in milliseconds; -1 to wait
+ *                  without limit.
+ *
+ *  \return 1 if data is available (or the port is in an error state, so
+ *          that rs232_recv() will detect it), 0 on timeout.
+ */
+int rs232_wait(HCOM *hcom, int timeout)
+{
+  #if defined _WIN32
+    COMSTAT comstat;
+    DWORD errors, result;
+    assert(hcom != NULL);
+    if (hcom->handle == INVALID_HANDLE_VALUE)
+      return 0;
+    if (!hcom->waitpending) {
+      if (ClearCommError(hcom->handle, &errors, &comstat) && comstat.cbInQue > 0)
+        return 1;
+      ResetEvent(hcom->ovWait.hEvent);
+      if (WaitCommEvent(hcom->handle, &hcom->waitmask, &hcom->ovWait))
+        return 1;
+      if (GetLastError() != ERROR_IO_PENDING)
+        return 1;   /* let rs232_recv() handle the error */
+      hcom->waitpending = TRUE;
+      /* bytes that arrived before WaitCommEvent() do not signal the event */
+      if (ClearCommError(hcom->handle, &errors, &comstat) && comstat.cbInQue > 0)
+        return 1;
+    }
+    result = WaitForSingleObject(hcom->ovWait.hEvent, (timeout < 0) ? INFINITE : (DWORD)timeout);
+    if (result != WAIT_OBJECT_0)
+      return 0;     /* leave the wait pending, for the next call */
+    hcom->waitpending = FALSE;
+    return 1;
+  #else /* _WIN32 */
+    struct pollfd pfd;
+    int result;
+    assert(hcom != NULL);
+    if (hcom->fd < 0)
+      return 0;
+    pfd.fd = hcom->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+      result = poll(&pfd, 1, timeout);
+    } while (result < 0 && errno == EINTR);
+    return result != 0;
+  #endif /* _WIN32 */
+}
+
+void rs232_break(HCOM *hcom)
 {
+  assert(hcom != NULL);
   #if defined _WIN32
-    if (hCom!=INVALID_HANDLE_VALUE) {
-      SetCommBreak(hCom);
+    if (hcom->handle!=INVALID_HANDLE_VALUE) {
+      SetCommBreak(hcom->handle);
       Sleep(200);
-      ClearCommBreak(hCom);
+      ClearCommBreak(hcom->handle);
     }
   #else /* _WIN32 */
-    if (fdCom>=0)
-      tcsendbreak(fdCom, 0);
+    if (hcom->fd>=0)
+      tcsendbreak(hcom->fd, 0);
   #endif /* _WIN32 */
 }
 
-void rs232_dtr(int set)
+void rs232_dtr(HCOM *hcom, int set)
 {
+  assert(hcom != NULL);
   #if defined _WIN32
-    if (hCom!=INVALID_HANDLE_VALUE)
-      EscapeCommFunction(hCom, set ? SETDTR : CLRDTR);
+    if (hcom->handle!=INVALID_HANDLE_VALUE)
+      EscapeCommFunction(hcom->handle, set ? SETDTR : CLRDTR);
   #else /* _WIN32 */
-    if (fdCom>=0) {
+    if (hcom->fd>=0) {
       int flags;
-      ioctl(fdCom,TIOCMGET,&flags);
+      ioctl(hcom->fd,TIOCMGET,&flags);
       if (set)
         flags |= TIOCM_DTR;
       else
         flags &= ~TIOCM_DTR;
-      ioctl(fdCom,TIOCMSET,&flags);
+      ioctl(hcom->fd,TIOCMSET,&flags);
     }
   #endif /* _WIN32 */
 }
 
-void rs232_rts(int set)
+void rs232_rts(HCOM *hcom, int set)
 {
+  assert(hcom != NULL);
   #if defined _WIN32
-  if (hCom!=INVALID_HANDLE_VALUE)
-    EscapeCommFunction(hCom, set ? SETRTS : CLRRTS);
+  if (hcom->handle!=INVALID_HANDLE_VALUE)
+    EscapeCommFunction(hcom->handle, set ? SETRTS : CLRRTS);
   #else /* _WIN32 */
-    if (fdCom>=0) {
+    if (hcom->fd>=0) {
       int flags;
-      ioctl(fdCom,TIOCMGET,&flags);
+      ioctl(hcom->fd,TIOCMGET,&flags);
       if (set)
         flags |= TIOCM_RTS;
       else
         flags &= ~TIOCM_RTS;
-      ioctl(fdCom,TIOCMSET,&flags);
+      ioctl(hcom->fd,TIOCMSET,&flags);
     }
   #endif /* _WIN32 */
 }
@@ -27,14 +27,17 @@ enum {
   PAR_EVEN,
 };
 
-int    rs232_open(const char *port, unsigned baud, int databits, int stopbits, int parity);
-void   rs232_close(void);
-int    rs232_isopen(void);
-size_t rs232_send(const unsigned char *buffer, size_t size);
-size_t rs232_recv(unsigned char *buffer, size_t size);
-void   rs232_break(void);
-void   rs232_dtr(int set);
-void   rs232_rts(int set);
+typedef struct tagHCOM HCOM;
+
+HCOM  *rs232_open(const char *port, unsigned baud, int databits, int stopbits, int parity);
+void   rs232_close(HCOM *hcom);
+int    rs232_isopen(const HCOM *hcom);
+size_t rs232_send(HCOM *hcom, const unsigned char *buffer, size_t size);
+size_t rs232_recv(HCOM *hcom, unsigned char *buffer, size_t size);
+int    rs232_wait(HCOM *hcom, int timeout);
+void   rs232_break(HCOM *hcom);
+void   rs232_dtr(HCOM *hcom, int set);
+void   rs232_rts(HCOM *hcom, int set);
 
 #if defined __cplusplus
   }
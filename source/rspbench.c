@@ -0,0 +1,286 @@
+/*
+ * Microbenchmark for the encoder and decoder of the GDB Remote Serial
+ * Protocol (gdb-rsp.c). The serial port layer is replaced by a loopback in
+ * memory, so that the throughput of the packet encoding and decoding
+ * (escapes and checksum) is measured without the overhead of the operating
+ * system. Before timing, it verifies that the
+ * decoded packets are equal to the transmitted payloads.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gdb-rsp.h"
+#include "rs232.h"
+
+
+#if !defined sizearray
+  #define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
+#endif
+
+#define MAX_PAYLOAD   4096
+#define RUN_TIME      0.5     /* seconds per measurement */
+
+/* The loopback: transmitted data is appended to the buffer, received data is
+   read from it. When "discard" is set, transmitted data is dropped. */
+struct tagHCOM {
+  unsigned char *buffer;
+  size_t size, length, readpos;
+  int discard;
+};
+
+static HCOM *loopback = NULL;
+
+HCOM *rs232_open(const char *port, unsigned baud, int databits, int stopbits, int parity)
+{
+  HCOM *hcom;
+
+  (void)port; (void)baud; (void)databits; (void)stopbits; (void)parity;
+  hcom = malloc(sizeof(HCOM));
+  if (hcom != NULL)
+    memset(hcom, 0, sizeof(HCOM));
+  loopback = hcom;
+  return hcom;
+}
+
+void rs232_close(HCOM *hcom)
+{
+  if (hcom != NULL) {
+    free(hcom->buffer);
+    free(hcom);
+  }
+  loopback = NULL;
+}
+
+int rs232_isopen(const HCOM *hcom)
+{
+  return hcom != NULL;
+}
+
+size_t rs232_send(HCOM *hcom, const unsigned char *buffer, size_t size)
+{
+  if (hcom->discard)
+    return size;
+  if (hcom->length + size > hcom->size) {
+    size_t newsize = (hcom->size > 0) ? hcom->size : 4096;
+    unsigned char *buf;
+    while (newsize < hcom->length + size)
+      newsize *= 2;
+    buf = realloc(hcom->buffer, newsize);
+    if (buf == NULL)
+      return 0;
+    hcom->buffer = buf;
+    hcom->size = newsize;
+  }
+  memcpy(hcom->buffer + hcom->length, buffer, size);
+  hcom->length += size;
+  return size;
+}
+
+size_t rs232_recv(HCOM *hcom, unsigned char *buffer, size_t size)
+{
+  if (size > hcom->length - hcom->readpos)
+    size = hcom->length - hcom->readpos;
+  memcpy(buffer, hcom->buffer + hcom->readpos, size);
+  hcom->readpos += size;
+  return size;
+}
+
+int rs232_wait(HCOM *hcom, int timeout)
+{
+  (void)timeout;
+  return hcom->readpos < hcom->length;
+}
+
+void rs232_break(HCOM *hcom)
+{
+  (void)hcom;
+}
+
+void rs232_dtr(HCOM *hcom, int set)
+{
+  (void)hcom; (void)set;
+}
+
+void rs232_rts(HCOM *hcom, int set)
+{
+  (void)hcom; (void)set;
+}
+
+static double timestamp(void)
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/** make_payload() fills a buffer with test data: random bytes (so that
+ *  about 4 in 256 bytes must be escaped), or hexadecimal text with runs of
+ *  repeated characters (as in a memory read reply).
+ */
+static void make_payload(unsigned char *payload, size_t size, int binary)
+{
+  size_t idx;
+
+  for (idx = 0; idx < size; idx++) {
+    if (binary)
+      payload[idx] = (unsigned char)rand();
+    else
+      payload[idx] = (unsigned char)("0123456789abcdef"[(idx / 16) % 16]);
+  }
+}
+
+/** check() transmits a set of packets and verifies that the decoder returns
+ *  the same payloads.
+ *
+ *  \return 1 on success, 0 on failure.
+ */
+static int check(GDBRSP *rsp, int binary)
+{
+  static unsigned char payload[MAX_PAYLOAD];
+  static char received[MAX_PAYLOAD];
+  size_t size, count;
+
+  for (size = 1; size <= MAX_PAYLOAD; size = size * 3 + 1) {
+    make_payload(payload, size, binary);
+    loopback->length = loopback->readpos = 0;
+    loopback->discard = 0;
+    gdbrsp_xmit(rsp, (const char*)payload, (int)size);
+    gdbrsp_xmit(rsp, "OK", -1);
+    count = gdbrsp_recv(rsp, received, sizeof received, 100);
+    if (count != size || memcmp(received, payload, size) != 0)
+      return 0;
+    count = gdbrsp_recv(rsp, received, sizeof received, 100);
+    if (count != 2 || memcmp(received, "OK", 2) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/** measure() returns the encoder and decoder throughput in MB/s of payload
+ *  data, for packets of a given size.
+ */
+static void measure(GDBRSP *rsp, size_t size, int binary, double *encode, double *decode)
+{
+  static unsigned char payload[MAX_PAYLOAD];
+  static char received[MAX_PAYLOAD];
+  GDBRSP_SEGMENT segment;
+  double start, stop;
+  size_t total;
+  int idx, packets;
+
+  make_payload(payload, size, binary);
+  segment.data = payload;
+  segment.size = size;
+
+  loopback->discard = 1;
+  total = 0;
+  start = timestamp();
+  do {
+    for (idx = 0; idx < 256; idx++) {
+      gdbrsp_xmitv(rsp, &segment, 1);
+      total += size;
+    }
+    stop = timestamp();
+  } while (stop - start < RUN_TIME);
+  *encode = total / (stop - start) / 1e6;
+
+  /* fill the loopback with packets (only once), then decode these repeatedly */
+  loopback->discard = 0;
+  loopback->length = 0;
+  packets = (int)((4UL << 20) / size) + 1;
+  for (idx = 0; idx < packets; idx++)
+    gdbrsp_xmitv(rsp, &segment, 1);
+  total = 0;
+  start = timestamp();
+  do {
+    loopback->readpos = 0;
+    for (idx = 0; idx < packets; idx++)
+      total += gdbrsp_recv(rsp, received, sizeof received, 100);
+    stop = timestamp();
+  } while (stop - start < RUN_TIME);
+  *decode = total / (stop - start) / 1e6;
+}
+
+static void usage(void)
+{
+  printf("rspbench - measure the throughput of the GDB-RSP packet encoder and decoder.\n\n"
+         "Usage: rspbench [options]\n\n"
+         "Options:\n"
+         "-c\t Only check that decoded packets match the transmitted ones.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const size_t sizes[] = { 64, 256, 1024, 4096 };
+  GDBRSP *rsp;
+  double encode, decode;
+  int idx, binary, opt_bench = 1;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 'c':
+        opt_bench = 0;
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+      return 1;
+    }
+  }
+
+  rsp = gdbrsp_open("loopback");
+  if (rsp == NULL) {
+    fprintf(stderr, "Failed to open the loopback port.\n");
+    return 1;
+  }
+  gdbrsp_noack(rsp, 1);
+  gdbrsp_packetsize(rsp, 2 * MAX_PAYLOAD + 32);  /* room for a fully escaped packet */
+
+  srand(1);
+  for (binary = 1; binary >= 0; binary--) {
+    if (!check(rsp, binary)) {
+      printf("Round trip of %s packets FAILED\n", binary ? "binary" : "text");
+      gdbrsp_close(rsp);
+      return 1;
+    }
+    printf("Round trip of %s packets: ok\n", binary ? "binary" : "text");
+  }
+
+  if (opt_bench) {
+    printf("\n%-10s%12s%12s%12s%12s   (MB/s)\n", "Payload", "enc-binary", "dec-binary", "enc-text", "dec-text");
+    for (idx = 0; idx < (int)sizearray(sizes); idx++) {
+      printf("%-10lu", (unsigned long)sizes[idx]);
+      for (binary = 1; binary >= 0; binary--) {
+        measure(rsp, sizes[idx], binary, &encode, &decode);
+        printf("%12.0f%12.0f", encode, decode);
+      }
+      printf("\n");
+    }
+  }
+
+  gdbrsp_close(rsp);
+  return 0;
+}
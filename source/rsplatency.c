@@ -0,0 +1,237 @@
+/*
+ * Round-trip latency benchmark for the GDB Remote Serial Protocol layer
+ * (gdb-rsp.c and rs232.c). It opens a pseudo-terminal, with a minimal
+ * stand-in for a gdbserver on the master side (in a child process), and
+ * times request/response round trips through the serial port layer, both
+ * with acknowledgements and in the "no-ack" mode. The requests are memory
+ * reads of 256 bytes, so a round trip is typical of what the utilities do
+ * (e.g. on a verify).
+ *
+ * This utility requires pseudo-terminals, and is therefore only available
+ * for Linux (and other POSIX systems).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "gdb-rsp.h"
+
+
+#define DEFAULT_COUNT 2000
+#define READ_SIZE     256     /* bytes per memory read */
+
+static void stub_reply(int fd, const char *payload, int noack)
+{
+  static char packet[2 * READ_SIZE + 16];
+  const char *ptr;
+  unsigned sum = 0;
+  int len;
+
+  for (ptr = payload; *ptr != '\0'; ptr++)
+    sum += (unsigned char)*ptr;
+  len = sprintf(packet, "%s$%s#%02x", noack ? "" : "+", payload, sum & 0xff);
+  if (write(fd, packet, len) != len)
+    perror("write");
+}
+
+/** stub_server() is the stand-in for the gdbserver: it answers a memory read
+ *  request ("m") with a block of data, and any other request with "OK". It
+ *  does not verify checksums.
+ */
+static void stub_server(int fd)
+{
+  static char buffer[8192];
+  static char data[2 * READ_SIZE + 1];
+  int len = 0, noack = 0;
+
+  memset(data, 'a', 2 * READ_SIZE);
+  data[2 * READ_SIZE] = '\0';
+  for ( ;; ) {
+    int count = read(fd, buffer + len, sizeof buffer - len);
+    if (count <= 0)
+      return;
+    len += count;
+    for ( ;; ) {
+      char *start, *end;
+      int used;
+      start = memchr(buffer, '$', len);
+      if (start == NULL) {
+        len = 0;  /* drop acknowledgements and noise */
+        break;
+      }
+      end = memchr(start, '#', len - (start - buffer));
+      if (end == NULL || end + 2 >= buffer + len)
+        break;    /* packet is not complete */
+      if (end - start - 1 == 15 && memcmp(start + 1, "QStartNoAckMode", 15) == 0) {
+        stub_reply(fd, "OK", 0);
+        noack = 1;
+      } else if (start[1] == 'm') {
+        stub_reply(fd, data, noack);
+      } else {
+        stub_reply(fd, "OK", noack);
+      }
+      used = (end + 3) - buffer;
+      memmove(buffer, buffer + used, len - used);
+      len -= used;
+    }
+  }
+}
+
+static double timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da < db) ? -1 : (da > db) ? 1 : 0;
+}
+
+/** measure() runs the round trips and prints the statistics.
+ *
+ *  \return The number of round trips that failed.
+ */
+static int measure(GDBRSP *rsp, const char *label, double *times, int count)
+{
+  char request[32], reply[2 * READ_SIZE + 16];
+  double start, total;
+  int idx, failed = 0;
+
+  sprintf(request, "m20000000,%x", READ_SIZE);
+  total = 0.0;
+  for (idx = 0; idx < count; idx++) {
+    start = timestamp();
+    if (!gdbrsp_xmit(rsp, request, -1) || gdbrsp_recv(rsp, reply, sizeof reply, 1000) != 2 * READ_SIZE)
+      failed++;
+    times[idx] = timestamp() - start;
+    total += times[idx];
+  }
+  qsort(times, count, sizeof(double), compare_double);
+  printf("%-8s %8.1f %8.1f %8.1f %8.1f   %d/%d\n", label,
+         1e6 * total / count, 1e6 * times[count / 2], 1e6 * times[(count * 99) / 100],
+         1e6 * times[count - 1], count - failed, count);
+  return failed;
+}
+
+static void usage(void)
+{
+  printf("rsplatency - measure the round-trip latency of the GDB-RSP layer over a\n"
+         "             pseudo-terminal.\n\n"
+         "Usage: rsplatency [options]\n\n"
+         "Options:\n"
+         "-n=count Number of round trips per mode (default %d).\n",
+         DEFAULT_COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+  struct termios tio;
+  char portname[160], reply[64];
+  double *times;
+  GDBRSP *rsp;
+  pid_t pid;
+  int idx, master, slave, failed;
+  int count = DEFAULT_COUNT;
+
+  for (idx = 1; idx < argc; idx++) {
+    if (argv[idx][0] == '-' || argv[idx][0] == '/') {
+      const char *ptr = &argv[idx][2];
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage();
+        return 0;
+      case 'n':
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        count = atoi(ptr);
+        if (count < 1) {
+          fprintf(stderr, "Invalid count %s.\n", ptr);
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option %s; use option -h for help.\n", argv[idx]);
+      return 1;
+    }
+  }
+
+  times = malloc(count * sizeof(double));
+  if (times == NULL) {
+    fprintf(stderr, "Memory allocation failure.\n");
+    return 1;
+  }
+  if (openpty(&master, &slave, portname, NULL, NULL) != 0) {
+    perror("openpty");
+    return 1;
+  }
+  tcgetattr(master, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master, TCSANOW, &tio);
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    close(slave);
+    stub_server(master);
+    _exit(0);
+  }
+  close(master);
+
+  rsp = gdbrsp_open(portname);
+  if (rsp == NULL) {
+    fprintf(stderr, "Failed to open %s.\n", portname);
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  gdbrsp_packetsize(rsp, 2 * READ_SIZE + 16);
+
+  printf("Round trip of a %d-byte memory read, in microseconds\n", READ_SIZE);
+  printf("%-8s %8s %8s %8s %8s   %s\n", "Mode", "mean", "median", "99%", "max", "ok");
+  failed = measure(rsp, "ack", times, count);
+  gdbrsp_xmit(rsp, "QStartNoAckMode", -1);
+  if (gdbrsp_recv(rsp, reply, sizeof reply, 1000) == 2 && memcmp(reply, "OK", 2) == 0) {
+    gdbrsp_noack(rsp, 1);
+    failed += measure(rsp, "no-ack", times, count);
+  } else {
+    printf("Failed to switch to no-ack mode.\n");
+    failed++;
+  }
+
+  gdbrsp_close(rsp);
+  close(slave);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  free(times);
+  return (failed > 0) ? 1 : 0;
+}
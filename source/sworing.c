@@ -0,0 +1,310 @@
+/*
+ * Shared-memory ring buffer for the raw SWO packets, so that the trace data
+ * of a single probe can be consumed by several processes. There is a single
+ * writer (the capture daemon) and any number of readers, each with its own
+ * read position.
+ *
+ * The writer never waits for the readers: a reader that falls behind by more
+ * than the size of the ring loses packets (an overrun), which it detects
+ * from the sequence numbers. Each slot carries the sequence number of the
+ * packet in it; the writer invalidates it before overwriting the slot, and
+ * a reader checks it before and after copying the slot, so that it never
+ * returns a packet that was overwritten while it was reading it.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined WIN32 || defined _WIN32
+  #define STRICT
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <signal.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "atomics.h"
+#include "sworing.h"
+
+#if defined WIN32 || defined _WIN32
+  #define RING_NAME     "Local\\BlackMagicSWO"
+#else
+  #define RING_NAME     "/blackmagic-swo"
+#endif
+#define RING_MAGIC      0x474e5253UL  /* "SRNG" */
+#define SEQ_INVALID     (~(uint64_t)0)
+
+typedef struct tagRINGSLOT {
+  uint64_t seq;             /* sequence number of the packet in the slot */
+  double timestamp;
+  uint32_t length;
+  unsigned char data[SWORING_PKTSIZE];
+} RINGSLOT;
+
+typedef struct tagRINGHEADER {
+  uint32_t magic;
+  uint32_t slots;           /* number of slots that follow the header */
+  uint32_t pid;             /* process id of the writer, 0 when it has quit */
+  uint32_t reserved;
+  uint64_t head;            /* sequence number of the next packet to write */
+} RINGHEADER;
+
+static RINGHEADER *ring = NULL;
+static RINGSLOT *ring_slots = NULL;
+static size_t ring_size = 0;      /* size of the mapping, in bytes */
+static int ring_writer = 0;
+static uint64_t cursor = 0;       /* sequence number of the next packet to read */
+static unsigned long overruns = 0;
+#if defined WIN32 || defined _WIN32
+  static HANDLE hMapping = NULL;
+#endif
+
+/** sworing_create() creates the shared ring, for the writer.
+ *  \param slots  The number of packets that the ring holds.
+ *
+ *  \return 1 on success, 0 on failure.
+ */
+int sworing_create(unsigned slots)
+{
+  void *map;
+
+  assert(slots > 0);
+  sworing_close();
+  ring_size = sizeof(RINGHEADER) + slots * sizeof(RINGSLOT);
+  #if defined WIN32 || defined _WIN32
+    hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)ring_size, RING_NAME);
+    if (hMapping == NULL)
+      return 0;
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+      CloseHandle(hMapping);  /* another daemon is running */
+      hMapping = NULL;
+      return 0;
+    }
+    map = MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, ring_size);
+    if (map == NULL) {
+      CloseHandle(hMapping);
+      hMapping = NULL;
+      return 0;
+    }
+  #else
+    {
+      int fd;
+      shm_unlink(RING_NAME);  /* remove a stale ring of a daemon that crashed */
+      fd = shm_open(RING_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if (fd < 0)
+        return 0;
+      if (ftruncate(fd, ring_size) != 0) {
+        close(fd);
+        shm_unlink(RING_NAME);
+        return 0;
+      }
+      map = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) {
+        shm_unlink(RING_NAME);
+        return 0;
+      }
+    }
+  #endif
+  ring = (RINGHEADER*)map;
+  ring_slots = (RINGSLOT*)(ring + 1);
+  memset(map, 0, ring_size);
+  ring->slots = slots;
+  #if defined WIN32 || defined _WIN32
+    ring->pid = (uint32_t)GetCurrentProcessId();
+  #else
+    ring->pid = (uint32_t)getpid();
+  #endif
+  ATOMIC_STORE32(&ring->magic, RING_MAGIC); /* magic last, readers check it */
+  ring_writer = 1;
+  return 1;
+}
+
+/** sworing_open() attaches to the shared ring, for a reader. The reader
+ *  starts at the most recent packet; it does not receive older packets.
+ *
+ *  \return 1 on success, 0 on failure (no capture daemon is running).
+ */
+int sworing_open(void)
+{
+  void *map;
+
+  sworing_close();
+  #if defined WIN32 || defined _WIN32
+    hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, RING_NAME);
+    if (hMapping == NULL)
+      return 0;
+    map = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (map == NULL) {
+      CloseHandle(hMapping);
+      hMapping = NULL;
+      return 0;
+    }
+    ring_size = 0;  /* not needed for unmapping */
+  #else
+    {
+      struct stat st;
+      int fd = shm_open(RING_NAME, O_RDONLY, 0);
+      if (fd < 0)
+        return 0;
+      if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RINGHEADER)) {
+        close(fd);
+        return 0;
+      }
+      ring_size = (size_t)st.st_size;
+      map = mmap(NULL, ring_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED)
+        return 0;
+    }
+  #endif
+  ring = (RINGHEADER*)map;
+  ring_slots = (RINGSLOT*)(ring + 1);
+  ring_writer = 0;
+  /* check that the ring is valid, and that the daemon is still running */
+  if (ATOMIC_LOAD32(&ring->magic) != RING_MAGIC || ring->pid == 0
+      #if !(defined WIN32 || defined _WIN32)
+        || (ring_size < sizeof(RINGHEADER) + ring->slots * sizeof(RINGSLOT))
+        || (kill((pid_t)ring->pid, 0) != 0 && errno != EPERM)
+      #endif
+     )
+  {
+    sworing_close();
+    return 0;
+  }
+  cursor = ATOMIC_LOAD64(&ring->head);
+  overruns = 0;
+  return 1;
+}
+
+/** sworing_close() detaches from the shared ring. When the writer closes
+ *  the ring, readers see that the daemon has quit.
+ */
+void sworing_close(void)
+{
+  if (ring == NULL)
+    return;
+  if (ring_writer)
+    ATOMIC_STORE32(&ring->pid, 0);
+  #if defined WIN32 || defined _WIN32
+    UnmapViewOfFile(ring);
+    CloseHandle(hMapping);
+    hMapping = NULL;
+  #else
+    munmap(ring, ring_size);
+    if (ring_writer)
+      shm_unlink(RING_NAME);
+  #endif
+  ring = NULL;
+  ring_slots = NULL;
+  ring_writer = 0;
+}
+
+/** sworing_isopen() returns whether the ring is created or attached to.
+ */
+int sworing_isopen(void)
+{
+  return (ring != NULL);
+}
+
+/** sworing_write() adds a packet to the ring (writer only). The oldest
+ *  packet is overwritten when the ring is full.
+ */
+void sworing_write(const unsigned char *data, size_t length, double timestamp)
+{
+  uint64_t seq;
+  RINGSLOT *slot;
+
+  assert(ring != NULL && ring_writer);
+  assert(data != NULL || length == 0);
+  if (length > SWORING_PKTSIZE)
+    length = SWORING_PKTSIZE;
+  seq = ring->head;
+  slot = &ring_slots[seq % ring->slots];
+  ATOMIC_STORE64(&slot->seq, SEQ_INVALID);  /* readers now skip this slot */
+  FENCE_RELEASE();  /* the slot is invalid before its payload changes */
+  slot->timestamp = timestamp;
+  slot->length = (uint32_t)length;
+  memcpy(slot->data, data, length);
+  ATOMIC_STORE64(&slot->seq, seq);
+  ATOMIC_STORE64(&ring->head, seq + 1);     /* publish */
+}
+
+/** sworing_read() copies the next packet from the ring (reader only).
+ *  \param data       Is set to the packet data.
+ *  \param size       The size of the "data" buffer.
+ *  \param timestamp  Is set to the time at which the daemon received the
+ *                    packet.
+ *
+ *  \return The size of the packet, 0 if there is no new packet, or -1 if
+ *          the daemon has quit.
+ *
+ *  \note If the reader fell behind, so that the ring overwrote packets
+ *        before they were read, the reader continues at the oldest packet
+ *        in the ring, and the overrun counter is incremented.
+ */
+int sworing_read(unsigned char *data, size_t size, double *timestamp)
+{
+  assert(ring != NULL && !ring_writer);
+  assert(data != NULL && timestamp != NULL);
+  for ( ;; ) {
+    uint64_t head = ATOMIC_LOAD64(&ring->head);
+    const RINGSLOT *slot;
+    uint32_t length;
+    if (cursor == head)
+      return (ATOMIC_LOAD32(&ring->pid) != 0) ? 0 : -1;
+    if (head - cursor > ring->slots) {
+      overruns++;
+      cursor = head - ring->slots;
+    }
+    slot = &ring_slots[cursor % ring->slots];
+    if (ATOMIC_LOAD64(&slot->seq) != cursor) {
+      overruns++;   /* the slot is being overwritten */
+      cursor++;
+      continue;
+    }
+    length = slot->length;
+    if (length > size)
+      length = (uint32_t)size;
+    if (length > SWORING_PKTSIZE)
+      length = SWORING_PKTSIZE;
+    memcpy(data, slot->data, length);
+    *timestamp = slot->timestamp;
+    FENCE_ACQUIRE();
+    if (ATOMIC_LOAD64(&slot->seq) != cursor) {
+      overruns++;   /* overwritten while it was copied */
+      cursor++;
+      continue;
+    }
+    cursor++;
+    return (int)length;
+  }
+}
+
+/** sworing_overruns() returns the number of times that the reader lost
+ *  packets, because it fell behind the writer.
+ */
+unsigned long sworing_overruns(void)
+{
+  return overruns;
+}
@@ -0,0 +1,43 @@
+/*
+ * Shared-memory ring buffer for the raw SWO packets, so that the trace data
+ * of a single probe can be consumed by several processes. There is a single
+ * writer (the capture daemon) and any number of readers, each with its own
+ * read position.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _SWORING_H
+#define _SWORING_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+#define SWORING_PKTSIZE 64    /* maximum size of a packet (USB transfer) */
+#define SWORING_SLOTS   4096  /* default number of packets in the ring */
+
+int  sworing_create(unsigned slots);
+int  sworing_open(void);
+void sworing_close(void);
+int  sworing_isopen(void);
+void sworing_write(const unsigned char *data, size_t length, double timestamp);
+int  sworing_read(unsigned char *data, size_t size, double *timestamp);
+unsigned long sworing_overruns(void);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _SWORING_H */
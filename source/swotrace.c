@@ -16,6 +16,9 @@
  * limitations under the License.
  */
 #include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,10 +27,6 @@
   #define STRICT
   #define WIN32_LEAN_AND_MEAN
   #include <windows.h>
-  #include <tchar.h>
-  #include <initguid.h>
-  #include <setupapi.h>
-  #include <winusb.h>
   #include <malloc.h>
   #if defined __MINGW32__ || defined __MINGW64__ || defined _MSC_VER
     #include "strlcpy.h"
@@ -41,14 +40,20 @@
   #include <unistd.h>
   #include <bsd/string.h>
   #include <sys/stat.h>
-  #include <libusb-1.0/libusb.h>
 #endif
 
-#include "bmscan.h"
+#include "atomics.h"
+#include "capture.h"
 #include "guidriver.h"
 #include "parsetsdl.h"
 #include "decodectf.h"
+#include "ctfstore.h"
+#include "decodeitm.h"
+#include "decodetpiu.h"
+#include "sworing.h"
+#include "swousb.h"
 #include "swotrace.h"
+#include "tracetime.h"
 
 
 #ifndef NK_ASSERT
@@ -139,20 +144,24 @@ void channel_setcolor(int index, struct nk_color color)
 
 
 #define PACKET_SIZE 64
-#define PACKET_NUM  16
+#define PACKET_NUM  256   /* queue between the USB reader and the decoder */
 typedef struct tagPACKET {
   unsigned char data[PACKET_SIZE];
   size_t length;
   double timestamp;
+  int gap;              /* packets were lost before this one */
 } PACKET;
 static PACKET trace_queue[PACKET_NUM];
-static int tracequeue_head = 0, tracequeue_tail = 0;
+static volatile int tracequeue_head = 0, tracequeue_tail = 0;
+
+static volatile int decode_enabled = 0;
+static volatile int decode_quit = 0;
 
 
 typedef struct tagTRACESTRING {
   struct tagTRACESTRING *next;
   char *text;
-  double timestamp;       /* in micro-seconds */
+  double timestamp;       /* in seconds */
   char timefmt[15];       /* formatted string with time stamp */
   unsigned short timefmt_len;
   unsigned short length, size;
@@ -164,188 +173,1029 @@ typedef struct tagTRACESTRING {
 #define TRACESTRING_INITSIZE  32
 static TRACESTRING tracestring_root = { NULL, NULL };
 static TRACESTRING *tracestring_tail = NULL;
+static TRACESTRING *tracestring_untimed = NULL; /* first string since the most recent ITM timestamp */
+static TIMEFIT ctf_fit;   /* mapping of the CTF clock to the host clock */
 static int trace_decodectf = 0;
+static int trace_formatter = 0;
+
+#define TRACEFLG_DONE     0x01  /* string is terminated */
+#define TRACEFLG_CTFCLOCK 0x02  /* timestamp is from the CTF clock */
+
+/* The decoder thread builds the strings in a list that only it modifies.
+   Strings that can no longer change (terminated, and with their final
+   timestamp) are "sealed", and after each batch of packets, the decoder
+   publishes the range of sealed strings. The GUI only walks the published
+   range, from a snapshot that it takes once per frame, in
+   tracestring_process(). Strings that the decoder removes from the head of
+   the list are not freed until the GUI has started a new frame (and thus
+   taken a new snapshot). */
+static TRACESTRING *tracestring_sealed = NULL;  /* last sealed string */
+static unsigned sealed_count = 0;
+static volatile unsigned pub_seq = 0;           /* sequence lock on the published range */
+static TRACESTRING * volatile pub_head = NULL;
+static TRACESTRING * volatile pub_tail = NULL;
+static volatile unsigned pub_count = 0;
+static volatile unsigned gui_epoch = 0;         /* incremented on each GUI frame */
+static TRACESTRING *view_head = NULL;           /* snapshot of the published range (GUI) */
+static TRACESTRING *view_tail = NULL;
+static unsigned view_count = 0;
+
+#define RETIRE_MARKS  8
+typedef struct tagRETIREMARK {
+  TRACESTRING *last;
+  unsigned epoch;
+} RETIREMARK;
+static TRACESTRING *retired_head = NULL;  /* removed strings, waiting to be freed */
+static TRACESTRING *retired_last = NULL;
+static RETIREMARK retired_marks[RETIRE_MARKS];
+static int retired_count = 0;
 
-void tracestring_add(const unsigned char *buffer, size_t length, double timestamp)
+#if defined WIN32 || defined _WIN32
+  static CRITICAL_SECTION decode_lock;
+#else
+  static pthread_mutex_t decode_lock;
+#endif
+static int decode_lock_init = 0;
+
+/* trigger conditions for the capture */
+static char trigger_text[128] = "";
+static char trigger_event[CTF_NAME_LENGTH] = "";
+static char trigger_field[128] = "";  /* "name = value", or empty for any field values */
+static TRACESTRING *trigger_scan = NULL;  /* most recent string that was checked */
+
+/** tracestring_settime() sets the timestamp of a string, plus the formatted
+ *  time relative to the first string.
+ */
+static void tracestring_settime(TRACESTRING *item, double timestamp, int precise)
 {
-  unsigned idx, chan;
+  double reltime;
 
-  NK_ASSERT(buffer != NULL);
-  NK_ASSERT(length > 0);
-  NK_ASSERT((length & 1) == 0);
+  item->timestamp = timestamp;
+  if (tracestring_root.next != NULL)
+    reltime = timestamp - tracestring_root.next->timestamp;
+  else
+    reltime = 0.0;
+  sprintf(item->timefmt, precise ? "%.6f" : "%.3f", reltime);
+  item->timefmt_len = (unsigned short)strlen(item->timefmt);
+  assert(item->timefmt_len < sizearray(item->timefmt));
+}
 
-  if (trace_decodectf) {
-    /* CTF mode */
-    unsigned char *bytestream = alloca(length);
-    int pos;
-    idx = 0;
-    while (idx < length) {
-      if ((buffer[idx] & 0x07) != 0x01) {
-        ctf_decode_reset();
-        idx += 2;
-        continue; /* this is not an ITM packet */
-      }
-      chan = (buffer[idx] >> 3) & 0x1f;
-      /* collect packets from the same channel in a separate buffer */
-      pos = 0;
-      bytestream[pos++] = buffer[idx + 1];
-      idx += 2;
-      while (idx < length && ((buffer[idx] >> 3) & 0x1f) == chan) {
-        bytestream[pos++] = buffer[idx + 1];
-        idx += 2;
-      }
-      /* check whether the channel is enabled (in passive mode, the target that
-         sends the trace messages is oblivious of the settings in this viewer,
-         so it may send trace messages for disabled channels) */
-      if (channels[chan].enabled) {
-        int count = ctf_decode(bytestream, pos, chan);
-        if (count > 0) {
-          uint16_t streamid;
-          double tstamp;
-          const char *message;
-          while (msgstack_peek(&streamid, &tstamp, &message)) {
-            TRACESTRING *item = malloc(sizeof(TRACESTRING));
-            if (item != NULL) {
-              memset(item, 0, sizeof(TRACESTRING));
-              item->length = (unsigned short)strlen(message);
-              item->size = item->length + 1;
-              item->text = malloc(item->size * sizeof(unsigned char));
-              if (item->text != NULL) {
-                strcpy(item->text, message);
-                item->length = item->size - 1;
-                item->channel = (unsigned char)streamid;
-                if (tstamp > 0.001)
-                  timestamp = tstamp; /* use precision timestamp from remote host */
-                item->timestamp = timestamp;
-                if (tracestring_root.next != NULL)
-                  timestamp -= tracestring_root.next->timestamp;
-                else
-                  timestamp = 0.0;
-                /* create formatted timestamp */
-                if (tstamp > 0.001)
-                  sprintf(item->timefmt, "%.6f", timestamp);
-                else
-                  sprintf(item->timefmt, "%.3f", timestamp);
-                item->timefmt_len = (unsigned short)strlen(item->timefmt);
-                assert(item->timefmt_len < sizearray(item->timefmt));
-                /* append to tail */
-                if (tracestring_tail != NULL)
-                  tracestring_tail->next = item;
-                else
-                  tracestring_root.next = item;
-                tracestring_tail = item;
-              }
-            }
-            msgstack_pop(NULL, NULL, NULL, 0);
+/** tracestring_addctf() passes a series of bytes from a single channel to
+ *  the CTF decoder, and adds the decoded messages to the list.
+ */
+static void tracestring_addctf(unsigned chan, const unsigned char *bytes, size_t length, double timestamp)
+{
+  int count = ctf_decode(bytes, length, chan);
+  if (count > 0) {
+    uint16_t streamid;
+    double tstamp;
+    const char *message;
+    const CTF_EVENT *event;
+    const CTF_VALUE *values;
+    int numvalues;
+    while (msgstack_peek(&streamid, &tstamp, &message)) {
+      TRACESTRING *item = malloc(sizeof(TRACESTRING));
+      if (item != NULL) {
+        memset(item, 0, sizeof(TRACESTRING));
+        item->length = (unsigned short)strlen(message);
+        item->size = item->length + 1;
+        item->text = malloc(item->size * sizeof(unsigned char));
+        if (item->text != NULL) {
+          strcpy(item->text, message);
+          item->length = item->size - 1;
+          item->channel = (unsigned char)streamid;
+          item->flags = TRACEFLG_DONE;  /* a CTF message is complete */
+          if (tstamp > 0.001) {
+            /* use precision timestamp from the target, mapped to the host
+               time base (so that it lines up with the other strings) */
+            timefit_add(&ctf_fit, tstamp, timestamp);
+            item->flags |= TRACEFLG_CTFCLOCK;
+            tracestring_settime(item, timefit_map(&ctf_fit, tstamp), 1);
+          } else {
+            tracestring_settime(item, timestamp, tracetime_valid());
           }
+          /* store the field values in the columns, for queries */
+          if (msgstack_peekvalues(&event, &values, &numvalues) && event != NULL)
+            ctfstore_add(event, item->timestamp, values, numvalues);
+          /* append to tail */
+          if (tracestring_tail != NULL)
+            tracestring_tail->next = item;
+          else
+            tracestring_root.next = item;
+          tracestring_tail = item;
+          if (tracestring_untimed == NULL)
+            tracestring_untimed = item;
+        } else {
+          free(item);
         }
       }
+      msgstack_pop(NULL, NULL, NULL, 0);
     }
-  } else {
-    /* plain text mode */
-    for (idx = 0; idx < length; idx += 2) {
-      if ((buffer[idx] & 0x07) != 0x01)
-        continue; /* this is not an ITM packet */
-      chan = (buffer[idx] >> 3) & 0x1f;
-      /* check whether the channel is enabled (in passive mode, the target that
-         sends the trace messages is oblivious of the settings in this viewer,
-         so it may send trace messages for disabled channels) */
-      if (!channels[chan].enabled)
-        continue;
+  }
+}
 
-      /* see whether to append to the recent string, or to add a new string */
-      if (tracestring_tail != NULL) {
-        if (buffer[idx + 1] == '\r' || buffer[idx + 1] == '\n') {
-          tracestring_tail->flags |= 0x01;  /* on newline, create a new string */
-          continue;
-        } else if (tracestring_tail->channel != chan) {
-          tracestring_tail->flags |= 0x01;  /* different channel, terminate previous string */
-        } else if (tracestring_tail->length >= TRACESTRING_MAXLENGTH) {
-          tracestring_tail->flags |= 0x01;  /* line length limit */
-        }
-        /* time criterion: there should not be more that 0.1 seconds between
-           parts of a continued string */
-        if (tracestring_tail != NULL && timestamp - tracestring_tail->timestamp > 0.1)
-          tracestring_tail->flags |= 0x01;  /* interval limit */
-      }
+static void tracestring_grow(TRACESTRING *item, size_t size)
+{
+  if (item->size < size) {
+    size_t newsize = item->size * 2;
+    char *ptr;
+    while (newsize < size)
+      newsize *= 2;
+    ptr = malloc(newsize * sizeof(unsigned char));
+    if (ptr != NULL) {
+      memcpy(ptr, item->text, item->length);
+      free((void*)item->text);
+      item->text = ptr;
+      item->size = (unsigned short)newsize;
+    }
+  }
+}
 
-      if (tracestring_tail != NULL && (tracestring_tail->flags & 0x01) == 0) {
-        /* append text to the current string */
-        if (tracestring_tail->length >= tracestring_tail->size) {
-          int newsize = tracestring_tail->size * 2;
-          char *ptr = malloc(newsize * sizeof(unsigned char));
-          if (ptr != NULL) {
-            memcpy(ptr, tracestring_tail->text, tracestring_tail->length);
-            free((void*)tracestring_tail->text);
-            tracestring_tail->text = ptr;
-            tracestring_tail->size = (unsigned short)newsize;
-          }
-        }
-        if (tracestring_tail->length < tracestring_tail->size)
-          tracestring_tail->text[tracestring_tail->length++] = buffer[idx + 1];
+/** tracestring_addchar() adds a character to the most recent string, or
+ *  starts a new string (plain text mode).
+ */
+static void tracestring_addchar(unsigned chan, unsigned char ch, double timestamp)
+{
+  /* see whether to append to the recent string, or to add a new string */
+  if (tracestring_tail != NULL) {
+    if (ch == '\r' || ch == '\n') {
+      tracestring_tail->flags |= TRACEFLG_DONE; /* on newline, create a new string */
+      return;
+    } else if (tracestring_tail->channel != chan) {
+      tracestring_tail->flags |= TRACEFLG_DONE; /* different channel, terminate previous string */
+    } else if (tracestring_tail->length >= TRACESTRING_MAXLENGTH) {
+      tracestring_tail->flags |= TRACEFLG_DONE; /* line length limit */
+    }
+    /* time criterion: there should not be more that 0.1 seconds between
+       parts of a continued string */
+    if (tracestring_tail != NULL && timestamp - tracestring_tail->timestamp > 0.1)
+      tracestring_tail->flags |= TRACEFLG_DONE; /* interval limit */
+  }
+
+  if (tracestring_tail != NULL && (tracestring_tail->flags & TRACEFLG_DONE) == 0) {
+    /* append text to the current string */
+    tracestring_grow(tracestring_tail, tracestring_tail->length + 1);
+    if (tracestring_tail->length < tracestring_tail->size)
+      tracestring_tail->text[tracestring_tail->length++] = ch;
+  } else {
+    /* create a new string */
+    TRACESTRING *item;
+    if (tracestring_tail == NULL && (ch == '\r' || ch == '\n'))
+      return; /* don't create an empty first string */
+    item = malloc(sizeof(TRACESTRING));
+    if (item != NULL) {
+      memset(item, 0, sizeof(TRACESTRING));
+      item->size = TRACESTRING_INITSIZE;
+      item->text = malloc(item->size * sizeof(unsigned char));
+      if (item->text != NULL) {
+        item->channel = (unsigned char)chan;
+        tracestring_settime(item, timestamp, tracetime_valid());
+        /* append to tail */
+        if (tracestring_tail != NULL)
+          tracestring_tail->next = item;
+        else
+          tracestring_root.next = item;
+        tracestring_tail = item;
+        if (tracestring_untimed == NULL)
+          tracestring_untimed = item;
+        tracestring_tail->text[tracestring_tail->length++] = ch;
       } else {
-        /* create a new string */
-        TRACESTRING *item;
-        if (tracestring_tail == NULL && (buffer[idx + 1] == '\r' || buffer[idx + 1] == '\n'))
-          continue; /* don't create an empty first string */
-        item = malloc(sizeof(TRACESTRING));
-        if (item != NULL) {
-          memset(item, 0, sizeof(TRACESTRING));
-          item->size = TRACESTRING_INITSIZE;
-          item->text = malloc(item->size * sizeof(unsigned char));
-          if (item->text != NULL) {
-            item->channel = (unsigned char)chan;
-            item->timestamp = timestamp;
-            if (tracestring_root.next != NULL)
-              timestamp -= tracestring_root.next->timestamp;
-            else
-              timestamp = 0.0;
-            /* create formatted timestamp */
-            sprintf(item->timefmt, "%.3f", timestamp);
-            item->timefmt_len = (unsigned short)strlen(item->timefmt);
-            assert(item->timefmt_len < sizearray(item->timefmt));
-            /* append to tail */
-            if (tracestring_tail != NULL)
-              tracestring_tail->next = item;
-            else
-              tracestring_root.next = item;
-            tracestring_tail = item;
-            tracestring_tail->text[tracestring_tail->length++] = buffer[idx + 1];
-          } else {
-            free(item); /* adding a new string failed */
-          }
-        }
+        free(item); /* adding a new string failed */
+      }
+    }
+  }
+}
+
+/** tracestring_addtext() adds a series of characters from a single channel
+ *  (plain text mode). Runs of characters without CR, LF or zero bytes are
+ *  appended to the current string in one go.
+ */
+static void tracestring_addtext(unsigned chan, const unsigned char *text, size_t length, double timestamp)
+{
+  while (length > 0) {
+    size_t run = itm_textrun(text, length);
+    if (run == 0) {
+      if (*text != 0)
+        tracestring_addchar(chan, *text, timestamp);  /* CR or LF */
+      text++;
+      length--;
+      continue;
+    }
+    length -= run;
+    while (run > 0) {
+      TRACESTRING *tail = tracestring_tail;
+      size_t count;
+      if (tail == NULL || (tail->flags & TRACEFLG_DONE) != 0 || tail->channel != chan
+          || tail->length >= TRACESTRING_MAXLENGTH || timestamp - tail->timestamp > 0.1)
+      {
+        /* let the general routine decide on starting a new string */
+        tracestring_addchar(chan, *text++, timestamp);
+        run--;
+        continue;
       }
+      count = TRACESTRING_MAXLENGTH - tail->length;
+      if (count > run)
+        count = run;
+      tracestring_grow(tail, tail->length + count);
+      if (tail->length + count > tail->size)
+        count = tail->size - tail->length;  /* memory allocation failed */
+      if (count == 0)
+        break;
+      memcpy(tail->text + tail->length, text, count);
+      tail->length += (unsigned short)count;
+      text += count;
+      run -= count;
     }
+    text += run;  /* skip the remainder, in case of an allocation failure */
   }
 }
 
+/* in CTF mode, the payloads of consecutive stimulus packets for the same
+   channel are collected, and passed to the CTF decoder in a single call */
+static unsigned char ctf_run[2 * PACKET_SIZE];
+static size_t ctf_runlength = 0;
+static unsigned ctf_runchannel = 0;
+
+/* handler for the packets from hardware sources (DWT) and for protocol packets */
+static TRACE_HWHANDLER hw_handler = NULL;
+
+static void ctf_runflush(double timestamp)
+{
+  if (ctf_runlength > 0) {
+    tracestring_addctf(ctf_runchannel, ctf_run, ctf_runlength, timestamp);
+    ctf_runlength = 0;
+  }
+}
+
+/** tracestring_retime() sets the time of the strings that were started since
+ *  the previous ITM timestamp packet to the time of the current timestamp
+ *  packet (an ITM local timestamp follows the packets that it stamps).
+ */
+static void tracestring_retime(void)
+{
+  TRACESTRING *item;
+  double timestamp = tracetime_now();
+
+  for (item = tracestring_untimed; item != NULL; item = item->next)
+    if ((item->flags & TRACEFLG_CTFCLOCK) == 0)
+      tracestring_settime(item, timestamp, 1);
+  tracestring_untimed = NULL;
+}
+
+static void itm_packet(const ITMPACKET *packet, void *arg)
+{
+  double hosttime = *(const double*)arg;
+  double timestamp = tracetime_valid() ? tracetime_now() : hosttime;
+  unsigned idx, chan;
+
+  switch (packet->type) {
+  case ITMPKT_STIMULUS:
+    chan = packet->address;
+    assert(chan < NUM_CHANNELS);
+    /* check whether the channel is enabled (in passive mode, the target that
+       sends the trace messages is oblivious of the settings in this viewer,
+       so it may send trace messages for disabled channels) */
+    if (!channels[chan].enabled)
+      break;
+    if (trace_decodectf) {
+      if (chan != ctf_runchannel || ctf_runlength + packet->size > sizearray(ctf_run))
+        ctf_runflush(timestamp);
+      ctf_runchannel = chan;
+      memcpy(ctf_run + ctf_runlength, packet->payload, packet->size);
+      ctf_runlength += packet->size;
+    } else {
+      /* 16-bit and 32-bit writes hold multiple characters (Little Endian);
+         zero bytes are padding */
+      for (idx = 0; idx < packet->size; idx++)
+        if (packet->payload[idx] != 0)
+          tracestring_addchar(chan, packet->payload[idx], timestamp);
+    }
+    break;
+  case ITMPKT_SYNC:
+  case ITMPKT_OVERFLOW:
+    /* data was lost (or the stream restarts), drop any partial CTF packet */
+    if (trace_decodectf) {
+      ctf_runflush(timestamp);
+      ctf_decode_reset();
+    }
+    tracetime_packet(packet, hosttime);
+    break;
+  case ITMPKT_LOCALTS:
+  case ITMPKT_GLOBALTS1:
+  case ITMPKT_GLOBALTS2:
+    if (trace_decodectf)
+      ctf_runflush(timestamp);
+    if (tracetime_packet(packet, hosttime))
+      tracestring_retime();
+    break;
+  }
+  /* the handler runs on the decoder thread, with the trace lock held */
+  if (packet->type != ITMPKT_STIMULUS && hw_handler != NULL)
+    hw_handler(packet, timestamp);
+}
+
+/** trace_resync() resets the decoders after packets were lost from the
+ *  shared ring, so that they do not continue in the middle of a packet. The
+ *  handler receives an overflow packet, like when the ITM itself drops data.
+ */
+static void trace_resync(double timestamp)
+{
+  ITMPACKET packet;
+
+  itm_decode_reset();
+  tpiu_decode_reset();
+  ctf_runlength = 0;    /* drop the partial CTF packet, it cannot be completed */
+  memset(&packet, 0, sizeof packet);
+  packet.type = ITMPKT_OVERFLOW;
+  packet.header = 0x70;
+  itm_packet(&packet, &timestamp);
+}
+
+/** tracestring_addpairs() handles the output of the fast path of the ITM
+ *  decoder: it walks through the runs of data bytes for the same port.
+ */
+static void tracestring_addpairs(const unsigned char *ports, const unsigned char *data, size_t count, double timestamp)
+{
+  size_t pos, run;
+
+  for (pos = 0; pos < count; pos += run) {
+    unsigned chan = ports[pos];
+    run = itm_samerun(ports + pos, count - pos);
+    assert(run > 0);
+    if (!channels[chan].enabled)
+      continue;
+    if (trace_decodectf) {
+      ctf_runflush(timestamp);  /* flush bytes from the general decoder first */
+      tracestring_addctf(chan, data + pos, run, timestamp);
+    } else {
+      tracestring_addtext(chan, data + pos, run, timestamp);
+    }
+  }
+}
+
+/** itm_process() decodes the ITM stream, either the raw SWO data, or the
+ *  data for the ITM that was extracted from the TPIU formatter frames.
+ */
+static void itm_process(const unsigned char *buffer, size_t length, double timestamp)
+{
+  unsigned char *ports, *data;
+  size_t pos;
+
+  ports = alloca(length / 2 + 1);
+  data = alloca(length / 2 + 1);
+  pos = 0;
+  while (pos < length) {
+    /* the common case is a sequence of 1-byte stimulus packets, for which
+       there is a fast path; other packets go through the general decoder */
+    size_t pairs = itm_demux(buffer + pos, length - pos, ports, data);
+    if (pairs > 0) {
+      /* strings get the target time if ITM timestamps are enabled, and
+         the arrival time of the USB packet otherwise */
+      tracestring_addpairs(ports, data, pairs, tracetime_valid() ? tracetime_now() : timestamp);
+      pos += 2 * pairs;
+    } else {
+      pos += itm_decode_packet(buffer + pos, length - pos, itm_packet, &timestamp);
+    }
+  }
+  ctf_runflush(tracetime_valid() ? tracetime_now() : timestamp);
+}
+
+static void tpiu_source(unsigned id, const unsigned char *data, size_t length, void *arg)
+{
+  /* only the ITM is decoded, data from other sources (ETM) is dropped */
+  if (id == TPIU_ID_ITM)
+    itm_process(data, length, *(const double*)arg);
+}
+
+void tracestring_add(const unsigned char *buffer, size_t length, double timestamp)
+{
+  NK_ASSERT(buffer != NULL);
+  NK_ASSERT(length > 0);
+
+  if (trace_formatter)
+    tpiu_decode(buffer, length, tpiu_source, &timestamp);
+  else
+    itm_process(buffer, length, timestamp);
+}
+
+static void tracestring_free(TRACESTRING *item)
+{
+  assert(item != NULL && item->text != NULL);
+  free((void*)item->text);
+  free((void*)item);
+}
+
+/** tracestring_publish() makes the sealed strings visible to the GUI.
+ *  Strings that were removed since the previous publication are marked
+ *  with the current epoch of the GUI; they are freed when the GUI has moved
+ *  on to a next frame.
+ */
+static void tracestring_publish(void)
+{
+  TRACESTRING *head = (tracestring_sealed != NULL) ? tracestring_root.next : NULL;
+  unsigned seq, epoch;
+
+  if (head != pub_head || tracestring_sealed != pub_tail) {
+    seq = pub_seq;
+    ATOMIC_STORE(&pub_seq, seq + 1);  /* odd: update in progress */
+    ATOMIC_FENCE();
+    ATOMIC_STORE(&pub_head, head);
+    ATOMIC_STORE(&pub_tail, tracestring_sealed);
+    ATOMIC_STORE(&pub_count, sealed_count);
+    ATOMIC_STORE(&pub_seq, seq + 2);
+  }
+  ATOMIC_FENCE();
+  epoch = ATOMIC_LOAD(&gui_epoch);
+  if (retired_last != NULL && (retired_count == 0 || retired_marks[retired_count - 1].last != retired_last)) {
+    if (retired_count == RETIRE_MARKS)
+      retired_count--;  /* merge with the most recent mark */
+    retired_marks[retired_count].last = retired_last;
+    retired_marks[retired_count].epoch = epoch;
+    retired_count++;
+  }
+}
+
+/** tracestring_reclaim() frees the removed strings that the GUI can no
+ *  longer refer to.
+ */
+static void tracestring_reclaim(void)
+{
+  unsigned epoch = ATOMIC_LOAD(&gui_epoch);
+
+  while (retired_count > 0 && (int)(epoch - retired_marks[0].epoch) > 0) {
+    TRACESTRING *last = retired_marks[0].last;
+    TRACESTRING *item, *next;
+    for (item = retired_head; ; item = next) {
+      next = item->next;
+      tracestring_free(item);
+      if (item == last)
+        break;
+    }
+    if (last == retired_last) {
+      retired_head = retired_last = NULL;
+    } else {
+      assert(next != NULL);
+      retired_head = next;
+    }
+    retired_count--;
+    memmove(retired_marks, retired_marks + 1, retired_count * sizeof(RETIREMARK));
+  }
+}
+
+/* The graph of a CTF field is calculated by the decoder thread, because the
+   columnar store is modified while decoding. The GUI posts the view that it
+   wants (event, field, time range and number of bins), and the decoder
+   publishes the bins for it, at most once per GUI frame. Both the request
+   and the result are guarded by a sequence lock, like the published range
+   of the strings. */
+#define PLOT_BINS 4096
+
+typedef struct tagPLOTREQUEST {
+  char event[CTF_NAME_LENGTH];
+  char field[CTF_NAME_LENGTH];
+  double start, end;  /* ignored when following the data */
+  int follow;         /* show the full range of the data */
+  int count;          /* number of bins */
+} PLOTREQUEST;
+
+typedef struct tagPLOTVIEW {
+  char event[CTF_NAME_LENGTH];
+  char field[CTF_NAME_LENGTH];
+  double start, end;  /* the range that the bins cover */
+  int count;
+  int valid;          /* whether there is data for the field in the range */
+  CTF_PLOTBIN bins[PLOT_BINS];
+} PLOTVIEW;
+
+static PLOTREQUEST plot_request;            /* written by the GUI */
+static volatile unsigned plot_reqseq = 0;
+static PLOTVIEW plot_view;                  /* written by the decoder */
+static volatile unsigned plot_viewseq = 0;
+static unsigned plot_seen = 0;              /* request that plot_view is for */
+static unsigned plot_epoch = 0;             /* GUI frame of the last update */
+static int plot_dirty = 0;                  /* data changed since the last update */
+
+/** traceplot_request() posts the view of the graph that the GUI wants. The
+ *  request is only updated if it differs from the previous one (GUI).
+ */
+static void traceplot_request(const char *event, const char *field, double start, double end,
+                              int follow, int count)
+{
+  unsigned seq;
+
+  if (strcmp(plot_request.event, event) == 0 && strcmp(plot_request.field, field) == 0
+      && plot_request.follow == follow && plot_request.count == count
+      && (follow || (plot_request.start == start && plot_request.end == end)))
+    return;
+  seq = plot_reqseq;
+  ATOMIC_STORE(&plot_reqseq, seq + 1);
+  ATOMIC_FENCE();
+  strlcpy(plot_request.event, event, sizearray(plot_request.event));
+  strlcpy(plot_request.field, field, sizearray(plot_request.field));
+  plot_request.start = start;
+  plot_request.end = end;
+  plot_request.follow = follow;
+  plot_request.count = count;
+  ATOMIC_STORE(&plot_reqseq, seq + 2);
+}
+
+/** traceplot_fetch() copies the most recently published bins of the graph
+ *  (GUI).
+ */
+static void traceplot_fetch(PLOTVIEW *view)
+{
+  unsigned seq;
+
+  do {
+    seq = ATOMIC_LOAD(&plot_viewseq);
+    memcpy(view, &plot_view, offsetof(PLOTVIEW, bins));
+    if (view->count > 0 && view->count <= PLOT_BINS)
+      memcpy(view->bins, plot_view.bins, view->count * sizeof(CTF_PLOTBIN));
+    ATOMIC_FENCE();
+  } while ((seq & 1) != 0 || seq != ATOMIC_LOAD(&plot_viewseq));
+}
+
+/** traceplot_update() recalculates the bins of the graph, if the data or
+ *  the request changed since the previous update (decoder thread).
+ *
+ *  \return 1 if the bins were updated, 0 otherwise.
+ */
+static int traceplot_update(void)
+{
+  PLOTREQUEST req;
+  unsigned seq, epoch;
+  double first, last;
+
+  do {
+    seq = ATOMIC_LOAD(&plot_reqseq);
+    memcpy(&req, &plot_request, sizeof req);
+    ATOMIC_FENCE();
+  } while ((seq & 1) != 0 || seq != ATOMIC_LOAD(&plot_reqseq));
+  if (seq == 0)
+    return 0; /* no graph requested yet */
+  epoch = ATOMIC_LOAD(&gui_epoch);
+  if ((seq == plot_seen && !plot_dirty) || epoch == plot_epoch)
+    return 0; /* no change, or the GUI has not yet drawn the previous update */
+  plot_seen = seq;
+  plot_epoch = epoch;
+  plot_dirty = 0;
+
+  seq = plot_viewseq;
+  ATOMIC_STORE(&plot_viewseq, seq + 1);
+  ATOMIC_FENCE();
+  strlcpy(plot_view.event, req.event, sizearray(plot_view.event));
+  strlcpy(plot_view.field, req.field, sizearray(plot_view.field));
+  plot_view.count = (req.count < PLOT_BINS) ? req.count : PLOT_BINS;
+  plot_view.start = plot_view.end = 0.0;
+  plot_view.valid = 0;
+  if (ctfstore_timerange(req.event, &first, &last)) {
+    if (first >= last) {
+      first -= 0.5;
+      last += 0.5;
+    }
+    if (req.follow || req.end <= req.start) {
+      req.start = first;
+      req.end = last;
+    }
+    plot_view.start = req.start;
+    plot_view.end = req.end;
+    plot_view.valid = ctfstore_plot(req.event, req.field, req.start, req.end, plot_view.bins, plot_view.count);
+  }
+  ATOMIC_STORE(&plot_viewseq, seq + 2);
+  return 1;
+}
+
+/* The density of the trace strings over time is kept in a pyramid of
+   buckets per channel: the finest level has DENSITY_BUCKETS buckets, and
+   each next level has half the number of buckets (each covering twice the
+   time). A string is counted at every level, which is constant time. When
+   the time of a string falls beyond the last bucket, the duration of the
+   buckets is doubled, which is a shift of the pyramid by one level.
+   The pyramid is owned by the decoder thread. The decoder publishes the
+   level that fits the width of the strip (which the GUI posts), at most
+   once per GUI frame, guarded by a sequence lock. */
+#define DENSITY_BUCKETS 4096
+#define DENSITY_LEVELS  13    /* 4096, 2048, ..., 1 */
+#define DENSITY_OFFSET(level)  (2 * DENSITY_BUCKETS - ((2 * DENSITY_BUCKETS) >> (level)))
+
+static unsigned density_count[NUM_CHANNELS][2 * DENSITY_BUCKETS];
+static double density_origin = 0.0;
+static double density_width = 0.001;  /* duration of a bucket at the finest level */
+static int density_maxbucket = -1;    /* highest used bucket at the finest level */
+static int density_dirty = 0;         /* counts changed since the last publication */
+
+typedef struct tagDENSITYVIEW {
+  double origin;        /* time of the first bucket */
+  double bucketwidth;   /* duration of a bucket */
+  int numbuckets;       /* 0 if there are no strings */
+  unsigned count[DENSITY_BUCKETS][NUM_CHANNELS];
+} DENSITYVIEW;
+
+static DENSITYVIEW density_view;            /* written by the decoder */
+static volatile unsigned density_viewseq = 0;
+static volatile int density_columns = 0;    /* width of the strip, written by the GUI */
+static int density_seencolumns = 0;
+static unsigned density_epoch = 0;          /* GUI frame of the last publication */
+
+static void density_reset(void)
+{
+  memset(density_count, 0, sizeof density_count);
+  density_origin = 0.0;
+  density_width = 0.001;
+  density_maxbucket = -1;
+  density_dirty = 1;
+}
+
+static void density_coarsen(void)
+{
+  int chan, level;
+
+  for (chan = 0; chan < NUM_CHANNELS; chan++) {
+    unsigned *counts = density_count[chan];
+    for (level = 0; level < DENSITY_LEVELS - 1; level++) {
+      int size = DENSITY_BUCKETS >> level;
+      memcpy(counts + DENSITY_OFFSET(level), counts + DENSITY_OFFSET(level + 1), (size / 2) * sizeof(unsigned));
+      memset(counts + DENSITY_OFFSET(level) + size / 2, 0, (size / 2) * sizeof(unsigned));
+    }
+  }
+  density_width *= 2;
+  density_maxbucket /= 2;
+}
+
+static int density_bucket(double timestamp)
+{
+  double pos = (timestamp - density_origin) / density_width;
+  return (pos > 0) ? (int)pos : 0;
+}
+
+static void density_update(int channel, double timestamp, int add)
+{
+  unsigned *counts;
+  int bucket, level;
+
+  assert(channel >= 0 && channel < NUM_CHANNELS);
+  if (density_maxbucket < 0) {
+    if (!add)
+      return;
+    density_origin = timestamp;
+  }
+  while ((bucket = density_bucket(timestamp)) >= DENSITY_BUCKETS)
+    density_coarsen();
+  if (add && bucket > density_maxbucket)
+    density_maxbucket = bucket;
+  counts = density_count[channel];
+  for (level = 0; level < DENSITY_LEVELS; level++) {
+    unsigned *cell = &counts[DENSITY_OFFSET(level) + (bucket >> level)];
+    if (add)
+      *cell += 1;
+    else if (*cell > 0)
+      *cell -= 1;
+  }
+  density_dirty = 1;
+}
+
+/** density_publish() copies the level of the pyramid that fits in the
+ *  width of the strip, if the counts or the width changed since the
+ *  previous publication (decoder thread).
+ *
+ *  \return 1 if the counts were published, 0 otherwise.
+ */
+static int density_publish(void)
+{
+  int columns = ATOMIC_LOAD(&density_columns);
+  unsigned epoch = ATOMIC_LOAD(&gui_epoch);
+  unsigned seq;
+  int level, offset, bucket, chan;
+
+  if (columns <= 0 || (!density_dirty && columns == density_seencolumns) || epoch == density_epoch)
+    return 0;
+  density_dirty = 0;
+  density_seencolumns = columns;
+  density_epoch = epoch;
+
+  seq = density_viewseq;
+  ATOMIC_STORE(&density_viewseq, seq + 1);
+  ATOMIC_FENCE();
+  if (density_maxbucket < 0) {
+    density_view.numbuckets = 0;
+  } else {
+    /* pick the finest level where the buckets are at least a pixel wide */
+    for (level = 0; level < DENSITY_LEVELS - 1 && (density_maxbucket >> level) >= columns; level++)
+      /* nothing */;
+    offset = DENSITY_OFFSET(level);
+    density_view.origin = density_origin;
+    density_view.bucketwidth = density_width * (1 << level);
+    density_view.numbuckets = (density_maxbucket >> level) + 1;
+    for (bucket = 0; bucket < density_view.numbuckets; bucket++)
+      for (chan = 0; chan < NUM_CHANNELS; chan++)
+        density_view.count[bucket][chan] = density_count[chan][offset + bucket];
+  }
+  ATOMIC_STORE(&density_viewseq, seq + 2);
+  return 1;
+}
+
+/** density_fetch() copies the most recently published counts (GUI).
+ */
+static void density_fetch(DENSITYVIEW *view)
+{
+  unsigned seq;
+
+  do {
+    seq = ATOMIC_LOAD(&density_viewseq);
+    memcpy(view, &density_view, offsetof(DENSITYVIEW, count));
+    if (view->numbuckets > 0 && view->numbuckets <= DENSITY_BUCKETS)
+      memcpy(view->count, density_view.count, view->numbuckets * sizeof(view->count[0]));
+    ATOMIC_FENCE();
+  } while ((seq & 1) != 0 || seq != ATOMIC_LOAD(&density_viewseq));
+}
+
+/** tracestring_seal() seals the strings that can no longer change.
+ *  \param force   Set to 1 to seal all strings, including a string that is
+ *                 not yet terminated, and strings that wait for an ITM
+ *                 timestamp.
+ */
+static void tracestring_seal(int force)
+{
+  TRACESTRING *item = (tracestring_sealed != NULL) ? tracestring_sealed->next : tracestring_root.next;
+  while (item != NULL) {
+    if (item == tracestring_untimed) {
+      if (tracetime_valid() && !force)
+        break;  /* the timestamp of this string may still be updated */
+      tracestring_untimed = NULL;
+    }
+    if ((item->flags & TRACEFLG_DONE) == 0) {
+      if (!force)
+        break;
+      item->flags |= TRACEFLG_DONE;
+    }
+    tracestring_sealed = item;
+    sealed_count++;
+    density_update(item->channel, item->timestamp, 1);
+    item = item->next;
+  }
+}
+
+/** tracestring_clear() removes all strings. The decoder thread is paused
+ *  while the list is cleared.
+ */
 void tracestring_clear(void)
 {
   TRACESTRING *item;
-  while (tracestring_root.next != NULL) {
-    item = tracestring_root.next;
-    tracestring_root.next = item->next;
-    assert(item->text!=NULL);
-    free((void*)item->text);
-    free((void*)item);
+  unsigned seq;
+
+  trace_lock();
+  /* the removed strings that are not yet freed are linked to the head of the
+     list, so that all strings can be freed in a single run */
+  item = (retired_head != NULL) ? retired_head : tracestring_root.next;
+  while (item != NULL) {
+    TRACESTRING *next = item->next;
+    tracestring_free(item);
+    item = next;
   }
+  tracestring_root.next = NULL;
   tracestring_tail = NULL;
+  tracestring_untimed = NULL;
+  tracestring_sealed = NULL;
+  sealed_count = 0;
+  retired_head = retired_last = NULL;
+  retired_count = 0;
+  trigger_scan = NULL;
+  timefit_reset(&ctf_fit);
+  ctfstore_clear();
+  plot_dirty = 1;
+  density_reset();
+  seq = pub_seq;
+  ATOMIC_STORE(&pub_seq, seq + 1);
+  ATOMIC_FENCE();
+  pub_head = pub_tail = NULL;
+  pub_count = 0;
+  ATOMIC_STORE(&pub_seq, seq + 2);
+  view_head = view_tail = NULL;
+  view_count = 0;
+  trace_unlock();
+}
+
+/** tracestring_trim() removes the strings that have fallen out of the
+ *  pre-trigger history of the capture, so that the memory use for the
+ *  decoded strings is bounded as well. The rows in the columnar store for
+ *  the CTF events are trimmed to the same history.
+ */
+static void tracestring_trim(void)
+{
+  TRACESTRING *item;
+  double oldest;
+
+  if (!capture_oldest(&oldest))
+    return;
+  while ((item = tracestring_root.next) != NULL && item != tracestring_tail && item->timestamp < oldest) {
+    tracestring_root.next = item->next;
+    if (trigger_scan == item)
+      trigger_scan = NULL;
+    if (tracestring_untimed == item)
+      tracestring_untimed = item->next;
+    if (tracestring_sealed != NULL) {
+      assert(sealed_count > 0);
+      sealed_count--;
+      density_update(item->channel, item->timestamp, 0);
+      if (tracestring_sealed == item)
+        tracestring_sealed = NULL;
+    }
+    /* the GUI may still refer to the string, so it is freed later */
+    if (retired_head == NULL)
+      retired_head = item;
+    retired_last = item;
+  }
+  ctfstore_trim(oldest);
+}
+
+static const char *memstr(const char *text, size_t length, const char *pattern)
+{
+  size_t len = strlen(pattern);
+  while (length >= len) {
+    if (memcmp(text, pattern, len) == 0)
+      return text;
+    text++;
+    length--;
+  }
+  return NULL;
+}
+
+/** trigger_match() checks a string against the trigger conditions.
+ */
+static int trigger_match(const TRACESTRING *item)
+{
+  if (trigger_text[0] != '\0' && memstr(item->text, item->length, trigger_text) != NULL)
+    return 1;
+  if (trigger_event[0] != '\0') {
+    /* CTF messages are formatted as "event: field = value, field = value" */
+    size_t len = strlen(trigger_event);
+    const char *ptr;
+    if (item->length < len || memcmp(item->text, trigger_event, len) != 0
+        || (item->length > len && item->text[len] != ':'))
+      return 0;
+    if (trigger_field[0] == '\0')
+      return 1;
+    ptr = item->text + len;
+    while ((ptr = memstr(ptr, item->length - (ptr - item->text), trigger_field)) != NULL) {
+      const char *end = ptr + strlen(trigger_field);
+      if ((ptr[-1] == ' ') && (end == item->text + item->length || *end == ','))
+        return 1;
+      ptr++;
+    }
+  }
+  return 0;
+}
+
+/** trigger_check() checks the strings that were added or extended since the
+ *  previous check, and fires the capture trigger on a match.
+ */
+static void trigger_check(void)
+{
+  TRACESTRING *item = (trigger_scan != NULL) ? trigger_scan : tracestring_root.next;
+  for ( ; item != NULL; item = item->next) {
+    if (trigger_match(item)) {
+      char msg[64];
+      sprintf(msg, "trace message on channel %d", item->channel);
+      capture_trigger(msg);
+      break;
+    }
+    trigger_scan = item;  /* the tail may still grow, so it is checked again */
+  }
 }
 
 int tracestring_isempty(void)
 {
-  return (tracestring_root.next == NULL);
+  return (view_head == NULL);
 }
 
-void tracestring_process(int enabled)
+/** tracestring_next() returns the string after the given one, within the
+ *  snapshot of the GUI.
+ */
+static TRACESTRING *tracestring_next(const TRACESTRING *item)
 {
-  while (tracequeue_head != tracequeue_tail) {
-    if (enabled)
-      tracestring_add(trace_queue[tracequeue_head].data, trace_queue[tracequeue_head].length,
-                      trace_queue[tracequeue_head].timestamp);
-    tracequeue_head = (tracequeue_head + 1) % PACKET_NUM;
+  return (item == view_tail) ? NULL : item->next;
+}
+
+/** trace_decodebatch() decodes the packets in the queue, and publishes the
+ *  strings that are complete, plus the graph and the density strip (decoder
+ *  thread).
+ *
+ *  \return The number of packets handled, or -1 if no packets were handled
+ *          but the graph or the density strip was updated (so the GUI must
+ *          still redraw).
+ */
+static int trace_decodebatch(void)
+{
+  int count = 0, refresh;
+
+  trace_lock();
+  while (count < PACKET_NUM) {
+    int head = tracequeue_head;
+    PACKET *pkt;
+    if (head == ATOMIC_LOAD(&tracequeue_tail))
+      break;
+    pkt = &trace_queue[head];
+    if (pkt->gap)
+      trace_resync(pkt->timestamp);
+    /* when a capture is frozen, the packets after the snapshot are dropped */
+    if (ATOMIC_LOAD(&decode_enabled) && capture_add(pkt->data, pkt->length, pkt->timestamp)) {
+      tracestring_add(pkt->data, pkt->length, pkt->timestamp);
+      if (capture_state() == CAPTURE_ARMED && (trigger_text[0] != '\0' || trigger_event[0] != '\0'))
+        trigger_check();
+      tracestring_trim();
+    }
+    ATOMIC_STORE(&tracequeue_head, (head + 1) % PACKET_NUM);
+    count++;
   }
+  /* when no more data arrives, a partial string is sealed after the same
+     interval that would otherwise terminate it (see tracestring_addchar()) */
+  tracestring_seal(count == 0 && tracestring_tail != NULL && tracestring_tail != tracestring_sealed
+                   && swousb_timestamp() - tracestring_tail->timestamp > 0.1);
+  tracestring_publish();
+  tracestring_reclaim();
+  if (count > 0)
+    plot_dirty = 1;
+  refresh = traceplot_update();
+  if (density_publish())
+    refresh = 1;
+  if (refresh && count == 0)
+    count = -1;
+  trace_unlock();
+  return count;
+}
+
+/** tracestring_process() must be called by the GUI at the start of each
+ *  frame. It takes a snapshot of the strings that the decoder published.
+ *  \param enabled   Whether to decode the incoming trace data; when zero,
+ *                   the packets are dropped.
+ */
+void tracestring_process(int enabled)
+{
+  unsigned seq;
+
+  ATOMIC_STORE(&decode_enabled, enabled);
+
+  /* start a new epoch, then take the snapshot */
+  ATOMIC_STORE(&gui_epoch, gui_epoch + 1);
+  ATOMIC_FENCE();
+  do {
+    seq = ATOMIC_LOAD(&pub_seq);
+    view_head = ATOMIC_LOAD(&pub_head);
+    view_tail = ATOMIC_LOAD(&pub_tail);
+    view_count = ATOMIC_LOAD(&pub_count);
+    ATOMIC_FENCE();
+  } while ((seq & 1) != 0 || seq != ATOMIC_LOAD(&pub_seq));
+}
+
+/** trace_lockinit() creates the (recursive) lock that trace_lock() and
+ *  trace_unlock() use. It is called from trace_init(), on the GUI thread and
+ *  before the decoder thread is created; it does nothing on later calls.
+ */
+static void trace_lockinit(void)
+{
+  if (decode_lock_init)
+    return;
+  #if defined WIN32 || defined _WIN32
+    InitializeCriticalSection(&decode_lock);
+  #else
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&decode_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  #endif
+  decode_lock_init = 1;
+}
+
+/** trace_lock() pauses the decoder thread, which is needed to change the
+ *  configuration of the decoders (such as loading a new TSDL file, or
+ *  setting up a capture). Calls to trace_lock() and trace_unlock() may be
+ *  nested.
+ *
+ *  \note Before trace_init() is called, there is no decoder thread, and
+ *         trace_lock() and trace_unlock() do nothing. They must therefore
+ *         not be called around a call to trace_init().
+ */
+void trace_lock(void)
+{
+  if (!decode_lock_init)
+    return;
+  #if defined WIN32 || defined _WIN32
+    EnterCriticalSection(&decode_lock);
+  #else
+    pthread_mutex_lock(&decode_lock);
+  #endif
+}
+
+void trace_unlock(void)
+{
+  if (!decode_lock_init)
+    return;
+  #if defined WIN32 || defined _WIN32
+    LeaveCriticalSection(&decode_lock);
+  #else
+    pthread_mutex_unlock(&decode_lock);
+  #endif
 }
 
 int tracestring_find(const char *text, int curline)
@@ -358,17 +1208,17 @@ int tracestring_find(const char *text, int curline)
   len = strlen(text);
 
   cur_mark = curline + 1;
-  item = tracestring_root.next;
+  item = view_head;
   line = 0;
   while (item != NULL && line < cur_mark) {
     line++;
-    item = item->next;
+    item = tracestring_next(item);
   }
   if (item == NULL || curline < 0) {
-    item = tracestring_root.next;
+    item = view_head;
     line = 0;
   } else {
-    item = item->next;
+    item = tracestring_next(item);
     line++;
   }
   while ((line != cur_mark || curline < 0) && item != NULL) {
@@ -386,10 +1236,10 @@ int tracestring_find(const char *text, int curline)
     }
     if (idx + len <= item->length)
       return line;  /* found, stop search */
-    item = item->next;
+    item = tracestring_next(item);
     line++;
     if (item == NULL) {
-      item = tracestring_root.next;
+      item = view_head;
       line = 0;
     }
   } /* while (line != cur_mark) */
@@ -409,7 +1259,7 @@ int trace_save(const char *filename)
     return 0;
 
   bufsize = 0;
-  for (item = tracestring_root.next; item != NULL; item = item->next)
+  for (item = view_head; item != NULL; item = tracestring_next(item))
     if (item->length > bufsize)
       bufsize = item->length;
 
@@ -420,11 +1270,11 @@ int trace_save(const char *filename)
   }
 
   fprintf(fp, "Number,Name,Timestamp,Text\n");
-  for (item = tracestring_root.next; item != NULL; item = item->next) {
+  for (item = view_head; item != NULL; item = tracestring_next(item)) {
     memcpy(buffer, item->text, item->length);
     buffer[item->length] = '\0';
     fprintf(fp, "%d,\"%s\",%.6f,\"%s\"\n", item->channel, channels[item->channel].name,
-            item->timestamp / 1000000.0, buffer);
+            item->timestamp, buffer);
   }
 
   free((void*)buffer);
@@ -432,6 +1282,132 @@ int trace_save(const char *filename)
   return 1;
 }
 
+/** trace_savesnapshot() saves the decoded strings to a CSV file (see
+ *  trace_save()), plus the raw data of the capture to a file with the same
+ *  name and ".swo" appended.
+ *
+ *  \return 1 on success, 0 on failure.
+ */
+int trace_savesnapshot(const char *filename)
+{
+  char *rawname;
+  int result;
+
+  assert(filename != NULL);
+  if (!trace_save(filename))
+    return 0;
+  rawname = alloca(strlen(filename) + 5);
+  strcpy(rawname, filename);
+  strcat(rawname, ".swo");
+  trace_lock();
+  result = capture_save(rawname);
+  trace_unlock();
+  return result;
+}
+
+/** trace_settrigger_text() sets a text that fires the capture trigger when
+ *  it appears in a trace message.
+ *  \param text    The text to match (case-sensitive), or NULL or an empty
+ *                 string to remove the condition.
+ */
+void trace_settrigger_text(const char *text)
+{
+  if (text == NULL)
+    text = "";
+  trace_lock();
+  strncpy(trigger_text, text, sizearray(trigger_text) - 1);
+  trigger_text[sizearray(trigger_text) - 1] = '\0';
+  trace_unlock();
+}
+
+static int trigger_setctf(const char *predicate)
+{
+  const CTF_EVENT *evt = NULL;
+  char name[CTF_NAME_LENGTH];
+  const char *ptr;
+  size_t len;
+
+  trigger_event[0] = '\0';
+  trigger_field[0] = '\0';
+  if (predicate == NULL)
+    return 1;
+  while (*predicate == ' ')
+    predicate++;
+  if (*predicate == '\0')
+    return 1;
+  len = strcspn(predicate, " ");
+  if (len >= sizearray(name))
+    return 0;
+  memcpy(name, predicate, len);
+  name[len] = '\0';
+  if (isdigit(name[0])) {
+    evt = event_by_id((int)strtol(name, NULL, 10));
+  } else {
+    for (evt = event_next(NULL); evt != NULL; evt = event_next(evt))
+      if (strcmp(evt->name, name) == 0)
+        break;
+  }
+  if (evt == NULL)
+    return 0;
+  strcpy(trigger_event, evt->name);
+  /* reformat the field predicate to the format of the CTF decoder */
+  ptr = predicate + len;
+  while (*ptr == ' ')
+    ptr++;
+  if (*ptr != '\0') {
+    const char *eq = strchr(ptr, '=');
+    const char *value;
+    if (eq == NULL)
+      return 0;
+    len = eq - ptr;
+    while (len > 0 && ptr[len - 1] == ' ')
+      len--;
+    value = eq + 1;
+    while (*value == ' ')
+      value++;
+    if (len + strlen(value) + 4 > sizearray(trigger_field))
+      return 0;
+    memcpy(trigger_field, ptr, len);
+    strcpy(trigger_field + len, " = ");
+    strcat(trigger_field, value);
+  }
+  return 1;
+}
+
+/** trace_settrigger_ctf() sets a CTF event that fires the capture trigger.
+ *  \param predicate  The event name or the event id (as a decimal number),
+ *                    optionally followed by a field name, "=" and a value,
+ *                    e.g. "overrun level=3". NULL or an empty string removes
+ *                    the condition.
+ *
+ *  \return 1 on success, 0 if the event is not found in the TSDL file.
+ */
+int trace_settrigger_ctf(const char *predicate)
+{
+  int result;
+
+  trace_lock();
+  result = trigger_setctf(predicate);
+  trace_unlock();
+  return result;
+}
+
+/** trace_sethwhandler() sets a function that receives all packets other
+ *  than stimulus packets: PC samples, exception trace & data trace packets
+ *  from the DWT, as well as timestamp, synchronization and overflow packets.
+ *  Set the handler to NULL to ignore these packets.
+ *
+ *  \note The handler runs on the decoder thread, while it holds the trace
+ *        lock. The GUI must therefore call trace_lock() before it reads (or
+ *        resets) the state that the handler updates.
+ */
+void trace_sethwhandler(TRACE_HWHANDLER handler)
+{
+  trace_lock();
+  hw_handler = handler;
+  trace_unlock();
+}
+
 /** trace_enablectf() sets or queries the CTF decoding mode. A TSDL file must
  *  have been parsed for the mode to become active. Set parameter "enable" to
  *  -1 to query the current mode (without changing it).
@@ -442,240 +1418,264 @@ int trace_enablectf(int enable)
   if (enable == 0 || enable == 1) {
     if (enable && event_count() == 0)
       enable = 0;
+    trace_lock();
     trace_decodectf = enable;
+    trace_unlock();
   }
   return curval;
 }
 
+/** trace_setformatter() sets whether the trace data is wrapped in frames
+ *  of the TPIU formatter (which multiplexes the ITM with other sources), or
+ *  whether the formatter is bypassed.
+ *  \param enable   1 for formatted data, 0 for raw ITM data, or -1 to only
+ *                  return the current setting.
+ *
+ *  \return The previous setting.
+ */
+int trace_setformatter(int enable)
+{
+  int curval = trace_formatter;
+  if ((enable == 0 || enable == 1) && enable != curval) {
+    trace_lock();
+    trace_formatter = enable;
+    tpiu_decode_reset();
+    itm_decode_reset();
+    trace_unlock();
+  }
+  return curval;
+}
 
-#if defined WIN32 || defined _WIN32
 
-static BOOL MakeGUID(const char *label, GUID *guid)
-{
-  unsigned i;
-  char b[5];
-
-  /* check whether the string has a valid format &*/
-  if (strlen(label) != 38)
-    return FALSE;
-  for (i=0; i<strlen(label); i++) {
-    char c = label[i];
-    if (i == 0) {
-      if (c != '{')
-        return FALSE;
-    } else if (i == 37) {
-      if (c != '}')
-        return FALSE;
-    } else if (i == 9 || i == 14 || i == 19 || i == 24) {
-      if (c != '-')
-        return FALSE;
-    } else {
-      if (!(c >= '0' && c <= '9') && !(c >= 'A' && c <= 'F') && !(c >= 'a' && c <= 'f'))
-        return FALSE;
-    }
-  }
-
-  guid->Data1 = strtoul(label+1, NULL, 16);
-  guid->Data2 = (unsigned short)strtoul(label+10, NULL, 16);
-  guid->Data3 = (unsigned short)strtoul(label+15, NULL, 16);
-  memset(b, 0, sizeof b);
-  for (i = 0; i < 2; i++) {
-    memcpy(&b[0], label+20+i*2, 2*sizeof(b[0]));
-    guid->Data4[i] = (unsigned char)strtoul(&b[0], NULL, 16);
-  }
-  for (i = 0; i < 6; i++) {
-    memcpy(&b[0], label+25+i*2, 2*sizeof(b[0]));
-    guid->Data4[2+i] = (unsigned char)strtoul(&b[0], NULL, 16);
-  }
-
-  return TRUE;
-}
-
-static BOOL usb_GetDevicePath(const TCHAR *guid, TCHAR *path, size_t pathsize)
-{
-  GUID ClsId;
-  HDEVINFO hDevInfo;
-  DWORD dwSize;
-  BOOL result = FALSE;
-
-  /* convert the string to a GUID */
-  MakeGUID(guid, &ClsId);
-
-  /* get the device information set for all USB devices that have a device
-     interface and are currently present on the system (plugged in). */
-  hDevInfo = SetupDiGetClassDevs(&ClsId, NULL, 0, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
-  if (hDevInfo != INVALID_HANDLE_VALUE) {
-    SP_DEVICE_INTERFACE_DATA DevIntfData;
-    /* keep calling SetupDiEnumDeviceInterfaces(..) until it fails with code
-       ERROR_NO_MORE_ITEMS (with call the dwMemberIdx value needs to be
-       incremented to retrieve the next device interface information */
-    DevIntfData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-    result = SetupDiEnumDeviceInterfaces(hDevInfo, NULL, &ClsId, 0, &DevIntfData);
-
-    if (result) {
-      SP_DEVINFO_DATA DevData;
-      PSP_DEVICE_INTERFACE_DETAIL_DATA DevIntfDetailData;
-      /* get more details for each of the interfaces, including the device path
-         (which contains the device's VID/PID */
-      DevData.cbSize = sizeof(DevData);
-
-      /* get the required buffer size, then allocate the memory for it and
-         initialize the cbSize field */
-      SetupDiGetDeviceInterfaceDetail(hDevInfo, &DevIntfData, NULL, 0,&dwSize, NULL);
-      DevIntfDetailData = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
-      #if defined _UNICODE
-        DevIntfDetailData->cbSize = sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
-      #elif defined _WIN64
-        DevIntfDetailData->cbSize = 8; // sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
-      #else
-        DevIntfDetailData->cbSize = 5; // sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
-      #endif
-
-      if (SetupDiGetDeviceInterfaceDetail(hDevInfo, &DevIntfData, DevIntfDetailData, dwSize,&dwSize,&DevData)) {
-        NK_ASSERT(path!=NULL);
-        NK_ASSERT(pathsize>0);
-        #if defined _UNICODE
-          memset(path, 0, pathsize*sizeof(TCHAR));
-          _tcsncpy(path, (TCHAR*)DevIntfDetailData->DevicePath, pathsize-1);
-        #else
-          strlcpy(path, DevIntfDetailData->DevicePath, pathsize);
-        #endif
-      } else {
-        result = FALSE;
-      }
 
-      HeapFree(GetProcessHeap(), 0, DevIntfDetailData);
-    }
+/* The trace data comes either directly from the USB interface of the Black
+   Magic Probe, or from the shared ring of the capture daemon (bmtraced), if
+   it is running. In the latter case, several applications can view the
+   trace data of the same probe at the same time. When the daemon quits, the
+   reader switches to the USB interface (or to a new daemon). */
+static volatile int trace_shared = 0;
+static volatile int trace_source = TRACESRC_NORMAL;
+static volatile unsigned long ring_overruns = 0;  /* total, over all rings */
+static unsigned long ring_seen = 0;   /* overruns of the current ring that were counted */
+static int ring_gap = 0;              /* set when packets were lost (reader thread) */
 
-    SetupDiDestroyDeviceInfoList(hDevInfo);
+/** trace_reopen() is called when the capture daemon has quit (or when the
+ *  source was lost earlier). It attaches to a new daemon if one runs, and
+ *  opens the USB interface of the probe otherwise.
+ *
+ *  \return -1, so that the reader waits before it tries again (if the
+ *          source is still lost).
+ */
+static int trace_reopen(void)
+{
+  if (trace_shared) {
+    sworing_close();
+    ATOMIC_STORE(&trace_shared, 0);
   }
-
-  return result;
+  ring_gap = 1;   /* the stream restarts at a different point */
+  if (sworing_open()) {
+    ring_seen = 0;
+    ATOMIC_STORE(&trace_shared, 1);
+    ATOMIC_STORE(&trace_source, TRACESRC_NORMAL);
+  } else if (swousb_open() == TRACESTAT_OK) {
+    ATOMIC_STORE(&trace_source, TRACESRC_FALLBACK);
+  } else {
+    ATOMIC_STORE(&trace_source, TRACESRC_LOST);
+  }
+  return -1;
 }
 
-static HANDLE usb_OpenDevice(const TCHAR *path)
+static int trace_nextpacket(unsigned char *buffer, size_t size, double *timestamp)
 {
-  BOOL result;
-  HANDLE hDev;
-  WINUSB_INTERFACE_HANDLE hUSB;
-
-  hDev = CreateFile(path, GENERIC_WRITE | GENERIC_READ,
-                    FILE_SHARE_WRITE | FILE_SHARE_READ,
-                    NULL, OPEN_EXISTING,
-                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
-  if (hDev == INVALID_HANDLE_VALUE)
-    return INVALID_HANDLE_VALUE;
-
-  result = WinUsb_Initialize(hDev, &hUSB);
-  if (!result) {
-    CloseHandle(hDev);
-    return INVALID_HANDLE_VALUE;
+  int numread;
+
+  if (trace_shared) {
+    numread = sworing_read(buffer, size, timestamp);
+    if (sworing_overruns() != ring_seen) {
+      /* the reader fell behind, and was moved ahead in the ring */
+      ATOMIC_STORE(&ring_overruns, ring_overruns + (sworing_overruns() - ring_seen));
+      ring_seen = sworing_overruns();
+      ring_gap = 1;
+    }
+    if (numread == 0)
+      numread = -2; /* no data, but no error either */
+    else if (numread < 0)
+      numread = trace_reopen(); /* the daemon quit */
+  } else if (trace_source == TRACESRC_LOST) {
+    numread = trace_reopen();
+  } else {
+    numread = swousb_read(buffer, size);
+    *timestamp = swousb_timestamp();
   }
-
-  return hUSB;
+  return numread;
 }
 
-/* endpoint: use 0x85 for input endpoint #5
+/** trace_queuepacket() adds a packet to the queue for the decoder.
+ *
+ *  \return 1 on success, 0 if the queue is full.
  */
-static BOOL usb_ConfigEndpoint(WINUSB_INTERFACE_HANDLE hUSB, unsigned char endpoint)
+static int trace_queuepacket(const unsigned char *buffer, int length, double timestamp)
 {
-  BOOL result;
-  USB_INTERFACE_DESCRIPTOR ifaceDescriptor;
+  int next = (tracequeue_tail + 1) % PACKET_NUM;
+  if (next == ATOMIC_LOAD(&tracequeue_head))
+    return 0;
+  if (length > 0) {
+    memcpy(trace_queue[tracequeue_tail].data, buffer, length);
+    trace_queue[tracequeue_tail].length = length;
+    trace_queue[tracequeue_tail].timestamp = timestamp;
+    trace_queue[tracequeue_tail].gap = ring_gap;
+    ring_gap = 0;
+    ATOMIC_STORE(&tracequeue_tail, next);
+  }
+  return 1;
+}
 
-  NK_ASSERT(hUSB != INVALID_HANDLE_VALUE);
+static int trace_open(void)
+{
+  trace_source = TRACESRC_NORMAL;
+  ring_overruns = ring_seen = 0;
+  ring_gap = 0;
+  trace_shared = sworing_open();
+  if (trace_shared)
+    return TRACESTAT_OK;
+  return swousb_open();
+}
 
-  if (WinUsb_QueryInterfaceSettings(hUSB, 0, &ifaceDescriptor)) {
-    WINUSB_PIPE_INFORMATION pipeInfo;
-    int idx;
-    for (idx=0; idx<ifaceDescriptor.bNumEndpoints; idx++) {
-      memset(&pipeInfo, 0, sizeof(pipeInfo));
-      result = WinUsb_QueryPipe(hUSB, 0, (unsigned char)idx, &pipeInfo);
-      if (result && pipeInfo.PipeId == endpoint)
-        return TRUE;
-    }
-  }
-  return FALSE;
+static void trace_release(void)
+{
+  if (trace_shared)
+    sworing_close();
+  else if (trace_source != TRACESRC_LOST)
+    swousb_close();
+  trace_shared = 0;
 }
 
-static HANDLE hThread = NULL;
-static WINUSB_INTERFACE_HANDLE hUSB = INVALID_HANDLE_VALUE;
-static LARGE_INTEGER pcfreq;
+/** trace_isshared() returns whether the trace data is received from the
+ *  capture daemon (rather than directly from the probe).
+ */
+int trace_isshared(void)
+{
+  return ATOMIC_LOAD(&trace_shared);
+}
 
-/** get_timestamp() return precision timestamp in seconds.
+/** trace_sourcestate() returns whether the trace data still arrives from
+ *  the source that trace_init() opened.
+ *
+ *  \param overruns   Set to the number of times that packets were lost,
+ *                    because the decoder fell behind the capture daemon.
+ *                    This parameter may be NULL.
+ *
+ *  \return TRACESRC_NORMAL, TRACESRC_FALLBACK if the capture daemon quit
+ *          and the data is now read from the probe directly, or
+ *          TRACESRC_LOST if the capture daemon quit and the probe is not
+ *          available either.
  */
-static double get_timestamp(void)
+int trace_sourcestate(unsigned long *overruns)
 {
-  LARGE_INTEGER t;
+  if (overruns != NULL)
+    *overruns = ATOMIC_LOAD(&ring_overruns);
+  return ATOMIC_LOAD(&trace_source);
+}
+
+#if defined WIN32 || defined _WIN32
 
-  if (pcfreq.LowPart == 0 && pcfreq.HighPart == 0)
-    QueryPerformanceFrequency(&pcfreq);
-  QueryPerformanceCounter(&t);
-  return (double)t.QuadPart / (double)pcfreq.QuadPart;
+static HANDLE hThread = NULL;
+static HANDLE hDecoder = NULL;
+
+static DWORD __stdcall trace_decode(LPVOID arg)
+{
+  (void)arg;
+  while (!ATOMIC_LOAD(&decode_quit)) {
+    if (trace_decodebatch() != 0)
+      PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L); /* just a flag to wake up the GUI */
+    else
+      Sleep(1);
+  }
+  return 0;
 }
 
 static DWORD __stdcall trace_read(LPVOID arg)
 {
-  #define PACKETSIZE  64
-  unsigned char buffer[PACKETSIZE];
-  unsigned long numread = 0;
+  unsigned char buffer[PACKET_SIZE];
+  double timestamp;
+  int numread;
 
   (void)arg;
   for ( ;; ) {
-    if (WinUsb_ReadPipe(hUSB, BMP_EP_TRACE, buffer, sizearray(buffer),&numread, NULL)) {
-      /* add the packet to the queue */
-      int next = (tracequeue_tail + 1) % PACKET_NUM;
-      if (numread > 0 && next != tracequeue_head) {
-        memcpy(trace_queue[tracequeue_tail].data, buffer, numread);
-        trace_queue[tracequeue_tail].length = numread;
-        trace_queue[tracequeue_tail].timestamp = get_timestamp();
-        tracequeue_tail = next;
-        PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L); /* just a flag to wake up the GUI */
-      }
-    } else {
+    numread = trace_nextpacket(buffer, sizearray(buffer), &timestamp);
+    if (numread > 0) {
+      /* when reading from the shared ring, wait for the decoder to catch up
+         (the ring buffers the data); packets from USB are dropped instead */
+      while (!trace_queuepacket(buffer, numread, timestamp) && trace_shared)
+        Sleep(1);
+    } else if (numread == -2)
+      Sleep(1);
+    else if (numread < 0)
       Sleep(100);
-    }
   }
   return 0;
 }
 
 int trace_init(void)
 {
-  TCHAR guid[100], path[_MAX_PATH];
+  int result;
 
-  if (hThread != NULL && hUSB != INVALID_HANDLE_VALUE)
+  if (hThread != NULL)
     return TRACESTAT_OK;            /* double initialization */
 
-  if (!find_bmp(0, BMP_IF_TRACE, guid, sizearray(guid)))
-    return TRACESTAT_NO_INTERFACE;  /* Black Magic Probe not found (trace interface not found) */
-  if (!usb_GetDevicePath(guid, path, sizearray(path)))
-    return TRACESTAT_NO_DEVPATH;    /* device path to trace interface not found (should not occur) */
+  trace_lockinit();
+  result = trace_open();
+  if (result != TRACESTAT_OK)
+    return result;
 
-  hUSB = usb_OpenDevice(path);
-  if (hUSB == INVALID_HANDLE_VALUE)
-    return TRACESTAT_NO_ACCESS;     /* failure opening the device interface */
-  if (!usb_ConfigEndpoint(hUSB, BMP_EP_TRACE))
-    return TRACESTAT_NO_PIPE;       /* endpoint pipe could not be found -> not a Black Magic Probe? */
+  itm_decode_reset();
+  tpiu_decode_reset();
+  tracetime_reset();
 
+  decode_quit = 0;
+  hDecoder = CreateThread(NULL, 0, trace_decode, NULL, 0, NULL);
+  if (hDecoder == NULL) {
+    trace_release();
+    return TRACESTAT_NO_THREAD;
+  }
   hThread = CreateThread(NULL, 0, trace_read, NULL, 0, NULL);
-  if (hThread == NULL)
+  if (hThread == NULL) {
+    trace_close();
     return TRACESTAT_NO_THREAD;
+  }
   SetThreadPriority(hThread, THREAD_PRIORITY_ABOVE_NORMAL);
-
   return TRACESTAT_OK;
 }
 
 void trace_close(void)
 {
-  TerminateThread(hThread, 0);
-  WinUsb_Free(hUSB);
-  hThread = NULL;
-  hUSB = INVALID_HANDLE_VALUE;
+  if (hThread != NULL) {
+    TerminateThread(hThread, 0);
+    hThread = NULL;
+  }
+  if (hDecoder != NULL) {
+    ATOMIC_STORE(&decode_quit, 1);
+    WaitForSingleObject(hDecoder, INFINITE);
+    CloseHandle(hDecoder);
+    hDecoder = NULL;
+  }
+  trace_release();
 }
 
 #else
 
 static pthread_t hThread;
-static libusb_device_handle *hUSB;
+static pthread_t hDecoder;
+
+static void *trace_decode(void *arg)
+{
+  (void)arg;
+  while (!ATOMIC_LOAD(&decode_quit)) {
+    if (trace_decodebatch() == 0)
+      usleep(1000);
+  }
+  return 0;
+}
 
 static int memicmp(const unsigned char *p1, const unsigned char *p2, size_t count)
 {
@@ -685,97 +1685,56 @@ static int memicmp(const unsigned char *p1, const unsigned char *p2, size_t coun
   return diff;
 }
 
-static double timestamp(void)
-{
-  struct timeval tv;
-  gettimeofday(&tv,NULL);
-  return 1000000.0 * tv.tv_sec + tv.tv_usec;
-}
-
 static void *trace_read(void *arg)
 {
-  unsigned char buffer[64];
-  int numread = 0;
+  unsigned char buffer[PACKET_SIZE];
+  double timestamp;
+  int numread;
 
   (void)arg;
   for ( ;; ) {
-    if (libusb_bulk_transfer(hUSB, BMP_EP_TRACE, buffer, sizeof(buffer), &numread, 0) == 0) {
-      /* add the packet to the queue */
-      int next = (tracequeue_tail + 1) % PACKET_NUM;
-      if (numread > 0 && next != tracequeue_head) {
-        memcpy(trace_queue[tracequeue_tail].data, buffer, numread);
-        trace_queue[tracequeue_tail].length = numread;
-        trace_queue[tracequeue_tail].timestamp = timestamp();
-        tracequeue_tail = next;
-      }
-    }
+    numread = trace_nextpacket(buffer, sizeof(buffer), &timestamp);
+    if (numread > 0) {
+      /* when reading from the shared ring, wait for the decoder to catch up
+         (the ring buffers the data); packets from USB are dropped instead */
+      while (!trace_queuepacket(buffer, numread, timestamp) && trace_shared)
+        usleep(1000);
+    } else if (numread == -2)
+      usleep(1000);
+    else if (numread < 0)
+      usleep(100 * 1000);
   }
   return 0;
 }
 
-static int usb_OpenDevice(libusb_device_handle **hUSB)
-{
-  libusb_device **devs;
-  libusb_device_handle *handle;
-  ssize_t cnt;
-  int devidx, i, res;
-
-  /* get list of all devices */
-  cnt = libusb_get_device_list(0, &devs);
-  if (cnt < 0)
-    return TRACESTAT_INIT_FAILED;
-
-  /* find the BMP */
-  devidx = -1;
-  for (i = 0; devs[i] != NULL; i++) {
-    struct libusb_device_descriptor desc;
-    res = libusb_get_device_descriptor(devs[i], &desc);
-    if (res >= 0 && desc.idVendor == BMP_VID && desc.idProduct == BMP_PID) {
-      devidx = i;
-      break;
-    }
-  }
-  if (devidx < 0) {
-    libusb_free_device_list(devs, 1);
-    return TRACESTAT_NO_DEVPATH;
-  }
-
-  res = libusb_open(devs[devidx], &handle);
-  libusb_free_device_list(devs, 1);
-  if (res < 0)
-    return TRACESTAT_NO_ACCESS;
-
-  /* connect to the BMP capture interface */
-  res = libusb_claim_interface(handle, BMP_IF_TRACE);
-  if (res < 0) {
-    libusb_close(handle);
-    return TRACESTAT_NO_INTERFACE;
-  }
-
-  assert(hUSB != NULL);
-  *hUSB = handle;
-  return TRACESTAT_OK;
-}
-
 int trace_init(void)
 {
   int result;
 
-  hUSB = NULL;
   hThread = 0;
-
-  result = libusb_init(0);
-  if (result < 0)
-    return TRACESTAT_INIT_FAILED;
-
-  result = usb_OpenDevice(&hUSB);
+  hDecoder = 0;
+  trace_lockinit();
+  result = trace_open();
   if (result != TRACESTAT_OK)
     return result;
 
+  itm_decode_reset();
+  tpiu_decode_reset();
+  tracetime_reset();
+
+  decode_quit = 0;
+  result = pthread_create(&hDecoder, NULL, trace_decode, NULL);
+  if (result != 0) {
+    hDecoder = 0;
+    trace_release();
+    return TRACESTAT_NO_THREAD;
+  }
   result = pthread_create(&hThread, NULL, trace_read, NULL);
-  if (result != 0)
+  if (result != 0) {
+    hThread = 0;
+    trace_close();
     return TRACESTAT_NO_THREAD;
-
+  }
   return TRACESTAT_OK;
 }
 
@@ -783,12 +1742,15 @@ void trace_close(void)
 {
   if (hThread != 0) {
     pthread_cancel(hThread);
+    pthread_join(hThread, NULL);
     hThread = 0;
   }
-  if (hUSB != NULL) {
-    libusb_close(hUSB);
-    hUSB = NULL;
+  if (hDecoder != 0) {
+    ATOMIC_STORE(&decode_quit, 1);
+    pthread_join(hDecoder, NULL);
+    hDecoder = 0;
   }
+  trace_release();
 }
 
 #endif
@@ -838,7 +1800,7 @@ void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, in
   }
   labelwidth = (int)((labelwidth * rowheight) / 2) + 10;
   tstampwidth = 0;
-  for (item = tracestring_root.next; item != NULL; item = item->next)
+  for (item = view_head; item != NULL; item = tracestring_next(item))
     if (tstampwidth < item->timefmt_len)
       tstampwidth = item->timefmt_len;
   tstampwidth = (int)((tstampwidth * rowheight) / 2) + 10;
@@ -848,7 +1810,7 @@ void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, in
   if (nk_group_begin_titled(ctx, id, "", widget_flags)) {
     int lines = 0, widgetlines = 0, ypos;
     float lineheight = 0;
-    for (item = tracestring_root.next; item != NULL; item = item->next) {
+    for (item = view_head; item != NULL; item = tracestring_next(item)) {
       int textwidth;
       struct nk_color clrtxt;
       NK_ASSERT(item->text != NULL);
@@ -939,3 +1901,222 @@ void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, in
   nk_style_pop_color(ctx);
 }
 
+
+/* traceplot_widget() draws a graph of a numeric field of a CTF event. The
+   mouse wheel zooms in and out around the mouse position, and dragging
+   the graph with the left mouse button pans it. As long as the graph is not
+   zoomed or panned, it shows the full range and follows new events; set
+   "reset" to return to this mode. */
+void traceplot_widget(struct nk_context *ctx, const char *event, const char *field, int reset)
+{
+  static PLOTVIEW view;   /* copy of the bins that the decoder published */
+  static double view_start = 0.0, view_end = 0.0;
+  static int follow = 1;
+  struct nk_command_buffer *canvas = nk_window_get_canvas(ctx);
+  const struct nk_input *input = &ctx->input;
+  const struct nk_user_font *font = ctx->style.font;
+  enum nk_widget_layout_states state;
+  struct nk_rect bounds, rc;
+  struct nk_color color = nk_rgb(255, 255, 128);
+  const CTF_EVENT *evt;
+  const CTF_PLOTBIN *bins;
+  double ymin, ymax, yscale;
+  float xprev, yprev;
+  char text[64];
+  int count, idx, current;
+
+  state = nk_widget(&bounds, ctx);
+  if (state == NK_WIDGET_INVALID)
+    return;
+  nk_fill_rect(canvas, bounds, 0, nk_rgba(20, 29, 38, 225));
+  if (event == NULL || field == NULL || *event == '\0' || bounds.w < 2 || bounds.h < 2)
+    return;
+  for (evt = event_next(NULL); evt != NULL && strcmp(evt->name, event) != 0; evt = event_next(evt))
+    /* nothing */;
+  if (evt != NULL)
+    color = channels[evt->stream_id % NUM_CHANNELS].color;
+
+  count = (int)bounds.w;
+  if (count > PLOT_BINS)
+    count = PLOT_BINS;
+  traceplot_fetch(&view);
+  current = strcmp(view.event, event) == 0 && strcmp(view.field, field) == 0 && view.end > view.start;
+  if (reset || follow || view_end <= view_start) {
+    /* zooming and panning start from the range that is displayed */
+    view_start = current ? view.start : 0.0;
+    view_end = current ? view.end : 0.0;
+    follow = 1;
+  }
+  if (current && state == NK_WIDGET_VALID && nk_input_is_mouse_hovering_rect(input, bounds)) {
+    double span = view_end - view_start;
+    if (input->mouse.scroll_delta.y < 0 || input->mouse.scroll_delta.y > 0) {
+      double anchor = view_start + span * (input->mouse.pos.x - bounds.x) / bounds.w;
+      double factor = (input->mouse.scroll_delta.y > 0) ? 0.8 : 1.25;
+      view_start = anchor - (anchor - view_start) * factor;
+      view_end = anchor + (view_end - anchor) * factor;
+      follow = 0;
+    }
+    if (nk_input_has_mouse_click_down_in_rect(input, NK_BUTTON_LEFT, bounds, nk_true)
+        && (input->mouse.delta.x < 0 || input->mouse.delta.x > 0)) {
+      double shift = -span * input->mouse.delta.x / bounds.w;
+      view_start += shift;
+      view_end += shift;
+      follow = 0;
+    }
+  }
+  traceplot_request(event, field, view_start, view_end, follow, count);
+  if (!current || !view.valid)
+    return;
+  /* the bins are for the request of the previous frame */
+  bins = view.bins;
+  count = view.count;
+
+  /* vertical range of the visible data */
+  ymin = DBL_MAX;
+  ymax = -DBL_MAX;
+  for (idx = 0; idx < count; idx++) {
+    if (bins[idx].count > 0) {
+      if (bins[idx].min < ymin)
+        ymin = bins[idx].min;
+      if (bins[idx].max > ymax)
+        ymax = bins[idx].max;
+    }
+  }
+  if (ymax - ymin < DBL_EPSILON * fabs(ymax) + DBL_MIN) {
+    ymin -= 1.0;
+    ymax += 1.0;
+  }
+  yscale = (bounds.h - 2 * font->height - 4) / (ymax - ymin);
+  #define PLOT_Y(v) (float)(bounds.y + font->height + 2 + (ymax - (v)) * yscale)
+
+  /* one vertical line per pixel column for the range of the values in it,
+     plus a line from the last value in the previous column with data */
+  xprev = -1;
+  yprev = 0;
+  for (idx = 0; idx < count; idx++) {
+    const CTF_PLOTBIN *bin = &bins[idx];
+    float x = bounds.x + idx + 0.5f;
+    float y1, y2;
+    if (bin->count == 0)
+      continue;
+    if (xprev >= 0)
+      nk_stroke_line(canvas, xprev, yprev, x, PLOT_Y(bin->first), 1.0f, color);
+    y1 = PLOT_Y(bin->max);
+    y2 = PLOT_Y(bin->min);
+    if (y2 - y1 < 1.0f)
+      y2 = y1 + 1.0f;
+    nk_stroke_line(canvas, x, y1, x, y2, 1.0f, color);
+    xprev = x;
+    yprev = PLOT_Y(bin->last);
+  }
+  #undef PLOT_Y
+
+  /* labels: value range at the left, time range at the bottom right */
+  rc = nk_rect(bounds.x + 4, bounds.y + 1, bounds.w / 2 - 4, font->height);
+  sprintf(text, "%.6g", ymax);
+  nk_draw_text(canvas, rc, text, (int)strlen(text), font, nk_rgba(0, 0, 0, 0), nk_rgb(200, 200, 200));
+  rc.y = bounds.y + bounds.h - font->height - 1;
+  sprintf(text, "%.6g", ymin);
+  nk_draw_text(canvas, rc, text, (int)strlen(text), font, nk_rgba(0, 0, 0, 0), nk_rgb(200, 200, 200));
+  sprintf(text, "%.3f .. %.3f s", view.start, view.end);
+  rc.w = font->width(font->userdata, font->height, text, (int)strlen(text));
+  rc.x = bounds.x + bounds.w - rc.w - 4;
+  nk_draw_text(canvas, rc, text, (int)strlen(text), font, nk_rgba(0, 0, 0, 0), nk_rgb(200, 200, 200));
+  snprintf(text, sizearray(text), "%s.%s", event, field);
+  rc.w = font->width(font->userdata, font->height, text, (int)strlen(text));
+  rc.x = bounds.x + bounds.w - rc.w - 4;
+  rc.y = bounds.y + 1;
+  nk_draw_text(canvas, rc, text, (int)strlen(text), font, nk_rgba(0, 0, 0, 0), color);
+}
+
+/* tracestring_findtime() returns the line number of the first string at or
+   after the given time, or the last line if all strings are earlier */
+static int tracestring_findtime(double timestamp)
+{
+  TRACESTRING *item;
+  int line = 0;
+
+  for (item = view_head; item != NULL; item = tracestring_next(item)) {
+    if (item->timestamp >= timestamp)
+      return line;
+    line++;
+  }
+  return (line > 0) ? line - 1 : -1;
+}
+
+/* tracedensity_widget() draws a strip with the number of strings over the
+   full duration of the trace, stacked per channel. It returns the line
+   number of the first string at the time that the user clicked on, or -1
+   if there was no click. */
+int tracedensity_widget(struct nk_context *ctx)
+{
+  static DENSITYVIEW view;  /* copy of the counts that the decoder published */
+  struct nk_command_buffer *canvas = nk_window_get_canvas(ctx);
+  const struct nk_input *input = &ctx->input;
+  enum nk_widget_layout_states state;
+  struct nk_rect bounds, rcwin;
+  double bucketwidth, clicktime = -1.0;
+  unsigned peak, total, hovercount = 0;
+  int numbuckets, bucket, chan, hover = -1;
+  float colwidth;
+  char text[64];
+
+  state = nk_widget(&bounds, ctx);
+  if (state == NK_WIDGET_INVALID)
+    return -1;
+  nk_fill_rect(canvas, bounds, 0, nk_rgba(20, 29, 38, 225));
+  if (bounds.w < 1 || bounds.h < 1)
+    return -1;
+
+  ATOMIC_STORE(&density_columns, (int)bounds.w);
+  density_fetch(&view);
+  if (view.numbuckets == 0)
+    return -1;
+  /* the counts are for the width of the strip in the previous frame */
+  numbuckets = view.numbuckets;
+  colwidth = bounds.w / numbuckets;
+  bucketwidth = view.bucketwidth;
+  peak = 0;
+  for (bucket = 0; bucket < numbuckets; bucket++) {
+    total = 0;
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+      total += view.count[bucket][chan];
+    if (peak < total)
+      peak = total;
+  }
+  if (state == NK_WIDGET_VALID && nk_input_is_mouse_hovering_rect(input, bounds)) {
+    hover = (int)((input->mouse.pos.x - bounds.x) / colwidth);
+    if (hover >= numbuckets)
+      hover = numbuckets - 1;
+    if (nk_input_mouse_clicked(input, NK_BUTTON_LEFT, bounds))
+      clicktime = view.origin + hover * bucketwidth;
+  }
+  for (bucket = 0; peak > 0 && bucket < numbuckets; bucket++) {
+    float x = bounds.x + bucket * colwidth;
+    float y = bounds.y + bounds.h;
+    total = 0;
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+      unsigned count = view.count[bucket][chan];
+      float h;
+      if (count == 0)
+        continue;
+      total += count;
+      h = bounds.h * count / peak;
+      nk_fill_rect(canvas, nk_rect(x, y - h, colwidth, h), 0, channels[chan].color);
+      y -= h;
+    }
+    if (bucket == hover) {
+      hovercount = total;
+      nk_stroke_rect(canvas, nk_rect(x, bounds.y, colwidth, bounds.h), 0, 1.0f, nk_rgb(255, 255, 128));
+    }
+  }
+  if (hover >= 0) {
+    sprintf(text, "%.3f s: %u strings", hover * bucketwidth, hovercount);
+    rcwin = nk_window_get_bounds(ctx);
+    nk_tooltip(ctx, text, &rcwin);
+  }
+
+  if (clicktime >= 0.0)
+    return tracestring_findtime(clicktime);
+  return -1;
+}
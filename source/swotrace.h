@@ -21,21 +21,19 @@
 #define NUM_CHANNELS  32  /* number of SWO channels */
 
 enum {
-  TRACESTAT_OK = 0,
-  TRACESTAT_NO_INTERFACE, /* Black Magic Probe not found (trace interface not found) */
-  TRACESTAT_NO_DEVPATH,   /* device path to trace interface not found */
-  TRACESTAT_NO_ACCESS,    /* failure opening the device interface */
-  TRACESTAT_NO_PIPE,      /* endpoint pipe could not be found -> not a Black Magic Probe? */
-  TRACESTAT_BAD_PACKET,   /* invalid trace data packet received */
-  TRACESTAT_NO_THREAD,    /* thread could not be created */
-  TRACESTAT_INIT_FAILED,  /* WunUSB / libusb initialization failed */
+  TRACESTATMSG_BMP,
+  TRACESTATMSG_CTF,
 };
 
 enum {
-  TRACESTATMSG_BMP,
-  TRACESTATMSG_CTF,
+  TRACESRC_NORMAL,    /* data arrives from the source that was opened */
+  TRACESRC_FALLBACK,  /* capture daemon quit, data is read from the probe */
+  TRACESRC_LOST,      /* capture daemon quit, probe not available */
 };
 
+struct tagITMPACKET;
+typedef void (*TRACE_HWHANDLER)(const struct tagITMPACKET *packet, double timestamp);
+
 void channel_set(int index, int enabled, const char *name, struct nk_color color);
 int  channel_getenabled(int index);
 void channel_setenabled(int index, int enabled);
@@ -44,18 +42,29 @@ void channel_setname(int index, const char *name);
 struct nk_color channel_getcolor(int index);
 void channel_setcolor(int index, struct nk_color color);
 
-int trace_init(void);
+int trace_init(void);   /* returns one of the TRACESTAT_xxx codes from swousb.h */
 void trace_close(void);
+int trace_isshared(void);
+int trace_sourcestate(unsigned long *overruns);
+void trace_lock(void);
+void trace_unlock(void);
 int trace_enablectf(int enable);
+int trace_setformatter(int enable);
+void trace_sethwhandler(TRACE_HWHANDLER handler);
 
 void tracestring_add(const unsigned char *buffer, size_t length, double timestamp);
 void tracestring_clear(void);
 int  tracestring_isempty(void);
 void tracestring_process(int enabled);
 int  trace_save(const char *filename);
+int  trace_savesnapshot(const char *filename);
+void trace_settrigger_text(const char *text);
+int  trace_settrigger_ctf(const char *predicate);
 int  tracestring_find(const char *text, int curline);
 
 void tracelog_statusmsg(int type, const char *msg, int code);
 void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, int markline, nk_flags widget_flags);
+int  tracedensity_widget(struct nk_context *ctx);
+void traceplot_widget(struct nk_context *ctx, const char *event, const char *field, int reset);
 
 #endif /* _SWOTRACE_H */
@@ -0,0 +1,367 @@
+/*
+ * Access to the trace interface of the Black Magic Probe: the bulk endpoint
+ * on which the probe sends the SWO data. This is used by the SWO trace code
+ * in bmtrace and bmdebug, and by the capture daemon.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined WIN32 || defined _WIN32
+  #define STRICT
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+  #include <tchar.h>
+  #include <initguid.h>
+  #include <setupapi.h>
+  #include <winusb.h>
+  #if defined __MINGW32__ || defined __MINGW64__ || defined _MSC_VER
+    #include "strlcpy.h"
+  #endif
+#elif defined __linux__
+  #include <time.h>
+  #include <libusb-1.0/libusb.h>
+#endif
+
+#include "bmscan.h"
+#include "swousb.h"
+
+#if !defined sizearray
+  #define sizearray(e)    (sizeof(e) / sizeof((e)[0]))
+#endif
+
+
+#if defined WIN32 || defined _WIN32
+
+static BOOL MakeGUID(const char *label, GUID *guid)
+{
+  unsigned i;
+  char b[5];
+
+  /* check whether the string has a valid format &*/
+  if (strlen(label) != 38)
+    return FALSE;
+  for (i=0; i<strlen(label); i++) {
+    char c = label[i];
+    if (i == 0) {
+      if (c != '{')
+        return FALSE;
+    } else if (i == 37) {
+      if (c != '}')
+        return FALSE;
+    } else if (i == 9 || i == 14 || i == 19 || i == 24) {
+      if (c != '-')
+        return FALSE;
+    } else {
+      if (!(c >= '0' && c <= '9') && !(c >= 'A' && c <= 'F') && !(c >= 'a' && c <= 'f'))
+        return FALSE;
+    }
+  }
+
+  guid->Data1 = strtoul(label+1, NULL, 16);
+  guid->Data2 = (unsigned short)strtoul(label+10, NULL, 16);
+  guid->Data3 = (unsigned short)strtoul(label+15, NULL, 16);
+  memset(b, 0, sizeof b);
+  for (i = 0; i < 2; i++) {
+    memcpy(&b[0], label+20+i*2, 2*sizeof(b[0]));
+    guid->Data4[i] = (unsigned char)strtoul(&b[0], NULL, 16);
+  }
+  for (i = 0; i < 6; i++) {
+    memcpy(&b[0], label+25+i*2, 2*sizeof(b[0]));
+    guid->Data4[2+i] = (unsigned char)strtoul(&b[0], NULL, 16);
+  }
+
+  return TRUE;
+}
+
+static BOOL usb_GetDevicePath(const TCHAR *guid, TCHAR *path, size_t pathsize)
+{
+  GUID ClsId;
+  HDEVINFO hDevInfo;
+  DWORD dwSize;
+  BOOL result = FALSE;
+
+  /* convert the string to a GUID */
+  MakeGUID(guid, &ClsId);
+
+  /* get the device information set for all USB devices that have a device
+     interface and are currently present on the system (plugged in). */
+  hDevInfo = SetupDiGetClassDevs(&ClsId, NULL, 0, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
+  if (hDevInfo != INVALID_HANDLE_VALUE) {
+    SP_DEVICE_INTERFACE_DATA DevIntfData;
+    /* keep calling SetupDiEnumDeviceInterfaces(..) until it fails with code
+       ERROR_NO_MORE_ITEMS (with call the dwMemberIdx value needs to be
+       incremented to retrieve the next device interface information */
+    DevIntfData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+    result = SetupDiEnumDeviceInterfaces(hDevInfo, NULL, &ClsId, 0, &DevIntfData);
+
+    if (result) {
+      SP_DEVINFO_DATA DevData;
+      PSP_DEVICE_INTERFACE_DETAIL_DATA DevIntfDetailData;
+      /* get more details for each of the interfaces, including the device path
+         (which contains the device's VID/PID */
+      DevData.cbSize = sizeof(DevData);
+
+      /* get the required buffer size, then allocate the memory for it and
+         initialize the cbSize field */
+      SetupDiGetDeviceInterfaceDetail(hDevInfo, &DevIntfData, NULL, 0,&dwSize, NULL);
+      DevIntfDetailData = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
+      #if defined _UNICODE
+        DevIntfDetailData->cbSize = sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
+      #elif defined _WIN64
+        DevIntfDetailData->cbSize = 8; // sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
+      #else
+        DevIntfDetailData->cbSize = 5; // sizeof(SP_INTERFACE_DEVICE_DETAIL_DATA);
+      #endif
+
+      if (SetupDiGetDeviceInterfaceDetail(hDevInfo, &DevIntfData, DevIntfDetailData, dwSize,&dwSize,&DevData)) {
+        assert(path!=NULL);
+        assert(pathsize>0);
+        #if defined _UNICODE
+          memset(path, 0, pathsize*sizeof(TCHAR));
+          _tcsncpy(path, (TCHAR*)DevIntfDetailData->DevicePath, pathsize-1);
+        #else
+          strlcpy(path, DevIntfDetailData->DevicePath, pathsize);
+        #endif
+      } else {
+        result = FALSE;
+      }
+
+      HeapFree(GetProcessHeap(), 0, DevIntfDetailData);
+    }
+
+    SetupDiDestroyDeviceInfoList(hDevInfo);
+  }
+
+  return result;
+}
+
+static HANDLE usb_OpenDevice(const TCHAR *path)
+{
+  BOOL result;
+  HANDLE hDev;
+  WINUSB_INTERFACE_HANDLE hUSB;
+
+  hDev = CreateFile(path, GENERIC_WRITE | GENERIC_READ,
+                    FILE_SHARE_WRITE | FILE_SHARE_READ,
+                    NULL, OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+  if (hDev == INVALID_HANDLE_VALUE)
+    return INVALID_HANDLE_VALUE;
+
+  result = WinUsb_Initialize(hDev, &hUSB);
+  if (!result) {
+    CloseHandle(hDev);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  return hUSB;
+}
+
+/* endpoint: use 0x85 for input endpoint #5
+ */
+static BOOL usb_ConfigEndpoint(WINUSB_INTERFACE_HANDLE hUSB, unsigned char endpoint)
+{
+  BOOL result;
+  USB_INTERFACE_DESCRIPTOR ifaceDescriptor;
+
+  assert(hUSB != INVALID_HANDLE_VALUE);
+
+  if (WinUsb_QueryInterfaceSettings(hUSB, 0, &ifaceDescriptor)) {
+    WINUSB_PIPE_INFORMATION pipeInfo;
+    int idx;
+    for (idx=0; idx<ifaceDescriptor.bNumEndpoints; idx++) {
+      memset(&pipeInfo, 0, sizeof(pipeInfo));
+      result = WinUsb_QueryPipe(hUSB, 0, (unsigned char)idx, &pipeInfo);
+      if (result && pipeInfo.PipeId == endpoint)
+        return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static WINUSB_INTERFACE_HANDLE hUSB = INVALID_HANDLE_VALUE;
+static LARGE_INTEGER pcfreq;
+
+/** swousb_open() opens the trace interface of the Black Magic Probe.
+ *
+ *  \return TRACESTAT_OK on success, or an error code on failure.
+ */
+int swousb_open(void)
+{
+  TCHAR guid[100], path[_MAX_PATH];
+
+  if (hUSB != INVALID_HANDLE_VALUE)
+    return TRACESTAT_OK;            /* double initialization */
+
+  if (!find_bmp(0, BMP_IF_TRACE, guid, sizearray(guid)))
+    return TRACESTAT_NO_INTERFACE;  /* Black Magic Probe not found (trace interface not found) */
+  if (!usb_GetDevicePath(guid, path, sizearray(path)))
+    return TRACESTAT_NO_DEVPATH;    /* device path to trace interface not found (should not occur) */
+
+  hUSB = usb_OpenDevice(path);
+  if (hUSB == INVALID_HANDLE_VALUE)
+    return TRACESTAT_NO_ACCESS;     /* failure opening the device interface */
+  if (!usb_ConfigEndpoint(hUSB, BMP_EP_TRACE))
+    return TRACESTAT_NO_PIPE;       /* endpoint pipe could not be found -> not a Black Magic Probe? */
+
+  {
+    ULONG timeout = 500;  /* so that swousb_read() returns periodically */
+    WinUsb_SetPipePolicy(hUSB, BMP_EP_TRACE, PIPE_TRANSFER_TIMEOUT, sizeof timeout, &timeout);
+  }
+  return TRACESTAT_OK;
+}
+
+void swousb_close(void)
+{
+  if (hUSB != INVALID_HANDLE_VALUE) {
+    WinUsb_Free(hUSB);
+    hUSB = INVALID_HANDLE_VALUE;
+  }
+}
+
+/** swousb_read() waits for a packet from the trace endpoint.
+ *
+ *  \return The number of bytes read, 0 on a time-out, or -1 on failure.
+ */
+int swousb_read(unsigned char *buffer, size_t size)
+{
+  unsigned long numread = 0;
+
+  assert(buffer != NULL && size > 0);
+  if (!WinUsb_ReadPipe(hUSB, BMP_EP_TRACE, buffer, (ULONG)size, &numread, NULL))
+    return (GetLastError() == ERROR_SEM_TIMEOUT) ? 0 : -1;
+  return (int)numread;
+}
+
+/** swousb_timestamp() returns a precision timestamp in seconds.
+ */
+double swousb_timestamp(void)
+{
+  LARGE_INTEGER t;
+
+  if (pcfreq.LowPart == 0 && pcfreq.HighPart == 0)
+    QueryPerformanceFrequency(&pcfreq);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart / (double)pcfreq.QuadPart;
+}
+
+#else
+
+static libusb_device_handle *hUSB = NULL;
+
+static int usb_OpenDevice(libusb_device_handle **hUSB)
+{
+  libusb_device **devs;
+  libusb_device_handle *handle;
+  ssize_t cnt;
+  int devidx, i, res;
+
+  /* get list of all devices */
+  cnt = libusb_get_device_list(0, &devs);
+  if (cnt < 0)
+    return TRACESTAT_INIT_FAILED;
+
+  /* find the BMP */
+  devidx = -1;
+  for (i = 0; devs[i] != NULL; i++) {
+    struct libusb_device_descriptor desc;
+    res = libusb_get_device_descriptor(devs[i], &desc);
+    if (res >= 0 && desc.idVendor == BMP_VID && desc.idProduct == BMP_PID) {
+      devidx = i;
+      break;
+    }
+  }
+  if (devidx < 0) {
+    libusb_free_device_list(devs, 1);
+    return TRACESTAT_NO_DEVPATH;
+  }
+
+  res = libusb_open(devs[devidx], &handle);
+  libusb_free_device_list(devs, 1);
+  if (res < 0)
+    return TRACESTAT_NO_ACCESS;
+
+  /* connect to the BMP capture interface */
+  res = libusb_claim_interface(handle, BMP_IF_TRACE);
+  if (res < 0) {
+    libusb_close(handle);
+    return TRACESTAT_NO_INTERFACE;
+  }
+
+  assert(hUSB != NULL);
+  *hUSB = handle;
+  return TRACESTAT_OK;
+}
+
+/** swousb_open() opens the trace interface of the Black Magic Probe.
+ *
+ *  \return TRACESTAT_OK on success, or an error code on failure.
+ */
+int swousb_open(void)
+{
+  int result;
+
+  if (hUSB != NULL)
+    return TRACESTAT_OK;            /* double initialization */
+
+  result = libusb_init(0);
+  if (result < 0)
+    return TRACESTAT_INIT_FAILED;
+
+  return usb_OpenDevice(&hUSB);
+}
+
+void swousb_close(void)
+{
+  if (hUSB != NULL) {
+    libusb_close(hUSB);
+    hUSB = NULL;
+  }
+}
+
+/** swousb_read() waits for a packet from the trace endpoint.
+ *
+ *  \return The number of bytes read, 0 on a time-out, or -1 on failure.
+ */
+int swousb_read(unsigned char *buffer, size_t size)
+{
+  int numread = 0;
+  int result;
+
+  assert(buffer != NULL && size > 0);
+  result = libusb_bulk_transfer(hUSB, BMP_EP_TRACE, buffer, (int)size, &numread, 500);
+  if (result == LIBUSB_ERROR_TIMEOUT)
+    return numread;
+  if (result != 0)
+    return -1;
+  return numread;
+}
+
+/** swousb_timestamp() returns a monotonic timestamp in seconds (immune to
+ *  changes of the system time, and the same clock in all processes).
+ */
+double swousb_timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+#endif
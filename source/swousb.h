@@ -0,0 +1,46 @@
+/*
+ * Access to the trace interface of the Black Magic Probe: the bulk endpoint
+ * on which the probe sends the SWO data.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _SWOUSB_H
+#define _SWOUSB_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+enum {
+  TRACESTAT_OK = 0,
+  TRACESTAT_NO_INTERFACE, /* Black Magic Probe not found (trace interface not found) */
+  TRACESTAT_NO_DEVPATH,   /* device path to trace interface not found */
+  TRACESTAT_NO_ACCESS,    /* failure opening the device interface */
+  TRACESTAT_NO_PIPE,      /* endpoint pipe could not be found -> not a Black Magic Probe? */
+  TRACESTAT_BAD_PACKET,   /* invalid trace data packet received */
+  TRACESTAT_NO_THREAD,    /* thread could not be created */
+  TRACESTAT_INIT_FAILED,  /* WunUSB / libusb initialization failed */
+};
+
+int    swousb_open(void);
+void   swousb_close(void);
+int    swousb_read(unsigned char *buffer, size_t size);
+double swousb_timestamp(void);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _SWOUSB_H */
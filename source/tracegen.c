@@ -49,6 +49,10 @@
 #define FLAG_INDENT     0x0002
 #define FLAG_BASICTYPES 0x0004
 #define FLAG_STREAMID   0x0008
+#define FLAG_BUFFERED   0x0010
+#define FLAG_CONTROL    0x0020
+
+#define DEFAULT_BUFFERSIZE  1024
 
 
 int ctf_error_notify(int code, int linenr, const char *message)
@@ -221,6 +225,28 @@ void generate_prototypes(FILE *fp, unsigned flags)
   }
   fprintf(fp, "\n");
 
+  if (flags & FLAG_CONTROL) {
+    int count = event_count();
+    fprintf(fp, "#ifndef NTRACE\n"
+                "#include <stdint.h>\n"
+                "typedef struct {\n"
+                "  uint32_t magic;\n"
+                "  uint16_t count;\n"
+                "  uint16_t reserved;\n"
+                "  uint32_t enabled[%d];\n"
+                "  uint16_t divider[%d];\n"
+                "} TRACE_CONTROL;\n"
+                "extern volatile TRACE_CONTROL trace_control;\n"
+                "#endif\n\n", (count + 31) / 32, (count > 0) ? count : 1);
+  }
+
+  if (flags & FLAG_BUFFERED)
+    fprintf(fp, "#ifdef NTRACE\n"
+                "  #define trace_drain() 0\n"
+                "#else\n"
+                "  unsigned trace_drain(void);\n"
+                "#endif\n\n");
+
   for (evt = event_next(NULL); evt != NULL; evt = event_next(evt)) {
     /* #ifdef NTRACE wrapper */
     fprintf(fp, "#ifdef NTRACE\n");
@@ -234,10 +260,263 @@ void generate_prototypes(FILE *fp, unsigned flags)
   fprintf(fp, "#endif /* TRACEGEN_PROTOTYPE_FUNCTIONS */\n");
 }
 
-void generate_funcstubs(FILE *fp, unsigned flags, const char *headerfile)
+static int stream_seqnr(const CTF_STREAM *stream)
+{
+  const CTF_STREAM *iter;
+  int seqnr;
+
+  for (seqnr = 0; (iter = stream_by_seqnr(seqnr)) != NULL; seqnr++)
+    if (iter == stream)
+      return seqnr;
+  return 0;
+}
+
+/** generate_header() writes the declaration of the constant part of the
+ *  packet and event headers (the magic, the stream id and the event id). It
+ *  returns the size of this constant part in bytes.
+ */
+static int generate_header(FILE *fp, const CTF_STREAM *stream, unsigned long event_id)
+{
+  const CTF_PACKET_HEADER *pkthdr = packet_header();
+  const CTF_EVENT_HEADER *evthdr = (stream != NULL) ? &stream->event : NULL;
+  int hdrsize;
+
+  fprintf(fp, "  static const unsigned char header[] = {");
+  /* check for a packet header (for stream-based protocols, there should be one) */
+  assert(pkthdr != NULL);
+  hdrsize = pkthdr->header.magic_size / 8;
+  switch (pkthdr->header.magic_size) {
+  case 8:
+    fprintf(fp, "0xc1");
+    break;
+  case 16:
+    fprintf(fp, "0xc1, 0x1f");
+    break;
+  case 32:
+    fprintf(fp, "0xc1, 0x1f, 0xfc, 0xc1");
+    break;
+  }
+  if (pkthdr->header.streamid_size > 0) {
+    unsigned long val;
+    if (hdrsize > 0)
+      fprintf(fp, ", ");
+    val = (stream != NULL) ? stream->stream_id : 0;
+    dumphex(fp, (unsigned char*)&val, pkthdr->header.streamid_size / 8);
+    hdrsize += pkthdr->header.streamid_size / 8;
+  }
+  /* check for an event header (there really should be one)
+     note that only the id is handled here (because it is constant for the
+     function); the timestamp is dynamic and cannot be stored in the array */
+  if (evthdr != NULL && evthdr->header.id_size > 0) {
+    if (hdrsize > 0)
+      fprintf(fp, ", ");
+    dumphex(fp, (unsigned char*)&event_id, evthdr->header.id_size / 8);
+    hdrsize += evthdr->header.id_size / 8;
+  }
+  fprintf(fp, " };\n");
+  return hdrsize;
+}
+
+/** generate_control() writes the control block with the enable bit and the
+ *  decimation divider for every event. The host can modify the control block
+ *  while the target runs (see CTF_CONTROL_MAGIC for the layout). The
+ *  counters for the decimation are kept apart, so that the host does not
+ *  need to write to memory that the target updates.
+ */
+static void generate_control(FILE *fp)
+{
+  int idx, count;
+
+  count = event_count();
+  fprintf(fp, "volatile TRACE_CONTROL trace_control = {\n"
+              "  0x%08lx, %d, 0,\n"
+              "  {", CTF_CONTROL_MAGIC, count);
+  for (idx = 0; idx < (count + 31) / 32; idx++) {
+    int bits = count - 32 * idx;
+    if (idx > 0)
+      fprintf(fp, ", ");
+    fprintf(fp, "0x%08lx", (bits >= 32) ? 0xffffffffUL : (1UL << bits) - 1);
+  }
+  fprintf(fp, " },\n"
+              "  { 0 }\n"
+              "};\n\n");
+  fprintf(fp, "static uint16_t trace_skipcount[%d];\n\n", (count > 0) ? count : 1);
+  fprintf(fp, "static int trace_sample(unsigned idx)\n"
+              "{\n"
+              "  uint16_t divider;\n"
+              "  if ((trace_control.enabled[idx / 32] & (1UL << (idx %% 32))) == 0)\n"
+              "    return 0;\n"
+              "  divider = trace_control.divider[idx];\n"
+              "  if (divider > 1) {\n"
+              "    if (++trace_skipcount[idx] < divider)\n"
+              "      return 0;\n"
+              "    trace_skipcount[idx] = 0;\n"
+              "  }\n"
+              "  return 1;\n"
+              "}\n\n");
+}
+
+/** generate_ringbuffer() writes the ring buffer that the trace functions store
+ *  their packets in (when the -b option is in effect), plus the routine that
+ *  drains the buffer to trace_xmit().
+ *
+ *  The buffer holds records that start on a 32-bit boundary. Each record has a
+ *  32-bit header with the payload size, the stream id and a "ready" flag. A
+ *  trace function reserves space by advancing the head with compare-and-swap,
+ *  copies its data and then sets the header with the "ready" flag. The drain
+ *  routine (the single consumer) stops at a record that is not yet complete;
+ *  it clears every record that it has transmitted, so that a header slot of a
+ *  reserved record always reads as "not ready". When the buffer is full, the
+ *  packet is dropped and counted; the drain routine then transmits a "lost
+ *  events" record (with the reserved event id) for each stream.
+ */
+static void generate_ringbuffer(FILE *fp, unsigned flags, unsigned long buffersize)
+{
+  const CTF_STREAM *stream;
+  int seqnr, count;
+
+  count = stream_count();
+  if (count == 0)
+    count = 1;
+
+  fprintf(fp, "/* TRACE_BUFFER_SIZE must be a power of 2 */\n"
+              "#if !defined TRACE_BUFFER_SIZE\n"
+              "  #define TRACE_BUFFER_SIZE %lu\n"
+              "#endif\n\n", buffersize);
+  fprintf(fp, "/* the atomic operations default to the GCC built-ins; on an architecture\n"
+              "   without exclusive load/store (e.g. Cortex-M0), redefine these macros\n"
+              "   with versions that briefly disable interrupts */\n"
+              "#if !defined TRACE_CAS\n"
+              "  #define TRACE_CAS(ptr, expected, value) \\\n"
+              "          __atomic_compare_exchange_n((ptr), &(expected), (value), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)\n"
+              "#endif\n"
+              "#if !defined TRACE_ADD\n"
+              "  #define TRACE_ADD(ptr, value)   __atomic_fetch_add((ptr), (value), __ATOMIC_RELAXED)\n"
+              "#endif\n"
+              "#if !defined TRACE_XCHG\n"
+              "  #define TRACE_XCHG(ptr, value)  __atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL)\n"
+              "#endif\n"
+              "#if !defined TRACE_BARRIER\n"
+              "  #define TRACE_BARRIER()         __atomic_thread_fence(__ATOMIC_SEQ_CST)\n"
+              "#endif\n\n");
+  fprintf(fp, "#define TRACE_REC_READY   0x80000000u\n"
+              "#define TRACE_REC_SIZE(n) (((n) + 4 + 3) & ~3u)\n\n"
+              "typedef struct {\n"
+              "  uint32_t start;\n"
+              "  uint32_t pos;\n"
+              "  uint32_t header;\n"
+              "} TRACE_RSV;\n\n"
+              "static uint32_t trace_ringbuffer[TRACE_BUFFER_SIZE / 4];\n"
+              "static volatile uint32_t trace_head, trace_tail;\n"
+              "static volatile uint32_t trace_lost[%d];\n\n", count);
+
+  /* reserve */
+  fprintf(fp, "static int trace_reserve(TRACE_RSV *rsv, int stream_id, int seqnr, unsigned size)\n"
+              "{\n"
+              "  uint32_t head, need = TRACE_REC_SIZE(size);\n"
+              "  do {\n"
+              "    head = trace_head;\n"
+              "    if (need > TRACE_BUFFER_SIZE - (head - trace_tail)) {\n"
+              "      TRACE_ADD(&trace_lost[seqnr], 1);\n"
+              "      return 0;\n"
+              "    }\n"
+              "  } while (!TRACE_CAS(&trace_head, head, head + need));\n"
+              "  rsv->start = head;\n"
+              "  rsv->pos = head + 4;\n"
+              "  rsv->header = (size & 0xffff) | ((uint32_t)(stream_id & 0xff) << 16);\n"
+              "  return 1;\n"
+              "}\n\n");
+  /* write */
+  fprintf(fp, "static void trace_write(TRACE_RSV *rsv, const void *data, unsigned size)\n"
+              "{\n"
+              "  unsigned char *buffer = (unsigned char*)trace_ringbuffer;\n"
+              "  uint32_t idx = rsv->pos & (TRACE_BUFFER_SIZE - 1);\n"
+              "  uint32_t part = TRACE_BUFFER_SIZE - idx;\n"
+              "  if (part > size)\n"
+              "    part = size;\n"
+              "  memcpy(buffer + idx, data, part);\n"
+              "  if (part < size)\n"
+              "    memcpy(buffer, (const unsigned char*)data + part, size - part);\n"
+              "  rsv->pos += size;\n"
+              "}\n\n");
+  /* commit */
+  fprintf(fp, "static void trace_commit(const TRACE_RSV *rsv)\n"
+              "{\n"
+              "  TRACE_BARRIER();\n"
+              "  trace_ringbuffer[(rsv->start & (TRACE_BUFFER_SIZE - 1)) / 4] = rsv->header | TRACE_REC_READY;\n"
+              "}\n\n");
+
+  /* drain */
+  fprintf(fp, "unsigned trace_drain(void)\n"
+              "{\n"
+              "  const unsigned char *buffer = (const unsigned char*)trace_ringbuffer;\n"
+              "  unsigned count = 0;\n"
+              "  for ( ;; ) {\n"
+              "    uint32_t tail = trace_tail;\n"
+              "    uint32_t header, size, need, idx, part;\n"
+              "    if (tail == trace_head)\n"
+              "      break;\n"
+              "    header = trace_ringbuffer[(tail & (TRACE_BUFFER_SIZE - 1)) / 4];\n"
+              "    if ((header & TRACE_REC_READY) == 0)\n"
+              "      break;  /* record is reserved, but not yet complete */\n"
+              "    size = header & 0xffff;\n"
+              "    need = TRACE_REC_SIZE(size);\n"
+              "    idx = (tail + 4) & (TRACE_BUFFER_SIZE - 1);\n"
+              "    part = TRACE_BUFFER_SIZE - idx;\n"
+              "    if (part > size)\n"
+              "      part = size;\n");
+  if (flags & FLAG_STREAMID) {
+    fprintf(fp, "    trace_xmit((header >> 16) & 0xff, buffer + idx, part);\n"
+                "    if (part < size)\n"
+                "      trace_xmit((header >> 16) & 0xff, buffer, size - part);\n");
+  } else {
+    fprintf(fp, "    trace_xmit(buffer + idx, part);\n"
+                "    if (part < size)\n"
+                "      trace_xmit(buffer, size - part);\n");
+  }
+  fprintf(fp, "    /* clear the record, so that the next record that gets reserved here\n"
+              "       does not look complete */\n"
+              "    for (idx = 0; idx < need; idx += 4)\n"
+              "      trace_ringbuffer[((tail + idx) & (TRACE_BUFFER_SIZE - 1)) / 4] = 0;\n"
+              "    TRACE_BARRIER();\n"
+              "    trace_tail = tail + need;\n"
+              "    count++;\n"
+              "  }\n");
+  /* lost events, per stream */
+  for (seqnr = 0; seqnr < count; seqnr++) {
+    char xmit_call[40];
+    int hdrsize;
+    stream = stream_by_seqnr(seqnr);
+    if (stream == NULL || stream->event.header.id_size == 0)
+      continue; /* "lost events" record cannot be identified */
+    if (flags & FLAG_STREAMID)
+      sprintf(xmit_call, "trace_xmit(%d, ", stream->stream_id);
+    else
+      strcpy(xmit_call, "trace_xmit(");
+    fprintf(fp, "  if (trace_lost[%d] != 0) {\n", seqnr);
+    fprintf(fp, "  ");
+    hdrsize = generate_header(fp, stream, CTF_EVENTID_LOST(stream->event.header.id_size));
+    fprintf(fp, "    uint32_t lost = TRACE_XCHG(&trace_lost[%d], 0);\n", seqnr);
+    if (stream->event.header.timestamp_size > 0) {
+      char typedesc[64];
+      assert(stream->clock != NULL);
+      fprintf(fp, "    %s tstamp = trace_timestamp();\n", type_to_string(stream->clock, typedesc, sizearray(typedesc)));
+    }
+    fprintf(fp, "    %sheader, %d);\n", xmit_call, hdrsize);
+    if (stream->event.header.timestamp_size > 0)
+      fprintf(fp, "    %s(const unsigned char*)&tstamp, %d);\n", xmit_call, stream->event.header.timestamp_size / 8);
+    fprintf(fp, "    %s(const unsigned char*)&lost, 4);\n", xmit_call);
+    fprintf(fp, "  }\n");
+  }
+  fprintf(fp, "  return count;\n"
+              "}\n\n");
+}
+
+void generate_funcstubs(FILE *fp, unsigned flags, const char *headerfile, unsigned long buffersize)
 {
   char xmit_call[40];
   const CTF_EVENT *evt;
+  int evt_idx;
 
   /* file header */
   assert(fp != NULL);
@@ -245,11 +524,19 @@ void generate_funcstubs(FILE *fp, unsigned flags, const char *headerfile)
   fprintf(fp, "/*\n"
               " * Trace functions implementation file, generated by tracegen\n"
               " */\n"
-              "#ifndef NTRACE\n"
-              "#include \"%s\"\n\n", headerfile);
-
-  for (evt = event_next(NULL); evt != NULL; evt = event_next(evt)) {
-    const CTF_PACKET_HEADER *pkthdr = packet_header();
+              "#ifndef NTRACE\n");
+  if (flags & (FLAG_BUFFERED | FLAG_CONTROL))
+    fprintf(fp, "#include <stdint.h>\n");
+  if (flags & FLAG_BUFFERED)
+    fprintf(fp, "#include <string.h>\n");
+  fprintf(fp, "#include \"%s\"\n\n", headerfile);
+
+  if (flags & FLAG_CONTROL)
+    generate_control(fp);
+  if (flags & FLAG_BUFFERED)
+    generate_ringbuffer(fp, flags, buffersize);
+
+  for (evt = event_next(NULL), evt_idx = 0; evt != NULL; evt = event_next(evt), evt_idx++) {
     const CTF_STREAM *stream = stream_by_id(evt->stream_id);
     const CTF_EVENT_HEADER *evthdr = (stream != NULL) ? &stream->event : NULL;
     const CTF_EVENT_FIELD *field;
@@ -258,57 +545,54 @@ void generate_funcstubs(FILE *fp, unsigned flags, const char *headerfile)
     generate_functionheader(fp, evt, flags);
     fprintf(fp, "\n{\n");
 
-    if (flags & FLAG_STREAMID)
+    if (flags & FLAG_BUFFERED)
+      strcpy(xmit_call, "trace_write(&rsv, ");
+    else if (flags & FLAG_STREAMID)
       sprintf(xmit_call, "trace_xmit(%d, ", (stream != NULL) ? stream->stream_id : 0);
     else
       strcpy(xmit_call, "trace_xmit(");
 
     /* handle the constant part of the headers */
-    fprintf(fp, "  static const unsigned char header[] = {");
-    /* check for a packet header (for stream-based protocols, there should be one) */
-    assert(pkthdr != NULL);
-    hdrsize = pkthdr->header.magic_size / 8;
-    switch (pkthdr->header.magic_size) {
-    case 8:
-      fprintf(fp, "0xc1");
-      break;
-    case 16:
-      fprintf(fp, "0xc1, 0x1f");
-      break;
-    case 32:
-      fprintf(fp, "0xc1, 0x1f, 0xfc, 0xc1");
-      break;
-    }
-    if (pkthdr->header.streamid_size > 0) {
-      unsigned long val;
-      if (hdrsize > 0)
-        fprintf(fp, ", ");
-      val = (stream != NULL) ? stream->stream_id : 0;
-      dumphex(fp, (unsigned char*)&val, pkthdr->header.streamid_size / 8);
-      hdrsize += pkthdr->header.streamid_size / 8;
-    }
-    /* check for an event header (there really should be one)
-       note that only the id is handled here (because it is constant for the
-       function); the timestamp is dynamic and cannot be stored in the array */
-    if (evthdr != NULL && evthdr->header.id_size > 0) {
-      if (hdrsize > 0)
-        fprintf(fp, ", ");
-      dumphex(fp, (unsigned char*)&evt->id, evthdr->header.id_size / 8);
-      hdrsize += evthdr->header.id_size / 8;
-    }
-    fprintf(fp, " };\n");
+    hdrsize = generate_header(fp, stream, evt->id);
     /* check whether the timestamp must be stored (and its type) */
     if (evthdr != NULL && evthdr->header.timestamp_size > 0) {
       char typedesc[64];
       const CTF_TYPE *clock = stream->clock;
       assert(clock != NULL);
       /* the clock type must be converted to a standard C type, because the
-         TSDL type is not compatible with C */
-      fprintf(fp, "  %s tstamp = trace_timestamp();\n", type_to_string(clock, typedesc, sizearray(typedesc)));
+         TSDL type is not compatible with C; with a control block, the
+         timestamp is only read when the event passes the filter */
+      fprintf(fp, "  %s tstamp%s;\n", type_to_string(clock, typedesc, sizearray(typedesc)),
+              (flags & FLAG_CONTROL) ? "" : " = trace_timestamp()");
+    }
+    if (flags & FLAG_BUFFERED)
+      fprintf(fp, "  TRACE_RSV rsv;\n");
+    /* the filter check follows the declarations */
+    if (flags & FLAG_CONTROL) {
+      fprintf(fp, "  if (!trace_sample(%d))\n"
+                  "    return;\n", evt_idx);
+      if (evthdr != NULL && evthdr->header.timestamp_size > 0)
+        fprintf(fp, "  tstamp = trace_timestamp();\n");
+    }
+    if (flags & FLAG_BUFFERED) {
+      /* calculate the total packet size, then reserve space for it */
+      int size = hdrsize;
+      if (evthdr != NULL)
+        size += evthdr->header.timestamp_size / 8;
+      for (field = evt->field_root.next; field != NULL; field = field->next)
+        if (field->type.typeclass != CLASS_STRING)
+          size += field->type.size / 8;
+      fprintf(fp, "  if (!trace_reserve(&rsv, %d, %d, %d",
+              (stream != NULL) ? stream->stream_id : 0, stream_seqnr(stream), size);
+      for (field = evt->field_root.next; field != NULL; field = field->next)
+        if (field->type.typeclass == CLASS_STRING)
+          fprintf(fp, " + strlen(%s) + 1", field->name);
+      fprintf(fp, "))\n"
+                  "    return;\n");
     }
     fprintf(fp, "  %sheader, %d);\n", xmit_call, hdrsize);
     if (evthdr != NULL && evthdr->header.timestamp_size > 0)
-      fprintf(fp, "  %s&tstamp, %d);\n", xmit_call, evthdr->header.timestamp_size / 8);
+      fprintf(fp, "  %s(const unsigned char*)&tstamp, %d);\n", xmit_call, evthdr->header.timestamp_size / 8);
 
     /* the parameters */
     for (field = evt->field_root.next; field != NULL; field = field->next) {
@@ -322,6 +606,8 @@ void generate_funcstubs(FILE *fp, unsigned flags, const char *headerfile)
       else
         fprintf(fp, "%u);\n", field->type.size / 8);
     }
+    if (flags & FLAG_BUFFERED)
+      fprintf(fp, "  trace_commit(&rsv);\n");
 
     fprintf(fp, "}\n\n");
   }
@@ -336,15 +622,21 @@ static void usage(void)
          "           for tracing in the Common Trace Format.\n\n"
          "Usage: tracegen [options] inputfile\n\n"
          "Options:\n"
+         "-b=size\t Store trace packets in a ring buffer on the target; the\n"
+         "\t buffer is transmitted with trace_drain(). The size is in bytes\n"
+         "\t and must be a power of 2 (default %d).\n"
+         "-c\t Add a control block to enable/disable events and to set a\n"
+         "\t decimation ratio per event, at run time.\n"
          "-o=name\t Base output filename; a .c and .h suffix is added to this name.\n"
          "-s\t Pass stream ID as separate parameter (SWO tracing).\n"
-         "-t\t Force basic C types on arguments, if availalble.\n");
+         "-t\t Force basic C types on arguments, if availalble.\n", DEFAULT_BUFFERSIZE);
 }
 
 int main(int argc, char *argv[])
 {
   char infile[256], outfile[256], *ptr;
   unsigned opt_flags;
+  unsigned long buffersize;
   int idx;
 
   if (argc <= 1) {
@@ -356,6 +648,7 @@ int main(int argc, char *argv[])
   infile[0] = '\0';
   outfile[0] = '\0';
   opt_flags = 0;
+  buffersize = DEFAULT_BUFFERSIZE;
   for (idx = 0; idx < argc; idx++) {
     if (argv[idx][0] == '-' || argv[idx][0] == '/') {
       switch (argv[idx][1]) {
@@ -363,6 +656,21 @@ int main(int argc, char *argv[])
       case 'h':
         usage();
         return 0;
+      case 'b':
+        opt_flags |= FLAG_BUFFERED;
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        if (*ptr != '\0')
+          buffersize = strtoul(ptr, NULL, 0);
+        if (buffersize < 16 || (buffersize & (buffersize - 1)) != 0) {
+          fprintf(stderr, "Invalid buffer size %s; it must be a power of 2.\n", ptr);
+          return 1;
+        }
+        break;
+      case 'c':
+        opt_flags |= FLAG_CONTROL;
+        break;
       case 'o':
         ptr = &argv[idx][2];
         if (*ptr == '=' || *ptr == ':')
@@ -410,6 +718,17 @@ int main(int argc, char *argv[])
     FILE *fp;
     int done_msg = 1;
 
+    if (opt_flags & FLAG_BUFFERED) {
+      /* check that no event uses the id that is reserved for "lost events" */
+      const CTF_EVENT *evt;
+      for (evt = event_next(NULL); evt != NULL; evt = event_next(evt)) {
+        const CTF_STREAM *stream = stream_by_id(evt->stream_id);
+        if (stream != NULL && stream->event.header.id_size > 0
+            && (unsigned long)evt->id == CTF_EVENTID_LOST(stream->event.header.id_size))
+          fprintf(stderr, "Warning: event %s uses the id that is reserved for lost events.\n", evt->name);
+      }
+    }
+
     strlcat(outfile, ".h", sizearray(outfile));
     fp = fopen(outfile, "wt");
     if (fp != NULL) {
@@ -428,7 +747,7 @@ int main(int argc, char *argv[])
       /* temporarily rename the extension back to .h */
       assert(ptr != NULL && *(ptr + 1) == 'c');
       *(ptr + 1) = 'h';
-      generate_funcstubs(fp, opt_flags, outfile);
+      generate_funcstubs(fp, opt_flags, outfile, buffersize);
       assert(ptr != NULL && *(ptr + 1) == 'h');
       *(ptr + 1) = 'c';
       fclose(fp);
@@ -0,0 +1,230 @@
+/*
+ * Host test for the ring buffer that tracegen generates for the target
+ * (option -b). The generated code is linked against a simulated ITM sink:
+ * trace_xmit() splits the data into 32-bit stimulus writes, and passes these
+ * to the CTF decoder of the host. The test verifies that the events come out
+ * of trace_drain() complete and in order, that events that do not fit in a
+ * full buffer are dropped and reported in a "lost events" record, and that
+ * no event goes missing when events are generated from several threads while
+ * the buffer is drained.
+ *
+ * The Makefile generates tracetest_gen.c and tracetest_gen.h from
+ * tracetest.tsdl, with a ring buffer of RING_SIZE bytes.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parsetsdl.h"
+#include "decodectf.h"
+#include "tracetest_gen.h"
+
+
+#define RING_SIZE     256     /* must match option -b of tracegen in the Makefile */
+#define START_RECORD  16      /* size of a "start" event in the ring (with the record header) */
+#define NUM_THREADS   4
+#define THREAD_EVENTS 20000
+
+/* what the decoder returned for the current test */
+static unsigned long msg_start, msg_value, msg_lost, msg_other;
+static unsigned long lost_total;
+static long expect_start = -1;  /* next value of a "start" event, or -1 to not check */
+static long expect_value = -1;
+static int failures = 0;
+
+static volatile unsigned long clock_ticks = 0;
+
+unsigned long trace_timestamp(void)
+{
+  return __atomic_fetch_add(&clock_ticks, 1, __ATOMIC_RELAXED);
+}
+
+static void check_message(const char *message)
+{
+  unsigned long count;
+  char text[64];
+  int value;
+
+  if (sscanf(message, "start: value = %d", &value) == 1) {
+    if (expect_start >= 0 && value != expect_start++) {
+      printf("  unexpected event: %s\n", message);
+      failures++;
+    }
+    msg_start++;
+  } else if (sscanf(message, "value: v = %d, s = \"%63[^\"]\"", &value, text) == 2) {
+    if (expect_value >= 0 && (value != expect_value || strlen(text) != (size_t)(value % 23) + 1)) {
+      printf("  unexpected event: %s\n", message);
+      failures++;
+    }
+    expect_value++;
+    msg_value++;
+  } else if (sscanf(message, "lost_events: count = %lu", &count) == 1) {
+    lost_total += count;
+    msg_lost++;
+  } else {
+    printf("  unknown event: %s\n", message);
+    msg_other++;
+    failures++;
+  }
+}
+
+/** trace_xmit() is the simulated ITM sink: it splits the data into the
+ *  payloads of 32-bit stimulus packets, and decodes these.
+ */
+void trace_xmit(const unsigned char *data, unsigned size)
+{
+  char message[256];
+
+  while (size > 0) {
+    unsigned count = (size > 4) ? 4 : size;
+    if (ctf_decode(data, count, 0) > 0)
+      while (msgstack_pop(NULL, NULL, message, sizeof message))
+        check_message(message);
+    data += count;
+    size -= count;
+  }
+}
+
+int ctf_error_notify(int code, int linenr, const char *message)
+{
+  if (code != CTFERR_NONE)
+    fprintf(stderr, "TSDL error %d on line %d: %s\n", code, linenr, (message != NULL) ? message : "");
+  return 0;
+}
+
+static void reset_counts(void)
+{
+  msg_start = msg_value = msg_lost = msg_other = 0;
+  lost_total = 0;
+  expect_start = expect_value = -1;
+}
+
+static void verify(const char *label, int condition)
+{
+  if (!condition)
+    failures++;
+  printf("%-48s %s\n", label, condition ? "ok" : "FAILED");
+}
+
+/* a full buffer drops the events that do not fit, and reports how many */
+static void test_overflow(void)
+{
+  unsigned drained;
+  int idx;
+
+  reset_counts();
+  expect_start = 0;
+  for (idx = 0; idx < RING_SIZE / START_RECORD + 4; idx++)
+    trace_start((uint16_t)idx);
+  drained = trace_drain();
+  verify("Full buffer: drained records", drained == RING_SIZE / START_RECORD);
+  verify("Full buffer: decoded events", msg_start == RING_SIZE / START_RECORD);
+  verify("Full buffer: lost events reported", msg_lost == 1 && lost_total == 4);
+
+  reset_counts();
+  drained = trace_drain();
+  verify("Empty buffer: nothing transmitted", drained == 0 && msg_start + msg_lost == 0);
+
+  /* after the drain, there is room again */
+  trace_start(1);
+  drained = trace_drain();
+  verify("Buffer reusable after a drain", drained == 1 && msg_start == 1 && msg_lost == 0);
+}
+
+/* records of varying sizes wrap around the end of the buffer */
+static void test_wraparound(void)
+{
+  char text[32];
+  int idx;
+
+  reset_counts();
+  expect_value = 0;
+  for (idx = 0; idx < 1000; idx++) {
+    memset(text, 'a' + idx % 26, sizeof text);
+    text[idx % 23 + 1] = '\0';
+    trace_value(idx, text);
+    if (idx % 5 == 4)
+      trace_drain();
+  }
+  trace_drain();
+  verify("Wrap-around: events decoded in order", msg_value == 1000 && msg_lost == 0);
+}
+
+static volatile int threads_done = 0;
+static unsigned long drained_total = 0;
+
+static void *producer(void *arg)
+{
+  int idx;
+
+  (void)arg;
+  for (idx = 0; idx < THREAD_EVENTS; idx++) {
+    trace_start((uint16_t)idx);
+    if ((idx & 15) == 0)
+      sched_yield();  /* give the drain thread a chance to run */
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg)
+{
+  (void)arg;
+  while (!__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE))
+    drained_total += trace_drain();
+  drained_total += trace_drain();
+  return NULL;
+}
+
+/* events from several threads, drained concurrently: every event is either
+   transmitted or counted as lost */
+static void test_threads(void)
+{
+  pthread_t producers[NUM_THREADS], drain;
+  int idx;
+
+  reset_counts();
+  drained_total = 0;
+  pthread_create(&drain, NULL, consumer, NULL);
+  for (idx = 0; idx < NUM_THREADS; idx++)
+    pthread_create(&producers[idx], NULL, producer, NULL);
+  for (idx = 0; idx < NUM_THREADS; idx++)
+    pthread_join(producers[idx], NULL);
+  __atomic_store_n(&threads_done, 1, __ATOMIC_RELEASE);
+  pthread_join(drain, NULL);
+  printf("  %lu events transmitted, %lu lost\n", msg_start, lost_total);
+  verify("Threads: decoded events match drained records", msg_start == drained_total && msg_other == 0);
+  verify("Threads: transmitted + lost == generated", msg_start + lost_total == NUM_THREADS * THREAD_EVENTS);
+}
+
+int main(void)
+{
+  if (!ctf_parse_init("tracetest.tsdl") || !ctf_parse_run()) {
+    fprintf(stderr, "Failed to load tracetest.tsdl.\n");
+    return 1;
+  }
+  test_overflow();
+  test_wraparound();
+  test_threads();
+  ctf_parse_cleanup();
+  ctf_decode_cleanup();
+  printf("%s\n", (failures == 0) ? "All tests passed" : "Tests FAILED");
+  return (failures == 0) ? 0 : 1;
+}
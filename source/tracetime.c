@@ -0,0 +1,230 @@
+/*
+ * Reconstruction of the target time from the timestamp packets in the ITM
+ * stream (and from the clock fields in CTF events), mapped onto the host
+ * clock with a running linear regression that corrects for clock drift.
+ *
+ * The host only knows when a USB packet with trace data arrived, so all
+ * characters in that packet get the same time, and the USB scheduling
+ * jitter shows up in the intervals between trace messages. The ITM local
+ * timestamps count target clock cycles between packets; accumulating these
+ * gives the target time, which is exact relative to itself. For each USB
+ * packet, the target time of its last timestamp is paired with the arrival
+ * time on the host; a linear fit through these pairs maps the target time
+ * onto the host time base (the slope absorbs any inaccuracy in the clock
+ * frequency, plus drift between both clocks).
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <string.h>
+#include "decodeitm.h"
+#include "tracetime.h"
+
+#define TIMEFIT_FORGET    0.999 /* weight decay per point, so that the fit follows a varying drift */
+#define TIMEFIT_MINPOINTS 8     /* minimum number of points before the slope is estimated */
+#define TIMEFIT_MINSPREAD 1e-6  /* minimum variance of the target times (s^2) for the slope */
+
+/** timefit_reset() clears all points from the fit.
+ */
+void timefit_reset(TIMEFIT *fit)
+{
+  assert(fit != NULL);
+  memset(fit, 0, sizeof(TIMEFIT));
+}
+
+/** timefit_rebase() drops all points from the fit, but keeps the current
+ *  slope as the estimate for the new series. This is used when the target
+ *  time jumps (e.g. after lost data), while the clock rates are unchanged.
+ */
+void timefit_rebase(TIMEFIT *fit)
+{
+  double slope;
+
+  assert(fit != NULL);
+  slope = timefit_slope(fit);
+  timefit_reset(fit);
+  fit->skew = slope - 1.0;
+}
+
+static void timefit_commit(TIMEFIT *fit)
+{
+  double dx, dy, w;
+
+  assert(fit->pending);
+  if (fit->count == 0) {
+    fit->x0 = fit->px;
+    fit->y0 = fit->py;
+  }
+  dx = fit->px - fit->x0;
+  dy = fit->py - fit->y0;
+  /* age the older points, then add the new point and move the origin to
+     the new weighted mean (this keeps the sums small, so that there is no
+     loss of precision when the timestamps grow large) */
+  fit->sw *= TIMEFIT_FORGET;
+  fit->sxx *= TIMEFIT_FORGET;
+  fit->sxy *= TIMEFIT_FORGET;
+  w = fit->sw / (fit->sw + 1.0);
+  fit->sxx += dx * dx * w;
+  fit->sxy += dx * dy * w;
+  fit->sw += 1.0;
+  fit->x0 += dx / fit->sw;
+  fit->y0 += dy / fit->sw;
+  fit->count++;
+  fit->pending = 0;
+}
+
+/** timefit_add() adds a pair of a target time and a host time to the fit.
+ *  \param fit    The fit.
+ *  \param x      The target time, in seconds.
+ *  \param y      The host time, in seconds.
+ *
+ *  \note The host time is the arrival time of a USB packet, so there are
+ *        typically several target times for the same host time. Only the
+ *        last target time for each host time goes into the fit, because
+ *        that one is closest to the moment that the packet was complete.
+ */
+void timefit_add(TIMEFIT *fit, double x, double y)
+{
+  assert(fit != NULL);
+  if (fit->pending && y != fit->py)
+    timefit_commit(fit);
+  fit->px = x;
+  fit->py = y;
+  fit->pending = 1;
+}
+
+/** timefit_slope() returns the slope of the fit, which is the ratio of
+ *  the host clock to the target clock.
+ */
+double timefit_slope(const TIMEFIT *fit)
+{
+  double slope;
+
+  assert(fit != NULL);
+  if (fit->count < TIMEFIT_MINPOINTS || fit->sxx <= TIMEFIT_MINSPREAD * fit->sw)
+    return 1.0 + fit->skew;
+  slope = fit->sxy / fit->sxx;
+  return (slope > 0.0) ? slope : 1.0 + fit->skew;
+}
+
+/** timefit_map() converts a target time to the host time base.
+ *  \param fit    The fit.
+ *  \param x      The target time, in seconds.
+ *
+ *  \return The matching host time, in seconds. If the fit has no points
+ *          yet, the target time is returned unchanged.
+ */
+double timefit_map(const TIMEFIT *fit, double x)
+{
+  assert(fit != NULL);
+  if (fit->count == 0)
+    return fit->pending ? fit->py + (1.0 + fit->skew) * (x - fit->px) : x;
+  return fit->y0 + timefit_slope(fit) * (x - fit->x0);
+}
+
+
+static TIMEFIT itm_fit;
+static unsigned long long itm_ticks = 0;  /* target time, in clock cycles */
+static unsigned long long itm_global = 0; /* most recent global timestamp */
+static unsigned long itm_clock = 0;
+static int itm_synced = 0;
+
+/** tracetime_reset() clears the target time and the clock mapping, for
+ *  example when the trace is restarted.
+ */
+void tracetime_reset(void)
+{
+  timefit_reset(&itm_fit);
+  itm_ticks = 0;
+  itm_global = 0;
+  itm_synced = 0;
+}
+
+/** tracetime_setclock() sets the frequency of the timestamp counter. This
+ *  is the CPU clock, if the timestamp prescaler is 1. The frequency is an
+ *  initial estimate; the clock mapping corrects for deviations.
+ */
+void tracetime_setclock(unsigned long frequency)
+{
+  if (frequency != itm_clock) {
+    itm_clock = frequency;
+    tracetime_reset();
+  }
+}
+
+/** tracetime_packet() handles the timestamp packets (and the overflow
+ *  packet) from the ITM stream.
+ *  \param packet   The decoded packet.
+ *  \param hosttime The time at which the data arrived at the host, in
+ *                  seconds.
+ *
+ *  \return 1 if the packet advanced the target time, 0 otherwise.
+ *
+ *  \note A local timestamp follows the packets that it stamps, so any
+ *        trace message received since the previous timestamp packet
+ *        should get the time that tracetime_now() returns after this call.
+ *
+ *  \note The global timestamp is assumed to count the same clock as the
+ *        local timestamp (TSVALUEB is the processor clock). When present,
+ *        it re-anchors the target time, which is lost after an overflow.
+ */
+int tracetime_packet(const ITMPACKET *packet, double hosttime)
+{
+  unsigned long long mask;
+
+  assert(packet != NULL);
+  switch (packet->type) {
+  case ITMPKT_LOCALTS:
+    itm_ticks += packet->value;
+    break;
+  case ITMPKT_GLOBALTS1:
+    /* the packet holds bits 0..25, but the high bytes are omitted if they
+       did not change */
+    mask = (packet->size >= 4) ? 0x03ffffffUL : (1UL << (7 * packet->size)) - 1;
+    itm_global = (itm_global & ~mask) | (packet->value & mask);
+    itm_ticks = itm_global;
+    break;
+  case ITMPKT_GLOBALTS2:
+    itm_global = (itm_global & 0x03ffffffUL) | (packet->value << 26);
+    itm_ticks = itm_global;
+    break;
+  case ITMPKT_OVERFLOW:
+    /* local timestamps were lost, so the target time jumps */
+    if (itm_synced)
+      timefit_rebase(&itm_fit);
+    return 0;
+  default:
+    return 0;
+  }
+  itm_synced = 1;
+  timefit_add(&itm_fit, (double)itm_ticks / (double)(itm_clock > 0 ? itm_clock : 1000000UL), hosttime);
+  return 1;
+}
+
+/** tracetime_valid() returns whether timestamp packets were received, so
+ *  that tracetime_now() returns a reconstructed time.
+ */
+int tracetime_valid(void)
+{
+  return itm_synced;
+}
+
+/** tracetime_now() returns the target time of the most recent timestamp
+ *  packet, mapped to the host time base (in seconds).
+ */
+double tracetime_now(void)
+{
+  return timefit_map(&itm_fit, (double)itm_ticks / (double)(itm_clock > 0 ? itm_clock : 1000000UL));
+}
@@ -0,0 +1,54 @@
+/*
+ * Reconstruction of the target time from the timestamp packets in the ITM
+ * stream (and from the clock fields in CTF events), mapped onto the host
+ * clock with a running linear regression that corrects for clock drift.
+ *
+ * Copyright 2019 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _TRACETIME_H
+#define _TRACETIME_H
+
+#if defined __cplusplus
+  extern "C" {
+#endif
+
+typedef struct tagTIMEFIT {
+  double x0, y0;        /* origin: weighted mean of the points */
+  double sw, sxx, sxy;  /* weighted sums, relative to the origin */
+  double px, py;        /* pending point (target time, host time) */
+  double skew;          /* estimated slope minus 1, used while there are too few points */
+  unsigned count;       /* number of points in the fit */
+  int pending;
+} TIMEFIT;
+
+void   timefit_reset(TIMEFIT *fit);
+void   timefit_rebase(TIMEFIT *fit);
+void   timefit_add(TIMEFIT *fit, double x, double y);
+double timefit_map(const TIMEFIT *fit, double x);
+double timefit_slope(const TIMEFIT *fit);
+
+struct tagITMPACKET;
+
+void   tracetime_reset(void);
+void   tracetime_setclock(unsigned long frequency);
+int    tracetime_packet(const struct tagITMPACKET *packet, double hosttime);
+int    tracetime_valid(void);
+double tracetime_now(void);
+
+#if defined __cplusplus
+  }
+#endif
+
+#endif /* _TRACETIME_H */